@@ -0,0 +1,247 @@
+// Opens many concurrent RunSimulation streams against a running server and
+// samples the server's resident set size and thread count while they are
+// open. With the callback service, neither should grow with the number of
+// streams once they are all open: queued and running jobs hold no threads.
+//
+// Run the server with a small --job_slots, so that most jobs wait in the
+// queue (and are sent QueueStatus updates), and a netlist that runs for a
+// while:
+//
+//   ./spice_server --job_slots=8 &
+//   ./load_test --server_pid=$! --netlist=long.sp --streams=5000
+
+#include <grpcpp/grpcpp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "proto/spice_simulator.grpc.pb.h"
+#include "proto/spice_simulator.pb.h"
+
+DEFINE_string(server, "localhost:50051", "Server address.");
+DEFINE_int32(server_pid, 0,
+             "Process ID of the server, whose memory and threads are "
+             "sampled. 0 to skip sampling.");
+DEFINE_int32(streams, 1000, "Number of concurrent RunSimulation streams.");
+DEFINE_int32(channels, 4,
+             "Number of channels (connections) the streams are spread over.");
+DEFINE_string(flavour, "NGSPICE", "Simulator flavour to request.");
+DEFINE_string(netlist, "", "Netlist to send as the (only) verbatim file.");
+DEFINE_int32(duration_s, 60,
+             "How long to hold the streams open before cancelling whatever "
+             "hasn't finished.");
+DEFINE_int32(sample_interval_ms, 1000, "How often to sample the server.");
+
+namespace {
+
+using spiceserver::SimulationRequest;
+using spiceserver::SimulationResponse;
+
+struct Counters {
+  std::atomic<int> open {0};
+  std::atomic<int> succeeded {0};
+  std::atomic<int> failed {0};
+  std::atomic<uint64_t> messages {0};
+  std::atomic<uint64_t> output_bytes {0};
+};
+
+// One stream, reading until the server is done with it.
+class Stream : public grpc::ClientReadReactor<SimulationResponse> {
+ public:
+  Stream(spiceserver::SpiceSimulator::Stub *stub,
+         const SimulationRequest &request,
+         Counters *counters)
+      : counters_(counters),
+        done_(false) {
+    ++counters_->open;
+    stub->async()->RunSimulation(&context_, &request, this);
+    StartRead(&response_);
+    StartCall();
+  }
+
+  void OnReadDone(bool ok) override {
+    if (!ok) {
+      return;
+    }
+    ++counters_->messages;
+    counters_->output_bytes += response_.output().size();
+    StartRead(&response_);
+  }
+
+  void OnDone(const grpc::Status &status) override {
+    if (status.ok()) {
+      ++counters_->succeeded;
+    } else {
+      ++counters_->failed;
+      LOG_FIRST_N(WARNING, 5) << "Stream failed: " << status.error_message();
+    }
+    --counters_->open;
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    done_condition_.notify_all();
+  }
+
+  void Cancel() { context_.TryCancel(); }
+
+  void WaitUntilDone() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_condition_.wait(lock, [this]() { return done_; });
+  }
+
+ private:
+  Counters *counters_;
+  grpc::ClientContext context_;
+  SimulationResponse response_;
+
+  std::mutex mutex_;
+  std::condition_variable done_condition_;
+  bool done_;
+};
+
+struct ProcessSample {
+  uint64_t rss_kib;
+  int threads;
+};
+
+// Reads VmRSS and Threads from /proc/<pid>/status.
+bool SampleProcess(int pid, ProcessSample *sample) {
+  std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+  if (!status) {
+    return false;
+  }
+  *sample = ProcessSample {0, 0};
+  std::string line;
+  while (std::getline(status, line)) {
+    std::istringstream fields(line);
+    std::string key;
+    fields >> key;
+    if (key == "VmRSS:") {
+      fields >> sample->rss_kib;
+    } else if (key == "Threads:") {
+      fields >> sample->threads;
+    }
+  }
+  return true;
+}
+
+}   // namespace
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_logtostderr = true;
+
+  LOG_IF(FATAL, FLAGS_netlist.empty()) << "--netlist is required";
+  std::ifstream netlist_file(FLAGS_netlist, std::ios::binary);
+  LOG_IF(FATAL, !netlist_file) << "Could not read " << FLAGS_netlist;
+  std::stringstream netlist;
+  netlist << netlist_file.rdbuf();
+
+  spiceserver::Flavour flavour;
+  LOG_IF(FATAL, !spiceserver::Flavour_Parse(FLAGS_flavour, &flavour))
+      << "Unknown flavour: " << FLAGS_flavour;
+
+  SimulationRequest request;
+  request.set_simulator(flavour);
+  spiceserver::FileInfo *file = request.mutable_verbatim_files()->add_files();
+  file->set_path("netlist.sp");
+  file->set_data(netlist.str());
+
+  std::vector<std::unique_ptr<spiceserver::SpiceSimulator::Stub>> stubs;
+  for (int i = 0; i < std::max(FLAGS_channels, 1); ++i) {
+    // Distinct channel arguments stop gRPC from sharing one connection.
+    grpc::ChannelArguments arguments;
+    arguments.SetInt("load_test_channel", i);
+    stubs.push_back(spiceserver::SpiceSimulator::NewStub(
+        grpc::CreateCustomChannel(
+            FLAGS_server, grpc::InsecureChannelCredentials(), arguments)));
+  }
+
+  ProcessSample before {0, 0};
+  bool sampling = FLAGS_server_pid > 0 &&
+                  SampleProcess(FLAGS_server_pid, &before);
+  LOG_IF(WARNING, FLAGS_server_pid > 0 && !sampling)
+      << "Could not sample server process " << FLAGS_server_pid;
+
+  std::cout << std::setw(8) << "time_s"
+            << std::setw(8) << "open"
+            << std::setw(10) << "ok"
+            << std::setw(10) << "failed"
+            << std::setw(12) << "messages"
+            << std::setw(12) << "rss_mib"
+            << std::setw(10) << "threads" << std::endl;
+
+  Counters counters;
+  std::vector<std::unique_ptr<Stream>> streams;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < FLAGS_streams; ++i) {
+    streams.push_back(std::make_unique<Stream>(
+        stubs[i % stubs.size()].get(), request, &counters));
+  }
+
+  // Every stream has been started by the first sample, so the range of
+  // samples is the server's footprint under the full load.
+  ProcessSample lowest {UINT64_MAX, INT32_MAX};
+  ProcessSample highest {0, 0};
+  auto deadline = start + std::chrono::seconds(FLAGS_duration_s);
+  while (counters.open > 0 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(FLAGS_sample_interval_ms));
+    double elapsed = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    ProcessSample sample {0, 0};
+    if (sampling && !SampleProcess(FLAGS_server_pid, &sample)) {
+      LOG(ERROR) << "Server process " << FLAGS_server_pid << " went away";
+      sampling = false;
+    }
+    if (sampling) {
+      lowest.rss_kib = std::min(lowest.rss_kib, sample.rss_kib);
+      lowest.threads = std::min(lowest.threads, sample.threads);
+      highest.rss_kib = std::max(highest.rss_kib, sample.rss_kib);
+      highest.threads = std::max(highest.threads, sample.threads);
+    }
+    std::cout << std::setw(8) << std::fixed << std::setprecision(1) << elapsed
+              << std::setw(8) << counters.open
+              << std::setw(10) << counters.succeeded
+              << std::setw(10) << counters.failed
+              << std::setw(12) << counters.messages
+              << std::setw(12) << sample.rss_kib / 1024
+              << std::setw(10) << sample.threads << std::endl;
+  }
+
+  for (auto &stream : streams) {
+    stream->Cancel();
+  }
+  for (auto &stream : streams) {
+    stream->WaitUntilDone();
+  }
+
+  std::cout << std::endl
+            << FLAGS_streams << " streams: " << counters.succeeded
+            << " finished, " << counters.failed << " failed or cancelled, "
+            << counters.messages << " messages, "
+            << counters.output_bytes << " bytes of output" << std::endl;
+  if (highest.threads > 0) {
+    std::cout << "Server before: " << before.rss_kib / 1024 << " MiB, "
+              << before.threads << " threads" << std::endl
+              << "Server under load: " << lowest.rss_kib / 1024 << "-"
+              << highest.rss_kib / 1024 << " MiB, "
+              << lowest.threads << "-" << highest.threads << " threads"
+              << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,153 @@
+// Measures how fast a request's verbatim files are written into a job
+// directory: InputWriter against the way it used to be done (copy the files
+// out of the request, then an ofstream and a create_directories per file).
+//
+// Two shapes of input: many small files (a netlist split into subcircuits,
+// say) and one large one (a PWL stimulus or model library).
+//
+//   ./materialise_benchmark --small_files=1000 --large_file_mb=1024
+//       --iterations=5 --directory=/tmp
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "input_writer.h"
+#include "proto/spice_simulator.pb.h"
+
+DEFINE_int32(small_files, 1000, "Number of files in the many-files input.");
+DEFINE_int32(small_file_kb, 4, "Size of each of those files (KiB).");
+DEFINE_int32(large_file_mb, 1024, "Size of the one-file input (MiB).");
+DEFINE_int32(iterations, 5, "Runs per method per input.");
+DEFINE_string(directory, "",
+              "Where to make job directories; defaults to the temp directory, "
+              "as the server does.");
+
+namespace {
+
+using spiceserver::FileInfo;
+using spiceserver::InputWriter;
+using spiceserver::VerbatimFileInput;
+
+// What SimulatorManager did before InputWriter.
+void WriteWithOfstream(const std::filesystem::path &directory,
+                       const InputWriter::Files &files) {
+  std::vector<FileInfo> copied(files.begin(), files.end());
+  for (const FileInfo &file : copied) {
+    std::filesystem::path path = directory / file.path();
+    std::filesystem::path directories = path;
+    directories.remove_filename();
+    std::filesystem::create_directories(directories);
+    std::ofstream of;
+    of.open(path, std::ios::out | std::ios::binary);
+    of.write(file.data().c_str(), file.data().size());
+    of.close();
+  }
+}
+
+void WriteWithInputWriter(const std::filesystem::path &directory,
+                          const InputWriter::Files &files) {
+  absl::Status status = InputWriter::Write(directory, files);
+  LOG_IF(FATAL, !status.ok()) << status;
+}
+
+VerbatimFileInput SmallFiles() {
+  VerbatimFileInput input;
+  std::string data(FLAGS_small_file_kb * 1024, '*');
+  for (int i = 0; i < FLAGS_small_files; ++i) {
+    FileInfo *file = input.add_files();
+    // Ten to a directory.
+    file->set_path("cells/" + std::to_string(i / 10) + "/cell_" +
+                   std::to_string(i) + ".sp");
+    file->set_data(data);
+  }
+  return input;
+}
+
+VerbatimFileInput LargeFile() {
+  VerbatimFileInput input;
+  FileInfo *file = input.add_files();
+  file->set_path("stimulus.pwl");
+  file->set_data(std::string(static_cast<size_t>(FLAGS_large_file_mb) << 20,
+                             '0'));
+  return input;
+}
+
+// Best of the iterations, in MiB/s, and that run's time.
+std::pair<double, double> Measure(
+    const std::function<void(const std::filesystem::path&,
+                             const InputWriter::Files&)> &write,
+    const VerbatimFileInput &input) {
+  uint64_t bytes = 0;
+  for (const FileInfo &file : input.files()) {
+    bytes += file.data().size();
+  }
+  std::filesystem::path root = FLAGS_directory.empty() ?
+      std::filesystem::temp_directory_path() :
+      std::filesystem::path(FLAGS_directory);
+  double best_s = 0;
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    std::filesystem::path directory =
+        root / ("materialise_benchmark." + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    // Includes getting it to the page cache, but not to the disk: neither
+    // does the server wait for that.
+    auto start = std::chrono::steady_clock::now();
+    write(directory, input.files());
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    std::filesystem::remove_all(directory);
+    if (i == 0 || seconds < best_s) {
+      best_s = seconds;
+    }
+  }
+  return {bytes / best_s / (1 << 20), best_s * 1000};
+}
+
+}   // namespace
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_logtostderr = true;
+  FLAGS_minloglevel = google::WARNING;
+
+  std::vector<std::pair<std::string, VerbatimFileInput>> inputs;
+  inputs.emplace_back(std::to_string(FLAGS_small_files) + " files",
+                      SmallFiles());
+  inputs.emplace_back(std::to_string(FLAGS_large_file_mb) + " MiB file",
+                      LargeFile());
+
+  std::cout << std::setw(16) << "input"
+            << std::setw(14) << "method"
+            << std::setw(12) << "best_ms"
+            << std::setw(12) << "mib_per_s" << std::endl;
+  for (const auto &[name, input] : inputs) {
+    for (const auto &[method, write] :
+             std::vector<std::pair<std::string,
+                                   std::function<void(
+                                       const std::filesystem::path&,
+                                       const InputWriter::Files&)>>> {
+                 {"ofstream", WriteWithOfstream},
+                 {"InputWriter", WriteWithInputWriter}}) {
+      auto [mib_per_s, best_ms] = Measure(write, input);
+      std::cout << std::setw(16) << name
+                << std::setw(14) << method
+                << std::setw(12) << std::fixed << std::setprecision(1)
+                << best_ms
+                << std::setw(12) << mib_per_s << std::endl;
+    }
+  }
+  return 0;
+}
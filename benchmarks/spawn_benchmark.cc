@@ -0,0 +1,144 @@
+// Measures how long it takes to launch a child process with each of the
+// Subprocess spawn methods, as the resident set size of the parent grows.
+//
+// The server carries the Python interpreter, numpy, gRPC and protobuf arenas,
+// so its RSS is large. fork() has to copy page tables proportional to that;
+// posix_spawn and clone(CLONE_VM | CLONE_VFORK) should not care, and neither
+// should the spawn helper, which is started before the ballast is allocated.
+//
+//   ./spawn_benchmark --ballast_mb=0,512,2048 --iterations=200
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+
+#include "spawn_helper.h"
+#include "subprocess.h"
+
+DEFINE_string(ballast_mb, "0,256,1024,4096",
+              "Comma-separated list of amounts of memory (MiB) to allocate "
+              "and touch before measuring.");
+DEFINE_int32(iterations, 100, "Number of spawns per method per ballast size.");
+DEFINE_string(command, "/bin/true", "Command to spawn.");
+
+namespace {
+
+using spiceserver::Subprocess;
+
+size_t ResidentSetBytes() {
+  std::ifstream statm("/proc/self/statm");
+  size_t size_pages = 0;
+  size_t resident_pages = 0;
+  statm >> size_pages >> resident_pages;
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+
+struct Result {
+  double mean_us;
+  double p50_us;
+  double p99_us;
+  double round_trip_mean_us;
+};
+
+Result Measure(Subprocess::SpawnMethod method) {
+  std::vector<double> spawn_us;
+  std::vector<double> round_trip_us;
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    Subprocess subprocess(method);
+    auto start = std::chrono::steady_clock::now();
+    auto status = subprocess.Spawn(FLAGS_command, {}, "/");
+    auto spawned = std::chrono::steady_clock::now();
+    LOG_IF(FATAL, !status.ok()) << status;
+    subprocess.WaitForCompletion();
+    auto finished = std::chrono::steady_clock::now();
+
+    spawn_us.push_back(
+        std::chrono::duration<double, std::micro>(spawned - start).count());
+    round_trip_us.push_back(
+        std::chrono::duration<double, std::micro>(finished - start).count());
+  }
+  std::sort(spawn_us.begin(), spawn_us.end());
+  Result result;
+  result.mean_us = std::accumulate(spawn_us.begin(), spawn_us.end(), 0.0) /
+      spawn_us.size();
+  result.p50_us = spawn_us[spawn_us.size() / 2];
+  result.p99_us = spawn_us[
+      std::min(spawn_us.size() - 1, spawn_us.size() * 99 / 100)];
+  result.round_trip_mean_us = std::accumulate(
+      round_trip_us.begin(), round_trip_us.end(), 0.0) / round_trip_us.size();
+  return result;
+}
+
+}   // namespace
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  FLAGS_logtostderr = true;
+  // Subprocess logs every command it runs.
+  FLAGS_minloglevel = google::WARNING;
+
+  auto helper_status = spiceserver::SpawnHelper::GetInstance().Start();
+  LOG_IF(FATAL, !helper_status.ok()) << helper_status;
+
+  std::vector<Subprocess::SpawnMethod> methods = {
+      Subprocess::SpawnMethod::FORK,
+      Subprocess::SpawnMethod::POSIX_SPAWN,
+      Subprocess::SpawnMethod::VFORK,
+      Subprocess::SpawnMethod::HELPER};
+
+  std::cout << std::setw(10) << "rss_mib"
+            << std::setw(14) << "method"
+            << std::setw(12) << "mean_us"
+            << std::setw(12) << "p50_us"
+            << std::setw(12) << "p99_us"
+            << std::setw(14) << "run_mean_us" << std::endl;
+
+  // Ballast is kept across sizes and grown, so that it stays resident.
+  size_t ballast_mib = 0;
+  for (absl::string_view entry : absl::StrSplit(FLAGS_ballast_mb, ',')) {
+    size_t target_mib = 0;
+    bool parsed = absl::SimpleAtoi(entry, &target_mib);
+    LOG_IF(FATAL, !parsed) << "Bad --ballast_mb entry: " << entry;
+    if (target_mib > ballast_mib) {
+      // MAP_POPULATE faults every page in, so that it is actually resident
+      // (and has page table entries for fork to copy).
+      size_t bytes = (target_mib - ballast_mib) * 1024 * 1024;
+      void *ballast = mmap(nullptr,
+                           bytes,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+                           -1,
+                           0);
+      LOG_IF(FATAL, ballast == MAP_FAILED)
+          << "Could not allocate " << target_mib << " MiB of ballast";
+      ballast_mib = target_mib;
+    }
+
+    double rss_mib = static_cast<double>(ResidentSetBytes()) / (1024 * 1024);
+    for (Subprocess::SpawnMethod method : methods) {
+      Result result = Measure(method);
+      std::cout << std::setw(10) << std::fixed << std::setprecision(0)
+                << rss_mib
+                << std::setw(14) << Subprocess::SpawnMethodName(method)
+                << std::setw(12) << std::setprecision(1) << result.mean_us
+                << std::setw(12) << result.p50_us
+                << std::setw(12) << result.p99_us
+                << std::setw(14) << result.round_trip_mean_us << std::endl;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef BATCH_JOB_H_
+#define BATCH_JOB_H_
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <absl/status/status.h>
+
+#include "simulation_job.h"
+#include "proto/spice_simulator.pb.h"
+
+// One RunSimulationBatch: a SimulationJob per request, with their responses
+// interleaved into one stream of BatchResponses.
+//
+// Requests are netlisted one at a time, in order, on the WorkerPool's
+// preparation pool, and only a few ahead of those started; a job is started
+// (joins the JobScheduler's queue) once it is netlisted and fewer than
+// max_parallel_jobs of the batch are queued or running. So request k+1 is
+// being netlisted while request k simulates, and is ready to go as soon as
+// there is room for it.
+//
+// Used the same way as a SimulationJob.
+
+namespace spiceserver {
+
+class BatchJob : public std::enable_shared_from_this<BatchJob> {
+ public:
+  using NextResult = SimulationJob::NextResult;
+
+  static absl::Status Validate(const BatchRequest &request);
+  static std::shared_ptr<BatchJob> Create(const BatchRequest &request,
+                                          const std::string &client);
+
+  BatchJob(const BatchJob&) = delete;
+  BatchJob& operator=(const BatchJob&) = delete;
+
+  void Start(std::function<void()> on_ready);
+  NextResult Next(BatchResponse *response, absl::Status *status);
+  void Cancel(const absl::Status &status);
+  void Detach();
+
+ private:
+  struct Job {
+    uint32_t index;
+    std::shared_ptr<SimulationJob> job;
+  };
+
+  BatchJob(const BatchRequest &request, const std::string &client);
+
+  // Runs on the preparation pool. Starts whatever jobs there is room for, and
+  // netlists ahead until enough are ready.
+  void Advance();
+
+  // Posts Advance, unless it is already running. Expects mutex_ to be held.
+  void ScheduleAdvance();
+
+  void NotifyReady();
+
+  const BatchRequest request_;
+  const std::string client_;
+  const uint32_t max_parallel_;
+
+  std::mutex callback_mutex_;
+  std::function<void()> on_ready_;
+
+  std::mutex mutex_;
+  // Set if the batch was cancelled.
+  bool finished_;
+  absl::Status final_status_;
+  bool advancing_;
+  // The next request to be netlisted.
+  uint32_t next_job_;
+  // Netlisted requests, in order, waiting for room to start.
+  std::deque<std::pair<uint32_t, SimulationRequest>> ready_;
+  // Queued or running, in the order their responses are next looked for.
+  std::list<Job> running_;
+  // Jobs that failed before they could start, to be reported.
+  std::deque<std::pair<uint32_t, absl::Status>> failed_;
+};
+
+}  // namespace spiceserver
+
+#endif  // BATCH_JOB_H_
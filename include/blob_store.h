@@ -0,0 +1,115 @@
+#ifndef BLOB_STORE_H_
+#define BLOB_STORE_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/string_view.h>
+
+#include "lru_directory.h"
+#include "sha256.h"
+
+// Optionally (--blob_store_dir), large input files that many requests share,
+// like PDK model libraries, are uploaded once (PutBlob) and from then on
+// referred to by their SHA-256 in FileInfo.blob_digest.
+//
+// Each blob is one read-only file, named for its digest. A job's copy is
+// made by hard link if the work directory is on the same filesystem,
+// otherwise by reflink (FICLONE) if the filesystem can, otherwise by
+// symbolic link; so nothing is copied byte by byte. The least recently used
+// blobs are removed once the total exceeds --blob_store_max_bytes, except
+// those symbolically linked to, which stay until the links have gone with
+// their jobs' directories. A client whose blob has gone is told so when it
+// next refers to it, and uploads it again.
+
+namespace spiceserver {
+
+class BlobStore {
+ public:
+  // A blob being uploaded. It is added to the store by Finish(), if its
+  // contents match the digest it was started with; otherwise (or if Finish()
+  // isn't called) it is thrown away.
+  class Upload {
+   public:
+    ~Upload();
+
+    Upload(const Upload&) = delete;
+    Upload& operator=(const Upload&) = delete;
+
+    absl::Status Append(absl::string_view data);
+    absl::Status Finish();
+
+    uint64_t size() const { return size_; }
+
+   private:
+    friend class BlobStore;
+    Upload(BlobStore *store, const std::string &digest,
+           const std::filesystem::path &path, int fd, uint64_t max_bytes);
+
+    BlobStore *store_;
+    const std::string digest_;
+    const std::filesystem::path path_;
+    const uint64_t max_bytes_;
+    int fd_;
+    uint64_t size_;
+    Sha256 hash_;
+  };
+
+  static BlobStore &GetInstance() {
+    static BlobStore instance;
+    return instance;
+  }
+
+  BlobStore();
+
+  BlobStore(const BlobStore&) = delete;
+  BlobStore& operator=(const BlobStore&) = delete;
+
+  // Opens the store given by the flags, if any.
+  absl::Status Initialise();
+
+  // Opens (creating it if need be) the store in directory, picking up what's
+  // there already. An empty directory turns the store off.
+  absl::Status Open(const std::filesystem::path &directory,
+                    uint64_t max_bytes);
+
+  bool enabled() const;
+
+  bool Has(const std::string &digest);
+
+  absl::StatusOr<std::unique_ptr<Upload>> StartUpload(
+      const std::string &digest);
+
+  // Puts the blob at path (which mustn't exist yet).
+  absl::Status Materialise(const std::string &digest,
+                           const std::filesystem::path &path);
+
+  uint64_t total_bytes() const;
+
+ private:
+  // Takes the finished upload at path into the store.
+  absl::Status Add(const std::string &digest,
+                   const std::filesystem::path &path,
+                   uint64_t size);
+
+  // Unpins the blobs whose symbolic links have all gone. Expects mutex_ to be
+  // held.
+  void UnpinUnlinked();
+
+  mutable std::mutex mutex_;
+  LruDirectory blobs_;
+  // The symbolic links made to pinned blobs, by digest.
+  std::map<std::string, std::vector<std::filesystem::path>> links_;
+  uint64_t next_upload_;
+};
+
+}  // namespace spiceserver
+
+#endif  // BLOB_STORE_H_
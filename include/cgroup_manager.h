@@ -0,0 +1,124 @@
+#ifndef CGROUP_MANAGER_H_
+#define CGROUP_MANAGER_H_
+
+#include <sys/types.h>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "proto/spice_simulator.pb.h"
+
+// Optionally (--job_cgroups), each simulator runs in its own cgroup v2 leaf
+// with its own cpu.max, memory.max and pids.max, so that one huge netlist
+// can't take the whole machine. The hierarchy looks like:
+//
+//   <root>/               the server's own cgroup, or --cgroup_root
+//     server/             where the server (and spawn helper) move to, since
+//                         a cgroup with processes can't delegate controllers
+//     jobs/
+//       job-<pid>-<n>/    one per simulation
+//
+// This needs cgroup v2 and write access to <root> (e.g. systemd's
+// Delegate=yes). If that isn't available, Initialise() says so and jobs run
+// without a cgroup, as before.
+//
+// This is a singleton.
+
+namespace spiceserver {
+
+// A cgroup for a single job. Removed (after killing anything left in it) on
+// destruction.
+class JobCgroup {
+ public:
+  ~JobCgroup();
+
+  JobCgroup(const JobCgroup&) = delete;
+  JobCgroup& operator=(const JobCgroup&) = delete;
+
+  const std::filesystem::path &path() const { return path_; }
+
+  // An open, writable cgroup.procs. A process joins the cgroup by writing "0"
+  // to this (see Subprocess::PlaceInCgroup).
+  int procs_fd() const { return procs_fd_; }
+
+  // Kills everything in the cgroup, however deep (cgroup.kill). Returns false
+  // if that isn't supported.
+  bool Kill();
+
+  // Reads memory.peak, cpu.stat and memory.events. Missing files (older
+  // kernels, disabled controllers) leave their fields zero.
+  CgroupUsage ReadUsage() const;
+
+ private:
+  friend class CgroupManager;
+  JobCgroup(const std::filesystem::path &path, int procs_fd);
+
+  std::filesystem::path path_;
+  int procs_fd_;
+};
+
+class CgroupManager {
+ public:
+  struct Limits {
+    // Cores' worth of CPU time; 0 for no limit.
+    double cpus;
+    // 0 for no limit.
+    uint64_t memory_bytes;
+    uint64_t max_pids;
+  };
+
+  CgroupManager(const CgroupManager&) = delete;
+  CgroupManager& operator=(const CgroupManager&) = delete;
+  static CgroupManager& GetInstance() {
+    static CgroupManager instance;
+    return instance;
+  }
+
+  // Server defaults, from flags.
+  static Limits DefaultLimits();
+
+  // Server defaults overridden by whatever the client set.
+  static Limits LimitsFromRequest(const JobLimits &limits_pb);
+
+  // Sets up the hierarchy, if --job_cgroups. Must be called before the spawn
+  // helper is started or any threads are, since the whole server may have to
+  // move into a new cgroup.
+  absl::Status Initialise();
+
+  bool IsAvailable() const;
+
+  absl::StatusOr<std::unique_ptr<JobCgroup>> CreateJobCgroup(
+      const Limits &limits);
+
+  // Parses "key value" lines, like cpu.stat and memory.events.
+  static std::map<std::string, uint64_t> ParseKeyedValues(
+      const std::string &contents);
+
+  // The cpu.max line for the given number of cores, e.g. "150000 100000".
+  static std::string FormatCpuMax(double cpus);
+
+ private:
+  CgroupManager();
+  ~CgroupManager() = default;
+
+  absl::Status EnableControllers(const std::filesystem::path &cgroup);
+
+  mutable std::mutex mutex_;
+  bool available_;
+  std::filesystem::path jobs_path_;
+  // Controllers enabled for job cgroups.
+  bool cpu_;
+  bool memory_;
+  bool pids_;
+  uint64_t next_id_;
+};
+
+}  // namespace spiceserver
+
+#endif  // CGROUP_MANAGER_H_
@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <functional>
 #include <filesystem>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -12,6 +13,7 @@
 // #include <python3.11/Python.h>
 #include <Python.h>
 
+#include <absl/status/status.h>
 #include <absl/status/statusor.h>
 
 #include "simulator_registry.h"
@@ -22,6 +24,12 @@
 // interpreter and also destroy it at the end of the program. (It turns out
 // that it's not possible to correctly initialize and de-initialize it when
 // using some modules, like numpy.)
+//
+// The Python side is compiled and imported once, when the instance is made,
+// leaving a netlisting function for each flavour. Netlisting hands the
+// serialised proto to that function as bytes and gets the netlist back as a
+// string; nothing goes through the filesystem. Only one thread can be in
+// Python at a time, so calls are serialised on the GIL.
 
 namespace spiceserver {
 
@@ -35,29 +43,80 @@ class EmbeddedPythonNetlister {
     return instance;
   }
 
-  // Write the given VLSIR package to disk at the given output_directory, in
-  // the given spice flavour. Returns a list of created files, with the file
-  // corresponding to the top-level module first.
-  std::vector<std::filesystem::path> WriteSim(
+  // Whether the netlisters loaded; if not, why not.
+  absl::Status status() const { return status_; }
+
+  // The netlist for sim_input in the given spice flavour. Python exceptions
+  // (say, for a malformed package) come back as errors.
+  absl::StatusOr<std::string> NetlistSim(
+      const vlsir::spice::SimInput &sim_input_pb,
+      const Flavour &spice_flavour);
+
+  absl::StatusOr<std::string> NetlistPackage(
+      const vlsir::circuit::Package &circuit_pb,
+      const Flavour &spice_flavour);
+
+  // The same, for input that is already serialised.
+  absl::StatusOr<std::string> NetlistSerialisedSim(
+      const std::string &serialised_sim_input,
+      const Flavour &spice_flavour);
+
+  absl::StatusOr<std::string> NetlistSerialisedPackage(
+      const std::string &serialised_package,
+      const Flavour &spice_flavour);
+
+  // Write the netlist for the given VLSIR input to the given
+  // output_directory, in the given spice flavour. Returns a list of created
+  // files, with the file corresponding to the top-level module first.
+  absl::StatusOr<std::vector<std::filesystem::path>> WriteSim(
       const vlsir::spice::SimInput &sim_input_pb,
       const Flavour &spice_flavour,
       const std::filesystem::path &output_directory);
 
-  std::vector<std::filesystem::path> WriteSpice(
+  absl::StatusOr<std::vector<std::filesystem::path>> WriteSpice(
       const vlsir::circuit::Package &circuit_pb,
       const Flavour &spice_flavour,
       const std::filesystem::path &output_directory);
 
  private:
   EmbeddedPythonNetlister()
-    : py_thread_state_(nullptr) {
+    : main_thread_state_(nullptr),
+      py_thread_state_(nullptr) {
     InitialisePython();
     ConfigurePythonPostInit();
+    status_ = LoadNetlisters();
+    // Let other threads take the GIL.
+    main_thread_state_ = PyEval_SaveThread();
   }
   ~EmbeddedPythonNetlister() {
+    PyEval_RestoreThread(main_thread_state_);
     DeinitialisePython();
   }
 
+  // Compiles the Python side and makes the netlisting functions. Expects the
+  // GIL to be held.
+  absl::Status LoadNetlisters();
+
+  // Calls the netlisting function for spice_flavour in netlisters with the
+  // serialised proto.
+  absl::StatusOr<std::string> Netlist(
+      const std::map<Flavour, PyObject*> &netlisters,
+      const std::string &serialised,
+      const Flavour &spice_flavour);
+
+  // Writes a netlist to output_directory / file_name.
+  static absl::StatusOr<std::vector<std::filesystem::path>> WriteNetlist(
+      const absl::StatusOr<std::string> &netlist,
+      const std::filesystem::path &output_directory,
+      const std::string &file_name);
+
+  absl::Status status_;
+  // Callables taking the serialised SimInput or Package and returning the
+  // netlist, by flavour.
+  std::map<Flavour, PyObject*> sim_netlisters_;
+  std::map<Flavour, PyObject*> package_netlisters_;
+  PyThreadState *main_thread_state_;
+
   // FIXME(aryap): numpy is bad at being run in a Python init/de-init loop or
   // in sub-interpreters. It even says:
   //
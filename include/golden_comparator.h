@@ -0,0 +1,46 @@
+#ifndef GOLDEN_COMPARATOR_H_
+#define GOLDEN_COMPARATOR_H_
+
+#include <absl/status/status.h>
+
+#include "rawfile_reader.h"
+#include "result_store.h"
+#include "proto/spice_simulator.pb.h"
+
+// Compares the rawfile of a finished simulation with the golden result of
+// its regression test (GoldenOptions), so that a regression run gets a
+// verdict and the worst deviations instead of its waveforms.
+//
+// A golden plot is matched with the run's plot of the same name (the n-th
+// golden "Transient Analysis" with the n-th of the run). Each signal is
+// checked at the points of both: the run, interpolated, at the golden's
+// points, and the golden, interpolated, at the run's; beyond either's ends
+// the last value holds. Complex signals are compared by the magnitude of
+// the difference.
+
+namespace spiceserver {
+
+class GoldenComparator {
+ public:
+  static absl::Status Validate(const GoldenOptions &options);
+
+  GoldenComparator(const StoredResult &golden, const RawfileReader &run);
+
+  GoldenComparator(const GoldenComparator&) = delete;
+  GoldenComparator& operator=(const GoldenComparator&) = delete;
+
+  GoldenComparison Compare(const GoldenOptions &options);
+
+ private:
+  void CompareSignal(int golden_plot,
+                     int golden_signal,
+                     const SignalTolerance &tolerance,
+                     SignalComparison *comparison);
+
+  const StoredResult &golden_;
+  const RawfileReader &run_;
+};
+
+}  // namespace spiceserver
+
+#endif  // GOLDEN_COMPARATOR_H_
@@ -0,0 +1,70 @@
+#ifndef INPUT_STAGER_H_
+#define INPUT_STAGER_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "proto/spice_simulator.pb.h"
+
+// Writes a job's input files into a fresh job directory as they arrive, so
+// that an UploadAndRun never holds more than a chunk of them in memory. The
+// directory is then handed to the job (Release), or removed.
+
+namespace spiceserver {
+
+class InputStager {
+ public:
+  static absl::StatusOr<std::unique_ptr<InputStager>> Create();
+
+  ~InputStager();
+
+  InputStager(const InputStager&) = delete;
+  InputStager& operator=(const InputStager&) = delete;
+
+  // Writes a whole file, from its data or its blob.
+  absl::Status AddFile(const FileInfo &file);
+
+  // Appends to the file being streamed, or starts the next one. Files are
+  // streamed one at a time: once another has started, a file can't be added
+  // to.
+  absl::Status Append(const FileChunk &chunk);
+
+  // Closes the last streamed file.
+  absl::Status Finish();
+
+  // Every file written so far, in the order they were started.
+  const std::vector<std::string> &paths() const { return paths_; }
+
+  const std::filesystem::path &directory() const { return directory_; }
+
+  uint64_t total_bytes() const { return total_bytes_; }
+
+  // The directory is no longer removed on destruction.
+  std::filesystem::path Release();
+
+ private:
+  explicit InputStager(const std::filesystem::path &directory);
+
+  // Where path goes in the directory, or an error if it would be outside it.
+  absl::StatusOr<std::filesystem::path> Resolve(const std::string &path);
+
+  absl::Status CloseStream();
+  absl::Status CountBytes(uint64_t bytes);
+
+  std::filesystem::path directory_;
+  std::vector<std::string> paths_;
+  uint64_t total_bytes_;
+  // The file being streamed, if any.
+  std::string stream_path_;
+  int stream_fd_;
+};
+
+}  // namespace spiceserver
+
+#endif  // INPUT_STAGER_H_
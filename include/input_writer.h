@@ -0,0 +1,40 @@
+#ifndef INPUT_WRITER_H_
+#define INPUT_WRITER_H_
+
+#include <filesystem>
+#include <string>
+
+#include <absl/status/status.h>
+#include <google/protobuf/repeated_ptr_field.h>
+
+#include "proto/spice_simulator.pb.h"
+
+// Writes a request's verbatim files into its job directory, straight from
+// the request: nothing is copied on the way to the kernel.
+//
+// Each directory is created once, however many files are in it. Big inputs
+// are cut into pieces that are written (pwrite, at their offsets) by the
+// calling thread together with some WorkerPool threads, so that one large
+// file doesn't take one thread's worth of memory bandwidth. The caller takes
+// pieces too, and only waits for pieces already being written, so this is
+// safe to call from the WorkerPool itself.
+
+namespace spiceserver {
+
+class InputWriter {
+ public:
+  using Files = google::protobuf::RepeatedPtrField<FileInfo>;
+
+  // directory must exist. Files from the BlobStore are linked, not written.
+  // Fails, before anything is written, if any path would leave directory.
+  static absl::Status Write(const std::filesystem::path &directory,
+                            const Files &files);
+
+  // Fails unless path is relative and has no ".." in it, so that it stays
+  // inside the job directory.
+  static absl::Status CheckPath(const std::string &path);
+};
+
+}  // namespace spiceserver
+
+#endif  // INPUT_WRITER_H_
@@ -0,0 +1,148 @@
+#ifndef JOB_SCHEDULER_H_
+#define JOB_SCHEDULER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <absl/status/statusor.h>
+
+#include "proto/spice_simulator.pb.h"
+
+// Admission control in front of SimulatorManager. Simulators are CPU-bound,
+// so running more of them than there are cores only makes every one of them
+// slower (and the tail much worse). Instead, each job takes some number of
+// slots (by default one per core) and waits in a queue until they're free.
+//
+// Jobs are admitted in order of:
+//  1. priority (higher first);
+//  2. fair share: the client with the fewest slots currently running goes
+//  first, so one client submitting a hundred jobs can't starve another
+//  submitting one;
+//  3. arrival.
+// A job that is blocked only by its flavour's slot limit doesn't hold up jobs
+// of other flavours. A job waiting for host slots does hold up everything
+// behind it, so that large jobs aren't starved by a stream of small ones.
+
+namespace spiceserver {
+
+class JobScheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct JobRequest {
+    Flavour flavour;
+    // Whoever fair share is computed over.
+    std::string client;
+    int priority;
+    // Clamped to [1, host slots].
+    int slots;
+  };
+
+  // A job's place in the scheduler. Destroying it gives up the place (if
+  // still waiting) or the slots (if admitted).
+  class Ticket {
+   public:
+    ~Ticket();
+
+    Ticket(const Ticket&) = delete;
+    Ticket& operator=(const Ticket&) = delete;
+
+    // Waits up to timeout to be admitted. Returns true once admitted.
+    bool WaitForAdmission(std::chrono::milliseconds timeout);
+
+    // Calls callback once the job is admitted: straight away if it already
+    // has been, otherwise on whichever thread frees up the slots. The
+    // callback is not called with the scheduler's lock held, but shouldn't
+    // block.
+    void OnAdmitted(std::function<void()> callback);
+
+    bool admitted() const;
+
+    // Where the job stands while it waits.
+    QueueStatus Status() const;
+
+    // Call when the job has run to completion, so that its run time informs
+    // future estimates.
+    void Finished();
+
+   private:
+    friend class JobScheduler;
+    Ticket(JobScheduler *scheduler, const JobRequest &request, uint64_t id);
+
+    JobScheduler *scheduler_;
+    JobRequest request_;
+    uint64_t id_;
+    Clock::time_point enqueued_at_;
+
+    // Guarded by the scheduler's mutex.
+    bool admitted_;
+    Clock::time_point admitted_at_;
+    std::function<void()> on_admitted_;
+  };
+
+  static JobScheduler &GetInstance();
+
+  // flavour_slots limits how many slots jobs of each flavour may hold at once;
+  // flavours not mentioned may use all of them.
+  JobScheduler(int host_slots, const std::map<Flavour, int> &flavour_slots);
+
+  JobScheduler(const JobScheduler&) = delete;
+  JobScheduler& operator=(const JobScheduler&) = delete;
+
+  // The job's slots are clamped to what the host, and its flavour, allow.
+  std::unique_ptr<Ticket> Enqueue(const JobRequest &request);
+
+  // Parses --flavour_slots-style limits, e.g. "XYCE=8,NGSPICE=4".
+  static absl::StatusOr<std::map<Flavour, int>> ParseFlavourSlots(
+      const std::string &spec);
+
+  int host_slots() const { return host_slots_; }
+
+ private:
+  struct RunningJob {
+    Flavour flavour;
+    int slots;
+    Clock::time_point admitted_at;
+  };
+
+  // All of these expect mutex_ to be held. Admit() collects the OnAdmitted
+  // callbacks to run, which the caller must pass to RunCallbacks once it has
+  // released the lock.
+  void Admit(std::vector<std::function<void()>> *callbacks);
+  // True if a should be admitted before b.
+  bool Ranks(const Ticket *a, const Ticket *b) const;
+  std::list<Ticket*> RankedWaiting() const;
+  int RunningSlots(Flavour flavour) const;
+  std::optional<std::chrono::duration<double>> ExpectedDuration(
+      Flavour flavour) const;
+  void Release(Ticket *ticket, std::vector<std::function<void()>> *callbacks);
+
+  static void RunCallbacks(const std::vector<std::function<void()>> &callbacks);
+  QueueStatus StatusOf(const Ticket *ticket) const;
+
+  const int host_slots_;
+  const std::map<Flavour, int> flavour_slots_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable changed_;
+  uint64_t next_id_;
+  int free_slots_;
+  std::list<Ticket*> waiting_;
+  std::map<uint64_t, RunningJob> running_;
+  std::map<std::string, int> client_running_slots_;
+  // Moving average of run time, in seconds, per flavour.
+  std::map<Flavour, double> mean_run_seconds_;
+};
+
+}  // namespace spiceserver
+
+#endif  // JOB_SCHEDULER_H_
@@ -0,0 +1,92 @@
+#ifndef LRU_DIRECTORY_H_
+#define LRU_DIRECTORY_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+
+#include <absl/status/status.h>
+
+// The size-bounded, least-recently-used index of a directory whose entries
+// (files, or directories of files) are named for their keys, as kept by the
+// ResultCache, BlobStore and ResultStore.
+//
+// Opening picks up what's there, oldest modification first; anything that
+// isn't an entry (like the remains of one being written when the server
+// stopped) is removed. Once the total size exceeds max_bytes, the least
+// recently used entries are removed from disk. Whoever has one open already
+// keeps it, since on Linux that outlives its name.
+//
+// Not thread-safe: the stores call it under their own locks.
+
+namespace spiceserver {
+
+class LruDirectory {
+ public:
+  // Whether something found on opening is an entry.
+  using IsEntry =
+      std::function<bool(const std::filesystem::directory_entry&)>;
+
+  LruDirectory();
+
+  LruDirectory(const LruDirectory&) = delete;
+  LruDirectory& operator=(const LruDirectory&) = delete;
+
+  // Forgets everything, then (creating it if need be) indexes directory.
+  // Names in ignore are left alone. An empty directory leaves this closed.
+  absl::Status Open(const std::filesystem::path &directory,
+                    uint64_t max_bytes,
+                    const IsEntry &is_entry,
+                    const std::set<std::string> &ignore = {});
+
+  // Empty if closed.
+  const std::filesystem::path &directory() const { return directory_; }
+
+  std::filesystem::path PathFor(const std::string &key) const {
+    return directory_ / key;
+  }
+
+  bool Contains(const std::string &key) const;
+
+  // Makes key the most recently used, if it's there.
+  bool Touch(const std::string &key);
+
+  // Indexes (or re-indexes) the entry now at PathFor(key) as the most
+  // recently used, then evicts.
+  void Add(const std::string &key, uint64_t size);
+
+  // Forgets key, without removing it from disk.
+  void Remove(const std::string &key);
+
+  // A pinned entry isn't evicted, though it still counts towards the total.
+  void Pin(const std::string &key) { pinned_.insert(key); }
+  void Unpin(const std::string &key) { pinned_.erase(key); }
+
+  size_t size() const { return entries_.size(); }
+  uint64_t total_bytes() const { return total_bytes_; }
+  uint64_t max_bytes() const { return max_bytes_; }
+
+ private:
+  struct Entry {
+    uint64_t size;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  void Evict();
+
+  std::filesystem::path directory_;
+  uint64_t max_bytes_;
+  uint64_t total_bytes_;
+  std::map<std::string, Entry> entries_;
+  // Least recently used first.
+  std::list<std::string> lru_;
+  std::set<std::string> pinned_;
+};
+
+}  // namespace spiceserver
+
+#endif  // LRU_DIRECTORY_H_
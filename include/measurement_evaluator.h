@@ -0,0 +1,64 @@
+#ifndef MEASUREMENT_EVALUATOR_H_
+#define MEASUREMENT_EVALUATOR_H_
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <google/protobuf/repeated_ptr_field.h>
+
+#include "rawfile_reader.h"
+#include "proto/spice_simulator.pb.h"
+
+// Makes a request's Measurements from the rawfile of a finished simulation,
+// so that clients characterising a circuit get a few numbers instead of its
+// waveforms.
+//
+// Each signal a measurement needs is copied out of the rawfile once, as a
+// contiguous column, and every measurement is then a single pass over the
+// points of its window.
+
+namespace spiceserver {
+
+class MeasurementEvaluator {
+ public:
+  static absl::Status Validate(
+      const google::protobuf::RepeatedPtrField<Measurement> &measurements);
+
+  explicit MeasurementEvaluator(const RawfileReader &reader);
+
+  MeasurementEvaluator(const MeasurementEvaluator&) = delete;
+  MeasurementEvaluator& operator=(const MeasurementEvaluator&) = delete;
+
+  MeasurementResult Evaluate(const Measurement &measurement);
+
+ private:
+  // A signal and the plot's first signal, over the points of a window.
+  struct Trace {
+    const double *x;
+    const double *y;
+    uint64_t num_points;
+    // Where the window starts and ends, within the plot.
+    double from;
+    double to;
+  };
+
+  absl::StatusOr<Trace> Find(const Measurement &measurement,
+                             const std::string &signal);
+
+  absl::StatusOr<double> Cross(const Measurement &measurement,
+                               const Crossing &crossing);
+
+  const std::vector<double> &Column(size_t plot, size_t signal);
+
+  const RawfileReader &reader_;
+  std::map<std::pair<size_t, size_t>, std::vector<double>> columns_;
+};
+
+}  // namespace spiceserver
+
+#endif  // MEASUREMENT_EVALUATOR_H_
@@ -0,0 +1,63 @@
+#ifndef NATIVE_NETLISTER_H_
+#define NATIVE_NETLISTER_H_
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "proto/spice_simulator.pb.h"
+#include "vlsir/circuit.pb.h"
+#include "vlsir/spice.pb.h"
+
+// Netlists VLSIR for Xyce and ngspice in C++, walking the protobufs
+// directly, so that the common case needs no Python at all. The interface is
+// EmbeddedPythonNetlister's.
+//
+// Anything it doesn't know how to netlist (other flavours, primitives it
+// doesn't know, more than one analysis) is reported as UNIMPLEMENTED, and
+// should be handed to the Python netlister instead; other errors are the
+// input's fault. Netlists are meant to be equivalent to vlsirtools', not
+// identical: see tests/native_netlister_test.cc for the comparison.
+//
+// Each module's text is kept in the SubcircuitCache, keyed by a hash of the
+// module and the ports of whatever it instantiates, so that modules seen
+// before are spliced in rather than written again.
+//
+// Only that cache is shared between calls, so any number can run at once.
+
+namespace spiceserver {
+
+class NativeNetlister {
+ public:
+  // Whether to try this netlister first (--native_netlister).
+  static bool Enabled();
+
+  static bool Supports(const Flavour &spice_flavour);
+
+  static absl::StatusOr<std::string> NetlistSim(
+      const vlsir::spice::SimInput &sim_input_pb,
+      const Flavour &spice_flavour);
+
+  static absl::StatusOr<std::string> NetlistPackage(
+      const vlsir::circuit::Package &circuit_pb,
+      const Flavour &spice_flavour);
+
+  // As for EmbeddedPythonNetlister, but the netlist is streamed to the file
+  // as it is made.
+  static absl::StatusOr<std::vector<std::filesystem::path>> WriteSim(
+      const vlsir::spice::SimInput &sim_input_pb,
+      const Flavour &spice_flavour,
+      const std::filesystem::path &output_directory);
+
+  static absl::StatusOr<std::vector<std::filesystem::path>> WriteSpice(
+      const vlsir::circuit::Package &circuit_pb,
+      const Flavour &spice_flavour,
+      const std::filesystem::path &output_directory);
+};
+
+}  // namespace spiceserver
+
+#endif  // NATIVE_NETLISTER_H_
@@ -0,0 +1,104 @@
+#ifndef NETLISTER_POOL_H_
+#define NETLISTER_POOL_H_
+
+#include <sys/types.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "proto/netlister_worker.pb.h"
+#include "proto/spice_simulator.pb.h"
+#include "vlsir/circuit.pb.h"
+#include "vlsir/spice.pb.h"
+
+// Optionally (--netlister_workers), VLSIR inputs are netlisted by a pool of
+// worker processes rather than by the server's own Python interpreter, in
+// which only one thread can run at a time.
+//
+// Each worker is spice_server itself, started with --netlister_worker_fd: it
+// loads the EmbeddedPythonNetlister (importing vlsirtools once), says so, and
+// then answers NetlistWorkRequests on the socket it was given, one at a time.
+// A worker that dies, or takes longer than --netlister_timeout_ms, is killed
+// and replaced when next needed; the request it had fails with UNAVAILABLE or
+// DEADLINE_EXCEEDED.
+
+namespace spiceserver {
+
+class NetlisterPool {
+ public:
+  static NetlisterPool &GetInstance() {
+    static NetlisterPool instance;
+    return instance;
+  }
+
+  NetlisterPool();
+  ~NetlisterPool();
+
+  NetlisterPool(const NetlisterPool&) = delete;
+  NetlisterPool& operator=(const NetlisterPool&) = delete;
+
+  // Whether this process was started as a worker.
+  static bool IsWorkerProcess();
+
+  // A worker's main loop. Returns (the exit code) when the server goes away.
+  static int ServeWorker();
+
+  // Starts the workers given by the flags, if any.
+  absl::Status Initialise();
+
+  // Starts num_workers workers, each running command with args, plus
+  // --netlister_worker_fd. Only fails if none of them will start.
+  absl::Status Start(int num_workers,
+                     const std::string &command,
+                     const std::vector<std::string> &args,
+                     std::chrono::milliseconds timeout);
+
+  bool enabled() const;
+
+  absl::StatusOr<std::string> NetlistSim(
+      const vlsir::spice::SimInput &sim_input_pb,
+      const Flavour &spice_flavour);
+
+  absl::StatusOr<std::string> NetlistPackage(
+      const vlsir::circuit::Package &circuit_pb,
+      const Flavour &spice_flavour);
+
+  // How many times a worker has had to be replaced.
+  uint64_t restarts() const;
+
+ private:
+  struct Worker {
+    pid_t pid = -1;
+    int socket_fd = -1;
+  };
+
+  absl::StatusOr<std::string> Netlist(const NetlistWorkRequest &request);
+
+  // Starts the worker and waits for it to load its netlisters.
+  absl::Status Spawn(Worker *worker);
+  void Kill(Worker *worker);
+
+  // Takes an idle worker, waiting for one if need be; and gives it back.
+  Worker *Acquire();
+  void Release(Worker *worker);
+
+  mutable std::mutex mutex_;
+  std::condition_variable released_;
+  std::string command_;
+  std::vector<std::string> args_;
+  std::chrono::milliseconds timeout_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<Worker*> idle_;
+  uint64_t restarts_;
+};
+
+}  // namespace spiceserver
+
+#endif  // NETLISTER_POOL_H_
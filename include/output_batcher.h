@@ -0,0 +1,113 @@
+#ifndef OUTPUT_BATCHER_H_
+#define OUTPUT_BATCHER_H_
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <absl/strings/string_view.h>
+
+#include "subprocess.h"
+#include "proto/spice_simulator.pb.h"
+
+// Simulators can print millions of short lines, and each read() from their
+// pipes can be anything from a few bytes to a buffer-full that splits a line
+// in two. Sending a SimulationResponse per read() means paying for gRPC
+// framing (and a syscall or two) on every one of them.
+//
+// The OutputBatcher accumulates output per stream and cuts it into batches
+// when:
+//  - max_bytes are pending; or
+//  - the oldest pending byte has waited max_latency (so that interactive
+//  runs still see output promptly).
+// If line_framed, batches are cut at the last newline so that lines are not
+// split across messages (unless a single line exceeds max_bytes or nothing
+// but a partial line has arrived within max_latency).
+//
+// stdout and stderr are batched separately, so each stream's output stays
+// in order but their order relative to each other does not: a batch of
+// stdout can go out after stderr that was printed later (FlushAll sends
+// stdout first). Clients that need the interleaving should disable
+// batching.
+
+namespace spiceserver {
+
+class OutputBatcher {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Options {
+    size_t max_bytes;
+    std::chrono::milliseconds max_latency;
+    bool line_framed;
+    bool as_lines;
+    bool disabled;
+  };
+
+  // Server defaults, from flags.
+  static Options DefaultOptions();
+
+  // Server defaults overridden by whatever the client set.
+  static Options OptionsFromRequest(const OutputBatching &batching_pb);
+
+  explicit OutputBatcher(const Options &options);
+
+  // Adds a chunk of output. Any batches that are now complete are appended to
+  // ready.
+  void Add(const char *data,
+           size_t length,
+           Subprocess::StreamType stream_type,
+           Clock::time_point now,
+           std::vector<SimulationResponse> *ready);
+
+  // Appends batches whose oldest data has waited at least max_latency.
+  void FlushExpired(Clock::time_point now,
+                    std::vector<SimulationResponse> *ready);
+
+  // Appends everything still pending, including partial lines.
+  void FlushAll(std::vector<SimulationResponse> *ready);
+
+  // When FlushExpired next has something to do, if anything is pending.
+  std::optional<Clock::time_point> NextDeadline() const;
+
+  const Options &options() const { return options_; }
+
+ private:
+  struct Pending {
+    // Bytes before start have been emitted, and are only erased once per
+    // Add() so that cutting a large chunk into many batches stays linear.
+    std::string data;
+    size_t start = 0;
+    // When the first unread byte arrived.
+    Clock::time_point oldest;
+
+    absl::string_view unread() const {
+      return absl::string_view(data).substr(start);
+    }
+  };
+
+  Pending &PendingFor(Subprocess::StreamType stream_type) {
+    return stream_type == Subprocess::StreamType::STDOUT ? stdout_ : stderr_;
+  }
+
+  // Emits the first length unread bytes of pending as a response.
+  void Emit(Subprocess::StreamType stream_type,
+            size_t length,
+            std::vector<SimulationResponse> *ready);
+
+  static void Compact(Pending *pending);
+
+  // How much of the pending data to emit when the batch is cut: everything up
+  // to and including the last newline if we're line-framed and there is one,
+  // otherwise all of it.
+  size_t CutPoint(absl::string_view data) const;
+
+  Options options_;
+  Pending stdout_;
+  Pending stderr_;
+};
+
+}  // namespace spiceserver
+
+#endif  // OUTPUT_BATCHER_H_
@@ -0,0 +1,127 @@
+#ifndef OUTPUT_REACTOR_H_
+#define OUTPUT_REACTOR_H_
+
+#include <sys/types.h>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <absl/status/statusor.h>
+
+#include "subprocess.h"
+
+// Instead of parking one thread per simulation in poll(), every running
+// simulator's stdout/stderr pipes and pidfd are registered with a small, fixed
+// number of epoll event loops. Each loop:
+//
+//  - reads whatever is available on a readable pipe into a buffer shared by
+//  all the jobs on that loop, and hands it to that job's output callback;
+//  - stops watching a pipe when it reaches EOF; and
+//  - when the pidfd becomes readable (the child has exited), drains anything
+//  left in the pipes, stops watching all of the job's descriptors, and then
+//  calls the job's exit callback exactly once.
+//
+// Callbacks run on the event loop thread, so they must not block. (Queue the
+// data somewhere and get out of the way.)
+//
+// This is a singleton. The loops are started on first use.
+
+namespace spiceserver {
+
+class OutputReactor {
+ public:
+  using ExitCallback = std::function<void()>;
+
+  OutputReactor(const OutputReactor&) = delete;
+  OutputReactor& operator=(const OutputReactor&) = delete;
+  static OutputReactor& GetInstance() {
+    static OutputReactor instance;
+    return instance;
+  }
+
+  // Start watching the given descriptors. Ownership of the descriptors stays
+  // with the caller, who must keep them open until either the exit callback
+  // has been called or Remove() has returned. Returns an ID for use with
+  // Remove().
+  absl::StatusOr<uint64_t> Add(int stdout_fd,
+                               int stderr_fd,
+                               int pidfd,
+                               Subprocess::OutputCallback on_output,
+                               ExitCallback on_exit);
+
+  // Stop watching the descriptors registered under the given ID. When this
+  // returns no callback for that ID is running or will run again. Must not be
+  // called from within one of that ID's own callbacks.
+  void Remove(uint64_t id);
+
+  size_t NumWatched() const;
+
+ private:
+  OutputReactor();
+  ~OutputReactor();
+
+  enum class FdKind : uint64_t {
+    STDOUT = 0,
+    STDERR = 1,
+    PIDFD = 2,
+    WAKEUP = 3
+  };
+
+  struct Watch {
+    uint64_t id;
+    int stdout_fd;
+    int stderr_fd;
+    int pidfd;
+    bool stdout_open;
+    bool stderr_open;
+    Subprocess::OutputCallback on_output;
+    ExitCallback on_exit;
+
+    // Held by the loop for the duration of any callback, and by Remove() to
+    // wait for the loop to finish with this Watch.
+    std::mutex mutex;
+    bool removed;
+  };
+
+  struct Loop {
+    int epoll_fd;
+    int wakeup_fd;
+    std::thread thread;
+
+    std::mutex mutex;
+    std::map<uint64_t, std::shared_ptr<Watch>> watches;
+  };
+
+  void Run(Loop *loop);
+
+  // Read once from the given descriptor into the loop's buffer and pass it on.
+  // Returns false when the descriptor is at EOF (or broken).
+  bool ReadOnce(Watch *watch,
+                int fd,
+                Subprocess::StreamType stream_type,
+                std::vector<char> *buffer);
+
+  // Called when a child has exited: drain the remaining output, deregister
+  // everything and notify the owner.
+  void Finish(Loop *loop, const std::shared_ptr<Watch> &watch,
+              std::vector<char> *buffer);
+
+  void Unregister(Loop *loop, Watch *watch);
+
+  static uint64_t EncodeEvent(uint64_t id, FdKind kind) {
+    return (id << 2) | static_cast<uint64_t>(kind);
+  }
+
+  std::vector<std::unique_ptr<Loop>> loops_;
+  std::atomic<uint64_t> next_id_;
+  std::atomic<bool> stopping_;
+};
+
+}  // namespace spiceserver
+
+#endif  // OUTPUT_REACTOR_H_
@@ -0,0 +1,109 @@
+#ifndef OUTPUT_SPOOL_H_
+#define OUTPUT_SPOOL_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "subprocess.h"
+
+// A per-job buffer between the OutputReactor, which reads the simulator's
+// pipes, and whoever sends that output to the client.
+//
+// Writes never wait for the reader. Output goes into a fixed-size in-memory
+// ring buffer; if that is full, it is appended to an overflow file (in the
+// job's directory) instead, and stays there until the reader has caught up.
+// So a slow client only costs us disk, never simulator time: the simulator is
+// never blocked on a full pipe.
+//
+// Order is preserved. Once anything has gone to the overflow file, everything
+// after it does too until the reader has drained the file.
+
+namespace spiceserver {
+
+class OutputSpool {
+ public:
+  struct Statistics {
+    // Everything ever appended.
+    uint64_t total_bytes;
+    // Most bytes (including record headers) ever held in the ring buffer.
+    uint64_t memory_high_water_bytes;
+    // Most bytes ever waiting for the reader, in memory and on disk.
+    uint64_t backlog_high_water_bytes;
+    // Bytes that went through the overflow file.
+    uint64_t spilled_bytes;
+    // Bytes lost because the overflow file couldn't be written.
+    uint64_t dropped_bytes;
+  };
+
+  OutputSpool(size_t memory_bytes, const std::filesystem::path &overflow_path);
+  ~OutputSpool();
+
+  OutputSpool(const OutputSpool&) = delete;
+  OutputSpool& operator=(const OutputSpool&) = delete;
+
+  // Adds a chunk of output. Never blocks on the reader.
+  void Append(Subprocess::StreamType stream_type,
+              const char *data,
+              size_t length);
+
+  // No more output will be appended.
+  void Finish();
+
+  // Waits up to timeout for output, then passes up to (about) max_bytes of it,
+  // in order, to the callback. The callback is not called with the lock held.
+  // Returns false once the spool is finished and everything has been read.
+  bool Read(Subprocess::OutputCallback callback,
+            std::chrono::milliseconds timeout,
+            size_t max_bytes);
+
+  // Calls callback once, as soon as Read has something to return (output, or
+  // the news that the spool is finished). That may be straight away, on this
+  // thread, or else on the thread that appends. Replaces any callback already
+  // waiting. The callback is not called with the lock held.
+  void NotifyWhenReadable(std::function<void()> callback);
+
+  Statistics statistics() const;
+
+ private:
+  // Each record is stored as a one-byte stream type, a 4-byte length and then
+  // the data.
+  static constexpr size_t kHeaderBytes = 1 + sizeof(uint32_t);
+
+  // All of these expect mutex_ to be held.
+  void WriteRing(const char *data, size_t length);
+  void ReadRing(char *data, size_t length);
+  bool AppendToFile(Subprocess::StreamType stream_type,
+                    const char *data,
+                    size_t length);
+  bool ReadRecordFromFile(Subprocess::StreamType *stream_type,
+                          std::string *data);
+  uint64_t Backlog() const {
+    return ring_used_ + (file_write_offset_ - file_read_offset_);
+  }
+
+  mutable std::mutex mutex_;
+  std::condition_variable data_available_;
+
+  std::vector<char> ring_;
+  size_t ring_head_;   // Where the next read starts.
+  size_t ring_used_;
+
+  std::filesystem::path overflow_path_;
+  int file_fd_;
+  uint64_t file_read_offset_;
+  uint64_t file_write_offset_;
+
+  bool finished_;
+  Statistics statistics_;
+  std::function<void()> readable_callback_;
+};
+
+}  // namespace spiceserver
+
+#endif  // OUTPUT_SPOOL_H_
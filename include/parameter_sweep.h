@@ -0,0 +1,44 @@
+#ifndef PARAMETER_SWEEP_H_
+#define PARAMETER_SWEEP_H_
+
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <absl/status/statusor.h>
+
+#include "proto/spice_simulator.pb.h"
+
+// Turns a SweepRequest into the points to simulate, and a netlist into the
+// netlist for each point.
+//
+// Points are applied by rewriting the values of existing .param statements,
+// so the netlist has to declare every swept parameter (with any default).
+// Names are matched case-insensitively, as SPICE does.
+
+namespace spiceserver {
+
+// A value for each swept parameter, in the order they were given.
+using SweepPoint = std::vector<std::pair<std::string, double>>;
+
+class ParameterSweep {
+ public:
+  // Fails if the sweep is malformed or has more than --max_sweep_points.
+  static absl::StatusOr<std::vector<SweepPoint>> Expand(
+      const SweepRequest &request);
+
+  // Replaces the values of the point's parameters wherever they are set by a
+  // .param statement (including its '+' continuation lines). The names of
+  // parameters that were found are added to *replaced.
+  static std::string RewriteParameters(const std::string &netlist,
+                                       const SweepPoint &point,
+                                       std::set<std::string> *replaced);
+
+  // Enough digits that the simulator sees the same double.
+  static std::string FormatValue(double value);
+};
+
+}  // namespace spiceserver
+
+#endif  // PARAMETER_SWEEP_H_
@@ -0,0 +1,108 @@
+#ifndef RAWFILE_READER_H_
+#define RAWFILE_READER_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <absl/status/statusor.h>
+
+#include "proto/spice_simulator.pb.h"
+
+// Reads the binary SPICE rawfiles that Xyce and ngspice write with -r, for
+// sending to clients as WaveformChunks.
+//
+// The file is mapped, not read: the headers are parsed when it is opened, and
+// samples are copied straight from the mapping into the chunks (transposed
+// from the file's point-by-point order to a column per signal) as they are
+// asked for. A file cut short, by a simulator that was killed, say, gives
+// only its whole points.
+//
+// Samples are read in the server's byte order, which is the simulator's.
+
+namespace spiceserver {
+
+class RawfileReader {
+ public:
+  struct Plot {
+    std::string title;
+    std::string name;
+    bool complex;
+    std::vector<WaveformSignal> signals;
+    uint64_t num_points;
+    // num_points rows of a double (or two, if complex) per signal.
+    const char *data;
+  };
+
+  static absl::StatusOr<std::unique_ptr<RawfileReader>> Open(
+      const std::filesystem::path &path);
+
+  ~RawfileReader();
+
+  RawfileReader(const RawfileReader&) = delete;
+  RawfileReader& operator=(const RawfileReader&) = delete;
+
+  const std::vector<Plot> &plots() const { return plots_; }
+
+  // Copies points [first_point, first_point + num_points) of one signal of
+  // the plot to out: num_points values, or (real, imaginary) pairs.
+  void ReadSignal(size_t plot,
+                  size_t signal,
+                  uint64_t first_point,
+                  uint64_t num_points,
+                  double *out) const;
+
+  // As ReadSignal, for all of the plot's signals, one after another, into
+  // chunk's values (or float_values).
+  void FillChunk(size_t plot,
+                 uint64_t first_point,
+                 uint64_t num_points,
+                 bool single_precision,
+                 WaveformChunk *chunk) const;
+
+ private:
+  RawfileReader(void *mapping, size_t size);
+
+  absl::Status Parse();
+
+  // The columns of signals [first_signal, end_signal), one after another.
+  template <typename Value>
+  void Transpose(size_t plot,
+                 size_t first_signal,
+                 size_t end_signal,
+                 uint64_t first_point,
+                 uint64_t num_points,
+                 Value *out) const;
+
+  void *mapping_;
+  size_t size_;
+  std::vector<Plot> plots_;
+};
+
+// The WaveformChunks of a rawfile, in order: every plot, a few points at a
+// time.
+class WaveformStream {
+ public:
+  WaveformStream(std::unique_ptr<RawfileReader> reader,
+                 const WaveformOptions &options);
+
+  // Fills in the next chunk, or returns false if there are no more.
+  bool Next(WaveformChunk *chunk);
+
+ private:
+  uint64_t PointsPerChunk(const RawfileReader::Plot &plot) const;
+
+  std::unique_ptr<RawfileReader> reader_;
+  const WaveformOptions options_;
+  size_t plot_;
+  uint64_t next_point_;
+  // Whether the current plot's first chunk has been sent, which it is even
+  // if the plot has no points.
+  bool started_plot_;
+};
+
+}  // namespace spiceserver
+
+#endif  // RAWFILE_READER_H_
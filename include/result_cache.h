@@ -0,0 +1,96 @@
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "lru_directory.h"
+#include "proto/spice_simulator.pb.h"
+
+// Optionally (--result_cache_dir), the responses of finished simulations are
+// kept on disk, keyed by a SHA-256 of everything that decides them: the
+// flavour, the simulator's path, version, size and modification time, the
+// inputs, the additional arguments, the limits and how output is batched. A
+// request with the same key is then answered by replaying the stored
+// responses, without running anything.
+//
+// Identical requests in flight at the same time are coalesced: the first to
+// look up a key runs the simulation, and the others wait for it to Store (or
+// Abandon) its result before looking again.
+//
+// Each entry is one file, named for its key, holding the responses as a
+// sequence of length-delimited SimulationResponses. The least recently used
+// entries are removed once the total exceeds --result_cache_max_bytes.
+
+namespace spiceserver {
+
+class ResultCache {
+ public:
+  enum class LookupResult {
+    // *responses has been filled in.
+    HIT,
+    // Not cached. The caller must run the simulation and then Store or
+    // Abandon the key.
+    MISS,
+    // Someone else is running the simulation. on_done will be called (from
+    // whichever thread Stores or Abandons it) when it is worth looking again.
+    IN_FLIGHT
+  };
+
+  static ResultCache &GetInstance() {
+    static ResultCache instance;
+    return instance;
+  }
+
+  ResultCache();
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  // Opens the cache given by the flags, if any.
+  absl::Status Initialise();
+
+  // Opens (creating it if need be) the cache in directory, picking up what's
+  // there already. An empty directory turns the cache off.
+  absl::Status Open(const std::filesystem::path &directory,
+                    uint64_t max_bytes);
+
+  bool enabled() const;
+
+  // The key for a request, or an error if its simulator isn't known.
+  static absl::StatusOr<std::string> KeyFor(const SimulationRequest &request);
+
+  LookupResult Lookup(const std::string &key,
+                      std::vector<SimulationResponse> *responses,
+                      std::function<void()> on_done);
+
+  void Store(const std::string &key,
+             const std::vector<SimulationResponse> &responses);
+
+  // Gives up on a MISS without storing anything.
+  void Abandon(const std::string &key);
+
+  uint64_t total_bytes() const;
+
+ private:
+  // Expects mutex_ to be held.
+  std::vector<std::function<void()>> EndFlight(const std::string &key);
+
+  mutable std::mutex mutex_;
+  LruDirectory entries_;
+  // Keys being computed, and who is waiting for them.
+  std::map<std::string, std::vector<std::function<void()>>> in_flight_;
+  uint64_t next_temporary_;
+};
+
+}  // namespace spiceserver
+
+#endif  // RESULT_CACHE_H_
@@ -0,0 +1,119 @@
+#ifndef RESULT_STORE_H_
+#define RESULT_STORE_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+
+#include "lru_directory.h"
+#include "rawfile_reader.h"
+#include "proto/result_store.pb.h"
+
+// Optionally (--result_store_dir), the waveforms of finished simulations are
+// kept, if asked for (WaveformOptions.store), so that clients can read back
+// just the signals and spans they need with GetWaveform instead of
+// downloading everything.
+//
+// Each result is a directory, named for its random ID, holding an index and
+// a file per plot. A plot file is columnar: each signal's values (or
+// (real, imaginary) pairs) over all points, one signal after another; the
+// first signal, time or frequency, doubles as the index into the others.
+// Reading maps the files, so only the pages asked for are read from disk.
+//
+// The least recently used results are removed once the total exceeds
+// --result_store_max_bytes. Results being read when that happens stay
+// readable until their readers are done.
+//
+// Golden results, one per regression test ID, are stored the same way
+// under goldens/, named for the ID's SHA-256. They are replaced whole (a
+// reader sees the old one or the new), never evicted, and don't count
+// towards the total.
+
+namespace spiceserver {
+
+// A result, mapped for reading.
+class StoredResult {
+ public:
+  ~StoredResult();
+
+  StoredResult(const StoredResult&) = delete;
+  StoredResult& operator=(const StoredResult&) = delete;
+
+  const StoredResultIndex &index() const { return index_; }
+
+  // The values of one signal of a plot, num_points of them (or twice that,
+  // if the plot is complex).
+  const double *Signal(size_t plot, size_t signal) const;
+
+ private:
+  friend class ResultStore;
+  StoredResult() = default;
+
+  StoredResultIndex index_;
+  // Mappings of the plot files, and their sizes.
+  std::vector<std::pair<void*, size_t>> plots_;
+};
+
+class ResultStore {
+ public:
+  static ResultStore &GetInstance() {
+    static ResultStore instance;
+    return instance;
+  }
+
+  ResultStore();
+
+  ResultStore(const ResultStore&) = delete;
+  ResultStore& operator=(const ResultStore&) = delete;
+
+  // Opens the store given by the flags, if any.
+  absl::Status Initialise();
+
+  // Opens (creating it if need be) the store in directory, picking up what's
+  // there already. An empty directory turns the store off.
+  absl::Status Open(const std::filesystem::path &directory,
+                    uint64_t max_bytes);
+
+  bool enabled() const;
+
+  // Stores the rawfile's plots, returning the result's ID.
+  absl::StatusOr<std::string> Add(const RawfileReader &rawfile);
+
+  absl::StatusOr<std::unique_ptr<StoredResult>> Get(const std::string &id);
+
+  // Stores the rawfile's plots as the golden result of test_id, replacing
+  // any before.
+  absl::Status SetGolden(const std::string &test_id,
+                         const RawfileReader &rawfile);
+
+  absl::StatusOr<std::unique_ptr<StoredResult>> GetGolden(
+      const std::string &test_id);
+
+  uint64_t total_bytes() const;
+
+ private:
+  static bool IsResultId(const std::string &name);
+
+  static absl::StatusOr<std::unique_ptr<StoredResult>> Map(
+      const std::filesystem::path &path);
+  // Maps the result in the open directory, which is at path.
+  static absl::StatusOr<std::unique_ptr<StoredResult>> MapAt(
+      int directory, const std::filesystem::path &path);
+
+  // Expects mutex_ to be held.
+  std::filesystem::path GoldenPath(const std::string &test_id) const;
+
+  mutable std::mutex mutex_;
+  LruDirectory results_;
+};
+
+}  // namespace spiceserver
+
+#endif  // RESULT_STORE_H_
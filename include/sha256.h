@@ -0,0 +1,45 @@
+#ifndef SHA256_H_
+#define SHA256_H_
+
+#include <openssl/evp.h>
+
+#include <cstdint>
+#include <string>
+
+#include <absl/strings/string_view.h>
+
+// Incremental SHA-256, for content addressing (see ResultCache, BlobStore).
+
+namespace spiceserver {
+
+class Sha256 {
+ public:
+  Sha256();
+  ~Sha256();
+
+  Sha256(const Sha256&) = delete;
+  Sha256& operator=(const Sha256&) = delete;
+
+  void Update(const void *data, size_t length);
+  void Update(absl::string_view data) { Update(data.data(), data.size()); }
+
+  // For keys made of several fields: each field is preceded by its length,
+  // so that no two different sequences of fields hash the same bytes.
+  void AddField(absl::string_view field);
+  void AddField(uint64_t value) { Update(&value, sizeof(value)); }
+
+  // Lower-case hex. Ends the hash: no more updates.
+  std::string HexDigest();
+
+  static std::string HexDigestOf(absl::string_view data);
+
+  // Whether digest looks like something HexDigest would return.
+  static bool IsHexDigest(absl::string_view digest);
+
+ private:
+  EVP_MD_CTX *context_;
+};
+
+}  // namespace spiceserver
+
+#endif  // SHA256_H_
@@ -0,0 +1,187 @@
+#ifndef SIMULATION_JOB_H_
+#define SIMULATION_JOB_H_
+
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+
+#include "job_scheduler.h"
+#include "output_batcher.h"
+#include "rawfile_reader.h"
+#include "simulator_manager.h"
+#include "waveform_preview.h"
+#include "proto/spice_simulator.pb.h"
+
+// One RunSimulation, from the queue to the final response, without holding a
+// thread while it waits for anything.
+//
+// The job is driven by events: admission by the JobScheduler, output in the
+// simulator's OutputSpool, batching deadlines. Preparing the job (writing
+// inputs, netlisting, spawning) runs on the WorkerPool's preparation pool,
+// and the rest on the WorkerPool; termination waits out its grace period
+// with timers rather than a thread. Responses are produced only as fast as the transport takes
+// them: whenever there might be a new one, on_ready is called, and the
+// transport calls Next() until it says WAIT. Output that arrives in the
+// meantime waits in the spool, as before.
+//
+// Jobs are always held by shared_ptr, since the WorkerPool's tasks and the
+// spool's callbacks may outlive the transport's interest in them.
+
+namespace spiceserver {
+
+class SimulationJob : public std::enable_shared_from_this<SimulationJob> {
+ public:
+  enum class NextResult {
+    // *response has been filled in; send it and call Next() again.
+    MESSAGE,
+    // Nothing to send yet. on_ready will be called when there might be.
+    WAIT,
+    // The job is over; *status says how it went.
+    DONE
+  };
+
+  // Checks the request, returning an error (and no job) if it can't be run.
+  // client is who the job counts against for fair sharing.
+  static absl::Status Validate(const SimulationRequest &request);
+  static std::shared_ptr<SimulationJob> Create(const SimulationRequest &request,
+                                               const std::string &client);
+
+  // For inputs already written to directory (see InputStager), which the
+  // job takes over. request's verbatim_files give only their paths, main
+  // file first.
+  static std::shared_ptr<SimulationJob> CreateStaged(
+      const SimulationRequest &request,
+      const std::string &client,
+      const std::filesystem::path &directory);
+
+  ~SimulationJob();
+
+  SimulationJob(const SimulationJob&) = delete;
+  SimulationJob& operator=(const SimulationJob&) = delete;
+
+  // Joins the queue, unless the result is in the ResultCache. on_ready may
+  // be called from any thread, but never with any of the job's own locks
+  // held, and never after Detach() returns.
+  void Start(std::function<void()> on_ready);
+
+  NextResult Next(SimulationResponse *response, absl::Status *status);
+
+  // Gives up on the job, terminating the simulator if it has started, or
+  // dropping what's left to send if it has finished. Next() returns DONE from
+  // now on, with the given status unless everything had already been sent.
+  void Cancel(const absl::Status &status);
+
+  // Stops calls to on_ready, waiting for any already under way.
+  void Detach();
+
+ private:
+  enum class State {
+    QUEUED,
+    PREPARING,
+    RUNNING,
+    FINISHED
+  };
+
+  SimulationJob(const SimulationRequest &request,
+                const std::string &client,
+                const std::filesystem::path &staged_directory);
+
+  // Joins the JobScheduler's queue.
+  void Enqueue();
+
+  // Runs on the WorkerPool's preparation pool.
+  void Prepare();
+
+  // These run on the WorkerPool.
+  void CheckCache();
+  void LookUpResult(const std::string &key);
+  void Pump();
+  void Stop();
+  void FinishStop();
+  void SendQueueStatus();
+
+  // Sends the simulator SIGTERM and arranges for FinishStop to kill what's
+  // left of it, and reap it, once it exits or the grace period is up. Expects
+  // work_mutex_ to be held.
+  void BeginStop();
+
+  // Arranges for Pump to run when there's more output or a batch is due.
+  // Expects mutex_ to be held.
+  void ArmPump();
+
+  // Arranges for Pump to run when the next preview is due, if it isn't
+  // already. Expects work_mutex_ to be held.
+  void ArmPreview();
+
+  // Arranges for Pump to run when the batcher's oldest batch is due, if it
+  // isn't already. Expects work_mutex_ to be held.
+  void ArmBatchTimer();
+
+  // Fills in the accounting fields of a response and records the run.
+  void Account(SimulationResponse *response);
+
+  // Stores what was recorded (if store) or abandons the key, if this job was
+  // computing a result for the ResultCache.
+  void FinishCaching(bool store);
+
+  void NotifyReady();
+
+  const SimulationRequest request_;
+  const std::string client_;
+  // Empty unless the inputs were staged.
+  const std::filesystem::path staged_directory_;
+  const CgroupManager::Limits limits_;
+  const SimulatorManager::Clock::time_point received_at_;
+
+  std::mutex callback_mutex_;
+  std::function<void()> on_ready_;
+
+  mutable std::mutex mutex_;
+  State state_;
+  std::deque<SimulationResponse> pending_;
+  // Once the simulator is done, if waveforms were asked for: what's left of
+  // them, and the final response, which comes after.
+  std::unique_ptr<WaveformStream> waveforms_;
+  std::optional<SimulationResponse> final_response_;
+  absl::Status final_status_;
+  bool pump_armed_;
+  std::optional<QueueStatus> last_queue_status_;
+  SimulatorManager::Clock::time_point last_queue_status_at_;
+  // Copied out under mutex_ to be used. Declared before simulator_ so that
+  // the simulator is gone before the slots are given up.
+  std::shared_ptr<JobScheduler::Ticket> ticket_;
+  // Set while the job is computing a result for the ResultCache, which other
+  // jobs may be waiting for.
+  std::string cache_key_;
+  // Every response sent so far, to be stored, if cache_key_ is set. Only
+  // used by Pump.
+  std::vector<SimulationResponse> recorded_;
+
+  // Only used by one WorkerPool task at a time, under work_mutex_. Once the
+  // job is RUNNING (and until it is FINISHED), simulator_ may also be used
+  // under mutex_ to wait for output.
+  std::mutex work_mutex_;
+  std::chrono::duration<double> queue_time_;
+  OutputBatcher batcher_;
+  bool batch_timer_armed_;
+  std::unique_ptr<SimulatorManager> simulator_;
+  // Set once the simulator has been asked to stop early.
+  bool stopping_;
+  SimulatorManager::Clock::time_point stop_deadline_;
+  // If a preview was asked for, once the simulator has started.
+  std::unique_ptr<WaveformPreviewer> previewer_;
+  OutputBatcher::Clock::time_point next_preview_at_;
+  bool preview_armed_;
+};
+
+}  // namespace spiceserver
+
+#endif  // SIMULATION_JOB_H_
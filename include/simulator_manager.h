@@ -1,11 +1,21 @@
 #ifndef SIMULATOR_MANAGER_H_
 #define SIMULATOR_MANAGER_H_
 
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include <absl/status/statusor.h>
 
+#include "cgroup_manager.h"
+#include "input_writer.h"
+#include "output_spool.h"
 #include "simulator_registry.h"
 #include "subprocess.h"
 #include "proto/spice_simulator.pb.h"
@@ -25,19 +35,38 @@
 //  buffer and give the data to some external function (callback)
 //  - if we have to wait for completion, use another syscall to wait for the
 //  child process to complete
+//
+// The reading is done by the OutputReactor, which watches the pipes (and a
+// pidfd, to find out when the child exits) of every running simulator from a
+// small number of shared threads. The reactor hands us chunks of output,
+// which we put in an OutputSpool (memory, overflowing to a file in the job
+// directory) until the caller of PollAndReadOutput picks them up. The
+// simulator is never held up by a slow reader.
 
 namespace spiceserver {
 
 class SimulatorManager {
  public:
+  using Clock = std::chrono::steady_clock;
+
   SimulatorManager();
   ~SimulatorManager();
 
+  // Limits for the simulator's cgroup, if jobs run in cgroups. Must be set
+  // before RunSimulator to have any effect.
+  void SetLimits(const CgroupManager::Limits &limits) { limits_ = limits; }
+
+  // Whether to have the simulator write its results to a binary rawfile, at
+  // RawfilePath(), if it can. Must be set before RunSimulator.
+  void SetWriteRawfile(bool write_rawfile) { write_rawfile_ = write_rawfile; }
+  static bool CanWriteRawfile(const Flavour &flavour);
+  std::filesystem::path RawfilePath() const;
+
   // Creates a temporary directory, writes the given files to disk, calls the
   // simulator (with any additional args). Results will then be available
   // through PollAndReadOutput.
   absl::Status RunSimulator(const Flavour &flavour,
-                            const std::vector<FileInfo> &files,
+                            const InputWriter::Files &files,
                             const std::vector<std::string> &additional_args);
 
   // Same deal, but all netlist info is provided through VLSIR protobufs. This
@@ -47,10 +76,36 @@ class SimulatorManager {
                             const vlsir::spice::SimInput &sim_input,
                             const std::vector<std::string> &additional_args);
 
-  // Polls and reads from subprocess stdout/stderr, invoking the callback
+  // Runs the simulator on main_file in a directory that already holds the
+  // inputs (see InputStager), which becomes the job directory.
+  absl::Status RunSimulatorInDirectory(
+      const Flavour &flavour,
+      const std::filesystem::path &directory,
+      const std::string &main_file,
+      const std::vector<std::string> &additional_args);
+
+  // Netlists sim_input for the given flavour without running anything, and
+  // returns the netlist files, top-level netlist first, with paths relative
+  // to the directory they would be run in. For running the same netlist many
+  // times (e.g. in a sweep) as verbatim files.
+  static absl::StatusOr<std::vector<FileInfo>> Netlist(
+      const Flavour &flavour, const vlsir::spice::SimInput &sim_input);
+
+  // A new, empty job directory.
+  static absl::StatusOr<std::string> CreateTemporaryDirectory();
+
+  // Waits up to timeout for output from the subprocess, invoking the callback
   // for each chunk of data received.
   // Returns true while the process is running, false when complete.
-  bool PollAndReadOutput(Subprocess::OutputCallback callback);
+  bool PollAndReadOutput(
+      Subprocess::OutputCallback callback,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(1000));
+
+  // Calls callback once PollAndReadOutput has something to return, instead
+  // of waiting in it; see OutputSpool::NotifyWhenReadable. Returns false (and
+  // never calls back) if output isn't being streamed, in which case the
+  // caller has to poll.
+  bool NotifyWhenOutputReady(std::function<void()> callback);
 
   // Waits for the subprocess to complete and returns the exit code.
   // Returns -1 if the process was terminated by a signal.
@@ -59,11 +114,94 @@ class SimulatorManager {
   // Returns true if a subprocess is currently running.
   bool IsRunning() const;
 
+  // Stops the simulator early: sends SIGTERM to its process group, waits up
+  // to grace_period for it to exit, then sends SIGKILL to anything left in
+  // the group (or the job's cgroup) and reaps the child.
+  void Terminate(std::chrono::milliseconds grace_period);
+
+  // As above, with --termination_grace_period_ms.
+  void Terminate();
+
+  // Terminate's steps, for callers that wait out the grace period without
+  // blocking: BeginTermination sends the SIGTERM, and Kill sends SIGKILL to
+  // whatever is left and reaps the child.
+  void BeginTermination();
+  void Kill();
+
+  // True once the child has exited (though it may not have been reaped).
+  bool HasExited() { return WaitForExit(std::chrono::milliseconds(0)); }
+
+  // Calls callback, on the OutputReactor's thread, once the child has exited,
+  // or right away if it already has. Returns false (and never calls back) if
+  // output isn't being streamed, in which case the caller has to poll
+  // HasExited.
+  bool NotifyWhenExited(std::function<void()> callback);
+
+  // The directory the simulator runs in, once it has been created.
+  const std::filesystem::path &directory() const { return directory_; }
+
+  // Only meaningful once the simulator has finished (WaitForCompletion has
+  // returned).
+  ResourceUsage GetResourceUsage() const;
+  int TerminatingSignal() const;
+
+  // Usage of the whole job, if it ran in its own cgroup.
+  std::optional<CgroupUsage> GetCgroupUsage() const;
+
+  // Wall-clock timings, measured from when this SimulatorManager was created
+  // up to now.
+  PhaseTimings GetPhaseTimings() const;
+
+  // High-water marks etc. for the output spool. All zero if we weren't
+  // spooling.
+  OutputSpool::Statistics SpoolStatistics() const;
+
  private:
   absl::StatusOr<std::string> PrepareVerbatimInputsOnDisk(
-      const std::vector<FileInfo> &files);
-  absl::StatusOr<std::string> CreateTemporaryDirectory();
+      const InputWriter::Files &files);
+
+  // Registers the freshly-spawned subprocess with the OutputReactor, which
+  // spools output in the given directory. If that isn't possible, we fall
+  // back to polling the pipes ourselves.
+  void StartStreaming(const std::filesystem::path &directory);
+
+  // Waits up to timeout for the child to exit. Returns true if it has.
+  bool WaitForExit(std::chrono::milliseconds timeout);
+
+  // The simulator's command line, after its path.
+  std::vector<std::string> Arguments(
+      const Flavour &flavour,
+      const std::string &main_file,
+      const std::vector<std::string> &additional_args) const;
+
+  // Spawns the simulator in directory_ and starts streaming its output.
+  absl::Status Start(const std::string &command,
+                     const std::vector<std::string> &args);
+
+  std::filesystem::path directory_;
+  std::unique_ptr<OutputSpool> spool_;
+
+  CgroupManager::Limits limits_;
+  // Outlives subprocess_, so that the cgroup is only removed once the child
+  // is gone.
+  std::unique_ptr<JobCgroup> cgroup_;
+
+  Clock::time_point created_at_;
+  Clock::time_point spawn_started_at_;
+  Clock::time_point spawned_at_;
+  // Set under mutex_ when streaming.
+  Clock::time_point exited_at_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable exited_condition_;
+  bool exited_;
+  std::function<void()> on_exited_;
+  int exit_code_;
+  bool streaming_;
+  bool write_rawfile_;
 
+  // This must be destroyed first, since it stops the OutputReactor from
+  // calling back into the members above.
   Subprocess subprocess_;
 };
 
@@ -4,25 +4,52 @@
 #include <grpcpp/grpcpp.h>
 #include "proto/spice_simulator.grpc.pb.h"
 
+// The service uses gRPC's callback API: no RPC holds a thread while it waits
+// for the queue, the simulator or the client. Streams are driven by
+// SimulationJob (see simulation_job.h), whose blocking work runs on the
+// WorkerPool.
+
 namespace spiceserver {
 
-class SimulatorServiceImpl final : public SpiceSimulator::Service {
+class SimulatorServiceImpl final : public SpiceSimulator::CallbackService {
  public:
-  grpc::Status RunSimulation(
-      grpc::ServerContext* context,
-      const SimulationRequest* request,
-      grpc::ServerWriter<SimulationResponse>* writer) override;
+  grpc::ServerWriteReactor<SimulationResponse>* RunSimulation(
+      grpc::CallbackServerContext* context,
+      const SimulationRequest* request) override;
+
+  grpc::ServerWriteReactor<SweepResponse>* RunSweep(
+      grpc::CallbackServerContext* context,
+      const SweepRequest* request) override;
+
+  grpc::ServerWriteReactor<BatchResponse>* RunSimulationBatch(
+      grpc::CallbackServerContext* context,
+      const BatchRequest* request) override;
+
+  grpc::ServerBidiReactor<UploadRequest, SimulationResponse>* UploadAndRun(
+      grpc::CallbackServerContext* context) override;
+
+  grpc::ServerUnaryReactor* HasBlobs(
+      grpc::CallbackServerContext* context,
+      const HasBlobsRequest* request,
+      HasBlobsResponse* response) override;
+
+  grpc::ServerReadReactor<PutBlobRequest>* PutBlob(
+      grpc::CallbackServerContext* context,
+      PutBlobResponse* response) override;
+
+  grpc::ServerWriteReactor<WaveformChunk>* GetWaveform(
+      grpc::CallbackServerContext* context,
+      const GetWaveformRequest* request) override;
 
-  grpc::Status ListSimulators(
-      grpc::ServerContext *context,
+  grpc::ServerUnaryReactor* ListSimulators(
+      grpc::CallbackServerContext *context,
       const ListSimulatorsRequest *request,
       ListSimulatorsResponse *response) override;
 
- private:
-  void StreamProcessOutput(
-      int fd,
-      SimulationResponse::StreamType stream_type,
-      grpc::ServerWriter<SimulationResponse> *writer);
+  grpc::ServerUnaryReactor* GetUsageStatistics(
+      grpc::CallbackServerContext *context,
+      const GetUsageStatisticsRequest *request,
+      GetUsageStatisticsResponse *response) override;
 };
 
 } // namespace spiceserver
@@ -0,0 +1,92 @@
+#ifndef SPAWN_HELPER_H_
+#define SPAWN_HELPER_H_
+
+#include <sys/types.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+
+#include "subprocess.h"
+#include "proto/spawn_helper.pb.h"
+
+// The spawn helper (or "zygote") is a small process forked from spice_server
+// at startup, before the Python interpreter, the gRPC server and all of their
+// threads exist. Simulators are then launched by asking the helper, over a
+// Unix socket, instead of by forking the big, multi-threaded server:
+//
+//  - the server sends a SpawnRequest (command, args, working directory and
+//  resource limits, and perhaps the cgroup to join);
+//  - the helper makes the pipes and creates the child with
+//  clone3(CLONE_PARENT | CLONE_PIDFD), so that the child's parent is the
+//  server and not the helper (the server can then reap it as usual);
+//  - the helper sends back a SpawnResponse with the pid, and passes the read
+//  ends of the pipes and the pidfd with SCM_RIGHTS.
+//
+// Since the helper stays small, launches cost the same no matter how large the
+// server gets.
+//
+// This is a singleton.
+
+namespace spiceserver {
+
+class SpawnHelper {
+ public:
+  // What the server gets back for each spawned child. The caller owns the
+  // descriptors.
+  struct SpawnedProcess {
+    pid_t pid;
+    int stdout_fd;
+    int stderr_fd;
+    int pidfd;
+  };
+
+  SpawnHelper(const SpawnHelper&) = delete;
+  SpawnHelper& operator=(const SpawnHelper&) = delete;
+  static SpawnHelper& GetInstance() {
+    static SpawnHelper instance;
+    return instance;
+  }
+
+  // Forks the helper process. This should be called as early as possible in
+  // main(), while the server is still small and single-threaded.
+  absl::Status Start();
+
+  bool IsRunning() const;
+
+  // If cgroup_procs_fd is not -1, it is passed to the helper and the child
+  // joins that cgroup.
+  absl::Status Spawn(const SpawnRequest &request,
+                     int cgroup_procs_fd,
+                     SpawnedProcess *spawned);
+
+ private:
+  SpawnHelper();
+  ~SpawnHelper();
+
+  // The helper's main loop. Never returns.
+  [[noreturn]] static void Serve(int socket_fd);
+
+  // Handles one request in the helper. received_fds are those that came with
+  // the request. Returns the descriptors to pass back (which the caller closes
+  // after sending).
+  static SpawnResponse HandleRequest(const SpawnRequest &request,
+                                     const std::vector<int> &received_fds,
+                                     std::vector<int> *fds_to_send);
+
+  static bool SendMessage(int socket_fd,
+                          const google::protobuf::Message &message,
+                          const std::vector<int> &fds);
+  static bool ReceiveMessage(int socket_fd,
+                             google::protobuf::Message *message,
+                             std::vector<int> *fds);
+
+  mutable std::mutex mutex_;
+  pid_t helper_pid_;
+  int socket_fd_;
+};
+
+}  // namespace spiceserver
+
+#endif  // SPAWN_HELPER_H_
@@ -0,0 +1,62 @@
+#ifndef SUBCIRCUIT_CACHE_H_
+#define SUBCIRCUIT_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// The netlist text of modules the NativeNetlister has already written, keyed
+// by a hash of everything that decided it (see NativeNetlister). Packages
+// that share standard-cell and PDK modules across requests then only have
+// the modules that changed written out again.
+//
+// Kept in memory; the least recently used entries are dropped once the total
+// exceeds --subcircuit_cache_max_bytes, and 0 turns the cache off.
+
+namespace spiceserver {
+
+class SubcircuitCache {
+ public:
+  static SubcircuitCache &GetInstance();
+
+  explicit SubcircuitCache(uint64_t max_bytes);
+
+  SubcircuitCache(const SubcircuitCache&) = delete;
+  SubcircuitCache& operator=(const SubcircuitCache&) = delete;
+
+  bool enabled() const { return max_bytes_ > 0; }
+
+  // nullptr if key isn't cached.
+  std::shared_ptr<const std::string> Lookup(const std::string &key);
+
+  void Store(const std::string &key, std::string text);
+
+  uint64_t total_bytes() const;
+  uint64_t hits() const;
+  uint64_t misses() const;
+
+ private:
+  struct Entry {
+    std::shared_ptr<const std::string> text;
+    std::list<std::string>::iterator lru_position;
+  };
+
+  // Expects mutex_ to be held.
+  void Evict();
+
+  const uint64_t max_bytes_;
+  mutable std::mutex mutex_;
+  uint64_t total_bytes_;
+  uint64_t hits_;
+  uint64_t misses_;
+  std::map<std::string, Entry> entries_;
+  // Least recently used first.
+  std::list<std::string> lru_;
+};
+
+}  // namespace spiceserver
+
+#endif  // SUBCIRCUIT_CACHE_H_
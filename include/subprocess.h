@@ -1,12 +1,18 @@
 #ifndef SUBPROCESS_H_
 #define SUBPROCESS_H_
 
+#include <sys/resource.h>
 #include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include <absl/status/status.h>
+#include <absl/status/statusor.h>
 
 namespace spiceserver {
 
@@ -22,37 +28,177 @@ class Subprocess {
       size_t length,
       StreamType stream_type)>;
 
+  using ExitCallback = std::function<void(int exit_code)>;
+
+  // How the child is created. FORK copies the (large) server's page tables
+  // and then execs. POSIX_SPAWN and VFORK (clone with CLONE_VM |
+  // CLONE_VFORK) share the parent's memory until the exec, so their cost
+  // doesn't grow with the server's RSS. HELPER delegates to the SpawnHelper
+  // process, if it is running.
+  enum class SpawnMethod {
+    FORK,
+    POSIX_SPAWN,
+    VFORK,
+    HELPER
+  };
+
+  static absl::StatusOr<SpawnMethod> ParseSpawnMethod(const std::string &name);
+  static std::string SpawnMethodName(SpawnMethod method);
+
+  // The method selected with --spawn_method.
+  static SpawnMethod DefaultSpawnMethod();
+
+  struct ResourceLimit {
+    // One of the RLIMIT_* constants.
+    int resource;
+    rlim_t soft;
+    rlim_t hard;
+  };
+
+  // Everything the child needs between being created and exec'ing the
+  // command. This is prepared in the parent, since the child can't safely
+  // allocate.
+  struct ChildSetup {
+    const char *command;
+    char *const *argv;
+    const char *directory;
+    int stdout_write_fd;
+    int stderr_write_fd;
+    // If not -1, the errno of a failed exec is also written here, for
+    // parents that don't share memory with the child.
+    int error_fd;
+    const std::vector<ResourceLimit> *resource_limits;
+    // If not -1, the child joins this cgroup (by writing "0" to its
+    // cgroup.procs) before exec'ing.
+    int cgroup_procs_fd;
+  };
+
+  // Runs in the child after fork/clone: moves the child into a new process
+  // group (and cgroup, if given), applies the resource limits, changes directory, redirects
+  // stdout/stderr and execs. Only async-signal-safe calls are made. Never
+  // returns; if anything fails the errno is stored in *exec_errno and the
+  // child exits with code 127.
+  [[noreturn]] static void ExecChild(const ChildSetup &setup, int *exec_errno);
+
   Subprocess();
+  explicit Subprocess(SpawnMethod spawn_method);
   ~Subprocess();
 
+  // Resource limits applied to the child before it runs the command.
+  void AddResourceLimit(int resource, rlim_t soft, rlim_t hard) {
+    resource_limits_.push_back(ResourceLimit{resource, soft, hard});
+  }
+
+  // Runs the child in the cgroup whose cgroup.procs is open as
+  // cgroup_procs_fd, which must stay open until Spawn returns.
+  //
+  // posix_spawn has no attributes for either this or resource limits, so a
+  // child that needs them is made with clone(CLONE_VFORK) instead, which
+  // applies them itself before it execs.
+  void PlaceInCgroup(int cgroup_procs_fd) {
+    cgroup_procs_fd_ = cgroup_procs_fd;
+  }
+
   // Spawns a subprocess with the given command and arguments in the specified
   // directory. Returns true on success, false on failure.
   absl::Status Spawn(const std::string &command,
                      const std::vector<std::string> &args,
                      const std::string &directory);
 
-  // Polls and reads from subprocess stdout/stderr, invoking the callback
-  // for each chunk of data received.
+  // Hands the subprocess' stdout/stderr and its pidfd over to the
+  // OutputReactor. on_output is called (on the reactor thread) for each chunk
+  // of data received, and on_exit is called once with the exit code after the
+  // child has exited and been reaped. Use either this or PollAndReadOutput,
+  // not both.
+  absl::Status StartWatching(OutputCallback on_output, ExitCallback on_exit);
+
+  // Polls (for up to timeout) and reads from subprocess stdout/stderr,
+  // invoking the callback for each chunk of data received.
   // Returns true while the process is running, false when complete.
-  bool PollAndReadOutput(OutputCallback callback);
+  bool PollAndReadOutput(
+      OutputCallback callback,
+      std::chrono::milliseconds timeout = std::chrono::milliseconds(1000));
 
   // Waits for the subprocess to complete and returns the exit code.
-  // Returns -1 if the process was terminated by a signal.
+  // Returns -1 if the process was terminated by a signal. If the child has
+  // already been reaped by the OutputReactor this returns immediately.
   int WaitForCompletion();
 
   // Returns true if a subprocess is currently running.
   bool IsRunning() const;
 
+  // Once the child has been reaped: the resources used by it (and by any of
+  // its own children that it waited for), and the signal that killed it, or 0
+  // if it exited normally.
+  const struct rusage &resource_usage() const { return rusage_; }
+  int terminating_signal() const { return terminating_signal_; }
+
+  // Every child leads its own process group, so that anything it starts
+  // (e.g. MPI ranks) can be signalled along with it. Sends signal_number to
+  // that group. Returns false if there was nobody left to signal, or if the
+  // child has already been reaped: its group id may since have been reused.
+  bool SignalProcessGroup(int signal_number);
+
+  // Waits up to timeout for the child to exit, without reaping it. Returns
+  // true if it has exited. Don't use this while the OutputReactor is
+  // watching; it reaps the child itself.
+  bool WaitForExit(std::chrono::milliseconds timeout);
+
  private:
+  absl::Status SpawnWithFork(const std::string &command,
+                             const std::vector<char*> &argv,
+                             const std::string &directory);
+  absl::Status SpawnWithPosixSpawn(const std::string &command,
+                                   const std::vector<char*> &argv,
+                                   const std::string &directory);
+  absl::Status SpawnWithCloneVfork(const std::string &command,
+                                   const std::vector<char*> &argv,
+                                   const std::string &directory);
+
+  absl::Status SpawnWithHelper(const std::string &command,
+                               const std::vector<std::string> &args,
+                               const std::string &directory);
+
+  // Common bookkeeping once the child exists, however it was made.
+  absl::Status FinishSpawn(const std::string &command,
+                           const std::vector<std::string> &args);
+
+  ChildSetup MakeChildSetup(const std::vector<char*> &argv,
+                            const std::string &directory) const;
+
   void CleanupPipes();
   void SetNonBlocking(int fd);
+  void StopWatching();
+
+  // Collects the exit status and resource usage of the child. Blocks if it
+  // hasn't exited yet.
+  void Reap();
+
+  SpawnMethod spawn_method_;
+  std::vector<ResourceLimit> resource_limits_;
+  int cgroup_procs_fd_;
 
   pid_t pid_;
+  int pidfd_;
   int stdout_pipe_[2];
   int stderr_pipe_[2];
-  bool stdout_open_;
-  bool stderr_open_;
-  bool process_spawned_;
+  // Written by the OutputReactor's thread when it reaps a watched child,
+  // and read from others. reaped_ is set (with release) once exit_code_,
+  // terminating_signal_ and rusage_ are, and before process_spawned_ is
+  // cleared.
+  std::atomic<bool> stdout_open_;
+  std::atomic<bool> stderr_open_;
+  std::atomic<bool> process_spawned_;
+
+  std::atomic<bool> reaped_;
+  std::atomic<int> exit_code_;
+  // Held while reaping and while signalling the process group.
+  std::mutex reap_mutex_;
+  int terminating_signal_;
+  struct rusage rusage_;
+
+  // ID with the OutputReactor, or 0 if we're not being watched.
+  uint64_t watch_id_;
 };
 
 }  // namespace spiceserver
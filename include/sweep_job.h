@@ -0,0 +1,95 @@
+#ifndef SWEEP_JOB_H_
+#define SWEEP_JOB_H_
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+
+#include "parameter_sweep.h"
+#include "simulation_job.h"
+#include "proto/spice_simulator.pb.h"
+
+// One RunSweep: a SimulationJob per point of the sweep, with their responses
+// interleaved into one stream of SweepResponses.
+//
+// The inputs are prepared once: VLSIR is netlisted up front, and each point
+// gets a copy of the resulting files with its .param values substituted.
+// Points are started (up to max_parallel_points at a time) as earlier ones
+// finish; the JobScheduler decides when each actually runs, so a sweep can
+// fill every free core without starving other clients.
+//
+// Used the same way as a SimulationJob.
+
+namespace spiceserver {
+
+class SweepJob : public std::enable_shared_from_this<SweepJob> {
+ public:
+  using NextResult = SimulationJob::NextResult;
+
+  static absl::Status Validate(const SweepRequest &request);
+  static std::shared_ptr<SweepJob> Create(const SweepRequest &request,
+                                          const std::string &client);
+
+  SweepJob(const SweepJob&) = delete;
+  SweepJob& operator=(const SweepJob&) = delete;
+
+  void Start(std::function<void()> on_ready);
+  NextResult Next(SweepResponse *response, absl::Status *status);
+  void Cancel(const absl::Status &status);
+  void Detach();
+
+ private:
+  struct Point {
+    uint32_t index;
+    std::shared_ptr<SimulationJob> job;
+    bool sent_parameters;
+  };
+
+  SweepJob(const SweepRequest &request, const std::string &client);
+
+  // Runs on the WorkerPool's preparation pool.
+  void Prepare();
+
+  // Runs on the WorkerPool.
+  void StartPoints();
+
+  // The request for one point: the original with the point's .param values
+  // substituted in the prepared files.
+  SimulationRequest RequestForPoint(uint32_t index) const;
+
+  void Fail(const absl::Status &status);
+  void NotifyReady();
+
+  const SweepRequest request_;
+  const std::string client_;
+
+  std::mutex callback_mutex_;
+  std::function<void()> on_ready_;
+
+  // Set once by Prepare, before any points start.
+  std::vector<SweepPoint> points_;
+  std::vector<FileInfo> files_;
+  uint32_t max_parallel_;
+
+  std::mutex mutex_;
+  bool prepared_;
+  // Set if the sweep failed or was cancelled; a sweep that runs all its
+  // points is done once none are left.
+  bool finished_;
+  absl::Status final_status_;
+  uint32_t next_point_;
+  // Points taken from next_point_ but not yet in running_.
+  uint32_t starting_;
+  // In the order their responses are next looked for.
+  std::list<Point> running_;
+};
+
+}  // namespace spiceserver
+
+#endif  // SWEEP_JOB_H_
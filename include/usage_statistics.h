@@ -0,0 +1,41 @@
+#ifndef USAGE_STATISTICS_H_
+#define USAGE_STATISTICS_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "proto/spice_simulator.pb.h"
+
+namespace spiceserver {
+
+// Server-wide totals of what simulations have used, per flavour, so that we
+// can size machines and spot memory-hungry netlists.
+class UsageStatistics {
+ public:
+  static UsageStatistics &GetInstance() {
+    static UsageStatistics instance;
+    return instance;
+  }
+
+  UsageStatistics() = default;
+
+  UsageStatistics(const UsageStatistics&) = delete;
+  UsageStatistics& operator=(const UsageStatistics&) = delete;
+
+  // Adds one finished (or terminated) run, using the accounting fields of its
+  // final response.
+  void Record(Flavour flavour,
+              const std::string &directory,
+              const SimulationResponse &final_response);
+
+  void Report(GetUsageStatisticsResponse *response) const;
+
+ private:
+  mutable std::mutex mutex_;
+  std::map<Flavour, FlavourUsage> by_flavour_;
+};
+
+}  // namespace spiceserver
+
+#endif  // USAGE_STATISTICS_H_
@@ -0,0 +1,119 @@
+#ifndef WAVEFORM_PREVIEW_H_
+#define WAVEFORM_PREVIEW_H_
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <absl/status/status.h>
+
+#include "rawfile_reader.h"
+#include "proto/spice_simulator.pb.h"
+
+// Live previews of a running simulation's waveforms (see PreviewOptions).
+//
+// While the simulator runs, its rawfile is reopened every interval and only
+// the points written since the last look are read. They go into a
+// MinMaxDecimator per plot, which keeps a bucket's min, max and last value
+// per signal; what has changed since the last preview is sent. Once the
+// simulator is done, the rest of the rawfile is read to finish the live
+// pass, and then the whole of it is decimated again for each refinement.
+
+namespace spiceserver {
+
+// The min, max and last values of some of a plot's signals, over buckets of
+// its first signal.
+class MinMaxDecimator {
+ public:
+  MinMaxDecimator(std::vector<size_t> columns, double resolution);
+
+  double resolution() const { return resolution_; }
+
+  // Takes points [first_point, first_point + num_points) of the plot.
+  void Add(const RawfileReader &reader,
+           size_t plot,
+           uint64_t first_point,
+           uint64_t num_points);
+
+  // Moves the buckets that have changed since the last call, including the
+  // one still filling, into preview. Returns false if there were none.
+  bool Flush(WaveformPreview *preview);
+
+ private:
+  // Closes the open bucket, if any.
+  void Close();
+
+  const std::vector<size_t> columns_;
+  const double resolution_;
+
+  // Closed since the last Flush: their indices, and per bucket a value per
+  // column.
+  std::vector<int64_t> closed_;
+  std::vector<double> closed_min_;
+  std::vector<double> closed_max_;
+  std::vector<double> closed_last_;
+
+  std::optional<int64_t> open_;
+  bool open_changed_;
+  std::vector<double> open_min_;
+  std::vector<double> open_max_;
+  std::vector<double> open_last_;
+};
+
+class WaveformPreviewer {
+ public:
+  static absl::Status Validate(const PreviewOptions &options);
+
+  WaveformPreviewer(const std::filesystem::path &rawfile,
+                    const PreviewOptions &options);
+
+  // How long to wait between calls to Poll.
+  std::chrono::milliseconds interval() const;
+
+  // Adds previews of whatever the simulator has written since the last
+  // call. A rawfile that isn't there, or can't be read yet, gives none.
+  void Poll(std::vector<WaveformPreview> *previews);
+
+  // Adds the rest of the live pass, from the finished rawfile, then the
+  // refinements.
+  void Finish(const RawfileReader &reader,
+              std::vector<WaveformPreview> *previews);
+
+ private:
+  struct PlotState {
+    std::unique_ptr<MinMaxDecimator> decimator;
+    uint64_t points_seen;
+    bool started;
+  };
+
+  // The plot's signals to preview, or none if it can't be.
+  std::vector<size_t> Columns(const RawfileReader::Plot &plot) const;
+
+  // Decimates the reader's points since points_seen.
+  void Update(const RawfileReader &reader,
+              bool final,
+              std::vector<WaveformPreview> *previews);
+
+  // Adds points [first_point, end_point) of the plot to decimator, flushing
+  // every so often so that no preview gets too big.
+  void Decimate(const RawfileReader &reader,
+                size_t plot,
+                uint32_t pass,
+                uint64_t first_point,
+                uint64_t end_point,
+                bool final,
+                MinMaxDecimator *decimator,
+                bool *started,
+                std::vector<WaveformPreview> *previews) const;
+
+  const std::filesystem::path rawfile_;
+  const PreviewOptions options_;
+  std::vector<PlotState> plots_;
+};
+
+}  // namespace spiceserver
+
+#endif  // WAVEFORM_PREVIEW_H_
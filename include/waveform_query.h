@@ -0,0 +1,85 @@
+#ifndef WAVEFORM_QUERY_H_
+#define WAVEFORM_QUERY_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include <absl/status/status.h>
+
+#include "result_store.h"
+#include "simulation_job.h"
+#include "proto/spice_simulator.pb.h"
+
+// One GetWaveform: the signals and span asked for of one plot of a stored
+// result, as WaveformChunks.
+//
+// The span is found by binary search over the plot's first signal, so only
+// the pages it and the chosen signals' spans lie on are read. With
+// max_points, every stride'th point is sent, starting from the first.
+//
+// Chunks are filled on the WorkerPool, one ahead of the one being written,
+// since reading them may mean waiting for the disk. Used the same way as a
+// SimulationJob.
+
+namespace spiceserver {
+
+class WaveformQuery : public std::enable_shared_from_this<WaveformQuery> {
+ public:
+  using NextResult = SimulationJob::NextResult;
+
+  static absl::Status Validate(const GetWaveformRequest &request);
+  static std::shared_ptr<WaveformQuery> Create(
+      const GetWaveformRequest &request);
+
+  WaveformQuery(const WaveformQuery&) = delete;
+  WaveformQuery& operator=(const WaveformQuery&) = delete;
+
+  void Start(std::function<void()> on_ready);
+  NextResult Next(WaveformChunk *chunk, absl::Status *status);
+  void Cancel(const absl::Status &status);
+  void Detach();
+
+ private:
+  explicit WaveformQuery(const GetWaveformRequest &request);
+
+  // These run on the WorkerPool.
+  void Open();
+  void Fill();
+
+  // Works out the columns, span and stride from the result's index.
+  absl::Status Plan();
+
+  // Fills in the next chunk, returning whether it is the last.
+  bool FillChunk(WaveformChunk *chunk);
+
+  void Fail(const absl::Status &status);
+  void NotifyReady();
+
+  const GetWaveformRequest request_;
+
+  std::mutex callback_mutex_;
+  std::function<void()> on_ready_;
+
+  // Set once by Open, then only used by Fill, of which there is only ever
+  // one at a time.
+  std::unique_ptr<StoredResult> result_;
+  std::vector<size_t> columns_;
+  uint64_t first_point_;
+  uint64_t stride_;
+  // How many points will be sent, and how many have been.
+  uint64_t num_points_;
+  uint64_t sent_points_;
+
+  std::mutex mutex_;
+  absl::Status status_;
+  std::optional<WaveformChunk> ready_;
+  bool filled_last_;
+};
+
+}  // namespace spiceserver
+
+#endif  // WAVEFORM_QUERY_H_
@@ -0,0 +1,71 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A small, fixed pool of threads for the work a simulation job does outside
+// of gRPC's callback threads (which must never block): reading output,
+// terminating and, since tasks can be delayed, timers. The server's has
+// --job_worker_threads of them.
+//
+// Preparing a job (writing inputs, netlisting, spawning) can block for much
+// longer, so it gets a pool of its own, with --job_prepare_threads, where it
+// can't hold up the timers.
+
+namespace spiceserver {
+
+class WorkerPool {
+ public:
+  using Clock = std::chrono::steady_clock;
+  using Task = std::function<void()>;
+
+  static WorkerPool &GetInstance();
+  static WorkerPool &GetPreparationInstance();
+
+  explicit WorkerPool(int num_threads);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  // Runs the task as soon as a thread is free.
+  void Post(Task task);
+
+  // Runs the task once delay has passed. Tasks can't be cancelled, so they
+  // should hold weak references to whatever they act on.
+  void PostAfter(std::chrono::milliseconds delay, Task task);
+
+ private:
+  struct DelayedTask {
+    Clock::time_point due;
+    // Keeps tasks due at the same time in order.
+    uint64_t sequence;
+    Task task;
+
+    bool operator>(const DelayedTask &other) const {
+      return due != other.due ? due > other.due : sequence > other.sequence;
+    }
+  };
+
+  void Run();
+
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool stopping_;
+  uint64_t next_sequence_;
+  std::priority_queue<DelayedTask,
+                      std::vector<DelayedTask>,
+                      std::greater<DelayedTask>> tasks_;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace spiceserver
+
+#endif  // WORKER_POOL_H_
@@ -0,0 +1,254 @@
+#include "batch_job.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
+
+#include "job_scheduler.h"
+#include "simulator_manager.h"
+#include "worker_pool.h"
+
+DEFINE_uint64(max_batch_jobs, 10000,
+              "The most requests a single RunSimulationBatch may have.");
+DEFINE_uint32(batch_netlist_ahead, 2,
+              "How many requests of a batch to netlist before there is room "
+              "to start them.");
+
+namespace spiceserver {
+
+namespace {
+
+// The request with any VLSIR input replaced by the netlists made from it.
+absl::StatusOr<SimulationRequest> Netlisted(const SimulationRequest &request) {
+  if (!request.has_vlsir_sim_input()) {
+    return request;
+  }
+  auto files = SimulatorManager::Netlist(
+      request.simulator(), request.vlsir_sim_input());
+  if (!files.ok()) {
+    return files.status();
+  }
+  SimulationRequest netlisted = request;
+  // This also clears the VLSIR input.
+  VerbatimFileInput *inputs = netlisted.mutable_verbatim_files();
+  for (FileInfo &file : *files) {
+    *inputs->add_files() = std::move(file);
+  }
+  return netlisted;
+}
+
+}   // namespace
+
+absl::Status BatchJob::Validate(const BatchRequest &request) {
+  if (request.requests().empty()) {
+    return absl::InvalidArgumentError("Batch has no requests");
+  }
+  if (static_cast<uint64_t>(request.requests_size()) > FLAGS_max_batch_jobs) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Batch has more than the maximum of ", FLAGS_max_batch_jobs,
+        " requests"));
+  }
+  for (int i = 0; i < request.requests_size(); ++i) {
+    absl::Status status = SimulationJob::Validate(request.requests(i));
+    if (!status.ok()) {
+      return absl::Status(status.code(), absl::StrCat(
+          "Request ", i, " of batch: ", status.message()));
+    }
+  }
+  return absl::OkStatus();
+}
+
+std::shared_ptr<BatchJob> BatchJob::Create(const BatchRequest &request,
+                                           const std::string &client) {
+  return std::shared_ptr<BatchJob>(new BatchJob(request, client));
+}
+
+BatchJob::BatchJob(const BatchRequest &request, const std::string &client)
+    : request_(request),
+      client_(client),
+      max_parallel_(request.max_parallel_jobs() > 0 ?
+                    request.max_parallel_jobs() :
+                    JobScheduler::GetInstance().host_slots()),
+      finished_(false),
+      advancing_(false),
+      next_job_(0) {}
+
+void BatchJob::Start(std::function<void()> on_ready) {
+  {
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    on_ready_ = std::move(on_ready);
+  }
+  LOG(INFO) << "Batch of " << request_.requests_size() << " jobs";
+  std::lock_guard<std::mutex> lock(mutex_);
+  ScheduleAdvance();
+}
+
+void BatchJob::ScheduleAdvance() {
+  if (advancing_ || finished_) {
+    return;
+  }
+  advancing_ = true;
+  auto job = shared_from_this();
+  WorkerPool::GetPreparationInstance().Post([job]() { job->Advance(); });
+}
+
+void BatchJob::Advance() {
+  std::weak_ptr<BatchJob> weak_batch = weak_from_this();
+  while (true) {
+    std::vector<Job> to_start;
+    std::optional<uint32_t> to_netlist;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (finished_) {
+        advancing_ = false;
+        break;
+      }
+      while (!ready_.empty() && running_.size() < max_parallel_) {
+        Job job {ready_.front().first,
+                 SimulationJob::Create(ready_.front().second, client_)};
+        ready_.pop_front();
+        running_.push_back(job);
+        to_start.push_back(std::move(job));
+      }
+      if (next_job_ < static_cast<uint32_t>(request_.requests_size()) &&
+          ready_.size() < FLAGS_batch_netlist_ahead) {
+        to_netlist = next_job_++;
+      }
+      if (to_start.empty() && !to_netlist) {
+        advancing_ = false;
+        break;
+      }
+    }
+
+    for (const Job &job : to_start) {
+      job.job->Start([weak_batch]() {
+        if (auto batch = weak_batch.lock()) {
+          batch->NotifyReady();
+        }
+      });
+    }
+    if (!to_netlist) {
+      continue;
+    }
+
+    // The slow part: the other jobs carry on meanwhile.
+    absl::StatusOr<SimulationRequest> netlisted =
+        Netlisted(request_.requests(*to_netlist));
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (netlisted.ok()) {
+      ready_.emplace_back(*to_netlist, std::move(*netlisted));
+    } else {
+      failed_.emplace_back(*to_netlist, netlisted.status());
+    }
+  }
+  // Whether or not anything changed, the batch may now be done.
+  NotifyReady();
+}
+
+BatchJob::NextResult BatchJob::Next(BatchResponse *response,
+                                    absl::Status *status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (finished_) {
+    *status = final_status_;
+    return NextResult::DONE;
+  }
+
+  if (!failed_.empty()) {
+    response->Clear();
+    response->set_job(failed_.front().first);
+    const absl::Status &failure = failed_.front().second;
+    response->set_error_code(static_cast<int>(failure.code()));
+    response->set_error_message(std::string(failure.message()));
+    failed_.pop_front();
+    return NextResult::MESSAGE;
+  }
+
+  // As for sweeps, look at each running job once, starting after the last
+  // one that sent something.
+  bool freed = false;
+  NextResult result = NextResult::WAIT;
+  for (size_t remaining = running_.size();
+       remaining > 0 && result == NextResult::WAIT;
+       --remaining) {
+    Job job = std::move(running_.front());
+    running_.pop_front();
+
+    SimulationResponse job_response;
+    absl::Status job_status;
+    switch (job.job->Next(&job_response, &job_status)) {
+      case NextResult::MESSAGE:
+        response->Clear();
+        response->set_job(job.index);
+        *response->mutable_response() = std::move(job_response);
+        running_.push_back(std::move(job));
+        result = NextResult::MESSAGE;
+        break;
+      case NextResult::DONE:
+        freed = true;
+        if (!job_status.ok()) {
+          response->Clear();
+          response->set_job(job.index);
+          response->set_error_code(static_cast<int>(job_status.code()));
+          response->set_error_message(std::string(job_status.message()));
+          result = NextResult::MESSAGE;
+        }
+        break;
+      case NextResult::WAIT:
+        running_.push_back(std::move(job));
+        break;
+    }
+  }
+
+  if (freed) {
+    ScheduleAdvance();
+  }
+  if (result == NextResult::MESSAGE) {
+    return result;
+  }
+  if (!advancing_ && running_.empty() && ready_.empty() &&
+      next_job_ >= static_cast<uint32_t>(request_.requests_size())) {
+    *status = absl::OkStatus();
+    return NextResult::DONE;
+  }
+  return NextResult::WAIT;
+}
+
+void BatchJob::Cancel(const absl::Status &status) {
+  std::list<Job> running;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_) {
+      return;
+    }
+    finished_ = true;
+    final_status_ = status;
+    running.swap(running_);
+    ready_.clear();
+  }
+  for (const Job &job : running) {
+    job.job->Cancel(status);
+  }
+}
+
+void BatchJob::Detach() {
+  std::lock_guard<std::mutex> lock(callback_mutex_);
+  on_ready_ = nullptr;
+}
+
+void BatchJob::NotifyReady() {
+  std::lock_guard<std::mutex> lock(callback_mutex_);
+  if (on_ready_) {
+    on_ready_();
+  }
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,277 @@
+#include "blob_store.h"
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/string_view.h>
+
+#include "lru_directory.h"
+#include "sha256.h"
+
+DEFINE_string(blob_store_dir, "",
+              "If set, accept blobs (PutBlob) and keep them here, for "
+              "requests to refer to by digest.");
+DEFINE_uint64(blob_store_max_bytes, 10ULL << 30,
+              "How big the blob store may grow before the least recently "
+              "used blobs are removed.");
+
+namespace spiceserver {
+
+namespace {
+
+absl::Status ErrnoError(const std::string &what, int error) {
+  return absl::InternalError(absl::StrCat(what, ": ", strerror(error)));
+}
+
+}   // namespace
+
+BlobStore::Upload::Upload(BlobStore *store, const std::string &digest,
+                          const std::filesystem::path &path, int fd,
+                          uint64_t max_bytes)
+    : store_(store),
+      digest_(digest),
+      path_(path),
+      max_bytes_(max_bytes),
+      fd_(fd),
+      size_(0) {}
+
+BlobStore::Upload::~Upload() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  // Gone already if it was added to the store.
+  std::error_code error;
+  std::filesystem::remove(path_, error);
+}
+
+absl::Status BlobStore::Upload::Append(absl::string_view data) {
+  if (fd_ < 0) {
+    return absl::FailedPreconditionError("Upload already finished");
+  }
+  size_ += data.size();
+  if (size_ > max_bytes_) {
+    return absl::ResourceExhaustedError(absl::StrCat(
+        "Blob is bigger than the store (", max_bytes_, " bytes)"));
+  }
+  hash_.Update(data);
+  while (!data.empty()) {
+    ssize_t written = write(fd_, data.data(), data.size());
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError("Could not write blob", errno);
+    }
+    data.remove_prefix(written);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status BlobStore::Upload::Finish() {
+  if (fd_ < 0) {
+    return absl::FailedPreconditionError("Upload already finished");
+  }
+  // Read-only, so that a simulator can't change a blob through its link.
+  fchmod(fd_, 0444);
+  int result = close(fd_);
+  fd_ = -1;
+  if (result != 0) {
+    return ErrnoError("Could not write blob", errno);
+  }
+  std::string digest = hash_.HexDigest();
+  if (digest != digest_) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Blob contents have digest ", digest, ", not ", digest_));
+  }
+  return store_->Add(digest_, path_, size_);
+}
+
+BlobStore::BlobStore()
+    : next_upload_(0) {}
+
+absl::Status BlobStore::Initialise() {
+  if (FLAGS_blob_store_dir.empty()) {
+    return absl::OkStatus();
+  }
+  return Open(FLAGS_blob_store_dir, FLAGS_blob_store_max_bytes);
+}
+
+absl::Status BlobStore::Open(const std::filesystem::path &directory,
+                             uint64_t max_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  links_.clear();
+  // Anything that isn't a blob (like an interrupted upload) is removed.
+  absl::Status status = blobs_.Open(
+      directory, max_bytes,
+      [](const std::filesystem::directory_entry &file) {
+        std::error_code error;
+        return file.is_regular_file(error) &&
+            Sha256::IsHexDigest(file.path().filename().string());
+      });
+  if (!status.ok() || directory.empty()) {
+    return status;
+  }
+  LOG(INFO) << "Blob store in " << directory << ": " << blobs_.size()
+            << " blobs, " << blobs_.total_bytes() << " bytes";
+  return absl::OkStatus();
+}
+
+bool BlobStore::enabled() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !blobs_.directory().empty();
+}
+
+uint64_t BlobStore::total_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return blobs_.total_bytes();
+}
+
+bool BlobStore::Has(const std::string &digest) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // A client asking is about to use it.
+  return blobs_.Touch(digest);
+}
+
+absl::StatusOr<std::unique_ptr<BlobStore::Upload>> BlobStore::StartUpload(
+    const std::string &digest) {
+  if (!Sha256::IsHexDigest(digest)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Not a SHA-256 digest: \"", digest, "\""));
+  }
+  std::filesystem::path path;
+  uint64_t max_bytes;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (blobs_.directory().empty()) {
+      return absl::UnimplementedError("This server has no blob store");
+    }
+    path = blobs_.directory() / absl::StrCat(digest, ".", next_upload_++);
+    max_bytes = blobs_.max_bytes();
+  }
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return ErrnoError(absl::StrCat("Could not create ", path.string()),
+                      errno);
+  }
+  return std::unique_ptr<Upload>(
+      new Upload(this, digest, path, fd, max_bytes));
+}
+
+absl::Status BlobStore::Add(const std::string &digest,
+                            const std::filesystem::path &path,
+                            uint64_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (blobs_.directory().empty()) {
+    return absl::UnavailableError("Blob store was closed");
+  }
+  if (blobs_.Contains(digest)) {
+    // Someone else uploaded it meanwhile; the Upload removes ours.
+    return absl::OkStatus();
+  }
+  std::error_code error;
+  std::filesystem::rename(path, blobs_.PathFor(digest), error);
+  if (error) {
+    return absl::InternalError(absl::StrCat(
+        "Could not store blob ", digest, ": ", error.message()));
+  }
+  // Jobs already using an evicted blob keep their hard link (or clone).
+  UnpinUnlinked();
+  blobs_.Add(digest, size);
+  return absl::OkStatus();
+}
+
+absl::Status BlobStore::Materialise(const std::string &digest,
+                                    const std::filesystem::path &path) {
+  std::filesystem::path source;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!blobs_.Touch(digest)) {
+      return absl::FailedPreconditionError(absl::StrCat(
+          "Blob ", digest, " is not in the store; upload it with PutBlob"));
+    }
+    source = blobs_.PathFor(digest);
+  }
+
+  if (link(source.c_str(), path.c_str()) == 0) {
+    return absl::OkStatus();
+  }
+  if (errno == ENOENT) {
+    // Evicted since we looked.
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Blob ", digest, " is not in the store; upload it with PutBlob"));
+  }
+
+  // Most likely a different filesystem. Some (btrfs, XFS) can share the
+  // blocks anyway.
+  int source_fd = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+  if (source_fd >= 0) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0444);
+    bool cloned = fd >= 0 && ioctl(fd, FICLONE, source_fd) == 0;
+    if (fd >= 0) {
+      close(fd);
+    }
+    close(source_fd);
+    if (cloned) {
+      return absl::OkStatus();
+    }
+    if (fd >= 0) {
+      unlink(path.c_str());
+    }
+  }
+
+  // A symbolic link doesn't keep the blob, so it is pinned until the link has
+  // gone (with the job's directory).
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!blobs_.Contains(digest)) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        "Blob ", digest, " is not in the store; upload it with PutBlob"));
+  }
+  if (symlink(source.c_str(), path.c_str()) != 0) {
+    return ErrnoError(absl::StrCat("Could not link blob ", digest, " to ",
+                                   path.string()), errno);
+  }
+  blobs_.Pin(digest);
+  links_[digest].push_back(path);
+  return absl::OkStatus();
+}
+
+void BlobStore::UnpinUnlinked() {
+  for (auto it = links_.begin(); it != links_.end();) {
+    std::filesystem::path source = blobs_.PathFor(it->first);
+    std::vector<std::filesystem::path> &paths = it->second;
+    paths.erase(std::remove_if(paths.begin(), paths.end(),
+                               [&](const std::filesystem::path &path) {
+                                 std::error_code error;
+                                 return std::filesystem::read_symlink(
+                                     path, error) != source;
+                               }),
+                paths.end());
+    if (!paths.empty()) {
+      ++it;
+      continue;
+    }
+    blobs_.Unpin(it->first);
+    it = links_.erase(it);
+  }
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,369 @@
+#include "cgroup_manager.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+
+DEFINE_bool(job_cgroups, false,
+            "Run each simulator in its own cgroup v2 leaf, with the limits "
+            "below (or from the request). Needs a delegated cgroup; jobs run "
+            "without one if that isn't available.");
+DEFINE_string(cgroup_root, "",
+              "The cgroup (a directory under /sys/fs/cgroup) to create job "
+              "cgroups in. Defaults to the server's own cgroup, in which case "
+              "the server moves itself into a \"server\" child of it.");
+DEFINE_double(job_cpus, 0,
+              "Default CPU limit per job, in cores (cpu.max). 0 for none.");
+DEFINE_uint64(job_memory_bytes, 0,
+              "Default memory limit per job (memory.max). 0 for none.");
+DEFINE_uint64(job_max_pids, 0,
+              "Default limit on processes per job (pids.max). 0 for none.");
+
+namespace spiceserver {
+
+namespace {
+
+constexpr char kCgroupMount[] = "/sys/fs/cgroup";
+
+// cpu.max period.
+constexpr uint64_t kCpuPeriodMicros = 100000;
+
+// How long we wait for the processes in a job cgroup to die before giving up
+// on removing it.
+constexpr std::chrono::milliseconds kRemoveTimeout(1000);
+
+absl::Status WriteFile(const std::filesystem::path &path,
+                       const std::string &contents) {
+  int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return absl::UnavailableError(
+        absl::StrCat("Could not open ", path.string(), ": ", strerror(errno)));
+  }
+  ssize_t written = write(fd, contents.data(), contents.size());
+  int write_errno = errno;
+  close(fd);
+  if (written != static_cast<ssize_t>(contents.size())) {
+    return absl::UnavailableError(
+        absl::StrCat("Could not write \"", contents, "\" to ", path.string(),
+                     ": ", strerror(write_errno)));
+  }
+  return absl::OkStatus();
+}
+
+std::string ReadFile(const std::filesystem::path &path) {
+  std::ifstream in(path);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  return contents.str();
+}
+
+// The server's own cgroup v2 path, from the "0::" line of /proc/self/cgroup.
+absl::StatusOr<std::filesystem::path> OwnCgroup() {
+  std::ifstream in("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(in, line)) {
+    absl::string_view view(line);
+    if (absl::ConsumePrefix(&view, "0::")) {
+      return std::filesystem::path(kCgroupMount) /
+             std::filesystem::path(std::string(view)).relative_path();
+    }
+  }
+  return absl::UnavailableError("Not running under cgroup v2");
+}
+
+}   // namespace
+
+JobCgroup::JobCgroup(const std::filesystem::path &path, int procs_fd)
+    : path_(path),
+      procs_fd_(procs_fd) {}
+
+JobCgroup::~JobCgroup() {
+  if (procs_fd_ != -1) {
+    close(procs_fd_);
+  }
+
+  // A cgroup can only be removed once it's empty. Normally it already is.
+  auto deadline = std::chrono::steady_clock::now() + kRemoveTimeout;
+  bool killed = false;
+  while (rmdir(path_.c_str()) == -1) {
+    if (errno != EBUSY) {
+      LOG(WARNING) << "Could not remove " << path_ << ": " << strerror(errno);
+      return;
+    }
+    if (!killed) {
+      killed = Kill();
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      LOG(WARNING) << "Gave up removing busy cgroup " << path_;
+      return;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+bool JobCgroup::Kill() {
+  // cgroup.kill appeared in Linux 5.14.
+  absl::Status status = WriteFile(path_ / "cgroup.kill", "1");
+  if (!status.ok()) {
+    LOG_FIRST_N(WARNING, 1) << status;
+    return false;
+  }
+  return true;
+}
+
+CgroupUsage JobCgroup::ReadUsage() const {
+  CgroupUsage usage_pb;
+
+  uint64_t memory_peak;
+  if (absl::SimpleAtoi(
+          absl::StripAsciiWhitespace(ReadFile(path_ / "memory.peak")),
+          &memory_peak)) {
+    usage_pb.set_memory_peak_bytes(memory_peak);
+  }
+
+  auto cpu_stat = CgroupManager::ParseKeyedValues(ReadFile(path_ / "cpu.stat"));
+  usage_pb.set_cpu_usage_seconds(cpu_stat["usage_usec"] / 1e6);
+  usage_pb.set_cpu_user_seconds(cpu_stat["user_usec"] / 1e6);
+  usage_pb.set_cpu_system_seconds(cpu_stat["system_usec"] / 1e6);
+  usage_pb.set_cpu_throttled_periods(cpu_stat["nr_throttled"]);
+  usage_pb.set_cpu_throttled_seconds(cpu_stat["throttled_usec"] / 1e6);
+
+  auto memory_events =
+      CgroupManager::ParseKeyedValues(ReadFile(path_ / "memory.events"));
+  usage_pb.set_memory_max_events(memory_events["max"]);
+  usage_pb.set_oom_kills(memory_events["oom_kill"]);
+  return usage_pb;
+}
+
+CgroupManager::CgroupManager()
+    : available_(false),
+      cpu_(false),
+      memory_(false),
+      pids_(false),
+      next_id_(0) {}
+
+CgroupManager::Limits CgroupManager::DefaultLimits() {
+  return Limits {
+    .cpus = FLAGS_job_cpus,
+    .memory_bytes = FLAGS_job_memory_bytes,
+    .max_pids = FLAGS_job_max_pids
+  };
+}
+
+CgroupManager::Limits CgroupManager::LimitsFromRequest(
+    const JobLimits &limits_pb) {
+  Limits limits = DefaultLimits();
+  if (limits_pb.cpus() > 0) {
+    limits.cpus = limits_pb.cpus();
+  }
+  if (limits_pb.memory_bytes() > 0) {
+    limits.memory_bytes = limits_pb.memory_bytes();
+  }
+  if (limits_pb.max_pids() > 0) {
+    limits.max_pids = limits_pb.max_pids();
+  }
+  return limits;
+}
+
+std::map<std::string, uint64_t> CgroupManager::ParseKeyedValues(
+    const std::string &contents) {
+  std::map<std::string, uint64_t> values;
+  for (absl::string_view line : absl::StrSplit(contents, '\n')) {
+    std::vector<absl::string_view> fields =
+        absl::StrSplit(line, ' ', absl::SkipEmpty());
+    uint64_t value;
+    if (fields.size() == 2 && absl::SimpleAtoi(fields[1], &value)) {
+      values[std::string(fields[0])] = value;
+    }
+  }
+  return values;
+}
+
+std::string CgroupManager::FormatCpuMax(double cpus) {
+  if (cpus <= 0) {
+    return absl::StrCat("max ", kCpuPeriodMicros);
+  }
+  // The kernel won't take a quota under 1 ms.
+  uint64_t quota = std::max<uint64_t>(
+      1000, static_cast<uint64_t>(std::llround(cpus * kCpuPeriodMicros)));
+  return absl::StrCat(quota, " ", kCpuPeriodMicros);
+}
+
+absl::Status CgroupManager::EnableControllers(
+    const std::filesystem::path &cgroup) {
+  std::string available = ReadFile(cgroup / "cgroup.controllers");
+  std::vector<std::string> wanted;
+  for (absl::string_view controller : absl::StrSplit(
+           absl::StripAsciiWhitespace(available), ' ', absl::SkipEmpty())) {
+    if (controller == "cpu" || controller == "memory" || controller == "pids") {
+      wanted.push_back(std::string(controller));
+    }
+  }
+
+  // Enable them one at a time, so that one we can't have doesn't stop us
+  // getting the others.
+  cpu_ = memory_ = pids_ = false;
+  for (const std::string &controller : wanted) {
+    auto status = WriteFile(cgroup / "cgroup.subtree_control",
+                            absl::StrCat("+", controller));
+    if (!status.ok()) {
+      LOG(WARNING) << "Could not enable cgroup controller " << controller
+                   << ": " << status;
+      continue;
+    }
+    cpu_ |= controller == "cpu";
+    memory_ |= controller == "memory";
+    pids_ |= controller == "pids";
+  }
+  if (!cpu_ && !memory_ && !pids_) {
+    return absl::UnavailableError(absl::StrCat(
+        "No cpu, memory or pids controllers available in ", cgroup.string()));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status CgroupManager::Initialise() {
+  if (!FLAGS_job_cgroups) {
+    return absl::OkStatus();
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (available_) {
+    return absl::OkStatus();
+  }
+
+  std::filesystem::path root;
+  if (FLAGS_cgroup_root.empty()) {
+    auto own = OwnCgroup();
+    if (!own.ok()) {
+      return own.status();
+    }
+    root = *own;
+
+    // No internal processes: we have to leave before our cgroup can hand
+    // controllers down to the job cgroups.
+    std::filesystem::path server = root / "server";
+    std::error_code error;
+    std::filesystem::create_directory(server, error);
+    if (error) {
+      return absl::UnavailableError(absl::StrCat(
+          "Could not create ", server.string(), ": ", error.message()));
+    }
+    auto moved = WriteFile(server / "cgroup.procs", "0");
+    if (!moved.ok()) {
+      return moved;
+    }
+  } else {
+    root = FLAGS_cgroup_root;
+  }
+
+  auto enabled = EnableControllers(root);
+  if (!enabled.ok()) {
+    return enabled;
+  }
+
+  std::filesystem::path jobs = root / "jobs";
+  std::error_code error;
+  std::filesystem::create_directory(jobs, error);
+  if (error) {
+    return absl::UnavailableError(absl::StrCat(
+        "Could not create ", jobs.string(), ": ", error.message()));
+  }
+  enabled = EnableControllers(jobs);
+  if (!enabled.ok()) {
+    return enabled;
+  }
+
+  jobs_path_ = jobs;
+  available_ = true;
+  LOG(INFO) << "Simulators will run in cgroups under " << jobs_path_
+            << " (cpu: " << cpu_ << ", memory: " << memory_
+            << ", pids: " << pids_ << ")";
+  return absl::OkStatus();
+}
+
+bool CgroupManager::IsAvailable() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return available_;
+}
+
+absl::StatusOr<std::unique_ptr<JobCgroup>> CgroupManager::CreateJobCgroup(
+    const Limits &limits) {
+  std::filesystem::path path;
+  bool cpu, memory, pids;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!available_) {
+      return absl::UnavailableError("Job cgroups are not available.");
+    }
+    path = jobs_path_ / absl::StrCat("job-", getpid(), "-", next_id_++);
+    cpu = cpu_;
+    memory = memory_;
+    pids = pids_;
+  }
+
+  if (mkdir(path.c_str(), 0755) == -1) {
+    return absl::UnavailableError(absl::StrCat(
+        "Could not create ", path.string(), ": ", strerror(errno)));
+  }
+
+  int procs_fd = open((path / "cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+  if (procs_fd == -1) {
+    int open_errno = errno;
+    rmdir(path.c_str());
+    return absl::UnavailableError(absl::StrCat(
+        "Could not open ", path.string(), "/cgroup.procs: ",
+        strerror(open_errno)));
+  }
+  // From here on the destructor cleans up.
+  std::unique_ptr<JobCgroup> cgroup(new JobCgroup(path, procs_fd));
+
+  std::vector<std::pair<std::string, std::string>> settings;
+  if (cpu && limits.cpus > 0) {
+    settings.emplace_back("cpu.max", FormatCpuMax(limits.cpus));
+  }
+  if (memory && limits.memory_bytes > 0) {
+    settings.emplace_back("memory.max", absl::StrCat(limits.memory_bytes));
+    // Don't let the job dodge the limit by swapping.
+    settings.emplace_back("memory.swap.max", "0");
+  }
+  if (memory) {
+    // If the OOM killer picks something in the job, take the whole job; half
+    // an MPI run is no use to anyone.
+    settings.emplace_back("memory.oom.group", "1");
+  }
+  if (pids && limits.max_pids > 0) {
+    settings.emplace_back("pids.max", absl::StrCat(limits.max_pids));
+  }
+  for (const auto &setting : settings) {
+    auto status = WriteFile(path / setting.first, setting.second);
+    if (!status.ok()) {
+      // memory.swap.max doesn't exist without swap accounting, for example.
+      LOG(WARNING) << "Could not set " << setting.first << " for job: "
+                   << status;
+    }
+  }
+  return cgroup;
+}
+
+}  // namespace spiceserver
@@ -13,6 +13,7 @@
 
 #include <absl/status/status.h>
 #include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
 #include <absl/strings/str_join.h>
 
 #include "proto/spice_simulator.pb.h"
@@ -24,6 +25,98 @@ DEFINE_string(python_vlsir, "../vlsir_repo/bindings/python",
 
 namespace spiceserver {
 
+namespace {
+
+// Compiled once, as the module spice_server_netlister. Each flavour's
+// netlister class is looked for where vlsirtools keeps it; if this
+// vlsirtools doesn't have one, the flavour gets no netlister (None), rather
+// than another dialect's.
+constexpr char kNetlisterModuleSource[] = R"python(
+import importlib
+import io
+
+import vlsir.circuit_pb2 as circuit_pb2
+import vlsir.spice_pb2 as spice_pb2
+
+
+def netlister_class(module_name, class_name):
+  try:
+    return getattr(importlib.import_module(module_name), class_name)
+  except (ImportError, AttributeError):
+    return None
+
+
+def sim_netlister(module_name, class_name):
+  netlister = netlister_class(module_name, class_name)
+  if netlister is None:
+    return None
+  def netlist(serialised):
+    sim_input_pb = spice_pb2.SimInput()
+    sim_input_pb.ParseFromString(serialised)
+    out = io.StringIO()
+    netlister(out).write_sim_input(sim_input_pb)
+    return out.getvalue()
+  return netlist
+
+
+def package_netlister(module_name, class_name):
+  netlister = netlister_class(module_name, class_name)
+  if netlister is None:
+    return None
+  def netlist(serialised):
+    package_pb = circuit_pb2.Package()
+    package_pb.ParseFromString(serialised)
+    out = io.StringIO()
+    netlister(out).write_package(package_pb)
+    return out.getvalue()
+  return netlist
+)python";
+
+struct NetlisterClass {
+  Flavour flavour;
+  const char *module_name;
+  const char *class_name;
+};
+
+constexpr NetlisterClass kNetlisterClasses[] = {
+  {Flavour::XYCE, "vlsirtools.netlist.spice", "XyceNetlister"},
+  {Flavour::XYCE_7_8, "vlsirtools.netlist.spice", "XyceNetlister"},
+  {Flavour::XYCE_7_9, "vlsirtools.netlist.spice", "XyceNetlister"},
+  {Flavour::XYCE_7_10, "vlsirtools.netlist.spice", "XyceNetlister"},
+  {Flavour::NGSPICE, "vlsirtools.netlist.spice", "NgspiceNetlister"},
+  {Flavour::HSPICE, "vlsirtools.netlist.spice", "SpiceNetlister"},
+  {Flavour::SPECTRE, "vlsirtools.netlist.spectre", "SpectreNetlister"},
+};
+
+// Takes (and clears) the pending Python exception. Expects the GIL to be
+// held.
+std::string TakePythonError() {
+  PyObject *type = nullptr;
+  PyObject *value = nullptr;
+  PyObject *traceback = nullptr;
+  PyErr_Fetch(&type, &value, &traceback);
+  PyErr_NormalizeException(&type, &value, &traceback);
+  std::string message = "unknown Python error";
+  if (type != nullptr) {
+    PyObject *name = PyObject_GetAttrString(type, "__name__");
+    PyObject *text = value != nullptr ? PyObject_Str(value) : nullptr;
+    const char *name_utf8 = name != nullptr ? PyUnicode_AsUTF8(name) : nullptr;
+    const char *text_utf8 = text != nullptr ? PyUnicode_AsUTF8(text) : nullptr;
+    message = absl::StrCat(name_utf8 != nullptr ? name_utf8 : "Exception",
+                           ": ", text_utf8 != nullptr ? text_utf8 : "");
+    Py_XDECREF(name);
+    Py_XDECREF(text);
+  }
+  // Anything the above raised too.
+  PyErr_Clear();
+  Py_XDECREF(type);
+  Py_XDECREF(value);
+  Py_XDECREF(traceback);
+  return message;
+}
+
+}   // namespace
+
 void EmbeddedPythonNetlister::InitialisePython() {
   LOG(INFO) << "Starting Python";
   PyStatus py_status;
@@ -72,102 +165,149 @@ void EmbeddedPythonNetlister::DeinitialisePython() {
   Py_FinalizeEx();
 }
 
-std::vector<std::filesystem::path> EmbeddedPythonNetlister::WriteSim(
-    const vlsir::spice::SimInput &sim_input_pb,
-    const Flavour &spice_flavour,
-    const std::filesystem::path &output_directory) {
-  // vlsirtools/spice contains classes that implement the conversion of
-  // SimInput parameters to specific simulator commands (for including in the
-  // top level deck). TODO(aryap):
-  //  1) separate the logic which writes the top-level deck from running the
-  //  exectuable on them
-  //  2) hide this behind the existing interface so as to not break any other
-  //  code (no mood for fixing those yet)
-  //  3) write_sim_input seems to be the version of (1) that alrady exists, but
-  //  it has missing parts? it works for SpectreNetlister.
-  //  4) ok our job is to complete Netlister.write_sim_input!
-  std::string file_name = (output_directory / std::filesystem::path(
-      "vlsir_sim_input.pb")).string();
-  std::fstream output_file(
-      file_name, std::ios::out | std::ios::trunc | std::ios::binary);
-  if (!sim_input_pb.SerializeToOstream(&output_file)) {
-    LOG(ERROR) << "Could not write input proto to " << file_name;
-    return {};
-  } else {
-    LOG(INFO) << "SimInput protobuf written to " << file_name;
+absl::Status EmbeddedPythonNetlister::LoadNetlisters() {
+  PyObject *code = Py_CompileString(
+      kNetlisterModuleSource, "<spice_server_netlister>", Py_file_input);
+  if (code == nullptr) {
+    return absl::InternalError(absl::StrCat(
+        "Could not compile netlister module: ", TakePythonError()));
+  }
+  PyObject *module = PyImport_ExecCodeModule("spice_server_netlister", code);
+  Py_DECREF(code);
+  if (module == nullptr) {
+    return absl::UnavailableError(absl::StrCat(
+        "Could not load VLSIR netlisters: ", TakePythonError()));
   }
 
-  std::filesystem::path out_file_name = output_directory / "main.sp";
-
-  std::string python_script = absl::StrCat("input_pb_name = '", file_name, "'\n");
-  python_script += absl::StrCat(
-      "out_file_name = '", out_file_name.string(), "'\n");
-  python_script +=
-      "#import sys\n"
-      "#print(sys.path)\n"
-      "import vlsir.spice_pb2 as spice_pb2\n"
-      "from vlsirtools.netlist.spice import XyceNetlister\n"
-      "sim_input_pb = spice_pb2.SimInput()\n"
-      "with open(input_pb_name, 'rb') as in_file:\n"
-      "  print('reading:', input_pb_name)\n"
-      "  sim_input_pb.ParseFromString(in_file.read())\n"
-      "with open(out_file_name, 'w') as out_file:\n"
-      "  print('writing:', out_file_name)\n"
-      "  netlister = XyceNetlister(out_file)\n"
-      "  netlister.write_sim_input(sim_input_pb)\n";
-
-
-  VLOG(11) << "Running script:\n" << python_script;
-
-  PyRun_SimpleString(python_script.c_str());
-
-  // TODO(aryap): Need to extract any errors from running Python script.
-
-  return {out_file_name};
+  absl::Status status;
+  for (const NetlisterClass &entry : kNetlisterClasses) {
+    PyObject *sim = PyObject_CallMethod(
+        module, "sim_netlister", "ss", entry.module_name, entry.class_name);
+    PyObject *package = sim == nullptr ? nullptr : PyObject_CallMethod(
+        module, "package_netlister", "ss", entry.module_name,
+        entry.class_name);
+    if (sim == nullptr || package == nullptr) {
+      Py_XDECREF(sim);
+      status = absl::InternalError(absl::StrCat(
+          "Could not make netlister ", entry.class_name, ": ",
+          TakePythonError()));
+      break;
+    }
+    if (sim == Py_None || package == Py_None) {
+      LOG(WARNING) << "vlsirtools has no " << entry.class_name << ", so "
+                   << Flavour_Name(entry.flavour)
+                   << " can't be netlisted";
+      Py_DECREF(sim);
+      Py_DECREF(package);
+      continue;
+    }
+    sim_netlisters_[entry.flavour] = sim;
+    package_netlisters_[entry.flavour] = package;
+  }
+  Py_DECREF(module);
+  if (status.ok()) {
+    LOG(INFO) << "Loaded VLSIR netlisters for " << sim_netlisters_.size()
+              << " flavours";
+  }
+  return status;
 }
 
-std::vector<std::filesystem::path> EmbeddedPythonNetlister::WriteSpice(
-    const vlsir::circuit::Package &circuit_pb,
-    const Flavour &spice_flavour,
-    const std::filesystem::path &output_directory) {
-  std::string file_name = (output_directory / std::filesystem::path(
-      "vlsir_package.pb")).string();
-  std::fstream output_file(
-      file_name, std::ios::out | std::ios::trunc | std::ios::binary);
-  if (!circuit_pb.SerializeToOstream(&output_file)) {
-    LOG(ERROR) << "Could not write input proto to " << file_name;
-    return {};
+absl::StatusOr<std::string> EmbeddedPythonNetlister::Netlist(
+    const std::map<Flavour, PyObject*> &netlisters,
+    const std::string &serialised,
+    const Flavour &spice_flavour) {
+  if (!status_.ok()) {
+    return status_;
+  }
+  auto it = netlisters.find(spice_flavour);
+  if (it == netlisters.end()) {
+    return absl::UnimplementedError(absl::StrCat(
+        "No VLSIR netlister for flavour ", Flavour_Name(spice_flavour)));
+  }
+
+  PyGILState_STATE gil = PyGILState_Ensure();
+  absl::StatusOr<std::string> netlist;
+  PyObject *bytes = PyBytes_FromStringAndSize(serialised.data(),
+                                              serialised.size());
+  PyObject *result = bytes == nullptr ? nullptr :
+      PyObject_CallFunctionObjArgs(it->second, bytes, nullptr);
+  Py_XDECREF(bytes);
+  Py_ssize_t size = 0;
+  const char *text = result == nullptr ? nullptr :
+      PyUnicode_AsUTF8AndSize(result, &size);
+  if (text == nullptr) {
+    netlist = absl::InvalidArgumentError(absl::StrCat(
+        "Could not netlist VLSIR input: ", TakePythonError()));
   } else {
-    LOG(INFO) << "Circuit protobuf written to " << file_name;
+    netlist = std::string(text, size);
   }
+  Py_XDECREF(result);
+  PyGILState_Release(gil);
+  return netlist;
+}
 
-  std::filesystem::path out_file_name = output_directory / "netlist.sp";
+absl::StatusOr<std::string> EmbeddedPythonNetlister::NetlistSim(
+    const vlsir::spice::SimInput &sim_input_pb,
+    const Flavour &spice_flavour) {
+  return Netlist(sim_netlisters_, sim_input_pb.SerializeAsString(),
+                 spice_flavour);
+}
 
-  std::string python_script = absl::StrCat("input_pb_name = '", file_name, "'\n");
-  python_script += absl::StrCat(
-      "out_file_name = '", out_file_name.string(), "'\n");
-  python_script +=
-      "#import sys\n"
-      "#print(sys.path)\n"
-      "import vlsir.circuit_pb2 as circuit_pb2\n"
-      "from vlsirtools.netlist.spice import XyceNetlister\n"
-      "package_pb = circuit_pb2.Package()\n"
-      "with open(input_pb_name, 'rb') as in_file:\n"
-      "  print('reading:', input_pb_name)\n"
-      "  package_pb.ParseFromString(in_file.read())\n"
-      "with open(out_file_name, 'w') as out_file:\n"
-      "  print('writing:', out_file_name)\n"
-      "  netlister = XyceNetlister(out_file)\n"
-      "  netlister.write_package(package_pb)\n";
+absl::StatusOr<std::string> EmbeddedPythonNetlister::NetlistPackage(
+    const vlsir::circuit::Package &circuit_pb,
+    const Flavour &spice_flavour) {
+  return Netlist(package_netlisters_, circuit_pb.SerializeAsString(),
+                 spice_flavour);
+}
 
+absl::StatusOr<std::string> EmbeddedPythonNetlister::NetlistSerialisedSim(
+    const std::string &serialised_sim_input,
+    const Flavour &spice_flavour) {
+  return Netlist(sim_netlisters_, serialised_sim_input, spice_flavour);
+}
 
-  VLOG(11) << "Running script:\n" << python_script;
+absl::StatusOr<std::string> EmbeddedPythonNetlister::NetlistSerialisedPackage(
+    const std::string &serialised_package,
+    const Flavour &spice_flavour) {
+  return Netlist(package_netlisters_, serialised_package, spice_flavour);
+}
 
-  PyRun_SimpleString(python_script.c_str());
+absl::StatusOr<std::vector<std::filesystem::path>>
+EmbeddedPythonNetlister::WriteNetlist(
+    const absl::StatusOr<std::string> &netlist,
+    const std::filesystem::path &output_directory,
+    const std::string &file_name) {
+  if (!netlist.ok()) {
+    return netlist.status();
+  }
+  std::filesystem::path out_file_name = output_directory / file_name;
+  std::ofstream out(out_file_name,
+                    std::ios::out | std::ios::trunc | std::ios::binary);
+  out.write(netlist->data(), netlist->size());
+  out.close();
+  if (!out) {
+    return absl::InternalError(absl::StrCat(
+        "Could not write ", out_file_name.string()));
+  }
+  return std::vector<std::filesystem::path> {out_file_name};
+}
 
-  // TODO(aryap): Need to extract any errors from running Python script.
+absl::StatusOr<std::vector<std::filesystem::path>>
+EmbeddedPythonNetlister::WriteSim(
+    const vlsir::spice::SimInput &sim_input_pb,
+    const Flavour &spice_flavour,
+    const std::filesystem::path &output_directory) {
+  return WriteNetlist(NetlistSim(sim_input_pb, spice_flavour),
+                      output_directory, "main.sp");
+}
 
-  return {out_file_name};
+absl::StatusOr<std::vector<std::filesystem::path>>
+EmbeddedPythonNetlister::WriteSpice(
+    const vlsir::circuit::Package &circuit_pb,
+    const Flavour &spice_flavour,
+    const std::filesystem::path &output_directory) {
+  return WriteNetlist(NetlistPackage(circuit_pb, spice_flavour),
+                      output_directory, "netlist.sp");
 }
 
 }  // namespace spiceserver
@@ -0,0 +1,293 @@
+#include "golden_comparator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+
+namespace spiceserver {
+
+namespace {
+
+// A signal over the points of its plot, as columns.
+struct Trace {
+  std::vector<double> x;
+  std::vector<double> real;
+  // Empty if the plot is real.
+  std::vector<double> imaginary;
+};
+
+struct Statistics {
+  double max_error = 0;
+  double max_error_at = 0;
+  double max_relative_error = 0;
+  uint64_t points = 0;
+  uint64_t violations = 0;
+};
+
+// Splits num_points values, or (real, imaginary) pairs, into their parts.
+void Split(const double *values, uint64_t num_points, bool complex,
+           std::vector<double> *real, std::vector<double> *imaginary) {
+  real->resize(num_points);
+  if (!complex) {
+    std::copy(values, values + num_points, real->begin());
+    return;
+  }
+  imaginary->resize(num_points);
+  for (uint64_t i = 0; i < num_points; ++i) {
+    (*real)[i] = values[2 * i];
+    (*imaginary)[i] = values[2 * i + 1];
+  }
+}
+
+// The values of y (over x) at each of at, by linear interpolation; held
+// flat beyond the ends. Both x and at ascend, so this is one walk over
+// each.
+void Resample(const std::vector<double> &x, const std::vector<double> &y,
+              const std::vector<double> &at, std::vector<double> *out) {
+  out->resize(at.size());
+  size_t end = x.size();
+  size_t j = 0;
+  for (size_t i = 0; i < at.size(); ++i) {
+    while (j < end && x[j] <= at[i]) {
+      ++j;
+    }
+    if (j == 0) {
+      (*out)[i] = y[0];
+    } else if (j == end) {
+      (*out)[i] = y[end - 1];
+    } else {
+      (*out)[i] = y[j - 1] +
+          (y[j] - y[j - 1]) * (at[i] - x[j - 1]) / (x[j] - x[j - 1]);
+    }
+  }
+}
+
+void Resample(const Trace &trace, const std::vector<double> &at,
+              Trace *out) {
+  Resample(trace.x, trace.real, at, &out->real);
+  if (trace.imaginary.empty()) {
+    out->imaginary.clear();
+  } else {
+    Resample(trace.x, trace.imaginary, at, &out->imaginary);
+  }
+}
+
+// Adds the deviations of value from golden, both over the points x, to
+// statistics.
+void Accumulate(const std::vector<double> &x,
+                const Trace &value,
+                const Trace &golden,
+                const SignalTolerance &tolerance,
+                Statistics *statistics) {
+  size_t num_points = x.size();
+  // The errors and the golden's magnitudes first, as columns, then a pass
+  // over those.
+  std::vector<double> error(num_points);
+  std::vector<double> magnitude(num_points);
+  if (golden.imaginary.empty()) {
+    for (size_t i = 0; i < num_points; ++i) {
+      error[i] = std::fabs(value.real[i] - golden.real[i]);
+      magnitude[i] = std::fabs(golden.real[i]);
+    }
+  } else {
+    for (size_t i = 0; i < num_points; ++i) {
+      error[i] = std::hypot(value.real[i] - golden.real[i],
+                            value.imaginary[i] - golden.imaginary[i]);
+      magnitude[i] = std::hypot(golden.real[i], golden.imaginary[i]);
+    }
+  }
+
+  uint64_t violations = 0;
+  for (size_t i = 0; i < num_points; ++i) {
+    // NaN is never within tolerance.
+    violations += !(error[i] <= tolerance.absolute() +
+                                tolerance.relative() * magnitude[i]);
+  }
+  for (size_t i = 0; i < num_points; ++i) {
+    double deviation = std::isnan(error[i]) ?
+        std::numeric_limits<double>::infinity() : error[i];
+    if (deviation > statistics->max_error) {
+      statistics->max_error = deviation;
+      statistics->max_error_at = x[i];
+    }
+    if (magnitude[i] > 0) {
+      statistics->max_relative_error = std::max(
+          statistics->max_relative_error, deviation / magnitude[i]);
+    }
+  }
+  statistics->points += num_points;
+  statistics->violations += violations;
+}
+
+bool ValidTolerance(const SignalTolerance &tolerance) {
+  // Not negative, nor NaN.
+  return tolerance.absolute() >= 0 && tolerance.relative() >= 0;
+}
+
+}   // namespace
+
+absl::Status GoldenComparator::Validate(const GoldenOptions &options) {
+  if (options.test_id().empty()) {
+    return absl::InvalidArgumentError("Golden comparison needs a test ID");
+  }
+  if (!ValidTolerance(options.default_tolerance())) {
+    return absl::InvalidArgumentError("Tolerances can't be negative");
+  }
+  for (const SignalTolerance &tolerance : options.signals()) {
+    if (tolerance.signal().empty()) {
+      return absl::InvalidArgumentError("Tolerances need a signal");
+    }
+    if (!ValidTolerance(tolerance)) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Tolerances for ", tolerance.signal(), " can't be negative"));
+    }
+  }
+  return absl::OkStatus();
+}
+
+GoldenComparator::GoldenComparator(const StoredResult &golden,
+                                   const RawfileReader &run)
+    : golden_(golden),
+      run_(run) {}
+
+GoldenComparison GoldenComparator::Compare(const GoldenOptions &options) {
+  GoldenComparison comparison;
+  comparison.set_test_id(options.test_id());
+  comparison.set_passed(true);
+
+  std::set<std::string> compared;
+  const StoredResultIndex &index = golden_.index();
+  for (int plot = 0; plot < index.plots_size(); ++plot) {
+    const StoredPlot &stored = index.plots(plot);
+    for (int signal = 1; signal < stored.signals_size(); ++signal) {
+      const std::string &name = stored.signals(signal).name();
+      const SignalTolerance *tolerance = &options.default_tolerance();
+      if (!options.signals().empty()) {
+        auto it = std::find_if(
+            options.signals().begin(), options.signals().end(),
+            [&name](const SignalTolerance &candidate) {
+              return candidate.signal() == name;
+            });
+        if (it == options.signals().end()) {
+          continue;
+        }
+        tolerance = &*it;
+        compared.insert(name);
+      }
+      SignalComparison *result = comparison.add_signals();
+      CompareSignal(plot, signal, *tolerance, result);
+      if (!result->passed()) {
+        comparison.set_passed(false);
+      }
+    }
+  }
+
+  for (const SignalTolerance &tolerance : options.signals()) {
+    if (compared.count(tolerance.signal()) == 0) {
+      SignalComparison *result = comparison.add_signals();
+      result->set_signal(tolerance.signal());
+      result->set_error("Not in the golden");
+      comparison.set_passed(false);
+    }
+  }
+  if (comparison.signals().empty()) {
+    comparison.set_error("The golden has no signals to compare");
+    comparison.set_passed(false);
+  }
+  return comparison;
+}
+
+void GoldenComparator::CompareSignal(int golden_plot,
+                                     int golden_signal,
+                                     const SignalTolerance &tolerance,
+                                     SignalComparison *comparison) {
+  const StoredPlot &stored = golden_.index().plots(golden_plot);
+  const std::string &name = stored.signals(golden_signal).name();
+  comparison->set_plot(stored.name());
+  comparison->set_signal(name);
+
+  // The run's plot of the same name, counting those before.
+  int occurrence = 0;
+  for (int plot = 0; plot < golden_plot; ++plot) {
+    occurrence += golden_.index().plots(plot).name() == stored.name();
+  }
+  const std::vector<RawfileReader::Plot> &plots = run_.plots();
+  size_t plot = 0;
+  for (; plot < plots.size(); ++plot) {
+    if (plots[plot].name == stored.name() && occurrence-- == 0) {
+      break;
+    }
+  }
+  if (plot == plots.size()) {
+    comparison->set_error(absl::StrCat("The run has no plot ", stored.name()));
+    return;
+  }
+  const RawfileReader::Plot &source = plots[plot];
+  auto it = std::find_if(
+      source.signals.begin(), source.signals.end(),
+      [&name](const WaveformSignal &candidate) {
+        return candidate.name() == name;
+      });
+  if (it == source.signals.end()) {
+    comparison->set_error("Not in the run");
+    return;
+  }
+  if (source.complex != stored.complex()) {
+    comparison->set_error(source.complex ?
+        "Complex in the run, real in the golden" :
+        "Real in the run, complex in the golden");
+    return;
+  }
+  if (source.num_points == 0 || stored.num_points() == 0) {
+    comparison->set_error(source.num_points == 0 ?
+        "No points in the run" : "No points in the golden");
+    return;
+  }
+
+  bool complex = stored.complex();
+  std::vector<double> imaginary_x;
+  Trace golden;
+  Split(golden_.Signal(golden_plot, 0), stored.num_points(), complex,
+        &golden.x, &imaginary_x);
+  Split(golden_.Signal(golden_plot, golden_signal), stored.num_points(),
+        complex, &golden.real, &golden.imaginary);
+  Trace run;
+  std::vector<double> values(source.num_points * (complex ? 2 : 1));
+  run_.ReadSignal(plot, 0, 0, source.num_points, values.data());
+  Split(values.data(), source.num_points, complex, &run.x, &imaginary_x);
+  run_.ReadSignal(plot, it - source.signals.begin(), 0, source.num_points,
+                  values.data());
+  Split(values.data(), source.num_points, complex, &run.real,
+        &run.imaginary);
+
+  // Both at the points of either, so that neither's detail is missed; a point
+  // they share is compared once.
+  std::vector<double> at;
+  at.reserve(golden.x.size() + run.x.size());
+  std::merge(golden.x.begin(), golden.x.end(), run.x.begin(), run.x.end(),
+             std::back_inserter(at));
+  at.erase(std::unique(at.begin(), at.end()), at.end());
+  Trace run_at;
+  Trace golden_at;
+  Resample(run, at, &run_at);
+  Resample(golden, at, &golden_at);
+  Statistics statistics;
+  Accumulate(at, run_at, golden_at, tolerance, &statistics);
+
+  comparison->set_max_error(statistics.max_error);
+  comparison->set_max_error_at(statistics.max_error_at);
+  comparison->set_max_relative_error(statistics.max_relative_error);
+  comparison->set_points(statistics.points);
+  comparison->set_violations(statistics.violations);
+  comparison->set_passed(statistics.violations == 0);
+}
+
+}  // namespace spiceserver
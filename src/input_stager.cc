@@ -0,0 +1,181 @@
+#include "input_stager.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <gflags/gflags.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/string_view.h>
+
+#include "blob_store.h"
+#include "input_writer.h"
+#include "simulator_manager.h"
+
+DEFINE_uint64(max_upload_bytes, 8ULL << 30,
+              "The most input an UploadAndRun may stream.");
+
+namespace spiceserver {
+
+namespace {
+
+absl::Status WriteAll(int fd, absl::string_view data) {
+  while (!data.empty()) {
+    ssize_t written = write(fd, data.data(), data.size());
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return absl::InternalError(absl::StrCat(
+          "Could not write input: ", strerror(errno)));
+    }
+    data.remove_prefix(written);
+  }
+  return absl::OkStatus();
+}
+
+}   // namespace
+
+absl::StatusOr<std::unique_ptr<InputStager>> InputStager::Create() {
+  auto directory = SimulatorManager::CreateTemporaryDirectory();
+  if (!directory.ok()) {
+    return directory.status();
+  }
+  return std::unique_ptr<InputStager>(new InputStager(*directory));
+}
+
+InputStager::InputStager(const std::filesystem::path &directory)
+    : directory_(directory),
+      total_bytes_(0),
+      stream_fd_(-1) {}
+
+InputStager::~InputStager() {
+  if (stream_fd_ >= 0) {
+    close(stream_fd_);
+  }
+  if (!directory_.empty()) {
+    std::error_code error;
+    std::filesystem::remove_all(directory_, error);
+  }
+}
+
+std::filesystem::path InputStager::Release() {
+  std::filesystem::path directory;
+  directory.swap(directory_);
+  return directory;
+}
+
+absl::StatusOr<std::filesystem::path> InputStager::Resolve(
+    const std::string &path) {
+  absl::Status checked = InputWriter::CheckPath(path);
+  if (!checked.ok()) {
+    return checked;
+  }
+  std::filesystem::path relative(path);
+  if (std::find(paths_.begin(), paths_.end(), path) != paths_.end()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Input \"", path, "\" given twice"));
+  }
+  std::filesystem::path resolved = directory_ / relative.lexically_normal();
+  std::error_code error;
+  std::filesystem::create_directories(resolved.parent_path(), error);
+  if (error) {
+    return absl::InternalError(absl::StrCat(
+        "Could not create directory for ", path, ": ", error.message()));
+  }
+  return resolved;
+}
+
+absl::Status InputStager::CountBytes(uint64_t bytes) {
+  total_bytes_ += bytes;
+  if (total_bytes_ > FLAGS_max_upload_bytes) {
+    return absl::ResourceExhaustedError(absl::StrCat(
+        "Inputs are bigger than the maximum of ", FLAGS_max_upload_bytes,
+        " bytes"));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status InputStager::AddFile(const FileInfo &file) {
+  absl::Status closed = CloseStream();
+  if (!closed.ok()) {
+    return closed;
+  }
+  auto path = Resolve(file.path());
+  if (!path.ok()) {
+    return path.status();
+  }
+  paths_.push_back(file.path());
+
+  if (!file.blob_digest().empty()) {
+    return BlobStore::GetInstance().Materialise(file.blob_digest(), *path);
+  }
+  absl::Status counted = CountBytes(file.data().size());
+  if (!counted.ok()) {
+    return counted;
+  }
+  int fd = open(path->c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    return absl::InternalError(absl::StrCat(
+        "Could not create ", file.path(), ": ", strerror(errno)));
+  }
+  absl::Status written = WriteAll(fd, file.data());
+  close(fd);
+  return written;
+}
+
+absl::Status InputStager::Append(const FileChunk &chunk) {
+  if (chunk.path() != stream_path_ || stream_fd_ < 0) {
+    absl::Status closed = CloseStream();
+    if (!closed.ok()) {
+      return closed;
+    }
+    auto path = Resolve(chunk.path());
+    if (!path.ok()) {
+      return path.status();
+    }
+    stream_fd_ = open(path->c_str(),
+                      O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (stream_fd_ < 0) {
+      return absl::InternalError(absl::StrCat(
+          "Could not create ", chunk.path(), ": ", strerror(errno)));
+    }
+    paths_.push_back(chunk.path());
+    stream_path_ = chunk.path();
+  }
+  absl::Status counted = CountBytes(chunk.data().size());
+  if (!counted.ok()) {
+    return counted;
+  }
+  return WriteAll(stream_fd_, chunk.data());
+}
+
+absl::Status InputStager::Finish() {
+  return CloseStream();
+}
+
+absl::Status InputStager::CloseStream() {
+  if (stream_fd_ < 0) {
+    return absl::OkStatus();
+  }
+  int result = close(stream_fd_);
+  stream_fd_ = -1;
+  if (result != 0) {
+    return absl::InternalError(absl::StrCat(
+        "Could not write ", stream_path_, ": ", strerror(errno)));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace spiceserver
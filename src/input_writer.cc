@@ -0,0 +1,235 @@
+#include "input_writer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+
+#include "blob_store.h"
+#include "worker_pool.h"
+
+DEFINE_int32(input_write_threads, 4,
+             "The most WorkerPool threads that help write one job's inputs, "
+             "besides the job's own.");
+DEFINE_uint64(parallel_input_write_bytes, 32ULL << 20,
+              "Inputs smaller than this are written by one thread.");
+DEFINE_bool(preallocate_inputs, false,
+            "Reserve (fallocate) the space for each input file before "
+            "writing it, for filesystems that fragment otherwise.");
+
+namespace spiceserver {
+
+namespace {
+
+// Big files are split into pieces of this size.
+constexpr uint64_t kPieceBytes = 8 << 20;
+
+struct Piece {
+  int fd;
+  const std::string *data;
+  uint64_t offset;
+  uint64_t length;
+  const std::string *path;
+};
+
+// What the caller and its helpers share. Helpers hold a reference, since
+// they may start after the caller has finished.
+struct Work {
+  std::vector<Piece> pieces;
+  std::atomic<size_t> next_piece{0};
+
+  std::mutex mutex;
+  std::condition_variable idle;
+  // Set once the caller has stopped waiting for pieces; helpers that start
+  // after that mustn't touch them.
+  bool closed = false;
+  int helpers_writing = 0;
+  absl::Status status;
+};
+
+absl::Status WritePiece(const Piece &piece) {
+  const char *data = piece.data->data() + piece.offset;
+  uint64_t remaining = piece.length;
+  uint64_t offset = piece.offset;
+  while (remaining > 0) {
+    ssize_t written = pwrite(piece.fd, data, remaining, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return absl::InternalError(absl::StrCat(
+          "Could not write ", *piece.path, ": ", strerror(errno)));
+    }
+    data += written;
+    offset += written;
+    remaining -= written;
+  }
+  return absl::OkStatus();
+}
+
+void WritePieces(Work *work) {
+  while (true) {
+    size_t index = work->next_piece.fetch_add(1);
+    if (index >= work->pieces.size()) {
+      return;
+    }
+    absl::Status status = WritePiece(work->pieces[index]);
+    if (!status.ok()) {
+      std::lock_guard<std::mutex> lock(work->mutex);
+      work->status.Update(status);
+      // Nobody else need bother.
+      work->next_piece = work->pieces.size();
+      return;
+    }
+  }
+}
+
+void Help(std::shared_ptr<Work> work) {
+  {
+    std::lock_guard<std::mutex> lock(work->mutex);
+    if (work->closed) {
+      return;
+    }
+    ++work->helpers_writing;
+  }
+  WritePieces(work.get());
+  {
+    std::lock_guard<std::mutex> lock(work->mutex);
+    --work->helpers_writing;
+  }
+  work->idle.notify_all();
+}
+
+}   // namespace
+
+absl::Status InputWriter::CheckPath(const std::string &path) {
+  std::filesystem::path relative(path);
+  if (path.empty() || relative.is_absolute() ||
+      std::any_of(relative.begin(), relative.end(),
+                  [](const std::filesystem::path &part) {
+                    return part == "..";
+                  })) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Input path \"", path, "\" is not inside the job directory"));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status InputWriter::Write(const std::filesystem::path &directory,
+                                const Files &files) {
+  for (const FileInfo &file : files) {
+    absl::Status checked = CheckPath(file.path());
+    if (!checked.ok()) {
+      return checked;
+    }
+  }
+
+  // Parents first, since a set of paths sorts them that way; then each
+  // create_directories finds all but the last part made already.
+  std::set<std::filesystem::path> parents;
+  for (const FileInfo &file : files) {
+    std::filesystem::path parent =
+        std::filesystem::path(file.path()).parent_path();
+    if (!parent.empty()) {
+      parents.insert(parent);
+    }
+  }
+  for (const std::filesystem::path &parent : parents) {
+    std::error_code error;
+    std::filesystem::create_directories(directory / parent, error);
+    if (error) {
+      return absl::InternalError(absl::StrCat(
+          "Could not create ", parent.string(), ": ", error.message()));
+    }
+  }
+
+  int directory_fd = open(directory.c_str(),
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory_fd < 0) {
+    return absl::InternalError(absl::StrCat(
+        "Could not open ", directory.string(), ": ", strerror(errno)));
+  }
+
+  auto work = std::make_shared<Work>();
+  std::vector<int> fds;
+  uint64_t total_bytes = 0;
+  absl::Status status;
+  for (const FileInfo &file : files) {
+    if (!file.blob_digest().empty()) {
+      status = BlobStore::GetInstance().Materialise(
+          file.blob_digest(), directory / file.path());
+      if (!status.ok()) {
+        break;
+      }
+      continue;
+    }
+    int fd = openat(directory_fd, file.path().c_str(),
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      status = absl::InternalError(absl::StrCat(
+          "Could not create ", file.path(), ": ", strerror(errno)));
+      break;
+    }
+    fds.push_back(fd);
+    uint64_t size = file.data().size();
+    total_bytes += size;
+    // Not all filesystems can; writing works regardless.
+    if (FLAGS_preallocate_inputs && size > 0) {
+      posix_fallocate(fd, 0, size);
+    }
+    for (uint64_t offset = 0; offset < size; offset += kPieceBytes) {
+      work->pieces.push_back(Piece {
+          fd, &file.data(), offset, std::min(kPieceBytes, size - offset),
+          &file.path()});
+    }
+  }
+  close(directory_fd);
+
+  if (status.ok()) {
+    if (total_bytes >= FLAGS_parallel_input_write_bytes &&
+        work->pieces.size() > 1) {
+      int helpers = std::min<int>(FLAGS_input_write_threads,
+                                  work->pieces.size() - 1);
+      for (int i = 0; i < helpers; ++i) {
+        WorkerPool::GetInstance().Post([work]() { Help(work); });
+      }
+    }
+    WritePieces(work.get());
+
+    std::unique_lock<std::mutex> lock(work->mutex);
+    work->closed = true;
+    work->idle.wait(lock, [&work]() { return work->helpers_writing == 0; });
+    status = work->status;
+  }
+
+  for (int fd : fds) {
+    if (close(fd) != 0 && status.ok()) {
+      status = absl::InternalError(absl::StrCat(
+          "Could not write inputs: ", strerror(errno)));
+    }
+  }
+  if (status.ok()) {
+    LOG(INFO) << "Wrote " << files.size() << " input files ("
+              << total_bytes << " bytes) to " << directory;
+  }
+  return status;
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,355 @@
+#include "job_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <queue>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/strip.h>
+
+DEFINE_int32(job_slots, 0,
+             "How many slots (cores' worth of simulation) this host has. Jobs "
+             "wait in a queue until enough are free. 0 for one per core.");
+DEFINE_string(flavour_slots, "",
+              "Limits on the slots used by each flavour at once, e.g. "
+              "\"XYCE=8,NGSPICE=4\". Flavours not mentioned may use all of "
+              "them.");
+
+namespace spiceserver {
+
+namespace {
+
+// Weight of the latest run in the moving average of run time.
+constexpr double kRunTimeSmoothing = 0.2;
+
+int HostSlotsFromFlags() {
+  if (FLAGS_job_slots > 0) {
+    return FLAGS_job_slots;
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+std::map<Flavour, int> FlavourSlotsFromFlags() {
+  auto flavour_slots = JobScheduler::ParseFlavourSlots(FLAGS_flavour_slots);
+  if (!flavour_slots.ok()) {
+    LOG(ERROR) << "Ignoring --flavour_slots: " << flavour_slots.status();
+    return {};
+  }
+  return *flavour_slots;
+}
+
+}   // namespace
+
+JobScheduler &JobScheduler::GetInstance() {
+  static JobScheduler instance(HostSlotsFromFlags(), FlavourSlotsFromFlags());
+  return instance;
+}
+
+absl::StatusOr<std::map<Flavour, int>> JobScheduler::ParseFlavourSlots(
+    const std::string &spec) {
+  std::map<Flavour, int> flavour_slots;
+  for (absl::string_view entry : absl::StrSplit(spec, ',', absl::SkipEmpty())) {
+    std::vector<std::string> parts = absl::StrSplit(entry, '=');
+    Flavour flavour;
+    int slots;
+    if (parts.size() != 2 ||
+        !Flavour_Parse(std::string(absl::StripAsciiWhitespace(parts[0])),
+                       &flavour) ||
+        !absl::SimpleAtoi(parts[1], &slots) ||
+        slots <= 0) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Bad flavour slots entry: \"", entry, "\""));
+    }
+    flavour_slots[flavour] = slots;
+  }
+  return flavour_slots;
+}
+
+JobScheduler::JobScheduler(int host_slots,
+                           const std::map<Flavour, int> &flavour_slots)
+    : host_slots_(std::max(host_slots, 1)),
+      flavour_slots_(flavour_slots),
+      next_id_(1),
+      free_slots_(host_slots_) {
+  LOG(INFO) << "Job scheduler has " << host_slots_ << " slots";
+}
+
+JobScheduler::Ticket::Ticket(JobScheduler *scheduler,
+                             const JobRequest &request,
+                             uint64_t id)
+    : scheduler_(scheduler),
+      request_(request),
+      id_(id),
+      enqueued_at_(Clock::now()),
+      admitted_(false) {}
+
+JobScheduler::Ticket::~Ticket() {
+  std::vector<std::function<void()>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(scheduler_->mutex_);
+    scheduler_->Release(this, &callbacks);
+  }
+  RunCallbacks(callbacks);
+}
+
+bool JobScheduler::Ticket::WaitForAdmission(
+    std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(scheduler_->mutex_);
+  return scheduler_->changed_.wait_for(
+      lock, timeout, [this]() { return admitted_; });
+}
+
+void JobScheduler::Ticket::OnAdmitted(std::function<void()> callback) {
+  {
+    std::lock_guard<std::mutex> lock(scheduler_->mutex_);
+    if (!admitted_) {
+      on_admitted_ = std::move(callback);
+      return;
+    }
+  }
+  callback();
+}
+
+bool JobScheduler::Ticket::admitted() const {
+  std::lock_guard<std::mutex> lock(scheduler_->mutex_);
+  return admitted_;
+}
+
+QueueStatus JobScheduler::Ticket::Status() const {
+  std::lock_guard<std::mutex> lock(scheduler_->mutex_);
+  return scheduler_->StatusOf(this);
+}
+
+void JobScheduler::Ticket::Finished() {
+  std::lock_guard<std::mutex> lock(scheduler_->mutex_);
+  if (!admitted_) {
+    return;
+  }
+  double seconds = std::chrono::duration<double>(
+      Clock::now() - admitted_at_).count();
+  auto it = scheduler_->mean_run_seconds_.find(request_.flavour);
+  if (it == scheduler_->mean_run_seconds_.end()) {
+    scheduler_->mean_run_seconds_[request_.flavour] = seconds;
+  } else {
+    it->second += kRunTimeSmoothing * (seconds - it->second);
+  }
+}
+
+std::unique_ptr<JobScheduler::Ticket> JobScheduler::Enqueue(
+    const JobRequest &request) {
+  std::unique_ptr<Ticket> ticket;
+  std::vector<std::function<void()>> callbacks;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A job that needs more than its flavour may ever hold would wait
+    // forever, so it gets the most it can.
+    int max_slots = host_slots_;
+    auto limit = flavour_slots_.find(request.flavour);
+    if (limit != flavour_slots_.end()) {
+      max_slots = std::min(max_slots, limit->second);
+    }
+    JobRequest clamped = request;
+    clamped.slots = std::clamp(request.slots, 1, std::max(max_slots, 1));
+    ticket.reset(new Ticket(this, clamped, next_id_++));
+    waiting_.push_back(ticket.get());
+    Admit(&callbacks);
+  }
+  RunCallbacks(callbacks);
+  return ticket;
+}
+
+void JobScheduler::RunCallbacks(
+    const std::vector<std::function<void()>> &callbacks) {
+  for (const auto &callback : callbacks) {
+    callback();
+  }
+}
+
+bool JobScheduler::Ranks(const Ticket *a, const Ticket *b) const {
+  if (a->request_.priority != b->request_.priority) {
+    return a->request_.priority > b->request_.priority;
+  }
+  auto running_slots = [this](const std::string &client) {
+    auto it = client_running_slots_.find(client);
+    return it == client_running_slots_.end() ? 0 : it->second;
+  };
+  int a_running = running_slots(a->request_.client);
+  int b_running = running_slots(b->request_.client);
+  if (a_running != b_running) {
+    return a_running < b_running;
+  }
+  return a->id_ < b->id_;
+}
+
+std::list<JobScheduler::Ticket*> JobScheduler::RankedWaiting() const {
+  std::list<Ticket*> ranked = waiting_;
+  ranked.sort([this](const Ticket *a, const Ticket *b) {
+    return Ranks(a, b);
+  });
+  return ranked;
+}
+
+int JobScheduler::RunningSlots(Flavour flavour) const {
+  int slots = 0;
+  for (const auto &entry : running_) {
+    if (entry.second.flavour == flavour) {
+      slots += entry.second.slots;
+    }
+  }
+  return slots;
+}
+
+void JobScheduler::Admit(std::vector<std::function<void()>> *callbacks) {
+  bool admitted_any = false;
+  bool admitted_one = true;
+  // Each admission changes the fair share ranking, so start again after each.
+  while (admitted_one && free_slots_ > 0) {
+    admitted_one = false;
+    for (Ticket *ticket : RankedWaiting()) {
+      const JobRequest &request = ticket->request_;
+      auto limit = flavour_slots_.find(request.flavour);
+      if (limit != flavour_slots_.end() &&
+          RunningSlots(request.flavour) + request.slots > limit->second) {
+        // Only this flavour is full; others may go ahead.
+        continue;
+      }
+      if (request.slots > free_slots_) {
+        // Hold the slots that are free for this job.
+        break;
+      }
+
+      waiting_.remove(ticket);
+      free_slots_ -= request.slots;
+      client_running_slots_[request.client] += request.slots;
+      ticket->admitted_ = true;
+      ticket->admitted_at_ = Clock::now();
+      running_[ticket->id_] = RunningJob {
+        request.flavour, request.slots, ticket->admitted_at_};
+      if (ticket->on_admitted_) {
+        callbacks->push_back(std::move(ticket->on_admitted_));
+        ticket->on_admitted_ = nullptr;
+      }
+      admitted_one = true;
+      admitted_any = true;
+      break;
+    }
+  }
+  if (admitted_any) {
+    changed_.notify_all();
+  }
+}
+
+void JobScheduler::Release(Ticket *ticket,
+                           std::vector<std::function<void()>> *callbacks) {
+  if (!ticket->admitted_) {
+    waiting_.remove(ticket);
+  } else {
+    running_.erase(ticket->id_);
+    free_slots_ += ticket->request_.slots;
+    auto it = client_running_slots_.find(ticket->request_.client);
+    if (it != client_running_slots_.end()) {
+      it->second -= ticket->request_.slots;
+      if (it->second <= 0) {
+        client_running_slots_.erase(it);
+      }
+    }
+  }
+  // Either way, everyone behind has moved up.
+  Admit(callbacks);
+  changed_.notify_all();
+}
+
+std::optional<std::chrono::duration<double>> JobScheduler::ExpectedDuration(
+    Flavour flavour) const {
+  auto it = mean_run_seconds_.find(flavour);
+  if (it != mean_run_seconds_.end()) {
+    return std::chrono::duration<double>(it->second);
+  }
+  // Nothing of this flavour has finished yet; guess from the others.
+  if (mean_run_seconds_.empty()) {
+    return std::nullopt;
+  }
+  double total = 0;
+  for (const auto &entry : mean_run_seconds_) {
+    total += entry.second;
+  }
+  return std::chrono::duration<double>(total / mean_run_seconds_.size());
+}
+
+QueueStatus JobScheduler::StatusOf(const Ticket *ticket) const {
+  QueueStatus status_pb;
+  status_pb.set_running_jobs(running_.size());
+  status_pb.set_queued_jobs(waiting_.size());
+  status_pb.set_host_slots(host_slots_);
+  status_pb.set_free_slots(free_slots_);
+  if (ticket->admitted_) {
+    return status_pb;
+  }
+
+  std::list<Ticket*> ranked = RankedWaiting();
+  uint32_t position = 0;
+  for (const Ticket *other : ranked) {
+    if (other == ticket) {
+      break;
+    }
+    ++position;
+  }
+  status_pb.set_position(position);
+
+  // Estimate the start time by playing out the queue ahead of us, assuming
+  // every job takes its flavour's average time. Each entry is when a slot
+  // becomes free, in seconds from now.
+  Clock::time_point now = Clock::now();
+  std::priority_queue<double, std::vector<double>, std::greater<double>>
+      free_at;
+  for (int i = 0; i < free_slots_; ++i) {
+    free_at.push(0);
+  }
+  for (const auto &entry : running_) {
+    auto duration = ExpectedDuration(entry.second.flavour);
+    if (!duration) {
+      return status_pb;
+    }
+    double remaining = std::max(0.0, std::chrono::duration<double>(
+        entry.second.admitted_at + std::chrono::duration_cast<
+            Clock::duration>(*duration) - now).count());
+    for (int i = 0; i < entry.second.slots; ++i) {
+      free_at.push(remaining);
+    }
+  }
+
+  for (const Ticket *other : ranked) {
+    double start = 0;
+    for (int i = 0; i < other->request_.slots && !free_at.empty(); ++i) {
+      start = free_at.top();
+      free_at.pop();
+    }
+    if (other == ticket) {
+      status_pb.set_estimated_start_seconds(start);
+      status_pb.set_has_estimate(true);
+      break;
+    }
+    auto duration = ExpectedDuration(other->request_.flavour);
+    if (!duration) {
+      return status_pb;
+    }
+    for (int i = 0; i < other->request_.slots; ++i) {
+      free_at.push(start + duration->count());
+    }
+  }
+  return status_pb;
+}
+
+}  // namespace spiceserver
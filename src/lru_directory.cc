@@ -0,0 +1,134 @@
+#include "lru_directory.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+
+namespace spiceserver {
+
+namespace {
+
+// A file's size, or the total of the files in a directory.
+uint64_t SizeOf(const std::filesystem::directory_entry &entry,
+                std::error_code &error) {
+  if (!entry.is_directory(error)) {
+    return entry.file_size(error);
+  }
+  uint64_t size = 0;
+  for (const auto &file :
+           std::filesystem::directory_iterator(entry.path(), error)) {
+    size += file.file_size(error);
+  }
+  return size;
+}
+
+}   // namespace
+
+LruDirectory::LruDirectory()
+    : max_bytes_(0),
+      total_bytes_(0) {}
+
+absl::Status LruDirectory::Open(const std::filesystem::path &directory,
+                                uint64_t max_bytes,
+                                const IsEntry &is_entry,
+                                const std::set<std::string> &ignore) {
+  directory_.clear();
+  entries_.clear();
+  lru_.clear();
+  pinned_.clear();
+  total_bytes_ = 0;
+  max_bytes_ = max_bytes;
+  if (directory.empty()) {
+    return absl::OkStatus();
+  }
+
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  if (error) {
+    return absl::UnavailableError(absl::StrCat(
+        "Could not create ", directory.string(), ": ", error.message()));
+  }
+
+  std::vector<std::tuple<std::filesystem::file_time_type, std::string,
+                         uint64_t>> found;
+  for (const auto &entry :
+           std::filesystem::directory_iterator(directory, error)) {
+    std::string name = entry.path().filename().string();
+    if (ignore.count(name) > 0) {
+      continue;
+    }
+    if (!is_entry(entry)) {
+      std::filesystem::remove_all(entry.path(), error);
+      continue;
+    }
+    uint64_t size = SizeOf(entry, error);
+    found.emplace_back(entry.last_write_time(error), name, size);
+  }
+  if (error) {
+    return absl::UnavailableError(absl::StrCat(
+        "Could not read ", directory.string(), ": ", error.message()));
+  }
+  std::sort(found.begin(), found.end());
+
+  directory_ = directory;
+  for (const auto &[modified, key, size] : found) {
+    lru_.push_back(key);
+    entries_[key] = Entry {size, std::prev(lru_.end())};
+    total_bytes_ += size;
+  }
+  Evict();
+  return absl::OkStatus();
+}
+
+bool LruDirectory::Contains(const std::string &key) const {
+  return entries_.count(key) > 0;
+}
+
+bool LruDirectory::Touch(const std::string &key) {
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return false;
+  }
+  lru_.splice(lru_.end(), lru_, it->second.lru_position);
+  return true;
+}
+
+void LruDirectory::Add(const std::string &key, uint64_t size) {
+  Remove(key);
+  lru_.push_back(key);
+  entries_[key] = Entry {size, std::prev(lru_.end())};
+  total_bytes_ += size;
+  Evict();
+}
+
+void LruDirectory::Remove(const std::string &key) {
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return;
+  }
+  total_bytes_ -= it->second.size;
+  lru_.erase(it->second.lru_position);
+  entries_.erase(it);
+}
+
+void LruDirectory::Evict() {
+  auto it = lru_.begin();
+  while (total_bytes_ > max_bytes_ && it != lru_.end()) {
+    std::string key = *it++;
+    if (pinned_.count(key) > 0) {
+      continue;
+    }
+    Remove(key);
+    std::error_code error;
+    std::filesystem::remove_all(PathFor(key), error);
+  }
+}
+
+}  // namespace spiceserver
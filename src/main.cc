@@ -10,9 +10,15 @@
 
 #include "utility.h"
 
-#include "embedded_python_netlister.h"
+#include "blob_store.h"
+#include "cgroup_manager.h"
+#include "netlister_pool.h"
+#include "result_cache.h"
+#include "result_store.h"
 #include "simulator_service.h"
 #include "simulator_registry.h"
+#include "spawn_helper.h"
+#include "subprocess.h"
 #include "proto/spice_simulator.pb.h"
 
 // Define command line flags
@@ -42,6 +48,24 @@ int main(int argc, char **argv) {
   google::InitGoogleLogging(argv[0]);
   FLAGS_logtostderr = true;
 
+  if (spiceserver::NetlisterPool::IsWorkerProcess()) {
+    return spiceserver::NetlisterPool::ServeWorker();
+  }
+
+  // These have to happen before anything starts threads or loads Python.
+  auto cgroups = spiceserver::CgroupManager::GetInstance().Initialise();
+  LOG_IF(WARNING, !cgroups.ok())
+      << "Could not set up job cgroups, simulators will run without them: "
+      << cgroups;
+
+  if (spiceserver::Subprocess::DefaultSpawnMethod() ==
+          spiceserver::Subprocess::SpawnMethod::HELPER) {
+    auto status = spiceserver::SpawnHelper::GetInstance().Start();
+    LOG_IF(WARNING, !status.ok())
+        << "Could not start spawn helper, simulators will be spawned "
+        << "directly: " << status;
+  }
+
   spiceserver::SimulatorRegistry &registry =
       spiceserver::SimulatorRegistry::GetInstance();
 
@@ -58,6 +82,25 @@ int main(int argc, char **argv) {
 
   LOG(INFO) << "Installed: " << std::endl << registry.ReportInstalled();
 
+  auto result_cache = spiceserver::ResultCache::GetInstance().Initialise();
+  LOG_IF(WARNING, !result_cache.ok())
+      << "Could not open result cache, results will not be cached: "
+      << result_cache;
+
+  auto blob_store = spiceserver::BlobStore::GetInstance().Initialise();
+  LOG_IF(WARNING, !blob_store.ok())
+      << "Could not open blob store, blobs will not be accepted: "
+      << blob_store;
+
+  auto result_store = spiceserver::ResultStore::GetInstance().Initialise();
+  LOG_IF(WARNING, !result_store.ok())
+      << "Could not open result store, waveforms will not be stored: "
+      << result_store;
+
+  // Python, and the netlister workers, are only started on the first VLSIR
+  // input the native netlister is off for or can't handle (see
+  // SimulatorManager).
+
   std::string server_address = absl::StrCat("0.0.0.0:", FLAGS_port);
 
   LOG(INFO) << "Starting SpiceServer service...";
@@ -0,0 +1,255 @@
+#include "measurement_evaluator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
+
+namespace spiceserver {
+
+namespace {
+
+// The value of y at x = at, by linear interpolation; held flat beyond the
+// ends.
+double Interpolate(const double *x, const double *y, uint64_t num_points,
+                   double at) {
+  uint64_t i = std::upper_bound(x, x + num_points, at) - x;
+  if (i == 0) {
+    return y[0];
+  }
+  if (i == num_points) {
+    return y[num_points - 1];
+  }
+  double width = x[i] - x[i - 1];
+  if (width <= 0) {
+    return y[i];
+  }
+  return y[i - 1] + (y[i] - y[i - 1]) * (at - x[i - 1]) / width;
+}
+
+}   // namespace
+
+absl::Status MeasurementEvaluator::Validate(
+    const google::protobuf::RepeatedPtrField<Measurement> &measurements) {
+  for (const Measurement &measurement : measurements) {
+    if (measurement.name().empty()) {
+      return absl::InvalidArgumentError("Measurements need a name");
+    }
+    auto invalid = [&measurement](const std::string &why) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Measurement ", measurement.name(), ": ", why));
+    };
+    switch (measurement.kind()) {
+      case Measurement::DELAY:
+        if (measurement.target().signal().empty()) {
+          return invalid("target signal is required");
+        }
+        [[fallthrough]];
+      case Measurement::CROSS:
+        if (measurement.trigger().signal().empty()) {
+          return invalid("trigger signal is required");
+        }
+        break;
+      case Measurement::AVERAGE:
+      case Measurement::INTEGRAL:
+      case Measurement::MIN:
+      case Measurement::MAX:
+        if (measurement.signal().empty()) {
+          return invalid("signal is required");
+        }
+        break;
+      default:
+        return invalid("kind is required");
+    }
+    if (measurement.has_from() && measurement.has_to() &&
+        measurement.from() > measurement.to()) {
+      return invalid("from is after to");
+    }
+  }
+  return absl::OkStatus();
+}
+
+MeasurementEvaluator::MeasurementEvaluator(const RawfileReader &reader)
+    : reader_(reader) {}
+
+const std::vector<double> &MeasurementEvaluator::Column(size_t plot,
+                                                        size_t signal) {
+  std::vector<double> &column = columns_[{plot, signal}];
+  uint64_t num_points = reader_.plots()[plot].num_points;
+  if (column.size() != num_points) {
+    column.resize(num_points);
+    reader_.ReadSignal(plot, signal, 0, num_points, column.data());
+  }
+  return column;
+}
+
+absl::StatusOr<MeasurementEvaluator::Trace> MeasurementEvaluator::Find(
+    const Measurement &measurement, const std::string &signal) {
+  const std::vector<RawfileReader::Plot> &plots = reader_.plots();
+  for (size_t plot = 0; plot < plots.size(); ++plot) {
+    const RawfileReader::Plot &source = plots[plot];
+    if (!measurement.plot().empty() && source.name != measurement.plot()) {
+      continue;
+    }
+    auto it = std::find_if(
+        source.signals.begin(), source.signals.end(),
+        [&signal](const WaveformSignal &candidate) {
+          return candidate.name() == signal;
+        });
+    if (it == source.signals.end()) {
+      continue;
+    }
+    if (source.complex) {
+      return absl::UnimplementedError(absl::StrCat(
+          "Plot ", source.name, " is complex, which can't be measured"));
+    }
+    if (source.num_points == 0) {
+      return absl::OutOfRangeError(absl::StrCat(
+          "Plot ", source.name, " has no points"));
+    }
+    Trace trace;
+    trace.x = Column(plot, 0).data();
+    trace.y = Column(plot, it - source.signals.begin()).data();
+    trace.num_points = source.num_points;
+    double first = trace.x[0];
+    double last = trace.x[trace.num_points - 1];
+    trace.from = measurement.has_from() ?
+        std::max(measurement.from(), first) : first;
+    trace.to = measurement.has_to() ? std::min(measurement.to(), last) : last;
+    if (trace.from > trace.to) {
+      return absl::OutOfRangeError(absl::StrCat(
+          "Window is outside the simulated [", first, ", ", last, "]"));
+    }
+    return trace;
+  }
+  return absl::NotFoundError(absl::StrCat(
+      "No signal ", signal,
+      measurement.plot().empty() ? "" : " in plot " + measurement.plot()));
+}
+
+absl::StatusOr<double> MeasurementEvaluator::Cross(
+    const Measurement &measurement, const Crossing &crossing) {
+  auto found = Find(measurement, crossing.signal());
+  if (!found.ok()) {
+    return found.status();
+  }
+  const Trace &trace = *found;
+  const double *x = trace.x;
+  const double *y = trace.y;
+  uint64_t first = std::lower_bound(x, x + trace.num_points, trace.from) - x;
+  uint64_t end = std::upper_bound(x, x + trace.num_points, trace.to) - x;
+
+  // The window's points, with its ends (interpolated) added.
+  double previous_x = trace.from;
+  double previous = Interpolate(x, y, trace.num_points, trace.from) -
+      crossing.threshold();
+  uint32_t wanted = std::max<uint32_t>(1, crossing.occurrence());
+  uint32_t seen = 0;
+  for (uint64_t i = first; i <= end; ++i) {
+    double point_x = i < end ? x[i] : trace.to;
+    double current = (i < end ? y[i] :
+        Interpolate(x, y, trace.num_points, trace.to)) - crossing.threshold();
+    bool rise = previous < 0 && current >= 0;
+    bool fall = previous > 0 && current <= 0;
+    bool match = crossing.edge() == Crossing::RISE ? rise :
+        crossing.edge() == Crossing::FALL ? fall : rise || fall;
+    if (match && ++seen == wanted) {
+      return previous_x +
+          (point_x - previous_x) * -previous / (current - previous);
+    }
+    previous_x = point_x;
+    previous = current;
+  }
+  return absl::NotFoundError(absl::StrCat(
+      crossing.signal(), " crosses ", crossing.threshold(), " ", seen,
+      " times, not ", wanted));
+}
+
+MeasurementResult MeasurementEvaluator::Evaluate(
+    const Measurement &measurement) {
+  MeasurementResult result;
+  result.set_name(measurement.name());
+  absl::StatusOr<double> value;
+
+  switch (measurement.kind()) {
+    case Measurement::CROSS:
+      value = Cross(measurement, measurement.trigger());
+      break;
+    case Measurement::DELAY: {
+      auto trigger = Cross(measurement, measurement.trigger());
+      auto target = Cross(measurement, measurement.target());
+      if (!trigger.ok()) {
+        value = trigger.status();
+      } else if (!target.ok()) {
+        value = target.status();
+      } else {
+        value = *target - *trigger;
+      }
+      break;
+    }
+    default: {
+      auto found = Find(measurement, measurement.signal());
+      if (!found.ok()) {
+        value = found.status();
+        break;
+      }
+      const Trace &trace = *found;
+      const double *x = trace.x;
+      const double *y = trace.y;
+      uint64_t first =
+          std::lower_bound(x, x + trace.num_points, trace.from) - x;
+      uint64_t end = std::upper_bound(x, x + trace.num_points, trace.to) - x;
+      double at_from = Interpolate(x, y, trace.num_points, trace.from);
+      double at_to = Interpolate(x, y, trace.num_points, trace.to);
+
+      if (measurement.kind() == Measurement::MIN ||
+          measurement.kind() == Measurement::MAX) {
+        double low = std::min(at_from, at_to);
+        double high = std::max(at_from, at_to);
+        for (uint64_t i = first; i < end; ++i) {
+          low = std::min(low, y[i]);
+          high = std::max(high, y[i]);
+        }
+        value = measurement.kind() == Measurement::MIN ? low : high;
+        break;
+      }
+
+      // Trapezoids between the window's points, then the pieces at its
+      // ends.
+      double sum = 0;
+      for (uint64_t i = first; i + 1 < end; ++i) {
+        sum += (x[i + 1] - x[i]) * (y[i] + y[i + 1]);
+      }
+      if (first < end) {
+        sum += (x[first] - trace.from) * (at_from + y[first]) +
+            (trace.to - x[end - 1]) * (y[end - 1] + at_to);
+      } else {
+        sum += (trace.to - trace.from) * (at_from + at_to);
+      }
+      double integral = sum / 2;
+
+      if (measurement.kind() == Measurement::INTEGRAL) {
+        value = integral;
+      } else {
+        value = trace.to > trace.from ?
+            integral / (trace.to - trace.from) : at_from;
+      }
+      break;
+    }
+  }
+
+  if (value.ok()) {
+    result.set_value(*value);
+  } else {
+    result.set_error(std::string(value.status().message()));
+  }
+  return result;
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,839 @@
+#include "native_netlister.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
+#include <absl/strings/string_view.h>
+
+#include "sha256.h"
+#include "subcircuit_cache.h"
+#include "proto/spice_simulator.pb.h"
+#include "vlsir/circuit.pb.h"
+#include "vlsir/spice.pb.h"
+#include "vlsir/utils.pb.h"
+
+DEFINE_bool(native_netlister, true,
+            "Netlist VLSIR inputs for Xyce and ngspice in C++, falling back "
+            "to the Python netlister only for what it can't do.");
+
+namespace spiceserver {
+
+namespace {
+
+using vlsir::circuit::ConnectionTarget;
+using vlsir::circuit::ExternalModule;
+using vlsir::circuit::Instance;
+using vlsir::circuit::Module;
+using vlsir::circuit::Package;
+using vlsir::circuit::Port;
+using vlsir::spice::Control;
+using vlsir::spice::SimInput;
+using vlsir::utils::Param;
+using vlsir::utils::ParamValue;
+
+// When writing to a file, output is written out in pieces of about this
+// size.
+constexpr size_t kBufferBytes = 64 * 1024;
+
+constexpr char kPrimitivesDomain[] = "vlsir.primitives";
+
+// Changing how modules are written (or what goes into their keys) should
+// change this, so that old text is never mistaken for new.
+constexpr char kKeyVersion[] = "spiceserver-subcircuit-1";
+
+// Collects the netlist, either in a string or (whenever its buffer fills) in
+// a file.
+class NetlistWriter {
+ public:
+  explicit NetlistWriter(std::string *out) : out_(out), fd_(-1) {}
+  explicit NetlistWriter(int fd) : out_(&buffer_), fd_(fd) {}
+
+  template <typename... Args>
+  void Line(const Args&... args) {
+    absl::StrAppend(out_, args..., "\n");
+    MaybeFlush();
+  }
+
+  void Append(absl::string_view text) {
+    out_->append(text.data(), text.size());
+    MaybeFlush();
+  }
+
+  // Writes out what's buffered; returns the first error, if there has been
+  // one.
+  absl::Status Flush() {
+    absl::string_view data = *out_;
+    while (fd_ >= 0 && status_.ok() && !data.empty()) {
+      ssize_t written = write(fd_, data.data(), data.size());
+      if (written < 0) {
+        if (errno != EINTR) {
+          status_ = absl::InternalError(absl::StrCat(
+              "Could not write netlist: ", strerror(errno)));
+        }
+        continue;
+      }
+      data.remove_prefix(written);
+    }
+    if (fd_ >= 0) {
+      out_->clear();
+    }
+    return status_;
+  }
+
+ private:
+  void MaybeFlush() {
+    if (fd_ >= 0 && out_->size() >= kBufferBytes) {
+      // Errors are kept until the last Flush().
+      Flush().IgnoreError();
+    }
+  }
+
+  std::string *out_;
+  std::string buffer_;
+  int fd_;
+  absl::Status status_;
+};
+
+// The shortest form that reads back as the same double.
+std::string FormatNumber(double value) {
+  char text[32];
+  auto result = std::to_chars(text, text + sizeof(text), value);
+  return std::string(text, result.ptr);
+}
+
+int PrefixExponent(vlsir::utils::SIPrefix prefix) {
+  switch (prefix) {
+    case vlsir::utils::YOCTO: return -24;
+    case vlsir::utils::ZEPTO: return -21;
+    case vlsir::utils::ATTO: return -18;
+    case vlsir::utils::FEMTO: return -15;
+    case vlsir::utils::PICO: return -12;
+    case vlsir::utils::NANO: return -9;
+    case vlsir::utils::MICRO: return -6;
+    case vlsir::utils::MILLI: return -3;
+    case vlsir::utils::CENTI: return -2;
+    case vlsir::utils::DECI: return -1;
+    case vlsir::utils::DECA: return 1;
+    case vlsir::utils::HECTO: return 2;
+    case vlsir::utils::KILO: return 3;
+    case vlsir::utils::MEGA: return 6;
+    case vlsir::utils::GIGA: return 9;
+    case vlsir::utils::TERA: return 12;
+    case vlsir::utils::PETA: return 15;
+    case vlsir::utils::EXA: return 18;
+    case vlsir::utils::ZETTA: return 21;
+    case vlsir::utils::YOTTA: return 24;
+    default: return 0;
+  }
+}
+
+absl::StatusOr<std::string> FormatValue(const ParamValue &value) {
+  switch (value.value_case()) {
+    case ParamValue::kBoolValue:
+      return std::string(value.bool_value() ? "1" : "0");
+    case ParamValue::kInt64Value:
+      return absl::StrCat(value.int64_value());
+    case ParamValue::kDoubleValue:
+      return FormatNumber(value.double_value());
+    case ParamValue::kStringValue:
+      return value.string_value();
+    case ParamValue::kLiteral:
+      return value.literal();
+    case ParamValue::kPrefixed: {
+      const vlsir::utils::Prefixed &prefixed = value.prefixed();
+      double scale = std::pow(10.0, PrefixExponent(prefixed.prefix()));
+      switch (prefixed.number_case()) {
+        case vlsir::utils::Prefixed::kInt64Value:
+          return FormatNumber(prefixed.int64_value() * scale);
+        case vlsir::utils::Prefixed::kDoubleValue:
+          return FormatNumber(prefixed.double_value() * scale);
+        default:
+          return absl::UnimplementedError("Non-numeric prefixed value");
+      }
+    }
+    default:
+      return absl::InvalidArgumentError("Parameter has no value");
+  }
+}
+
+absl::StatusOr<std::string> FormatParams(
+    const google::protobuf::RepeatedPtrField<Param> &params) {
+  std::vector<std::string> formatted;
+  for (const Param &param : params) {
+    auto value = FormatValue(param.value());
+    if (!value.ok()) {
+      return absl::Status(value.status().code(), absl::StrCat(
+          "Parameter ", param.name(), ": ", value.status().message()));
+    }
+    formatted.push_back(absl::StrCat(param.name(), "=", *value));
+  }
+  return absl::StrJoin(formatted, " ");
+}
+
+// A primitive parameter written after the nodes: just its value, or after a
+// keyword.
+struct PrimitiveParam {
+  const char *name;
+  const char *keyword;
+};
+
+struct Primitive {
+  const char *name;
+  const char *prefix;
+  std::vector<const char*> ports;
+  std::vector<PrimitiveParam> params;
+};
+
+const std::vector<Primitive> &Primitives() {
+  static const std::vector<Primitive> primitives = {
+    {"resistor", "r", {"p", "n"}, {{"r", nullptr}}},
+    {"capacitor", "c", {"p", "n"}, {{"c", nullptr}}},
+    {"inductor", "l", {"p", "n"}, {{"l", nullptr}}},
+    {"vdc", "v", {"p", "n"}, {{"dc", "dc"}, {"ac", "ac"}}},
+    {"isource", "i", {"p", "n"}, {{"dc", "dc"}}},
+    {"vcvs", "e", {"p", "n", "cp", "cn"}, {{"gain", nullptr}}},
+    {"vccs", "g", {"p", "n", "cp", "cn"}, {{"gain", nullptr}}},
+  };
+  return primitives;
+}
+
+// What an instance is of: how to start its line, its ports (and their
+// widths) in order, and what to write after the nodes.
+struct Target {
+  std::string prefix;
+  std::vector<std::pair<std::string, int64_t>> ports;
+  // Empty for primitives.
+  std::string model;
+  const Primitive *primitive = nullptr;
+};
+
+absl::StatusOr<std::string> SpiceTypePrefix(vlsir::circuit::SpiceType type) {
+  switch (type) {
+    case vlsir::circuit::SUBCKT: return std::string("x");
+    case vlsir::circuit::RESISTOR: return std::string("r");
+    case vlsir::circuit::CAPACITOR: return std::string("c");
+    case vlsir::circuit::INDUCTOR: return std::string("l");
+    case vlsir::circuit::MOS: return std::string("m");
+    case vlsir::circuit::DIODE: return std::string("d");
+    case vlsir::circuit::BIPOLAR: return std::string("q");
+    default:
+      return absl::UnimplementedError(absl::StrCat(
+          "External modules of type ",
+          vlsir::circuit::SpiceType_Name(type)));
+  }
+}
+
+// Widths of a module's signals, by name.
+template <typename ModuleType>
+std::map<std::string, int64_t> SignalWidths(const ModuleType &module) {
+  std::map<std::string, int64_t> widths;
+  for (const auto &signal : module.signals()) {
+    widths[signal.name()] = std::max<int64_t>(signal.width(), 1);
+  }
+  return widths;
+}
+
+template <typename ModuleType>
+std::vector<std::pair<std::string, int64_t>> PortWidths(
+    const ModuleType &module) {
+  std::map<std::string, int64_t> widths = SignalWidths(module);
+  std::vector<std::pair<std::string, int64_t>> ports;
+  for (const Port &port : module.ports()) {
+    auto it = widths.find(port.signal());
+    ports.emplace_back(port.signal(), it == widths.end() ? 1 : it->second);
+  }
+  return ports;
+}
+
+// A bus's bits are separate nodes, name_0 upwards.
+std::string Bit(const std::string &name, int64_t width, int64_t index) {
+  return width == 1 ? name : absl::StrCat(name, "_", index);
+}
+
+class PackageNetlister {
+ public:
+  // Modules' text is taken from, and added to, cache if it isn't null.
+  PackageNetlister(const Package &package, SubcircuitCache *cache,
+                   NetlistWriter *out)
+      : package_(package), cache_(cache), out_(out) {
+    for (const Module &module : package_.modules()) {
+      modules_[module.name()] = &module;
+    }
+    for (const ExternalModule &module : package_.ext_modules()) {
+      external_modules_[{module.name().domain(), module.name().name()}] =
+          &module;
+    }
+  }
+
+  const Module *FindModule(const std::string &name) const {
+    auto it = modules_.find(name);
+    return it == modules_.end() ? nullptr : it->second;
+  }
+
+  absl::Status WriteModules() {
+    for (const Module &module : package_.modules()) {
+      if (cache_ == nullptr) {
+        absl::Status status = WriteModule(module, out_);
+        if (!status.ok()) {
+          return status;
+        }
+        continue;
+      }
+      std::string key = ModuleKey(module);
+      std::shared_ptr<const std::string> cached = cache_->Lookup(key);
+      if (cached) {
+        out_->Append(*cached);
+        continue;
+      }
+      std::string text;
+      NetlistWriter writer(&text);
+      absl::Status status = WriteModule(module, &writer);
+      if (!status.ok()) {
+        return status;
+      }
+      out_->Append(text);
+      cache_->Store(key, std::move(text));
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  // Everything a module's text depends on: the module itself, and the ports
+  // of (or, if external, everything about) what it instantiates.
+  std::string ModuleKey(const Module &module) const {
+    Sha256 hash;
+    hash.AddField(kKeyVersion);
+    hash.AddField(module.SerializeAsString());
+    std::set<std::string> seen;
+    for (const Instance &instance : module.instances()) {
+      const vlsir::utils::Reference &reference = instance.module();
+      std::string name = reference.SerializeAsString();
+      if (!seen.insert(name).second) {
+        continue;
+      }
+      hash.AddField(name);
+      if (reference.to_case() == vlsir::utils::Reference::kLocal) {
+        const Module *target = FindModule(reference.local());
+        hash.AddField(target != nullptr);
+        if (target == nullptr) {
+          continue;
+        }
+        auto ports = PortWidths(*target);
+        hash.AddField(ports.size());
+        for (const auto &[port, width] : ports) {
+          hash.AddField(port);
+          hash.AddField(width);
+        }
+      } else if (reference.to_case() == vlsir::utils::Reference::kExternal) {
+        auto it = external_modules_.find(
+            {reference.external().domain(), reference.external().name()});
+        hash.AddField(it != external_modules_.end());
+        if (it != external_modules_.end()) {
+          hash.AddField(it->second->SerializeAsString());
+        }
+      }
+    }
+    return hash.HexDigest();
+  }
+
+  absl::Status WriteModule(const Module &module, NetlistWriter *out) {
+    std::map<std::string, int64_t> widths = SignalWidths(module);
+    std::vector<std::string> ports;
+    for (const auto &[name, width] : PortWidths(module)) {
+      for (int64_t i = 0; i < width; ++i) {
+        ports.push_back(Bit(name, width, i));
+      }
+    }
+    auto params = FormatParams(module.parameters());
+    if (!params.ok()) {
+      return params.status();
+    }
+    out->Line(".SUBCKT ", module.name(), ports.empty() ? "" : " ",
+               absl::StrJoin(ports, " "), params->empty() ? "" : " PARAMS: ",
+               *params);
+    for (const vlsir::utils::Literal &literal : module.literals()) {
+      out->Line(literal.text());
+    }
+    for (const Instance &instance : module.instances()) {
+      absl::Status status = WriteInstance(instance, widths, out);
+      if (!status.ok()) {
+        return absl::Status(status.code(), absl::StrCat(
+            "In ", module.name(), ", instance ", instance.name(), ": ",
+            status.message()));
+      }
+    }
+    out->Line(".ENDS");
+    out->Line("");
+    return absl::OkStatus();
+  }
+
+  absl::StatusOr<Target> Resolve(const vlsir::utils::Reference &reference) {
+    Target target;
+    if (reference.to_case() == vlsir::utils::Reference::kLocal) {
+      const Module *module = FindModule(reference.local());
+      if (module == nullptr) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "No module ", reference.local()));
+      }
+      target.prefix = "x";
+      target.ports = PortWidths(*module);
+      target.model = module->name();
+      return target;
+    }
+    if (reference.to_case() != vlsir::utils::Reference::kExternal) {
+      return absl::InvalidArgumentError("Instance of nothing");
+    }
+    const vlsir::utils::QualifiedName &name = reference.external();
+    if (name.domain() == kPrimitivesDomain) {
+      for (const Primitive &primitive : Primitives()) {
+        if (name.name() == primitive.name) {
+          target.prefix = primitive.prefix;
+          for (const char *port : primitive.ports) {
+            target.ports.emplace_back(port, 1);
+          }
+          target.primitive = &primitive;
+          return target;
+        }
+      }
+      return absl::UnimplementedError(absl::StrCat(
+          "Primitive ", name.name()));
+    }
+    auto it = external_modules_.find({name.domain(), name.name()});
+    if (it == external_modules_.end()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "No external module ", name.domain(), ".", name.name()));
+    }
+    auto prefix = SpiceTypePrefix(it->second->spicetype());
+    if (!prefix.ok()) {
+      return prefix.status();
+    }
+    target.prefix = *prefix;
+    target.ports = PortWidths(*it->second);
+    target.model = name.name();
+    return target;
+  }
+
+  absl::Status AppendNodes(const ConnectionTarget &target,
+                           const std::map<std::string, int64_t> &widths,
+                           std::vector<std::string> *nodes) {
+    auto width_of = [&widths](const std::string &name) -> int64_t {
+      auto it = widths.find(name);
+      return it == widths.end() ? 1 : it->second;
+    };
+    switch (target.stype_case()) {
+      case ConnectionTarget::kSig: {
+        int64_t width = width_of(target.sig());
+        for (int64_t i = 0; i < width; ++i) {
+          nodes->push_back(Bit(target.sig(), width, i));
+        }
+        return absl::OkStatus();
+      }
+      case ConnectionTarget::kSlice: {
+        const vlsir::circuit::Slice &slice = target.slice();
+        int64_t width = width_of(slice.signal());
+        if (slice.bot() < 0 || slice.top() < slice.bot() ||
+            slice.top() >= width) {
+          return absl::InvalidArgumentError(absl::StrCat(
+              "Bad slice of ", slice.signal()));
+        }
+        for (int64_t i = slice.bot(); i <= slice.top(); ++i) {
+          nodes->push_back(Bit(slice.signal(), width, i));
+        }
+        return absl::OkStatus();
+      }
+      case ConnectionTarget::kConcat:
+        for (const ConnectionTarget &part : target.concat().parts()) {
+          absl::Status status = AppendNodes(part, widths, nodes);
+          if (!status.ok()) {
+            return status;
+          }
+        }
+        return absl::OkStatus();
+      default:
+        return absl::InvalidArgumentError("Empty connection");
+    }
+  }
+
+  absl::Status WriteInstance(const Instance &instance,
+                             const std::map<std::string, int64_t> &widths,
+                             NetlistWriter *out) {
+    auto target = Resolve(instance.module());
+    if (!target.ok()) {
+      return target.status();
+    }
+
+    std::vector<std::string> nodes;
+    for (const auto &[port, width] : target->ports) {
+      auto connection = std::find_if(
+          instance.connections().begin(), instance.connections().end(),
+          [&port](const vlsir::circuit::Connection &connection) {
+            return connection.portname() == port;
+          });
+      if (connection == instance.connections().end()) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Port ", port, " is not connected"));
+      }
+      size_t before = nodes.size();
+      absl::Status status = AppendNodes(connection->target(), widths, &nodes);
+      if (!status.ok()) {
+        return status;
+      }
+      if (nodes.size() - before != static_cast<size_t>(width)) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Port ", port, " is ", width, " wide but connected to ",
+            nodes.size() - before, " nodes"));
+      }
+    }
+
+    std::string name = absl::StrCat(target->prefix, instance.name());
+    if (target->primitive == nullptr) {
+      auto params = FormatParams(instance.parameters());
+      if (!params.ok()) {
+        return params.status();
+      }
+      out->Line(name, " ", absl::StrJoin(nodes, " "), " ", target->model,
+                 params->empty() ? "" : " ", *params);
+      return absl::OkStatus();
+    }
+
+    // Primitives' parameters are positional, or follow a keyword.
+    std::map<std::string, const ParamValue*> given;
+    for (const Param &param : instance.parameters()) {
+      given[param.name()] = &param.value();
+    }
+    std::vector<std::string> values;
+    for (const PrimitiveParam &param : target->primitive->params) {
+      auto it = given.find(param.name);
+      if (it == given.end()) {
+        if (param.keyword == nullptr) {
+          return absl::InvalidArgumentError(absl::StrCat(
+              "Parameter ", param.name, " is required"));
+        }
+        continue;
+      }
+      auto value = FormatValue(*it->second);
+      if (!value.ok()) {
+        return value.status();
+      }
+      values.push_back(param.keyword == nullptr ?
+          *value : absl::StrCat(param.keyword, " ", *value));
+      given.erase(it);
+    }
+    if (!given.empty()) {
+      return absl::UnimplementedError(absl::StrCat(
+          "Parameter ", given.begin()->first, " of primitive ",
+          target->primitive->name));
+    }
+    out->Line(name, " ", absl::StrJoin(nodes, " "),
+               values.empty() ? "" : " ", absl::StrJoin(values, " "));
+    return absl::OkStatus();
+  }
+
+  const Package &package_;
+  SubcircuitCache *cache_;
+  NetlistWriter *out_;
+  std::map<std::string, const Module*> modules_;
+  std::map<std::pair<std::string, std::string>, const ExternalModule*>
+      external_modules_;
+};
+
+SubcircuitCache *Cache() {
+  SubcircuitCache &cache = SubcircuitCache::GetInstance();
+  return cache.enabled() ? &cache : nullptr;
+}
+
+bool IsXyce(const Flavour &flavour) {
+  return flavour == Flavour::XYCE || flavour == Flavour::XYCE_7_8 ||
+      flavour == Flavour::XYCE_7_9 || flavour == Flavour::XYCE_7_10;
+}
+
+absl::Status WriteControl(const Control &control, NetlistWriter *out) {
+  switch (control.ctrl_case()) {
+    case Control::kInclude:
+      out->Line(".include \"", control.include().path(), "\"");
+      return absl::OkStatus();
+    case Control::kLib:
+      out->Line(".lib \"", control.lib().path(), "\" ",
+                control.lib().section());
+      return absl::OkStatus();
+    case Control::kMeas:
+      out->Line(".meas ", control.meas().analysis_type(), " ",
+                control.meas().name(), " ", control.meas().expr());
+      return absl::OkStatus();
+    case Control::kParam: {
+      auto value = FormatValue(control.param().value());
+      if (!value.ok()) {
+        return value.status();
+      }
+      out->Line(".param ", control.param().name(), "=", *value);
+      return absl::OkStatus();
+    }
+    case Control::kLiteral:
+      out->Line(control.literal().text());
+      return absl::OkStatus();
+    default:
+      return absl::UnimplementedError("Control statement");
+  }
+}
+
+absl::Status WriteControls(
+    const google::protobuf::RepeatedPtrField<Control> &controls,
+    NetlistWriter *out) {
+  for (const Control &control : controls) {
+    absl::Status status = WriteControl(control, out);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status WriteAnalysis(const vlsir::spice::Analysis &analysis,
+                           NetlistWriter *out) {
+  switch (analysis.an_case()) {
+    case vlsir::spice::Analysis::kOp: {
+      absl::Status status = WriteControls(analysis.op().ctrls(), out);
+      if (!status.ok()) {
+        return status;
+      }
+      out->Line(".op");
+      return absl::OkStatus();
+    }
+    case vlsir::spice::Analysis::kDc: {
+      const vlsir::spice::DcInput &dc = analysis.dc();
+      if (dc.sweep().tp_case() != vlsir::spice::Sweep::kLinear) {
+        return absl::UnimplementedError("DC sweeps other than linear");
+      }
+      absl::Status status = WriteControls(dc.ctrls(), out);
+      if (!status.ok()) {
+        return status;
+      }
+      const vlsir::spice::LinearSweep &sweep = dc.sweep().linear();
+      out->Line(".dc ", dc.indep_name(), " ", FormatNumber(sweep.start()),
+                " ", FormatNumber(sweep.stop()), " ",
+                FormatNumber(sweep.step()));
+      return absl::OkStatus();
+    }
+    case vlsir::spice::Analysis::kTran: {
+      const vlsir::spice::TranInput &tran = analysis.tran();
+      absl::Status status = WriteControls(tran.ctrls(), out);
+      if (!status.ok()) {
+        return status;
+      }
+      // Map order isn't stable.
+      std::map<std::string, double> initial(tran.ic().begin(),
+                                            tran.ic().end());
+      for (const auto &[node, value] : initial) {
+        out->Line(".ic v(", node, ")=", FormatNumber(value));
+      }
+      out->Line(".tran ", FormatNumber(tran.tstep()), " ",
+                FormatNumber(tran.tstop()));
+      return absl::OkStatus();
+    }
+    case vlsir::spice::Analysis::kAc: {
+      const vlsir::spice::AcInput &ac = analysis.ac();
+      absl::Status status = WriteControls(ac.ctrls(), out);
+      if (!status.ok()) {
+        return status;
+      }
+      out->Line(".ac dec ", ac.npts(), " ", FormatNumber(ac.fstart()), " ",
+                FormatNumber(ac.fstop()));
+      return absl::OkStatus();
+    }
+    default:
+      return absl::UnimplementedError("Analysis type");
+  }
+}
+
+absl::Status WriteOptions(const vlsir::spice::SimOptions &options,
+                          const Flavour &flavour, NetlistWriter *out) {
+  if (IsXyce(flavour)) {
+    std::vector<std::string> device;
+    if (options.temp() != 0) {
+      device.push_back(absl::StrCat("temp=", FormatNumber(options.temp())));
+    }
+    if (options.tnom() != 0) {
+      device.push_back(absl::StrCat("tnom=", FormatNumber(options.tnom())));
+    }
+    if (!device.empty()) {
+      out->Line(".options device ", absl::StrJoin(device, " "));
+    }
+  } else {
+    if (options.temp() != 0) {
+      out->Line(".temp ", FormatNumber(options.temp()));
+    }
+    if (options.tnom() != 0) {
+      out->Line(".options tnom=", FormatNumber(options.tnom()));
+    }
+  }
+  for (const Param &param : options.other()) {
+    auto value = FormatValue(param.value());
+    if (!value.ok()) {
+      return value.status();
+    }
+    out->Line(".options ", param.name(), "=", *value);
+  }
+  return absl::OkStatus();
+}
+
+absl::Status WriteSimInput(const SimInput &sim_input, const Flavour &flavour,
+                           NetlistWriter *out) {
+  if (!NativeNetlister::Supports(flavour)) {
+    return absl::UnimplementedError(absl::StrCat(
+        "Netlisting for ", Flavour_Name(flavour)));
+  }
+  if (sim_input.an_size() > 1) {
+    // Xyce can only do one; ngspice's batch mode is particular about them.
+    return absl::UnimplementedError("More than one analysis");
+  }
+
+  PackageNetlister netlister(sim_input.pkg(), Cache(), out);
+  const Module *top = netlister.FindModule(sim_input.top());
+  if (top == nullptr) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "No top module ", sim_input.top()));
+  }
+  if (top->ports_size() > 1) {
+    return absl::UnimplementedError("Top module with more than one port");
+  }
+
+  out->Line("* ", sim_input.top());
+  out->Line("");
+  absl::Status status = netlister.WriteModules();
+  if (!status.ok()) {
+    return status;
+  }
+  // The top module's one port, if any, is ground.
+  out->Line("xtop", top->ports_size() == 1 ? " 0 " : " ", top->name());
+  out->Line("");
+
+  status = WriteOptions(sim_input.opts(), flavour, out);
+  if (!status.ok()) {
+    return status;
+  }
+  status = WriteControls(sim_input.ctrls(), out);
+  if (!status.ok()) {
+    return status;
+  }
+  for (const vlsir::spice::Analysis &analysis : sim_input.an()) {
+    status = WriteAnalysis(analysis, out);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  out->Line(".end");
+  return absl::OkStatus();
+}
+
+absl::Status WritePackage(const Package &package, const Flavour &flavour,
+                          NetlistWriter *out) {
+  if (!NativeNetlister::Supports(flavour)) {
+    return absl::UnimplementedError(absl::StrCat(
+        "Netlisting for ", Flavour_Name(flavour)));
+  }
+  PackageNetlister netlister(package, Cache(), out);
+  return netlister.WriteModules();
+}
+
+// Streams the netlist made by write into output_directory / file_name.
+template <typename Write>
+absl::StatusOr<std::vector<std::filesystem::path>> WriteFile(
+    const std::filesystem::path &output_directory,
+    const std::string &file_name,
+    Write write) {
+  std::filesystem::path path = output_directory / file_name;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return absl::InternalError(absl::StrCat(
+        "Could not create ", path.string(), ": ", strerror(errno)));
+  }
+  NetlistWriter out(fd);
+  absl::Status status = write(&out);
+  absl::Status flushed = out.Flush();
+  if (close(fd) != 0 && flushed.ok()) {
+    flushed = absl::InternalError(absl::StrCat(
+        "Could not write ", path.string(), ": ", strerror(errno)));
+  }
+  if (status.ok()) {
+    status = flushed;
+  }
+  if (!status.ok()) {
+    std::error_code error;
+    std::filesystem::remove(path, error);
+    return status;
+  }
+  return std::vector<std::filesystem::path> {path};
+}
+
+}   // namespace
+
+bool NativeNetlister::Enabled() {
+  return FLAGS_native_netlister;
+}
+
+bool NativeNetlister::Supports(const Flavour &spice_flavour) {
+  return IsXyce(spice_flavour) || spice_flavour == Flavour::NGSPICE;
+}
+
+absl::StatusOr<std::string> NativeNetlister::NetlistSim(
+    const vlsir::spice::SimInput &sim_input_pb,
+    const Flavour &spice_flavour) {
+  std::string netlist;
+  NetlistWriter out(&netlist);
+  absl::Status status = WriteSimInput(sim_input_pb, spice_flavour, &out);
+  if (!status.ok()) {
+    return status;
+  }
+  return netlist;
+}
+
+absl::StatusOr<std::string> NativeNetlister::NetlistPackage(
+    const vlsir::circuit::Package &circuit_pb,
+    const Flavour &spice_flavour) {
+  std::string netlist;
+  NetlistWriter out(&netlist);
+  absl::Status status = WritePackage(circuit_pb, spice_flavour, &out);
+  if (!status.ok()) {
+    return status;
+  }
+  return netlist;
+}
+
+absl::StatusOr<std::vector<std::filesystem::path>> NativeNetlister::WriteSim(
+    const vlsir::spice::SimInput &sim_input_pb,
+    const Flavour &spice_flavour,
+    const std::filesystem::path &output_directory) {
+  return WriteFile(output_directory, "main.sp", [&](NetlistWriter *out) {
+    return WriteSimInput(sim_input_pb, spice_flavour, out);
+  });
+}
+
+absl::StatusOr<std::vector<std::filesystem::path>> NativeNetlister::WriteSpice(
+    const vlsir::circuit::Package &circuit_pb,
+    const Flavour &spice_flavour,
+    const std::filesystem::path &output_directory) {
+  return WriteFile(output_directory, "netlist.sp", [&](NetlistWriter *out) {
+    return WritePackage(circuit_pb, spice_flavour, out);
+  });
+}
+
+}  // namespace spiceserver
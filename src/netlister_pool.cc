@@ -0,0 +1,452 @@
+#include "netlister_pool.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
+
+#include "embedded_python_netlister.h"
+#include "proto/netlister_worker.pb.h"
+
+DEFINE_int32(netlister_workers, 0,
+             "If more than 0, VLSIR inputs are netlisted by this many worker "
+             "processes, in parallel, instead of in the server.");
+DEFINE_uint64(netlister_timeout_ms, 120000,
+              "How long a netlister worker has to start, or to netlist one "
+              "input, before it is killed and replaced.");
+DEFINE_string(netlister_worker_command, "/proc/self/exe",
+              "The program to run as a netlister worker.");
+DEFINE_int32(netlister_worker_fd, -1,
+             "Run as a netlister worker, serving the socket on this "
+             "descriptor. Set by the server for its workers.");
+
+DECLARE_string(python_vlsirtools);
+DECLARE_string(python_vlsir);
+
+extern char **environ;
+
+namespace spiceserver {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Where a worker finds its socket.
+constexpr int kWorkerFd = 3;
+
+// Protobufs can't be bigger than this anyway.
+constexpr uint32_t kMaxMessageBytes = std::numeric_limits<int32_t>::max();
+
+constexpr Clock::time_point kNoDeadline = Clock::time_point::max();
+
+absl::Status WaitFor(int fd, short events, Clock::time_point deadline) {
+  while (true) {
+    int timeout_ms = -1;
+    if (deadline != kNoDeadline) {
+      int64_t left_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - Clock::now()).count();
+      if (left_ms <= 0) {
+        return absl::DeadlineExceededError(
+            "Timed out waiting for the netlister");
+      }
+      timeout_ms = static_cast<int>(
+          std::min<int64_t>(left_ms, std::numeric_limits<int>::max()));
+    }
+    struct pollfd poll_fd = {fd, events, 0};
+    int result = poll(&poll_fd, 1, timeout_ms);
+    if (result < 0 && errno != EINTR) {
+      return absl::InternalError(absl::StrCat("poll: ", strerror(errno)));
+    }
+    if (result > 0) {
+      // Including hang-ups, which the read or write then reports.
+      return absl::OkStatus();
+    }
+  }
+}
+
+absl::Status WriteAll(int fd, const char *data, size_t size,
+                      Clock::time_point deadline) {
+  while (size > 0) {
+    absl::Status ready = WaitFor(fd, POLLOUT, deadline);
+    if (!ready.ok()) {
+      return ready;
+    }
+    ssize_t written = send(fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      return absl::UnavailableError(absl::StrCat(
+          "Lost the netlister: ", strerror(errno)));
+    }
+    data += written;
+    size -= written;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status ReadAll(int fd, char *data, size_t size,
+                     Clock::time_point deadline) {
+  while (size > 0) {
+    absl::Status ready = WaitFor(fd, POLLIN, deadline);
+    if (!ready.ok()) {
+      return ready;
+    }
+    ssize_t got = recv(fd, data, size, MSG_DONTWAIT);
+    if (got == 0) {
+      return absl::UnavailableError("The netlister went away");
+    }
+    if (got < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      return absl::UnavailableError(absl::StrCat(
+          "Lost the netlister: ", strerror(errno)));
+    }
+    data += got;
+    size -= got;
+  }
+  return absl::OkStatus();
+}
+
+absl::Status SendMessage(int fd, const google::protobuf::Message &message,
+                         Clock::time_point deadline) {
+  std::string serialised;
+  if (!message.SerializeToString(&serialised) ||
+      serialised.size() > kMaxMessageBytes) {
+    return absl::InvalidArgumentError("Input too big to netlist");
+  }
+  uint32_t size = serialised.size();
+  char header[4] = {
+      static_cast<char>(size), static_cast<char>(size >> 8),
+      static_cast<char>(size >> 16), static_cast<char>(size >> 24)};
+  absl::Status status = WriteAll(fd, header, sizeof(header), deadline);
+  if (!status.ok()) {
+    return status;
+  }
+  return WriteAll(fd, serialised.data(), serialised.size(), deadline);
+}
+
+absl::Status ReceiveMessage(int fd, google::protobuf::Message *message,
+                            Clock::time_point deadline) {
+  unsigned char header[4];
+  absl::Status status = ReadAll(
+      fd, reinterpret_cast<char*>(header), sizeof(header), deadline);
+  if (!status.ok()) {
+    return status;
+  }
+  uint32_t size = header[0] | header[1] << 8 | header[2] << 16 |
+      static_cast<uint32_t>(header[3]) << 24;
+  if (size > kMaxMessageBytes) {
+    return absl::InternalError("Netlister sent a message that is too big");
+  }
+  std::string serialised(size, '\0');
+  status = ReadAll(fd, serialised.data(), size, deadline);
+  if (!status.ok()) {
+    return status;
+  }
+  if (!message->ParseFromString(serialised)) {
+    return absl::InternalError("Netlister sent an unparseable message");
+  }
+  return absl::OkStatus();
+}
+
+void SetError(const absl::Status &status, NetlistWorkResponse *response) {
+  response->set_error_code(static_cast<int32_t>(status.code()));
+  response->set_error(std::string(status.message()));
+}
+
+}   // namespace
+
+bool NetlisterPool::IsWorkerProcess() {
+  return FLAGS_netlister_worker_fd >= 0;
+}
+
+int NetlisterPool::ServeWorker() {
+  int socket_fd = FLAGS_netlister_worker_fd;
+  // Don't outlive the server, and leave ^C to it.
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+  signal(SIGINT, SIG_IGN);
+
+  EmbeddedPythonNetlister &netlister = EmbeddedPythonNetlister::GetInstance();
+  NetlistWorkResponse ready;
+  SetError(netlister.status(), &ready);
+  if (!SendMessage(socket_fd, ready, kNoDeadline).ok() ||
+      !netlister.status().ok()) {
+    return 1;
+  }
+
+  while (true) {
+    NetlistWorkRequest request;
+    if (!ReceiveMessage(socket_fd, &request, kNoDeadline).ok()) {
+      // The server has gone away (or sent us garbage).
+      return 0;
+    }
+    absl::StatusOr<std::string> netlist;
+    Flavour flavour = static_cast<Flavour>(request.flavour());
+    switch (request.input_case()) {
+      case NetlistWorkRequest::kSimInput:
+        netlist = netlister.NetlistSerialisedSim(request.sim_input(), flavour);
+        break;
+      case NetlistWorkRequest::kPackage:
+        netlist = netlister.NetlistSerialisedPackage(request.package(),
+                                                     flavour);
+        break;
+      default:
+        netlist = absl::InvalidArgumentError("Nothing to netlist");
+        break;
+    }
+    NetlistWorkResponse response;
+    if (netlist.ok()) {
+      response.set_netlist(std::move(*netlist));
+    } else {
+      SetError(netlist.status(), &response);
+    }
+    if (!SendMessage(socket_fd, response, kNoDeadline).ok()) {
+      return 1;
+    }
+  }
+}
+
+NetlisterPool::NetlisterPool()
+    : timeout_(0),
+      restarts_(0) {}
+
+NetlisterPool::~NetlisterPool() {
+  for (const auto &worker : workers_) {
+    Kill(worker.get());
+  }
+}
+
+absl::Status NetlisterPool::Initialise() {
+  if (FLAGS_netlister_workers <= 0) {
+    return absl::OkStatus();
+  }
+  return Start(FLAGS_netlister_workers,
+               FLAGS_netlister_worker_command,
+               {absl::StrCat("--python_vlsirtools=", FLAGS_python_vlsirtools),
+                absl::StrCat("--python_vlsir=", FLAGS_python_vlsir),
+                "--logtostderr"},
+               std::chrono::milliseconds(FLAGS_netlister_timeout_ms));
+}
+
+absl::Status NetlisterPool::Start(int num_workers,
+                                  const std::string &command,
+                                  const std::vector<std::string> &args,
+                                  std::chrono::milliseconds timeout) {
+  command_ = command;
+  args_ = args;
+  timeout_ = timeout;
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  absl::Status status;
+  bool any_started = false;
+  for (int i = 0; i < num_workers; ++i) {
+    auto worker = std::make_unique<Worker>();
+    absl::Status spawned = Spawn(worker.get());
+    if (spawned.ok()) {
+      any_started = true;
+    } else {
+      status = spawned;
+    }
+    workers.push_back(std::move(worker));
+  }
+  if (!any_started) {
+    return status;
+  }
+  LOG_IF(WARNING, !status.ok())
+      << "Some netlister workers did not start (they will be retried): "
+      << status;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &worker : workers) {
+    idle_.push_back(worker.get());
+    workers_.push_back(std::move(worker));
+  }
+  return absl::OkStatus();
+}
+
+bool NetlisterPool::enabled() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !workers_.empty();
+}
+
+uint64_t NetlisterPool::restarts() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return restarts_;
+}
+
+absl::StatusOr<std::string> NetlisterPool::NetlistSim(
+    const vlsir::spice::SimInput &sim_input_pb,
+    const Flavour &spice_flavour) {
+  NetlistWorkRequest request;
+  request.set_flavour(spice_flavour);
+  sim_input_pb.SerializeToString(request.mutable_sim_input());
+  return Netlist(request);
+}
+
+absl::StatusOr<std::string> NetlisterPool::NetlistPackage(
+    const vlsir::circuit::Package &circuit_pb,
+    const Flavour &spice_flavour) {
+  NetlistWorkRequest request;
+  request.set_flavour(spice_flavour);
+  circuit_pb.SerializeToString(request.mutable_package());
+  return Netlist(request);
+}
+
+absl::StatusOr<std::string> NetlisterPool::Netlist(
+    const NetlistWorkRequest &request) {
+  if (!enabled()) {
+    return absl::FailedPreconditionError("No netlister workers");
+  }
+  Worker *worker = Acquire();
+  if (worker->socket_fd < 0) {
+    absl::Status spawned = Spawn(worker);
+    if (!spawned.ok()) {
+      Release(worker);
+      return spawned;
+    }
+  }
+
+  Clock::time_point deadline = Clock::now() + timeout_;
+  NetlistWorkResponse response;
+  absl::Status status = SendMessage(worker->socket_fd, request, deadline);
+  if (status.ok()) {
+    status = ReceiveMessage(worker->socket_fd, &response, deadline);
+  }
+  if (!status.ok()) {
+    LOG(WARNING) << "Replacing netlister worker " << worker->pid << ": "
+                 << status;
+    Kill(worker);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++restarts_;
+    }
+  }
+  Release(worker);
+  if (!status.ok()) {
+    return status;
+  }
+  if (response.error_code() != 0) {
+    return absl::Status(static_cast<absl::StatusCode>(response.error_code()),
+                        response.error());
+  }
+  return std::move(*response.mutable_netlist());
+}
+
+absl::Status NetlisterPool::Spawn(Worker *worker) {
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == -1) {
+    return absl::InternalError(
+        absl::StrCat("socketpair failed: ", strerror(errno)));
+  }
+  // dup2 onto itself would leave it close-on-exec.
+  if (sockets[1] == kWorkerFd) {
+    int moved = fcntl(sockets[1], F_DUPFD_CLOEXEC, kWorkerFd + 1);
+    close(sockets[1]);
+    sockets[1] = moved;
+  }
+
+  std::vector<std::string> args = {command_};
+  args.insert(args.end(), args_.begin(), args_.end());
+  args.push_back(absl::StrCat("--netlister_worker_fd=", kWorkerFd));
+  std::vector<char*> argv;
+  for (std::string &arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  posix_spawn_file_actions_adddup2(&file_actions, sockets[1], kWorkerFd);
+  // gRPC's threads block some signals; the worker shouldn't.
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  posix_spawnattr_setsigmask(&attributes, &empty_mask);
+  posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+  pid_t pid = -1;
+  int result = posix_spawn(&pid, command_.c_str(), &file_actions,
+                           &attributes, argv.data(), environ);
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&file_actions);
+  close(sockets[1]);
+  if (result != 0) {
+    close(sockets[0]);
+    return absl::InternalError(absl::StrCat(
+        "Could not start netlister worker ", command_, ": ",
+        strerror(result)));
+  }
+  worker->pid = pid;
+  worker->socket_fd = sockets[0];
+
+  // Loading Python and vlsirtools is the slow part.
+  NetlistWorkResponse ready;
+  absl::Status status = ReceiveMessage(
+      worker->socket_fd, &ready, Clock::now() + timeout_);
+  if (status.ok() && ready.error_code() != 0) {
+    status = absl::Status(static_cast<absl::StatusCode>(ready.error_code()),
+                          ready.error());
+  }
+  if (!status.ok()) {
+    Kill(worker);
+    return absl::Status(status.code(), absl::StrCat(
+        "Netlister worker did not start: ", status.message()));
+  }
+  LOG(INFO) << "Started netlister worker with pid " << worker->pid;
+  return absl::OkStatus();
+}
+
+void NetlisterPool::Kill(Worker *worker) {
+  if (worker->socket_fd >= 0) {
+    close(worker->socket_fd);
+    worker->socket_fd = -1;
+  }
+  if (worker->pid > 0) {
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, nullptr, 0);
+    worker->pid = -1;
+  }
+}
+
+NetlisterPool::Worker *NetlisterPool::Acquire() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  released_.wait(lock, [this]() { return !idle_.empty(); });
+  Worker *worker = idle_.back();
+  idle_.pop_back();
+  return worker;
+}
+
+void NetlisterPool::Release(Worker *worker) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_.push_back(worker);
+  }
+  released_.notify_one();
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,175 @@
+#include "output_batcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include <absl/strings/str_split.h>
+#include <absl/strings/string_view.h>
+
+#include "proto/spice_simulator.pb.h"
+
+DEFINE_uint32(output_batch_max_bytes, 32 * 1024,
+              "Default maximum number of bytes of simulator output per "
+              "SimulationResponse.");
+DEFINE_uint32(output_batch_max_latency_ms, 50,
+              "Default maximum time simulator output is held back while a "
+              "batch fills up.");
+DEFINE_bool(output_batch_line_framed, true,
+            "By default, only cut batches of simulator output at line "
+            "boundaries.");
+
+namespace spiceserver {
+
+OutputBatcher::Options OutputBatcher::DefaultOptions() {
+  return Options {
+    .max_bytes = std::max(FLAGS_output_batch_max_bytes, 1U),
+    .max_latency = std::chrono::milliseconds(FLAGS_output_batch_max_latency_ms),
+    .line_framed = FLAGS_output_batch_line_framed,
+    .as_lines = false,
+    .disabled = false
+  };
+}
+
+OutputBatcher::Options OutputBatcher::OptionsFromRequest(
+    const OutputBatching &batching_pb) {
+  Options options = DefaultOptions();
+  if (batching_pb.max_bytes() > 0) {
+    options.max_bytes = batching_pb.max_bytes();
+  }
+  if (batching_pb.max_latency_ms() > 0) {
+    options.max_latency = std::chrono::milliseconds(
+        batching_pb.max_latency_ms());
+  }
+  if (batching_pb.has_line_framed()) {
+    options.line_framed = batching_pb.line_framed();
+  }
+  options.as_lines = batching_pb.as_lines();
+  options.disabled = batching_pb.disabled();
+  return options;
+}
+
+OutputBatcher::OutputBatcher(const Options &options)
+    : options_(options) {}
+
+size_t OutputBatcher::CutPoint(absl::string_view data) const {
+  if (options_.line_framed) {
+    size_t last_newline = data.rfind('\n');
+    if (last_newline != absl::string_view::npos) {
+      return last_newline + 1;
+    }
+  }
+  return data.size();
+}
+
+void OutputBatcher::Emit(Subprocess::StreamType stream_type,
+                         size_t length,
+                         std::vector<SimulationResponse> *ready) {
+  Pending &pending = PendingFor(stream_type);
+  absl::string_view text = pending.unread().substr(0, length);
+  if (text.empty()) {
+    return;
+  }
+  length = text.size();
+
+  SimulationResponse response;
+  if (options_.as_lines) {
+    if (text.back() == '\n') {
+      text.remove_suffix(1);
+    }
+    for (absl::string_view line : absl::StrSplit(text, '\n')) {
+      response.add_lines(line.data(), line.size());
+    }
+  } else {
+    response.set_output(text.data(), text.size());
+  }
+  if (stream_type == Subprocess::StreamType::STDOUT) {
+    response.set_stream_type(SimulationResponse::STDOUT);
+  } else {
+    response.set_stream_type(SimulationResponse::STDERR);
+  }
+  response.set_done(false);
+  ready->push_back(std::move(response));
+
+  pending.start += length;
+}
+
+void OutputBatcher::Compact(Pending *pending) {
+  pending->data.erase(0, pending->start);
+  pending->start = 0;
+}
+
+void OutputBatcher::Add(const char *data,
+                        size_t length,
+                        Subprocess::StreamType stream_type,
+                        Clock::time_point now,
+                        std::vector<SimulationResponse> *ready) {
+  Pending &pending = PendingFor(stream_type);
+  if (pending.unread().empty()) {
+    pending.oldest = now;
+  }
+  pending.data.append(data, length);
+
+  if (options_.disabled) {
+    Emit(stream_type, pending.unread().size(), ready);
+    Compact(&pending);
+    return;
+  }
+
+  while (pending.unread().size() >= options_.max_bytes) {
+    size_t cut = options_.max_bytes;
+    if (options_.line_framed) {
+      size_t last_newline =
+          pending.unread().rfind('\n', options_.max_bytes - 1);
+      if (last_newline != absl::string_view::npos) {
+        cut = last_newline + 1;
+      }
+    }
+    Emit(stream_type, cut, ready);
+  }
+  Compact(&pending);
+}
+
+void OutputBatcher::FlushExpired(Clock::time_point now,
+                                 std::vector<SimulationResponse> *ready) {
+  for (Subprocess::StreamType stream_type : {Subprocess::StreamType::STDOUT,
+                                             Subprocess::StreamType::STDERR}) {
+    Pending &pending = PendingFor(stream_type);
+    if (pending.unread().empty() ||
+        now - pending.oldest < options_.max_latency) {
+      continue;
+    }
+    Emit(stream_type, CutPoint(pending.unread()), ready);
+    Compact(&pending);
+    // Whatever is left is a partial line. Give it one more period to be
+    // finished before it goes out on its own.
+    pending.oldest = now;
+  }
+}
+
+void OutputBatcher::FlushAll(std::vector<SimulationResponse> *ready) {
+  Emit(Subprocess::StreamType::STDOUT, stdout_.unread().size(), ready);
+  Emit(Subprocess::StreamType::STDERR, stderr_.unread().size(), ready);
+  Compact(&stdout_);
+  Compact(&stderr_);
+}
+
+std::optional<OutputBatcher::Clock::time_point>
+OutputBatcher::NextDeadline() const {
+  std::optional<Clock::time_point> deadline;
+  for (const Pending *pending : {&stdout_, &stderr_}) {
+    if (pending->unread().empty()) {
+      continue;
+    }
+    Clock::time_point expiry = pending->oldest + options_.max_latency;
+    if (!deadline || expiry < *deadline) {
+      deadline = expiry;
+    }
+  }
+  return deadline;
+}
+
+}  // namespace spiceserver
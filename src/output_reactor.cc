@@ -0,0 +1,284 @@
+#include "output_reactor.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
+
+DEFINE_int32(output_reactor_threads, 1,
+             "Number of event loop threads used to read output from all "
+             "running simulators.");
+DEFINE_int32(output_reactor_buffer_bytes, 64 * 1024,
+             "Size of the read buffer used by each output event loop thread.");
+
+namespace spiceserver {
+
+namespace {
+
+// The most reads we will do to drain a pipe after the child has exited. This
+// stops an orphaned grandchild that keeps the pipe open and keeps writing from
+// holding up the loop forever.
+constexpr int kMaxDrainReads = 1024;
+
+constexpr int kMaxEvents = 64;
+
+}   // namespace
+
+OutputReactor::OutputReactor()
+    : next_id_(1),
+      stopping_(false) {
+  int num_threads = std::max(FLAGS_output_reactor_threads, 1);
+  LOG(INFO) << "Starting " << num_threads << " output reactor thread(s)";
+  for (int i = 0; i < num_threads; ++i) {
+    auto loop = std::make_unique<Loop>();
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    LOG_IF(FATAL, loop->epoll_fd == -1)
+        << "epoll_create1 failed: " << strerror(errno);
+    loop->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    LOG_IF(FATAL, loop->wakeup_fd == -1)
+        << "eventfd failed: " << strerror(errno);
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = EncodeEvent(0, FdKind::WAKEUP);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &event);
+
+    Loop *raw = loop.get();
+    loop->thread = std::thread([this, raw]() { Run(raw); });
+    loops_.push_back(std::move(loop));
+  }
+}
+
+OutputReactor::~OutputReactor() {
+  stopping_ = true;
+  for (auto &loop : loops_) {
+    uint64_t one = 1;
+    ssize_t unused = write(loop->wakeup_fd, &one, sizeof(one));
+    (void)unused;
+  }
+  for (auto &loop : loops_) {
+    if (loop->thread.joinable()) {
+      loop->thread.join();
+    }
+    close(loop->wakeup_fd);
+    close(loop->epoll_fd);
+  }
+}
+
+absl::StatusOr<uint64_t> OutputReactor::Add(
+    int stdout_fd,
+    int stderr_fd,
+    int pidfd,
+    Subprocess::OutputCallback on_output,
+    ExitCallback on_exit) {
+  uint64_t id = next_id_++;
+  Loop *loop = loops_[id % loops_.size()].get();
+
+  auto watch = std::make_shared<Watch>();
+  watch->id = id;
+  watch->stdout_fd = stdout_fd;
+  watch->stderr_fd = stderr_fd;
+  watch->pidfd = pidfd;
+  watch->stdout_open = stdout_fd != -1;
+  watch->stderr_open = stderr_fd != -1;
+  watch->on_output = on_output;
+  watch->on_exit = on_exit;
+  watch->removed = false;
+
+  {
+    std::lock_guard<std::mutex> lock(loop->mutex);
+    loop->watches[id] = watch;
+  }
+
+  struct Registration {
+    int fd;
+    FdKind kind;
+  };
+  std::vector<Registration> registrations = {
+      {stdout_fd, FdKind::STDOUT},
+      {stderr_fd, FdKind::STDERR},
+      {pidfd, FdKind::PIDFD}};
+  for (const Registration &registration : registrations) {
+    if (registration.fd == -1) {
+      continue;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = EncodeEvent(id, registration.kind);
+    if (epoll_ctl(loop->epoll_fd,
+                  EPOLL_CTL_ADD,
+                  registration.fd,
+                  &event) == -1) {
+      std::string message = absl::StrCat(
+          "Could not add fd ", registration.fd, " to epoll set: ",
+          strerror(errno));
+      Remove(id);
+      return absl::InternalError(message);
+    }
+  }
+  return id;
+}
+
+void OutputReactor::Remove(uint64_t id) {
+  Loop *loop = loops_[id % loops_.size()].get();
+  std::shared_ptr<Watch> watch;
+  {
+    std::lock_guard<std::mutex> lock(loop->mutex);
+    auto it = loop->watches.find(id);
+    if (it == loop->watches.end()) {
+      // Already finished (or never added).
+      return;
+    }
+    watch = it->second;
+    loop->watches.erase(it);
+  }
+  std::lock_guard<std::mutex> lock(watch->mutex);
+  if (!watch->removed) {
+    Unregister(loop, watch.get());
+  }
+}
+
+size_t OutputReactor::NumWatched() const {
+  size_t total = 0;
+  for (const auto &loop : loops_) {
+    std::lock_guard<std::mutex> lock(loop->mutex);
+    total += loop->watches.size();
+  }
+  return total;
+}
+
+void OutputReactor::Unregister(Loop *loop, Watch *watch) {
+  for (int fd : {watch->stdout_fd, watch->stderr_fd, watch->pidfd}) {
+    if (fd != -1) {
+      // This fails harmlessly for pipes that already hit EOF and were removed.
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+  }
+  watch->stdout_open = false;
+  watch->stderr_open = false;
+  watch->removed = true;
+}
+
+bool OutputReactor::ReadOnce(Watch *watch,
+                             int fd,
+                             Subprocess::StreamType stream_type,
+                             std::vector<char> *buffer) {
+  ssize_t count = read(fd, buffer->data(), buffer->size());
+  if (count > 0) {
+    watch->on_output(buffer->data(), count, stream_type);
+    return true;
+  }
+  if (count == -1 && (errno == EAGAIN || errno == EINTR)) {
+    return true;
+  }
+  return false;
+}
+
+void OutputReactor::Finish(Loop *loop,
+                           const std::shared_ptr<Watch> &watch,
+                           std::vector<char> *buffer) {
+  struct Drain {
+    int fd;
+    bool *open;
+    Subprocess::StreamType stream_type;
+  };
+  std::vector<Drain> drains = {
+      {watch->stdout_fd, &watch->stdout_open, Subprocess::StreamType::STDOUT},
+      {watch->stderr_fd, &watch->stderr_open, Subprocess::StreamType::STDERR}};
+  for (const Drain &drain : drains) {
+    for (int i = 0; *drain.open && i < kMaxDrainReads; ++i) {
+      ssize_t count = read(drain.fd, buffer->data(), buffer->size());
+      if (count > 0) {
+        watch->on_output(buffer->data(), count, drain.stream_type);
+        continue;
+      }
+      if (count == -1 && errno == EINTR) {
+        continue;
+      }
+      // EOF, EAGAIN (nothing left that was written before exit) or error.
+      break;
+    }
+  }
+
+  Unregister(loop, watch.get());
+  watch->on_exit();
+  // Only now, so that a Remove() meanwhile still finds the watch and waits
+  // for on_exit to return.
+  std::lock_guard<std::mutex> lock(loop->mutex);
+  loop->watches.erase(watch->id);
+}
+
+void OutputReactor::Run(Loop *loop) {
+  std::vector<char> buffer(std::max(FLAGS_output_reactor_buffer_bytes, 4096));
+  struct epoll_event events[kMaxEvents];
+
+  while (!stopping_) {
+    int num_events = epoll_wait(loop->epoll_fd, events, kMaxEvents, -1);
+    if (num_events == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG(ERROR) << "epoll_wait failed: " << strerror(errno);
+      return;
+    }
+
+    for (int i = 0; i < num_events; ++i) {
+      uint64_t id = events[i].data.u64 >> 2;
+      FdKind kind = static_cast<FdKind>(events[i].data.u64 & 0x3);
+      if (kind == FdKind::WAKEUP) {
+        continue;
+      }
+
+      std::shared_ptr<Watch> watch;
+      {
+        std::lock_guard<std::mutex> lock(loop->mutex);
+        auto it = loop->watches.find(id);
+        if (it == loop->watches.end()) {
+          continue;
+        }
+        watch = it->second;
+      }
+
+      std::lock_guard<std::mutex> lock(watch->mutex);
+      if (watch->removed) {
+        continue;
+      }
+
+      switch (kind) {
+        case FdKind::STDOUT:
+          if (watch->stdout_open &&
+              !ReadOnce(watch.get(), watch->stdout_fd,
+                        Subprocess::StreamType::STDOUT, &buffer)) {
+            watch->stdout_open = false;
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->stdout_fd,
+                      nullptr);
+          }
+          break;
+        case FdKind::STDERR:
+          if (watch->stderr_open &&
+              !ReadOnce(watch.get(), watch->stderr_fd,
+                        Subprocess::StreamType::STDERR, &buffer)) {
+            watch->stderr_open = false;
+            epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->stderr_fd,
+                      nullptr);
+          }
+          break;
+        case FdKind::PIDFD:
+          Finish(loop, watch, &buffer);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,265 @@
+#include "output_spool.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+namespace spiceserver {
+
+namespace {
+
+bool PWriteAll(int fd, const char *data, size_t length, uint64_t offset) {
+  while (length > 0) {
+    ssize_t written = pwrite(fd, data, length, offset);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    length -= written;
+    offset += written;
+  }
+  return true;
+}
+
+bool PReadAll(int fd, char *data, size_t length, uint64_t offset) {
+  while (length > 0) {
+    ssize_t count = pread(fd, data, length, offset);
+    if (count == -1 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    data += count;
+    length -= count;
+    offset += count;
+  }
+  return true;
+}
+
+}   // namespace
+
+OutputSpool::OutputSpool(size_t memory_bytes,
+                         const std::filesystem::path &overflow_path)
+    : ring_(std::max(memory_bytes, kHeaderBytes + 1)),
+      ring_head_(0),
+      ring_used_(0),
+      overflow_path_(overflow_path),
+      file_fd_(-1),
+      file_read_offset_(0),
+      file_write_offset_(0),
+      finished_(false),
+      statistics_({0, 0, 0, 0, 0}) {}
+
+OutputSpool::~OutputSpool() {
+  if (file_fd_ != -1) {
+    close(file_fd_);
+    std::error_code error;
+    std::filesystem::remove(overflow_path_, error);
+  }
+}
+
+void OutputSpool::WriteRing(const char *data, size_t length) {
+  size_t tail = (ring_head_ + ring_used_) % ring_.size();
+  size_t first = std::min(length, ring_.size() - tail);
+  memcpy(ring_.data() + tail, data, first);
+  memcpy(ring_.data(), data + first, length - first);
+  ring_used_ += length;
+}
+
+void OutputSpool::ReadRing(char *data, size_t length) {
+  size_t first = std::min(length, ring_.size() - ring_head_);
+  memcpy(data, ring_.data() + ring_head_, first);
+  memcpy(data + first, ring_.data(), length - first);
+  ring_head_ = (ring_head_ + length) % ring_.size();
+  ring_used_ -= length;
+}
+
+bool OutputSpool::AppendToFile(Subprocess::StreamType stream_type,
+                               const char *data,
+                               size_t length) {
+  if (file_fd_ == -1) {
+    file_fd_ = open(overflow_path_.c_str(),
+                    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0600);
+    if (file_fd_ == -1) {
+      LOG(ERROR) << "Could not open output spool file " << overflow_path_
+                 << ": " << strerror(errno);
+      return false;
+    }
+    LOG(INFO) << "Output spool overflowing to " << overflow_path_;
+  }
+
+  char header[kHeaderBytes];
+  header[0] = static_cast<char>(stream_type);
+  uint32_t length_32 = static_cast<uint32_t>(length);
+  memcpy(header + 1, &length_32, sizeof(length_32));
+
+  if (!PWriteAll(file_fd_, header, kHeaderBytes, file_write_offset_) ||
+      !PWriteAll(file_fd_, data, length, file_write_offset_ + kHeaderBytes)) {
+    LOG(ERROR) << "Could not write to output spool file " << overflow_path_
+               << ": " << strerror(errno);
+    return false;
+  }
+  file_write_offset_ += kHeaderBytes + length;
+  return true;
+}
+
+bool OutputSpool::ReadRecordFromFile(Subprocess::StreamType *stream_type,
+                                     std::string *data) {
+  char header[kHeaderBytes];
+  if (!PReadAll(file_fd_, header, kHeaderBytes, file_read_offset_)) {
+    return false;
+  }
+  uint32_t length;
+  memcpy(&length, header + 1, sizeof(length));
+  *stream_type = static_cast<Subprocess::StreamType>(header[0]);
+
+  size_t offset = data->size();
+  data->resize(offset + length);
+  if (!PReadAll(file_fd_, data->data() + offset, length,
+                file_read_offset_ + kHeaderBytes)) {
+    data->resize(offset);
+    return false;
+  }
+  file_read_offset_ += kHeaderBytes + length;
+  return true;
+}
+
+void OutputSpool::Append(Subprocess::StreamType stream_type,
+                         const char *data,
+                         size_t length) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  statistics_.total_bytes += length;
+
+  bool file_has_backlog = file_write_offset_ > file_read_offset_;
+  size_t record_bytes = kHeaderBytes + length;
+  if (!file_has_backlog && ring_used_ + record_bytes <= ring_.size()) {
+    char header[kHeaderBytes];
+    header[0] = static_cast<char>(stream_type);
+    uint32_t length_32 = static_cast<uint32_t>(length);
+    memcpy(header + 1, &length_32, sizeof(length_32));
+    WriteRing(header, kHeaderBytes);
+    WriteRing(data, length);
+    statistics_.memory_high_water_bytes = std::max(
+        statistics_.memory_high_water_bytes,
+        static_cast<uint64_t>(ring_used_));
+  } else if (AppendToFile(stream_type, data, length)) {
+    statistics_.spilled_bytes += length;
+  } else {
+    statistics_.dropped_bytes += length;
+  }
+
+  statistics_.backlog_high_water_bytes = std::max(
+      statistics_.backlog_high_water_bytes, Backlog());
+  data_available_.notify_one();
+
+  std::function<void()> callback = std::move(readable_callback_);
+  readable_callback_ = nullptr;
+  lock.unlock();
+  if (callback) {
+    callback();
+  }
+}
+
+void OutputSpool::Finish() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  finished_ = true;
+  data_available_.notify_one();
+
+  std::function<void()> callback = std::move(readable_callback_);
+  readable_callback_ = nullptr;
+  lock.unlock();
+  if (callback) {
+    callback();
+  }
+}
+
+void OutputSpool::NotifyWhenReadable(std::function<void()> callback) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!finished_ && Backlog() == 0) {
+      readable_callback_ = std::move(callback);
+      return;
+    }
+  }
+  callback();
+}
+
+bool OutputSpool::Read(Subprocess::OutputCallback callback,
+                       std::chrono::milliseconds timeout,
+                       size_t max_bytes) {
+  // Records are copied out under the lock and handed over after it is
+  // released.
+  std::string data;
+  std::vector<std::pair<Subprocess::StreamType, size_t>> records;
+  bool more;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    data_available_.wait_for(lock, timeout, [this]() {
+      return finished_ || Backlog() > 0;
+    });
+
+    while (data.size() < max_bytes) {
+      Subprocess::StreamType stream_type;
+      size_t offset = data.size();
+      if (ring_used_ > 0) {
+        char header[kHeaderBytes];
+        ReadRing(header, kHeaderBytes);
+        uint32_t length;
+        memcpy(&length, header + 1, sizeof(length));
+        stream_type = static_cast<Subprocess::StreamType>(header[0]);
+        data.resize(offset + length);
+        ReadRing(data.data() + offset, length);
+      } else if (file_write_offset_ > file_read_offset_) {
+        if (!ReadRecordFromFile(&stream_type, &data)) {
+          LOG(ERROR) << "Could not read from output spool file "
+                     << overflow_path_ << "; discarding it";
+          statistics_.dropped_bytes += file_write_offset_ - file_read_offset_;
+          file_read_offset_ = file_write_offset_;
+          break;
+        }
+      } else {
+        break;
+      }
+      records.emplace_back(stream_type, data.size() - offset);
+    }
+
+    if (file_fd_ != -1 && file_write_offset_ > 0 &&
+        file_read_offset_ == file_write_offset_) {
+      // Caught up; start the file again from empty.
+      if (ftruncate(file_fd_, 0) == -1) {
+        LOG(WARNING) << "Could not truncate output spool file "
+                     << overflow_path_ << ": " << strerror(errno);
+      }
+      file_read_offset_ = 0;
+      file_write_offset_ = 0;
+    }
+
+    more = !finished_ || Backlog() > 0;
+  }
+
+  size_t offset = 0;
+  for (const auto &record : records) {
+    callback(data.data() + offset, record.second, record.first);
+    offset += record.second;
+  }
+  return more;
+}
+
+OutputSpool::Statistics OutputSpool::statistics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return statistics_;
+}
+
+}  // namespace spiceserver
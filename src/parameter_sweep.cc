@@ -0,0 +1,349 @@
+#include "parameter_sweep.h"
+
+#include <cctype>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/string_view.h>
+
+DEFINE_uint64(max_sweep_points, 100000,
+              "The most points a single RunSweep may have.");
+
+namespace spiceserver {
+
+namespace {
+
+absl::Status CheckNames(
+    const google::protobuf::RepeatedPtrField<SweepParameter> &parameters) {
+  std::set<std::string> names;
+  for (const SweepParameter &parameter : parameters) {
+    if (parameter.name().empty()) {
+      return absl::InvalidArgumentError("Sweep parameter has no name");
+    }
+    if (!names.insert(absl::AsciiStrToLower(parameter.name())).second) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Sweep parameter \"", parameter.name(), "\" given twice"));
+    }
+    if (parameter.values().empty()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Sweep parameter \"", parameter.name(), "\" has no values"));
+    }
+  }
+  return absl::OkStatus();
+}
+
+absl::Status TooManyPoints() {
+  return absl::InvalidArgumentError(absl::StrCat(
+      "Sweep has more than the maximum of ", FLAGS_max_sweep_points,
+      " points"));
+}
+
+absl::StatusOr<std::vector<SweepPoint>> ExpandGrid(const ParameterGrid &grid) {
+  absl::Status names = CheckNames(grid.parameters());
+  if (!names.ok()) {
+    return names;
+  }
+  uint64_t total = grid.parameters().empty() ? 0 : 1;
+  for (const SweepParameter &parameter : grid.parameters()) {
+    total *= parameter.values_size();
+    if (total > FLAGS_max_sweep_points) {
+      return TooManyPoints();
+    }
+  }
+
+  std::vector<SweepPoint> points;
+  points.reserve(total);
+  for (uint64_t index = 0; index < total; ++index) {
+    // Decompose index with the last parameter as the least significant digit.
+    SweepPoint point(grid.parameters_size());
+    uint64_t remainder = index;
+    for (int i = grid.parameters_size() - 1; i >= 0; --i) {
+      const SweepParameter &parameter = grid.parameters(i);
+      point[i] = {parameter.name(),
+                  parameter.values(remainder % parameter.values_size())};
+      remainder /= parameter.values_size();
+    }
+    points.push_back(std::move(point));
+  }
+  return points;
+}
+
+absl::StatusOr<std::vector<SweepPoint>> ExpandList(const ParameterList &list) {
+  absl::Status names = CheckNames(list.parameters());
+  if (!names.ok()) {
+    return names;
+  }
+  if (list.parameters().empty()) {
+    return std::vector<SweepPoint>();
+  }
+  int total = list.parameters(0).values_size();
+  for (const SweepParameter &parameter : list.parameters()) {
+    if (parameter.values_size() != total) {
+      return absl::InvalidArgumentError(
+          "All parameters of a list sweep must have the same number of "
+          "values");
+    }
+  }
+  if (static_cast<uint64_t>(total) > FLAGS_max_sweep_points) {
+    return TooManyPoints();
+  }
+
+  std::vector<SweepPoint> points;
+  points.reserve(total);
+  for (int index = 0; index < total; ++index) {
+    SweepPoint point;
+    for (const SweepParameter &parameter : list.parameters()) {
+      point.emplace_back(parameter.name(), parameter.values(index));
+    }
+    points.push_back(std::move(point));
+  }
+  return points;
+}
+
+absl::StatusOr<std::vector<SweepPoint>> ExpandMonteCarlo(
+    const MonteCarlo &monte_carlo) {
+  if (monte_carlo.samples() > FLAGS_max_sweep_points) {
+    return TooManyPoints();
+  }
+  std::set<std::string> names;
+  if (!monte_carlo.seed_parameter().empty()) {
+    names.insert(absl::AsciiStrToLower(monte_carlo.seed_parameter()));
+  }
+  for (const MonteCarloParameter &parameter : monte_carlo.parameters()) {
+    if (parameter.name().empty()) {
+      return absl::InvalidArgumentError("Sweep parameter has no name");
+    }
+    if (!names.insert(absl::AsciiStrToLower(parameter.name())).second) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Sweep parameter \"", parameter.name(), "\" given twice"));
+    }
+    if (parameter.distribution() == MonteCarloParameter::GAUSSIAN &&
+        parameter.sigma() < 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Sweep parameter \"", parameter.name(), "\" has negative sigma"));
+    }
+    if (parameter.distribution() == MonteCarloParameter::UNIFORM &&
+        parameter.max() < parameter.min()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Sweep parameter \"", parameter.name(), "\" has max < min"));
+    }
+  }
+  if (names.empty()) {
+    return absl::InvalidArgumentError("Monte Carlo sweep has no parameters");
+  }
+
+  // Draws are made in order, point by point, so that the points depend only
+  // on the seed.
+  std::mt19937_64 generator(monte_carlo.seed());
+  std::vector<SweepPoint> points;
+  points.reserve(monte_carlo.samples());
+  for (uint32_t index = 0; index < monte_carlo.samples(); ++index) {
+    SweepPoint point;
+    if (!monte_carlo.seed_parameter().empty()) {
+      point.emplace_back(monte_carlo.seed_parameter(),
+                         static_cast<double>(monte_carlo.seed() + index));
+    }
+    for (const MonteCarloParameter &parameter : monte_carlo.parameters()) {
+      double value;
+      switch (parameter.distribution()) {
+        case MonteCarloParameter::UNIFORM:
+          value = std::uniform_real_distribution<double>(
+              parameter.min(), parameter.max())(generator);
+          break;
+        case MonteCarloParameter::GAUSSIAN:
+        default:
+          value = parameter.sigma() == 0 ?
+              parameter.mean() :
+              std::normal_distribution<double>(
+                  parameter.mean(), parameter.sigma())(generator);
+          break;
+      }
+      point.emplace_back(parameter.name(), value);
+    }
+    points.push_back(std::move(point));
+  }
+  return points;
+}
+
+// The value of a .param assignment starting at text[start]: a braced or
+// quoted expression, or everything up to the next space. Returns where it
+// ends.
+size_t ValueEnd(absl::string_view text, size_t start) {
+  if (start >= text.size()) {
+    return start;
+  }
+  char open = text[start];
+  if (open == '{') {
+    int depth = 0;
+    for (size_t i = start; i < text.size(); ++i) {
+      if (text[i] == '{') {
+        ++depth;
+      } else if (text[i] == '}' && --depth == 0) {
+        return i + 1;
+      }
+    }
+    return text.size();
+  }
+  if (open == '\'' || open == '"') {
+    size_t close = text.find(open, start + 1);
+    return close == absl::string_view::npos ? text.size() : close + 1;
+  }
+  size_t i = start;
+  while (i < text.size() &&
+         !std::isspace(static_cast<unsigned char>(text[i]))) {
+    ++i;
+  }
+  return i;
+}
+
+// Rewrites the name=value assignments in the rest of a .param line.
+void RewriteAssignments(absl::string_view text,
+                        const std::map<std::string, double> &values,
+                        std::set<std::string> *replaced,
+                        std::string *out) {
+  size_t i = 0;
+  while (i < text.size()) {
+    // Copy separators.
+    while (i < text.size() &&
+           (std::isspace(static_cast<unsigned char>(text[i])) ||
+            text[i] == ',')) {
+      out->push_back(text[i++]);
+    }
+    size_t name_start = i;
+    while (i < text.size() &&
+           !std::isspace(static_cast<unsigned char>(text[i])) &&
+           text[i] != '=') {
+      ++i;
+    }
+    std::string name(text.substr(name_start, i - name_start));
+    size_t equals = i;
+    while (equals < text.size() &&
+           std::isspace(static_cast<unsigned char>(text[equals]))) {
+      ++equals;
+    }
+    if (name.empty() || equals >= text.size() || text[equals] != '=') {
+      // Not an assignment (perhaps a comment); leave the rest alone.
+      absl::StrAppend(out, text.substr(name_start));
+      return;
+    }
+    size_t value_start = equals + 1;
+    while (value_start < text.size() &&
+           std::isspace(static_cast<unsigned char>(text[value_start]))) {
+      ++value_start;
+    }
+    size_t value_end = ValueEnd(text, value_start);
+    absl::StrAppend(out, text.substr(name_start, value_start - name_start));
+
+    std::string key = absl::AsciiStrToLower(name);
+    auto it = values.find(key);
+    if (it != values.end()) {
+      absl::StrAppend(out, ParameterSweep::FormatValue(it->second));
+      replaced->insert(key);
+    } else {
+      absl::StrAppend(out, text.substr(value_start, value_end - value_start));
+    }
+    i = value_end;
+  }
+}
+
+// If line (less leading space) starts with keyword, as a whole word, returns
+// the offset just past it.
+bool StartsWithKeyword(absl::string_view line, absl::string_view keyword,
+                       size_t *after) {
+  size_t start = 0;
+  while (start < line.size() &&
+         std::isspace(static_cast<unsigned char>(line[start]))) {
+    ++start;
+  }
+  absl::string_view rest = line.substr(start);
+  if (!absl::StartsWithIgnoreCase(rest, keyword)) {
+    return false;
+  }
+  if (rest.size() > keyword.size() &&
+      !std::isspace(static_cast<unsigned char>(rest[keyword.size()]))) {
+    return false;
+  }
+  *after = start + keyword.size();
+  return true;
+}
+
+}   // namespace
+
+absl::StatusOr<std::vector<SweepPoint>> ParameterSweep::Expand(
+    const SweepRequest &request) {
+  absl::StatusOr<std::vector<SweepPoint>> points;
+  switch (request.sweep_case()) {
+    case SweepRequest::kGrid:
+      points = ExpandGrid(request.grid());
+      break;
+    case SweepRequest::kList:
+      points = ExpandList(request.list());
+      break;
+    case SweepRequest::kMonteCarlo:
+      points = ExpandMonteCarlo(request.monte_carlo());
+      break;
+    default:
+      return absl::InvalidArgumentError("No sweep given");
+  }
+  if (points.ok() && points->empty()) {
+    return absl::InvalidArgumentError("Sweep has no points");
+  }
+  return points;
+}
+
+std::string ParameterSweep::FormatValue(double value) {
+  return absl::StrFormat("%.17g", value);
+}
+
+std::string ParameterSweep::RewriteParameters(
+    const std::string &netlist,
+    const SweepPoint &point,
+    std::set<std::string> *replaced) {
+  std::map<std::string, double> values;
+  for (const auto &entry : point) {
+    values[absl::AsciiStrToLower(entry.first)] = entry.second;
+  }
+
+  std::string out;
+  out.reserve(netlist.size());
+  bool in_param = false;
+  bool first = true;
+  for (absl::string_view line : absl::StrSplit(netlist, '\n')) {
+    if (!first) {
+      out.push_back('\n');
+    }
+    first = false;
+
+    size_t after;
+    size_t first_char = line.find_first_not_of(" \t");
+    if (StartsWithKeyword(line, ".param", &after)) {
+      in_param = true;
+    } else if (in_param && first_char != absl::string_view::npos &&
+               line[first_char] == '+') {
+      // Continuation of the .param above.
+      after = first_char + 1;
+    } else {
+      in_param = false;
+      absl::StrAppend(&out, line);
+      continue;
+    }
+    absl::StrAppend(&out, line.substr(0, after));
+    RewriteAssignments(line.substr(after), values, replaced, &out);
+  }
+  return out;
+}
+
+}  // namespace spiceserver
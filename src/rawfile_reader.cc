@@ -0,0 +1,299 @@
+#include "rawfile_reader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/strings/string_view.h>
+
+DEFINE_uint64(waveform_chunk_bytes, 1 << 20,
+              "About how many bytes of samples to send in each WaveformChunk.");
+
+namespace spiceserver {
+
+namespace {
+
+// Takes the next line (without its end) off the front of text, if there is a
+// whole one.
+bool TakeLine(absl::string_view *text, absl::string_view *line) {
+  size_t end = text->find('\n');
+  if (end == absl::string_view::npos) {
+    return false;
+  }
+  *line = text->substr(0, end);
+  text->remove_prefix(end + 1);
+  if (!line->empty() && line->back() == '\r') {
+    line->remove_suffix(1);
+  }
+  return true;
+}
+
+}   // namespace
+
+absl::StatusOr<std::unique_ptr<RawfileReader>> RawfileReader::Open(
+    const std::filesystem::path &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return absl::NotFoundError(absl::StrCat(
+        "Could not open ", path.string(), ": ", strerror(errno)));
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    int error = errno;
+    close(fd);
+    return absl::InternalError(absl::StrCat(
+        "Could not stat ", path.string(), ": ", strerror(error)));
+  }
+  if (info.st_size == 0) {
+    close(fd);
+    return absl::DataLossError(absl::StrCat(path.string(), " is empty"));
+  }
+  size_t size = info.st_size;
+  void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  int error = errno;
+  // The mapping keeps the file.
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return absl::InternalError(absl::StrCat(
+        "Could not map ", path.string(), ": ", strerror(error)));
+  }
+  madvise(mapping, size, MADV_SEQUENTIAL);
+
+  std::unique_ptr<RawfileReader> reader(new RawfileReader(mapping, size));
+  absl::Status status = reader->Parse();
+  if (!status.ok()) {
+    return absl::Status(status.code(), absl::StrCat(
+        path.string(), ": ", status.message()));
+  }
+  return reader;
+}
+
+RawfileReader::RawfileReader(void *mapping, size_t size)
+    : mapping_(mapping), size_(size) {}
+
+RawfileReader::~RawfileReader() {
+  munmap(mapping_, size_);
+}
+
+absl::Status RawfileReader::Parse() {
+  absl::string_view rest(static_cast<const char*>(mapping_), size_);
+  while (!absl::StripLeadingAsciiWhitespace(rest).empty()) {
+    Plot plot {"", "", false, {}, 0, nullptr};
+    int64_t num_variables = -1;
+    int64_t num_points = -1;
+
+    absl::string_view line;
+    while (true) {
+      if (!TakeLine(&rest, &line)) {
+        return absl::DataLossError("Header is incomplete");
+      }
+      size_t colon = line.find(':');
+      if (colon == absl::string_view::npos) {
+        continue;
+      }
+      absl::string_view key = line.substr(0, colon);
+      absl::string_view value =
+          absl::StripAsciiWhitespace(line.substr(colon + 1));
+      if (key == "Title") {
+        plot.title = std::string(value);
+      } else if (key == "Plotname") {
+        plot.name = std::string(value);
+      } else if (key == "Flags") {
+        plot.complex = absl::StrContains(value, "complex");
+      } else if (key == "No. Variables") {
+        if (!absl::SimpleAtoi(value, &num_variables) || num_variables <= 0) {
+          return absl::DataLossError(absl::StrCat(
+              "Bad number of variables: ", value));
+        }
+      } else if (key == "No. Points") {
+        // Left blank (or 0, in ngspice) to be filled in later, while the
+        // plot is being written; see below.
+        if (value.empty()) {
+          continue;
+        }
+        if (!absl::SimpleAtoi(value, &num_points) || num_points < 0) {
+          return absl::DataLossError(absl::StrCat(
+              "Bad number of points: ", value));
+        }
+      } else if (key == "Variables") {
+        if (num_variables <= 0) {
+          return absl::DataLossError("Variables before their number");
+        }
+        for (int64_t i = 0; i < num_variables; ++i) {
+          if (!TakeLine(&rest, &line)) {
+            return absl::DataLossError("Variables are incomplete");
+          }
+          std::vector<absl::string_view> fields = absl::StrSplit(
+              line, absl::ByAnyChar(" \t"), absl::SkipEmpty());
+          if (fields.size() < 3) {
+            return absl::DataLossError(absl::StrCat(
+                "Bad variable: ", line));
+          }
+          WaveformSignal signal;
+          signal.set_name(std::string(fields[1]));
+          signal.set_type(std::string(fields[2]));
+          plot.signals.push_back(std::move(signal));
+        }
+      } else if (key == "Binary") {
+        break;
+      } else if (key == "Values") {
+        return absl::UnimplementedError("ASCII rawfiles are not supported");
+      }
+    }
+    if (plot.signals.empty()) {
+      return absl::DataLossError(absl::StrCat(
+          "Plot ", plot.name, " has no variables"));
+    }
+
+    size_t row_bytes =
+        plot.signals.size() * (plot.complex ? 2 : 1) * sizeof(double);
+    uint64_t available = rest.size() / row_bytes;
+    // A plot without its number of points, unless another plot follows at
+    // once (so it really has none), is the last, still being written: it
+    // has as many whole points as there are, and anything after is part of
+    // the next.
+    bool being_written = num_points < 0 ||
+        (num_points == 0 && !rest.empty() &&
+         !absl::StartsWith(rest, "Title:"));
+    bool truncated = being_written ||
+        static_cast<uint64_t>(num_points) > available;
+    plot.num_points = truncated ? available : num_points;
+    plot.data = rest.data();
+    rest.remove_prefix(plot.num_points * row_bytes);
+    plots_.push_back(std::move(plot));
+    if (truncated) {
+      break;
+    }
+  }
+  if (plots_.empty()) {
+    return absl::DataLossError("No plots");
+  }
+  return absl::OkStatus();
+}
+
+void RawfileReader::ReadSignal(size_t plot,
+                               size_t signal,
+                               uint64_t first_point,
+                               uint64_t num_points,
+                               double *out) const {
+  Transpose(plot, signal, signal + 1, first_point, num_points, out);
+}
+
+void RawfileReader::FillChunk(size_t plot,
+                              uint64_t first_point,
+                              uint64_t num_points,
+                              bool single_precision,
+                              WaveformChunk *chunk) const {
+  const Plot &source = plots_[plot];
+  size_t values = num_points * source.signals.size() * (source.complex ? 2 : 1);
+  if (single_precision) {
+    chunk->mutable_float_values()->Resize(values, 0);
+    Transpose(plot, 0, source.signals.size(), first_point, num_points,
+              chunk->mutable_float_values()->mutable_data());
+  } else {
+    chunk->mutable_values()->Resize(values, 0);
+    Transpose(plot, 0, source.signals.size(), first_point, num_points,
+              chunk->mutable_values()->mutable_data());
+  }
+}
+
+template <typename Value>
+void RawfileReader::Transpose(size_t plot,
+                              size_t first_signal,
+                              size_t end_signal,
+                              uint64_t first_point,
+                              uint64_t num_points,
+                              Value *out) const {
+  const Plot &source = plots_[plot];
+  size_t parts = source.complex ? 2 : 1;
+  size_t row_bytes = source.signals.size() * parts * sizeof(double);
+  const char *rows = source.data + first_point * row_bytes;
+  for (size_t column = first_signal * parts; column < end_signal * parts;
+       ++column) {
+    size_t signal = column / parts - first_signal;
+    size_t part = column % parts;
+    Value *column_out = out + signal * num_points * parts + part;
+    const char *in = rows + column * sizeof(double);
+    for (uint64_t point = 0; point < num_points; ++point) {
+      // The mapping needn't be aligned for doubles.
+      double value;
+      memcpy(&value, in, sizeof(value));
+      column_out[point * parts] = value;
+      in += row_bytes;
+    }
+  }
+}
+
+WaveformStream::WaveformStream(std::unique_ptr<RawfileReader> reader,
+                               const WaveformOptions &options)
+    : reader_(std::move(reader)),
+      options_(options),
+      plot_(0),
+      next_point_(0),
+      started_plot_(false) {}
+
+uint64_t WaveformStream::PointsPerChunk(
+    const RawfileReader::Plot &plot) const {
+  uint64_t point_bytes = plot.signals.size() * (plot.complex ? 2 : 1) *
+      (options_.single_precision() ? sizeof(float) : sizeof(double));
+  uint64_t points = std::max<uint64_t>(
+      1, FLAGS_waveform_chunk_bytes / point_bytes);
+  if (options_.max_points_per_chunk() > 0) {
+    points = std::min<uint64_t>(points, options_.max_points_per_chunk());
+  }
+  return points;
+}
+
+bool WaveformStream::Next(WaveformChunk *chunk) {
+  const std::vector<RawfileReader::Plot> &plots = reader_->plots();
+  while (plot_ < plots.size()) {
+    const RawfileReader::Plot &plot = plots[plot_];
+    if (started_plot_ && next_point_ >= plot.num_points) {
+      ++plot_;
+      next_point_ = 0;
+      started_plot_ = false;
+      continue;
+    }
+    chunk->Clear();
+    chunk->set_plot(plot_);
+    if (!started_plot_) {
+      chunk->set_plot_name(plot.name);
+      for (const WaveformSignal &signal : plot.signals) {
+        *chunk->add_signals() = signal;
+      }
+      started_plot_ = true;
+    }
+    chunk->set_complex(plot.complex);
+    uint64_t num_points = std::min(PointsPerChunk(plot),
+                                   plot.num_points - next_point_);
+    chunk->set_first_point(next_point_);
+    chunk->set_num_points(num_points);
+    reader_->FillChunk(plot_, next_point_, num_points,
+                       options_.single_precision(), chunk);
+    next_point_ += num_points;
+    chunk->set_last(next_point_ >= plot.num_points);
+    return true;
+  }
+  return false;
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,317 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/util/delimited_message_util.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/string_view.h>
+
+#include "cgroup_manager.h"
+#include "lru_directory.h"
+#include "output_batcher.h"
+#include "sha256.h"
+#include "simulator_registry.h"
+
+DEFINE_string(result_cache_dir, "",
+              "If set, keep the results of simulations here and replay them "
+              "for identical requests.");
+DEFINE_uint64(result_cache_max_bytes, 1ULL << 30,
+              "How big the result cache may grow before the least recently "
+              "used results are removed.");
+
+namespace spiceserver {
+
+namespace {
+
+// Changing what goes into a key (or how results are stored) should change
+// this, so that old entries are never mistaken for new ones.
+constexpr char kKeyVersion[] = "spiceserver-result-cache-3";
+
+std::string SerializeDeterministically(
+    const google::protobuf::MessageLite &message) {
+  std::string out;
+  {
+    google::protobuf::io::StringOutputStream stream(&out);
+    google::protobuf::io::CodedOutputStream coded(&stream);
+    coded.SetSerializationDeterministic(true);
+    message.SerializeToCodedStream(&coded);
+  }
+  return out;
+}
+
+bool ReadResponses(const std::filesystem::path &path,
+                   std::vector<SimulationResponse> *responses) {
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  google::protobuf::io::IstreamInputStream stream(&in);
+  responses->clear();
+  while (true) {
+    SimulationResponse response;
+    bool clean_eof = false;
+    if (!google::protobuf::util::ParseDelimitedFromZeroCopyStream(
+            &response, &stream, &clean_eof)) {
+      return clean_eof;
+    }
+    responses->push_back(std::move(response));
+  }
+}
+
+}   // namespace
+
+ResultCache::ResultCache()
+    : next_temporary_(0) {}
+
+absl::Status ResultCache::Initialise() {
+  if (FLAGS_result_cache_dir.empty()) {
+    return absl::OkStatus();
+  }
+  return Open(FLAGS_result_cache_dir, FLAGS_result_cache_max_bytes);
+}
+
+absl::Status ResultCache::Open(const std::filesystem::path &directory,
+                               uint64_t max_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Anything that isn't an entry (like the remains of an interrupted Store)
+  // is removed.
+  absl::Status status = entries_.Open(
+      directory, max_bytes,
+      [](const std::filesystem::directory_entry &file) {
+        std::error_code error;
+        return file.is_regular_file(error) &&
+            Sha256::IsHexDigest(file.path().filename().string());
+      });
+  if (!status.ok() || directory.empty()) {
+    return status;
+  }
+  LOG(INFO) << "Result cache in " << directory << ": " << entries_.size()
+            << " results, " << entries_.total_bytes() << " bytes";
+  return absl::OkStatus();
+}
+
+bool ResultCache::enabled() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !entries_.directory().empty();
+}
+
+uint64_t ResultCache::total_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.total_bytes();
+}
+
+absl::StatusOr<std::string> ResultCache::KeyFor(
+    const SimulationRequest &request) {
+  auto simulator_info =
+      SimulatorRegistry::GetInstance().GetSimulatorInfo(request.simulator());
+  if (!simulator_info) {
+    return absl::NotFoundError("No simulator found.");
+  }
+
+  Sha256 hash;
+  hash.AddField(kKeyVersion);
+  hash.AddField(static_cast<uint64_t>(request.simulator()));
+  hash.AddField(simulator_info->path);
+  hash.AddField(simulator_info->version);
+  // Catches a simulator replaced in place without a change of version.
+  std::error_code error;
+  uint64_t size = std::filesystem::file_size(simulator_info->path, error);
+  hash.AddField(error ? 0 : size);
+  auto modified = std::filesystem::last_write_time(simulator_info->path, error);
+  hash.AddField(error ? 0 : modified.time_since_epoch().count());
+
+  if (request.has_vlsir_sim_input()) {
+    hash.AddField("vlsir");
+    hash.AddField(SerializeDeterministically(request.vlsir_sim_input()));
+  } else {
+    // The first file is the one given to the simulator; the rest are only
+    // put in place, so their order doesn't matter.
+    const auto &files = request.verbatim_files().files();
+    hash.AddField("verbatim");
+    std::vector<const FileInfo*> sorted;
+    for (const FileInfo &file : files) {
+      sorted.push_back(&file);
+    }
+    if (!sorted.empty()) {
+      hash.AddField(sorted.front()->path());
+      std::sort(sorted.begin() + 1, sorted.end(),
+                [](const FileInfo *lhs, const FileInfo *rhs) {
+                  return lhs->path() < rhs->path();
+                });
+    }
+    hash.AddField(sorted.size());
+    for (const FileInfo *file : sorted) {
+      hash.AddField(file->path());
+      hash.AddField(file->data());
+      hash.AddField(file->blob_digest());
+    }
+  }
+
+  hash.AddField(request.additional_args_size());
+  for (const std::string &arg : request.additional_args()) {
+    hash.AddField(arg);
+  }
+
+  // A run cut short by its limits (out of memory, say) still exits, and is
+  // stored; it's only the same result under the same limits.
+  CgroupManager::Limits limits =
+      CgroupManager::LimitsFromRequest(request.limits());
+  uint64_t cpus;
+  static_assert(sizeof(cpus) == sizeof(limits.cpus));
+  std::memcpy(&cpus, &limits.cpus, sizeof(cpus));
+  hash.AddField(cpus);
+  hash.AddField(limits.memory_bytes);
+  hash.AddField(limits.max_pids);
+
+  // The responses are stored as they were batched, which the client chose.
+  OutputBatcher::Options batching =
+      OutputBatcher::OptionsFromRequest(request.output_batching());
+  hash.AddField(batching.max_bytes);
+  hash.AddField(batching.line_framed);
+  hash.AddField(batching.as_lines);
+  hash.AddField(batching.disabled);
+  return hash.HexDigest();
+}
+
+ResultCache::LookupResult ResultCache::Lookup(
+    const std::string &key,
+    std::vector<SimulationResponse> *responses,
+    std::function<void()> on_done) {
+  std::filesystem::path path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto waiting = in_flight_.find(key);
+    if (waiting != in_flight_.end()) {
+      waiting->second.push_back(std::move(on_done));
+      return LookupResult::IN_FLIGHT;
+    }
+    if (!entries_.Touch(key)) {
+      in_flight_[key];
+      return LookupResult::MISS;
+    }
+    path = entries_.PathFor(key);
+  }
+
+  // Read without the lock; if the entry is evicted meanwhile, the read fails
+  // and this is a miss after all.
+  if (ReadResponses(path, responses)) {
+    // So that the order survives a restart.
+    std::error_code error;
+    std::filesystem::last_write_time(
+        path, std::filesystem::file_time_type::clock::now(), error);
+    return LookupResult::HIT;
+  }
+  LOG(WARNING) << "Could not read cached result " << path;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.Remove(key);
+  auto waiting = in_flight_.find(key);
+  if (waiting != in_flight_.end()) {
+    waiting->second.push_back(std::move(on_done));
+    return LookupResult::IN_FLIGHT;
+  }
+  in_flight_[key];
+  return LookupResult::MISS;
+}
+
+void ResultCache::Store(const std::string &key,
+                        const std::vector<SimulationResponse> &responses) {
+  std::filesystem::path path;
+  std::filesystem::path temporary;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!entries_.directory().empty()) {
+      path = entries_.PathFor(key);
+      temporary = entries_.directory() /
+                  absl::StrCat(key, ".", next_temporary_++);
+    }
+  }
+  if (path.empty()) {
+    Abandon(key);
+    return;
+  }
+
+  // Written aside and renamed into place, so that a reader never sees half
+  // an entry.
+  bool written;
+  {
+    std::ofstream out(temporary,
+                      std::ios::out | std::ios::binary | std::ios::trunc);
+    written = static_cast<bool>(out);
+    for (const SimulationResponse &response : responses) {
+      if (!written) {
+        break;
+      }
+      written = google::protobuf::util::SerializeDelimitedToOstream(
+          response, &out);
+    }
+    out.close();
+    written = written && !out.fail();
+  }
+  std::error_code error;
+  uint64_t size = 0;
+  if (written) {
+    size = std::filesystem::file_size(temporary, error);
+    if (!error) {
+      std::filesystem::rename(temporary, path, error);
+    }
+  }
+  if (!written || error) {
+    LOG(WARNING) << "Could not store result " << key << " in cache: "
+                 << (error ? error.message() : "write failed");
+    std::filesystem::remove(temporary, error);
+    Abandon(key);
+    return;
+  }
+
+  std::vector<std::function<void()>> waiting;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.Add(key, size);
+    waiting = EndFlight(key);
+  }
+  for (auto &on_done : waiting) {
+    on_done();
+  }
+}
+
+void ResultCache::Abandon(const std::string &key) {
+  std::vector<std::function<void()>> waiting;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    waiting = EndFlight(key);
+  }
+  for (auto &on_done : waiting) {
+    on_done();
+  }
+}
+
+std::vector<std::function<void()>> ResultCache::EndFlight(
+    const std::string &key) {
+  std::vector<std::function<void()>> waiting;
+  auto it = in_flight_.find(key);
+  if (it != in_flight_.end()) {
+    waiting = std::move(it->second);
+    in_flight_.erase(it);
+  }
+  return waiting;
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,450 @@
+#include "result_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/status/statusor.h>
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+
+#include "lru_directory.h"
+#include "rawfile_reader.h"
+#include "sha256.h"
+#include "proto/result_store.pb.h"
+
+DEFINE_string(result_store_dir, "",
+              "If set, keep the waveforms of simulations that ask for it "
+              "here, for GetWaveform.");
+DEFINE_uint64(result_store_max_bytes, 16ULL << 30,
+              "How big the result store may grow before the least recently "
+              "used results are removed.");
+
+namespace spiceserver {
+
+namespace {
+
+constexpr char kIndexFileName[] = "index.pb";
+
+// Goldens are kept apart from results, and never evicted.
+constexpr char kGoldenDirectory[] = "goldens";
+
+// How many times a golden that is replaced while being read is read again.
+constexpr int kGoldenReadAttempts = 10;
+
+// How many points of a signal are copied out of the rawfile at a time.
+constexpr uint64_t kPointsPerWrite = 1 << 17;
+
+constexpr size_t kResultIdLength = 32;
+
+std::filesystem::path PlotFileName(size_t plot) {
+  return absl::StrCat("plot_", plot, ".bin");
+}
+
+absl::Status ErrnoError(const std::string &what, int error) {
+  return absl::UnavailableError(absl::StrCat(what, ": ", strerror(error)));
+}
+
+std::string NewResultId() {
+  static std::mutex mutex;
+  static std::mt19937_64 generator(std::random_device{}());
+  std::lock_guard<std::mutex> lock(mutex);
+  return absl::StrFormat("%016x%016x", generator(), generator());
+}
+
+absl::Status WriteAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return ErrnoError("Could not write result", errno);
+    }
+    data += written;
+    size -= written;
+  }
+  return absl::OkStatus();
+}
+
+// Writes the plot's signals one after another to path, returning how many
+// bytes that took.
+absl::StatusOr<uint64_t> WritePlot(const RawfileReader &rawfile,
+                                   size_t plot,
+                                   const std::filesystem::path &path) {
+  const RawfileReader::Plot &source = rawfile.plots()[plot];
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return ErrnoError(absl::StrCat("Could not create ", path.string()), errno);
+  }
+  size_t parts = source.complex ? 2 : 1;
+  std::vector<double> buffer(
+      std::min(kPointsPerWrite, source.num_points) * parts);
+  uint64_t total = 0;
+  absl::Status status;
+  for (size_t signal = 0; signal < source.signals.size() && status.ok();
+       ++signal) {
+    for (uint64_t first = 0; first < source.num_points && status.ok();
+         first += kPointsPerWrite) {
+      uint64_t count = std::min(kPointsPerWrite, source.num_points - first);
+      rawfile.ReadSignal(plot, signal, first, count, buffer.data());
+      size_t bytes = count * parts * sizeof(double);
+      status = WriteAll(fd, reinterpret_cast<const char*>(buffer.data()),
+                        bytes);
+      total += bytes;
+    }
+  }
+  if (close(fd) != 0 && status.ok()) {
+    status = ErrnoError(absl::StrCat("Could not write ", path.string()),
+                        errno);
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  return total;
+}
+
+// Writes the rawfile's plots and their index to directory, which must not
+// exist yet, returning how many bytes that took.
+absl::StatusOr<uint64_t> WriteResult(const RawfileReader &rawfile,
+                                     const std::filesystem::path &directory) {
+  std::error_code error;
+  std::filesystem::create_directory(directory, error);
+  if (error) {
+    return absl::UnavailableError(absl::StrCat(
+        "Could not create ", directory.string(), ": ", error.message()));
+  }
+
+  StoredResultIndex index;
+  uint64_t size = 0;
+  for (size_t plot = 0; plot < rawfile.plots().size(); ++plot) {
+    const RawfileReader::Plot &source = rawfile.plots()[plot];
+    StoredPlot *stored = index.add_plots();
+    stored->set_name(source.name);
+    stored->set_complex(source.complex);
+    stored->set_num_points(source.num_points);
+    for (const WaveformSignal &signal : source.signals) {
+      *stored->add_signals() = signal;
+    }
+    auto written = WritePlot(rawfile, plot, directory / PlotFileName(plot));
+    if (!written.ok()) {
+      std::filesystem::remove_all(directory, error);
+      return written.status();
+    }
+    size += *written;
+  }
+  std::ofstream out(directory / kIndexFileName, std::ios::binary);
+  if (!index.SerializeToOstream(&out) || !out.flush()) {
+    out.close();
+    std::filesystem::remove_all(directory, error);
+    return absl::UnavailableError("Could not write result index");
+  }
+  return size + index.ByteSizeLong();
+}
+
+// Moves the directory from to to, atomically, leaving whatever was at to
+// (if anything) at from.
+absl::Status SwapIn(const std::filesystem::path &from,
+                    const std::filesystem::path &to) {
+  while (true) {
+    if (renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(),
+                  RENAME_EXCHANGE) == 0) {
+      return absl::OkStatus();
+    }
+    if (errno != ENOENT) {
+      break;
+    }
+    // Nothing there yet.
+    if (renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(),
+                  RENAME_NOREPLACE) == 0) {
+      return absl::OkStatus();
+    }
+    if (errno != EEXIST) {
+      break;
+    }
+    // Someone else put one there meanwhile.
+  }
+  return ErrnoError(absl::StrCat("Could not move ", from.string(), " to ",
+                                 to.string()), errno);
+}
+
+}   // namespace
+
+StoredResult::~StoredResult() {
+  for (const auto &[mapping, size] : plots_) {
+    if (mapping != nullptr) {
+      munmap(mapping, size);
+    }
+  }
+}
+
+const double *StoredResult::Signal(size_t plot, size_t signal) const {
+  const StoredPlot &stored = index_.plots(plot);
+  uint64_t values = stored.num_points() * (stored.complex() ? 2 : 1);
+  return static_cast<const double*>(plots_[plot].first) + signal * values;
+}
+
+ResultStore::ResultStore() = default;
+
+absl::Status ResultStore::Initialise() {
+  if (FLAGS_result_store_dir.empty()) {
+    return absl::OkStatus();
+  }
+  return Open(FLAGS_result_store_dir, FLAGS_result_store_max_bytes);
+}
+
+absl::Status ResultStore::Open(const std::filesystem::path &directory,
+                               uint64_t max_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Anything that isn't a whole result (like one being written when the
+  // server stopped) is removed.
+  absl::Status status = results_.Open(
+      directory, max_bytes,
+      [](const std::filesystem::directory_entry &entry) {
+        std::error_code error;
+        return entry.is_directory(error) &&
+            IsResultId(entry.path().filename().string());
+      },
+      {kGoldenDirectory});
+  if (!status.ok() || directory.empty()) {
+    return status;
+  }
+
+  std::error_code error;
+  std::filesystem::path goldens = directory / kGoldenDirectory;
+  std::filesystem::create_directories(goldens, error);
+  if (error) {
+    return absl::UnavailableError(absl::StrCat(
+        "Could not create ", goldens.string(), ": ", error.message()));
+  }
+  // Leftovers of goldens being replaced when the server stopped.
+  for (const auto &entry :
+           std::filesystem::directory_iterator(goldens, error)) {
+    if (!Sha256::IsHexDigest(entry.path().filename().string())) {
+      std::filesystem::remove_all(entry.path(), error);
+    }
+  }
+
+  LOG(INFO) << "Result store in " << directory << ": " << results_.size()
+            << " results, " << results_.total_bytes() << " bytes";
+  return absl::OkStatus();
+}
+
+bool ResultStore::enabled() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return !results_.directory().empty();
+}
+
+uint64_t ResultStore::total_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return results_.total_bytes();
+}
+
+bool ResultStore::IsResultId(const std::string &name) {
+  return name.size() == kResultIdLength &&
+      std::all_of(name.begin(), name.end(), [](char c) {
+        return absl::ascii_isdigit(c) || (c >= 'a' && c <= 'f');
+      });
+}
+
+absl::StatusOr<std::string> ResultStore::Add(const RawfileReader &rawfile) {
+  std::filesystem::path directory;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (results_.directory().empty()) {
+      return absl::UnimplementedError("This server has no result store");
+    }
+    directory = results_.directory();
+  }
+  std::string id = NewResultId();
+  // Written under another name, so that a result is only ever seen whole.
+  std::filesystem::path partial = directory / absl::StrCat(id, ".partial");
+  auto size = WriteResult(rawfile, partial);
+  if (!size.ok()) {
+    return size.status();
+  }
+  std::error_code error;
+  std::filesystem::rename(partial, directory / id, error);
+  if (error) {
+    std::filesystem::remove_all(partial, error);
+    return absl::UnavailableError(absl::StrCat(
+        "Could not store result: ", error.message()));
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (results_.directory() != directory) {
+    // Reopened elsewhere in the meantime.
+    std::filesystem::remove_all(directory / id, error);
+    return absl::UnavailableError("Result store was moved");
+  }
+  // Results being read stay mapped.
+  results_.Add(id, *size);
+  return id;
+}
+
+absl::StatusOr<std::unique_ptr<StoredResult>> ResultStore::Get(
+    const std::string &id) {
+  if (!IsResultId(id)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Not a result ID: \"", id, "\""));
+  }
+  std::filesystem::path path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (results_.directory().empty()) {
+      return absl::UnimplementedError("This server has no result store");
+    }
+    if (!results_.Touch(id)) {
+      return absl::NotFoundError(absl::StrCat(
+          "No result ", id, "; it may have been removed to make room"));
+    }
+    path = results_.PathFor(id);
+  }
+  return Map(path);
+}
+
+absl::Status ResultStore::SetGolden(const std::string &test_id,
+                                    const RawfileReader &rawfile) {
+  std::filesystem::path path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (results_.directory().empty()) {
+      return absl::UnimplementedError("This server has no result store");
+    }
+    path = GoldenPath(test_id);
+  }
+  std::filesystem::path partial = path;
+  partial += absl::StrCat(".", NewResultId(), ".partial");
+  auto size = WriteResult(rawfile, partial);
+  if (!size.ok()) {
+    return size.status();
+  }
+  // Exchanged with the old one, so that there is always a golden to compare
+  // with; the old one is then removed from under any readers, who try again.
+  absl::Status status = SwapIn(partial, path);
+  std::error_code error;
+  std::filesystem::remove_all(partial, error);
+  if (!status.ok()) {
+    return absl::UnavailableError(absl::StrCat(
+        "Could not store golden for ", test_id, ": ", status.message()));
+  }
+  LOG(INFO) << "Stored golden for " << test_id << ", " << *size << " bytes";
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::unique_ptr<StoredResult>> ResultStore::GetGolden(
+    const std::string &test_id) {
+  std::filesystem::path path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (results_.directory().empty()) {
+      return absl::UnimplementedError("This server has no result store");
+    }
+    path = GoldenPath(test_id);
+  }
+  for (int attempt = 1; ; ++attempt) {
+    std::error_code error;
+    if (!std::filesystem::exists(path, error)) {
+      return absl::NotFoundError(absl::StrCat("No golden for ", test_id));
+    }
+    auto result = Map(path);
+    if (result.ok() || result.status().code() != absl::StatusCode::kNotFound ||
+        attempt == kGoldenReadAttempts) {
+      return result;
+    }
+    // Replaced while we were reading it.
+  }
+}
+
+std::filesystem::path ResultStore::GoldenPath(
+    const std::string &test_id) const {
+  // Test IDs are the client's, so not necessarily good file names.
+  return results_.directory() / kGoldenDirectory /
+      Sha256::HexDigestOf(test_id);
+}
+
+absl::StatusOr<std::unique_ptr<StoredResult>> ResultStore::Map(
+    const std::filesystem::path &path) {
+  // Everything is opened relative to the directory, so that it all comes
+  // from the same one even if a golden is swapped for another meanwhile.
+  int directory = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory < 0) {
+    return absl::NotFoundError(absl::StrCat(
+        "Could not open ", path.string(), ": ", strerror(errno)));
+  }
+  auto result = MapAt(directory, path);
+  close(directory);
+  return result;
+}
+
+absl::StatusOr<std::unique_ptr<StoredResult>> ResultStore::MapAt(
+    int directory, const std::filesystem::path &path) {
+  std::unique_ptr<StoredResult> result(new StoredResult());
+  int index_fd = openat(directory, kIndexFileName, O_RDONLY | O_CLOEXEC);
+  bool parsed =
+      index_fd >= 0 && result->index_.ParseFromFileDescriptor(index_fd);
+  if (index_fd >= 0) {
+    close(index_fd);
+  }
+  if (!parsed) {
+    return absl::NotFoundError(absl::StrCat(
+        "Could not read ", path.string()));
+  }
+  for (int plot = 0; plot < result->index_.plots_size(); ++plot) {
+    const StoredPlot &stored = result->index_.plots(plot);
+    size_t size = stored.num_points() * (stored.complex() ? 2 : 1) *
+        stored.signals_size() * sizeof(double);
+    if (size == 0) {
+      result->plots_.emplace_back(nullptr, 0);
+      continue;
+    }
+    std::filesystem::path plot_path = path / PlotFileName(plot);
+    int fd = openat(directory, PlotFileName(plot).c_str(),
+                    O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return absl::NotFoundError(absl::StrCat(
+          "Could not open ", plot_path.string(), ": ", strerror(errno)));
+    }
+    // Mapping past the end of a truncated file would mean SIGBUS on
+    // reading, not an error.
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 ||
+        static_cast<uint64_t>(file_stat.st_size) != size) {
+      close(fd);
+      return absl::DataLossError(absl::StrCat(
+          plot_path.string(), " is not the ", size, " bytes expected"));
+    }
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      return ErrnoError(absl::StrCat("Could not map ", plot_path.string()),
+                        error);
+    }
+    // Queries read a few spans, not the whole file.
+    madvise(mapping, size, MADV_RANDOM);
+    result->plots_.emplace_back(mapping, size);
+  }
+  return result;
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,59 @@
+#include "sha256.h"
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/escaping.h>
+#include <absl/strings/string_view.h>
+
+namespace spiceserver {
+
+namespace {
+
+constexpr size_t kHexDigestLength = 64;
+
+}   // namespace
+
+Sha256::Sha256() : context_(EVP_MD_CTX_new()) {
+  EVP_DigestInit_ex(context_, EVP_sha256(), nullptr);
+}
+
+Sha256::~Sha256() {
+  EVP_MD_CTX_free(context_);
+}
+
+void Sha256::Update(const void *data, size_t length) {
+  EVP_DigestUpdate(context_, data, length);
+}
+
+void Sha256::AddField(absl::string_view field) {
+  AddField(static_cast<uint64_t>(field.size()));
+  Update(field);
+}
+
+std::string Sha256::HexDigest() {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int length = 0;
+  EVP_DigestFinal_ex(context_, digest, &length);
+  return absl::BytesToHexString(absl::string_view(
+      reinterpret_cast<const char*>(digest), length));
+}
+
+std::string Sha256::HexDigestOf(absl::string_view data) {
+  Sha256 hash;
+  hash.Update(data);
+  return hash.HexDigest();
+}
+
+bool Sha256::IsHexDigest(absl::string_view digest) {
+  return digest.size() == kHexDigestLength &&
+      std::all_of(digest.begin(), digest.end(), [](char c) {
+        return absl::ascii_isdigit(c) || (c >= 'a' && c <= 'f');
+      });
+}
+
+}  // namespace spiceserver
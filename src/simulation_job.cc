@@ -0,0 +1,837 @@
+#include "simulation_job.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+
+#include "blob_store.h"
+#include "cgroup_manager.h"
+#include "golden_comparator.h"
+#include "job_scheduler.h"
+#include "measurement_evaluator.h"
+#include "output_batcher.h"
+#include "rawfile_reader.h"
+#include "result_cache.h"
+#include "result_store.h"
+#include "simulator_manager.h"
+#include "usage_statistics.h"
+#include "waveform_preview.h"
+#include "worker_pool.h"
+
+DECLARE_uint64(termination_grace_period_ms);
+
+namespace spiceserver {
+
+namespace {
+
+// How often to poll the simulator's pipes if its output can't be streamed.
+constexpr std::chrono::milliseconds kFallbackPollInterval(20);
+
+// How often a queued job checks whether its place in the queue has changed.
+constexpr std::chrono::milliseconds kQueueStatusPollInterval(250);
+
+// How often a queued client is sent its (updated) estimated start time even
+// if its position hasn't changed.
+constexpr std::chrono::seconds kQueueStatusRefreshInterval(5);
+
+// A job takes a slot per core it is allowed, and at least one.
+int SlotsFor(const CgroupManager::Limits &limits) {
+  return std::max(1, static_cast<int>(std::ceil(limits.cpus)));
+}
+
+bool StoresWaveforms(const WaveformOptions &options) {
+  return options.store() || options.store_only();
+}
+
+bool SendsWaveforms(const WaveformOptions &options) {
+  return options.enabled() && !options.store_only();
+}
+
+bool WritesRawfile(const SimulationRequest &request) {
+  const WaveformOptions &options = request.waveforms();
+  return SendsWaveforms(options) || StoresWaveforms(options) ||
+      options.has_preview() || !request.measurements().empty() ||
+      request.has_golden();
+}
+
+// Compares the run with its test's golden, or makes it the golden.
+GoldenComparison CompareWithGolden(const GoldenOptions &options,
+                                   const RawfileReader &run) {
+  GoldenComparison comparison;
+  ResultStore &store = ResultStore::GetInstance();
+  if (options.mode() == GoldenOptions::UPDATE) {
+    absl::Status stored = store.SetGolden(options.test_id(), run);
+    comparison.set_test_id(options.test_id());
+    comparison.set_updated(stored.ok());
+    comparison.set_passed(stored.ok());
+    if (!stored.ok()) {
+      comparison.set_error(stored.ToString());
+    }
+    return comparison;
+  }
+  auto golden = store.GetGolden(options.test_id());
+  if (!golden.ok()) {
+    comparison.set_test_id(options.test_id());
+    comparison.set_error(golden.status().ToString());
+    return comparison;
+  }
+  return GoldenComparator(**golden, run).Compare(options);
+}
+
+void AddPreviews(std::vector<WaveformPreview> *previews,
+                 std::vector<SimulationResponse> *responses) {
+  for (WaveformPreview &preview : *previews) {
+    *responses->emplace_back().mutable_preview() = std::move(preview);
+  }
+  previews->clear();
+}
+
+}   // namespace
+
+absl::Status SimulationJob::Validate(const SimulationRequest &request) {
+  if (request.simulator() == Flavour::UNSET) {
+    return absl::InvalidArgumentError("Simulator flavour is required");
+  }
+  if (!request.has_vlsir_sim_input() && !request.has_verbatim_files()) {
+    return absl::InvalidArgumentError("No circuit inputs.");
+  }
+  if (WritesRawfile(request) &&
+      !SimulatorManager::CanWriteRawfile(request.simulator())) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Waveforms are not available from ",
+        Flavour_Name(request.simulator())));
+  }
+  if ((StoresWaveforms(request.waveforms()) || request.has_golden()) &&
+      !ResultStore::GetInstance().enabled()) {
+    return absl::FailedPreconditionError("This server has no result store");
+  }
+  if (request.waveforms().has_preview()) {
+    absl::Status valid =
+        WaveformPreviewer::Validate(request.waveforms().preview());
+    if (!valid.ok()) {
+      return valid;
+    }
+  }
+  absl::Status measurements =
+      MeasurementEvaluator::Validate(request.measurements());
+  if (!measurements.ok()) {
+    return measurements;
+  }
+  if (request.has_golden()) {
+    absl::Status valid = GoldenComparator::Validate(request.golden());
+    if (!valid.ok()) {
+      return valid;
+    }
+  }
+  for (const FileInfo &file : request.verbatim_files().files()) {
+    if (file.blob_digest().empty()) {
+      continue;
+    }
+    if (!file.data().empty()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "File ", file.path(), " has both data and a blob digest"));
+    }
+    // Checked now so that the client can upload it and try again, rather
+    // than find out once the job has waited its turn.
+    if (!BlobStore::GetInstance().Has(file.blob_digest())) {
+      return absl::FailedPreconditionError(absl::StrCat(
+          "Blob ", file.blob_digest(), " for ", file.path(),
+          " is not in the store; upload it with PutBlob"));
+    }
+  }
+  return absl::OkStatus();
+}
+
+std::shared_ptr<SimulationJob> SimulationJob::Create(
+    const SimulationRequest &request, const std::string &client) {
+  return std::shared_ptr<SimulationJob>(
+      new SimulationJob(request, client, std::filesystem::path()));
+}
+
+std::shared_ptr<SimulationJob> SimulationJob::CreateStaged(
+    const SimulationRequest &request,
+    const std::string &client,
+    const std::filesystem::path &directory) {
+  return std::shared_ptr<SimulationJob>(
+      new SimulationJob(request, client, directory));
+}
+
+SimulationJob::SimulationJob(const SimulationRequest &request,
+                             const std::string &client,
+                             const std::filesystem::path &staged_directory)
+    : request_(request),
+      client_(client),
+      staged_directory_(staged_directory),
+      limits_(CgroupManager::LimitsFromRequest(request.limits())),
+      received_at_(SimulatorManager::Clock::now()),
+      state_(State::QUEUED),
+      pump_armed_(false),
+      queue_time_(0),
+      batcher_(OutputBatcher::OptionsFromRequest(request.output_batching())),
+      batch_timer_armed_(false),
+      stopping_(false),
+      preview_armed_(false) {}
+
+SimulationJob::~SimulationJob() {
+  if (!cache_key_.empty()) {
+    ResultCache::GetInstance().Abandon(cache_key_);
+  }
+}
+
+void SimulationJob::Start(std::function<void()> on_ready) {
+  {
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    on_ready_ = std::move(on_ready);
+  }
+
+  // Staged inputs aren't in the request, so can't be looked up. Waveforms
+  // aren't kept, nor are the options for them and for measurements part of
+  // the key.
+  if (staged_directory_.empty() && !WritesRawfile(request_) &&
+      ResultCache::GetInstance().enabled()) {
+    // Hashing the inputs can take a while.
+    std::weak_ptr<SimulationJob> weak_job = weak_from_this();
+    WorkerPool::GetInstance().Post([weak_job]() {
+      if (auto job = weak_job.lock()) {
+        job->CheckCache();
+      }
+    });
+    return;
+  }
+  Enqueue();
+}
+
+void SimulationJob::Enqueue() {
+  std::shared_ptr<JobScheduler::Ticket> ticket =
+      JobScheduler::GetInstance().Enqueue(JobScheduler::JobRequest {
+        .flavour = request_.simulator(),
+        .client = client_,
+        .priority = request_.priority(),
+        .slots = SlotsFor(limits_)
+      });
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ticket_ = ticket;
+  }
+
+  std::weak_ptr<SimulationJob> weak_job = weak_from_this();
+  ticket->OnAdmitted([weak_job]() {
+    WorkerPool::GetPreparationInstance().Post([weak_job]() {
+      if (auto job = weak_job.lock()) {
+        job->Prepare();
+      }
+    });
+  });
+  WorkerPool::GetInstance().Post([weak_job]() {
+    if (auto job = weak_job.lock()) {
+      job->SendQueueStatus();
+    }
+  });
+}
+
+void SimulationJob::CheckCache() {
+  auto key = ResultCache::KeyFor(request_);
+  if (!key.ok()) {
+    // Prepare will say what's wrong.
+    Enqueue();
+    return;
+  }
+  LookUpResult(*key);
+}
+
+void SimulationJob::LookUpResult(const std::string &key) {
+  std::weak_ptr<SimulationJob> weak_job = weak_from_this();
+  std::vector<SimulationResponse> responses;
+  ResultCache &cache = ResultCache::GetInstance();
+  auto found = cache.Lookup(key, &responses, [weak_job, key]() {
+    WorkerPool::GetInstance().Post([weak_job, key]() {
+      if (auto job = weak_job.lock()) {
+        job->LookUpResult(key);
+      }
+    });
+  });
+
+  switch (found) {
+    case ResultCache::LookupResult::HIT: {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (state_ != State::QUEUED) {
+          return;
+        }
+        if (!responses.empty()) {
+          responses.back().set_cached(true);
+        }
+        for (SimulationResponse &response : responses) {
+          pending_.push_back(std::move(response));
+        }
+        state_ = State::FINISHED;
+        final_status_ = absl::OkStatus();
+      }
+      LOG(INFO) << "Replaying cached result " << key;
+      NotifyReady();
+      return;
+    }
+    case ResultCache::LookupResult::MISS: {
+      bool queued;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued = state_ == State::QUEUED;
+        if (queued) {
+          cache_key_ = key;
+        }
+      }
+      if (!queued) {
+        cache.Abandon(key);
+        return;
+      }
+      Enqueue();
+      return;
+    }
+    case ResultCache::LookupResult::IN_FLIGHT:
+      // Looked up again when the other job is done.
+      return;
+  }
+}
+
+SimulationJob::NextResult SimulationJob::Next(SimulationResponse *response,
+                                              absl::Status *status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!pending_.empty()) {
+    *response = std::move(pending_.front());
+    pending_.pop_front();
+    return NextResult::MESSAGE;
+  }
+  // Chunks are only read from the rawfile as fast as they are sent.
+  if (waveforms_) {
+    response->Clear();
+    if (waveforms_->Next(response->mutable_waveform())) {
+      return NextResult::MESSAGE;
+    }
+    waveforms_.reset();
+    *response = std::move(*final_response_);
+    final_response_.reset();
+    return NextResult::MESSAGE;
+  }
+  if (state_ == State::FINISHED) {
+    *status = final_status_;
+    return NextResult::DONE;
+  }
+  if (state_ == State::RUNNING && !pump_armed_) {
+    ArmPump();
+  }
+  return NextResult::WAIT;
+}
+
+void SimulationJob::Cancel(const absl::Status &status) {
+  std::shared_ptr<JobScheduler::Ticket> ticket;
+  State previous_state;
+  std::unique_ptr<WaveformStream> waveforms;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ == State::FINISHED) {
+      // Whatever is still to be sent, the waveforms (and their rawfile's
+      // mapping) included, is dropped.
+      if (waveforms_ || !pending_.empty()) {
+        final_status_ = status;
+      }
+      waveforms = std::move(waveforms_);
+      final_response_.reset();
+      pending_.clear();
+      return;
+    }
+    previous_state = state_;
+    state_ = State::FINISHED;
+    final_status_ = status;
+    pending_.clear();
+    if (previous_state == State::QUEUED) {
+      ticket = std::move(ticket_);
+    }
+  }
+  LOG(INFO) << "Cancelling simulation: " << status.message();
+  FinishCaching(false);
+
+  // A job still being prepared is stopped once Prepare is done with it.
+  if (previous_state == State::RUNNING) {
+    auto job = shared_from_this();
+    WorkerPool::GetInstance().Post([job]() { job->Stop(); });
+  }
+  // Dropping the ticket (if we were queued) gives up our place.
+}
+
+void SimulationJob::Detach() {
+  std::lock_guard<std::mutex> lock(callback_mutex_);
+  on_ready_ = nullptr;
+}
+
+void SimulationJob::NotifyReady() {
+  std::lock_guard<std::mutex> lock(callback_mutex_);
+  if (on_ready_) {
+    on_ready_();
+  }
+}
+
+void SimulationJob::SendQueueStatus() {
+  std::shared_ptr<JobScheduler::Ticket> ticket;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ != State::QUEUED) {
+      return;
+    }
+    ticket = ticket_;
+  }
+  if (ticket->admitted()) {
+    return;
+  }
+
+  QueueStatus status = ticket->Status();
+  auto now = SimulatorManager::Clock::now();
+  bool send = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ != State::QUEUED) {
+      return;
+    }
+    send = !last_queue_status_ ||
+           status.position() != last_queue_status_->position() ||
+           status.has_estimate() != last_queue_status_->has_estimate() ||
+           now - last_queue_status_at_ >= kQueueStatusRefreshInterval;
+    if (send) {
+      SimulationResponse response;
+      *response.mutable_queue_status() = status;
+      pending_.push_back(std::move(response));
+      last_queue_status_ = status;
+      last_queue_status_at_ = now;
+    }
+  }
+  if (send) {
+    NotifyReady();
+  }
+
+  std::weak_ptr<SimulationJob> weak_job = weak_from_this();
+  WorkerPool::GetInstance().PostAfter(kQueueStatusPollInterval, [weak_job]() {
+    if (auto job = weak_job.lock()) {
+      job->SendQueueStatus();
+    }
+  });
+}
+
+void SimulationJob::Prepare() {
+  std::lock_guard<std::mutex> work_lock(work_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ != State::QUEUED) {
+      return;
+    }
+    state_ = State::PREPARING;
+  }
+  queue_time_ = SimulatorManager::Clock::now() - received_at_;
+
+  auto simulator = std::make_unique<SimulatorManager>();
+  simulator->SetLimits(limits_);
+  simulator->SetWriteRawfile(WritesRawfile(request_));
+
+  std::vector<std::string> additional_args(
+      request_.additional_args().begin(),
+      request_.additional_args().end());
+  absl::Status status;
+  if (!staged_directory_.empty()) {
+    status = simulator->RunSimulatorInDirectory(
+        request_.simulator(), staged_directory_,
+        request_.verbatim_files().files(0).path(), additional_args);
+  } else if (request_.has_vlsir_sim_input()) {
+    status = simulator->RunSimulator(
+        request_.simulator(), request_.vlsir_sim_input(), additional_args);
+  } else {
+    status = simulator->RunSimulator(
+        request_.simulator(), request_.verbatim_files().files(),
+        additional_args);
+  }
+
+  bool cancelled = false;
+  std::shared_ptr<JobScheduler::Ticket> ticket;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ == State::FINISHED) {
+      cancelled = true;
+      // A started simulator keeps it until it has been stopped.
+      if (!status.ok()) {
+        ticket = std::move(ticket_);
+      }
+    } else if (!status.ok()) {
+      state_ = State::FINISHED;
+      final_status_ = absl::InternalError(absl::StrCat(
+          "Failure in running simulator:", status.message()));
+      ticket = std::move(ticket_);
+    } else {
+      state_ = State::RUNNING;
+      simulator_ = std::move(simulator);
+    }
+  }
+  if (simulator_ && request_.waveforms().has_preview()) {
+    previewer_ = std::make_unique<WaveformPreviewer>(
+        simulator_->RawfilePath(), request_.waveforms().preview());
+    next_preview_at_ = OutputBatcher::Clock::now() + previewer_->interval();
+    ArmPreview();
+  }
+
+  if (cancelled && status.ok()) {
+    simulator_ = std::move(simulator);
+    BeginStop();
+    return;
+  }
+  // The simulator (if any) has to go before the ticket does.
+  simulator.reset();
+  ticket.reset();
+  if (!status.ok()) {
+    FinishCaching(false);
+  }
+  NotifyReady();
+}
+
+void SimulationJob::ArmPump() {
+  pump_armed_ = true;
+  std::weak_ptr<SimulationJob> weak_job = weak_from_this();
+  auto pump = [weak_job]() {
+    if (auto job = weak_job.lock()) {
+      job->Pump();
+    }
+  };
+  // The spool calls back on the OutputReactor's thread, which mustn't be
+  // held up (or end up destroying the job).
+  bool notified = simulator_->NotifyWhenOutputReady([pump]() {
+    WorkerPool::GetInstance().Post(pump);
+  });
+  if (!notified) {
+    WorkerPool::GetInstance().PostAfter(kFallbackPollInterval, pump);
+  }
+}
+
+void SimulationJob::Pump() {
+  std::lock_guard<std::mutex> work_lock(work_mutex_);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    pump_armed_ = false;
+    if (state_ != State::RUNNING || !simulator_) {
+      return;
+    }
+  }
+
+  std::vector<SimulationResponse> ready;
+  auto output_callback = [&](const char* data, size_t length,
+                             Subprocess::StreamType stream_type) {
+    if (request_.golden().discard_output()) {
+      return;
+    }
+    batcher_.Add(data, length, stream_type, OutputBatcher::Clock::now(),
+                 &ready);
+  };
+  bool running = simulator_->PollAndReadOutput(
+      output_callback, std::chrono::milliseconds(0));
+  batcher_.FlushExpired(OutputBatcher::Clock::now(), &ready);
+
+  std::vector<WaveformPreview> previews;
+  if (previewer_ && running &&
+      OutputBatcher::Clock::now() >= next_preview_at_) {
+    previewer_->Poll(&previews);
+    AddPreviews(&previews, &ready);
+    next_preview_at_ = OutputBatcher::Clock::now() + previewer_->interval();
+  }
+
+  std::shared_ptr<JobScheduler::Ticket> ticket;
+  bool exited = false;
+  std::unique_ptr<WaveformStream> waveforms;
+  std::optional<SimulationResponse> held_final_response;
+  if (!running) {
+    batcher_.FlushAll(&ready);
+
+    SimulationResponse final_response;
+    final_response.set_done(true);
+    final_response.set_exit_code(simulator_->WaitForCompletion());
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ticket = std::move(ticket_);
+    }
+    if (ticket) {
+      ticket->Finished();
+    }
+    Account(&final_response);
+
+    OutputSpool::Statistics spool_statistics = simulator_->SpoolStatistics();
+    SpoolStatistics *spool_statistics_pb =
+        final_response.mutable_spool_statistics();
+    spool_statistics_pb->set_total_bytes(spool_statistics.total_bytes);
+    spool_statistics_pb->set_memory_high_water_bytes(
+        spool_statistics.memory_high_water_bytes);
+    spool_statistics_pb->set_backlog_high_water_bytes(
+        spool_statistics.backlog_high_water_bytes);
+    spool_statistics_pb->set_spilled_bytes(spool_statistics.spilled_bytes);
+    spool_statistics_pb->set_dropped_bytes(spool_statistics.dropped_bytes);
+    exited = final_response.terminating_signal() == 0;
+
+    if (WritesRawfile(request_)) {
+      auto reader = RawfileReader::Open(simulator_->RawfilePath());
+      if (reader.ok()) {
+        MeasurementEvaluator evaluator(**reader);
+        for (const Measurement &measurement : request_.measurements()) {
+          *final_response.add_measurements() =
+              evaluator.Evaluate(measurement);
+        }
+      } else {
+        for (const Measurement &measurement : request_.measurements()) {
+          MeasurementResult *result = final_response.add_measurements();
+          result->set_name(measurement.name());
+          result->set_error(std::string(reader.status().message()));
+        }
+      }
+      if (request_.has_golden()) {
+        if (reader.ok()) {
+          *final_response.mutable_golden() =
+              CompareWithGolden(request_.golden(), **reader);
+        } else {
+          GoldenComparison *golden = final_response.mutable_golden();
+          golden->set_test_id(request_.golden().test_id());
+          golden->set_error(reader.status().ToString());
+        }
+      }
+      if (reader.ok() && previewer_) {
+        previewer_->Finish(**reader, &previews);
+        AddPreviews(&previews, &ready);
+      }
+      if (reader.ok() && StoresWaveforms(request_.waveforms())) {
+        auto id = ResultStore::GetInstance().Add(**reader);
+        if (id.ok()) {
+          final_response.set_result_id(*id);
+        } else {
+          final_response.set_waveform_error(id.status().ToString());
+        }
+      }
+      if (!reader.ok()) {
+        final_response.set_waveform_error(reader.status().ToString());
+      } else if (SendsWaveforms(request_.waveforms())) {
+        waveforms = std::make_unique<WaveformStream>(
+            std::move(*reader), request_.waveforms());
+      }
+    }
+    if (waveforms) {
+      // Sent once the waveforms have been.
+      held_final_response = std::move(final_response);
+    } else {
+      ready.push_back(std::move(final_response));
+    }
+  } else {
+    ArmBatchTimer();
+    ArmPreview();
+    if (ready.empty()) {
+      // The transport won't ask for more, so nothing else would (discarded
+      // output, say).
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (state_ == State::RUNNING && !pump_armed_) {
+        ArmPump();
+      }
+    }
+  }
+
+  bool store = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (state_ == State::RUNNING) {
+      if (!cache_key_.empty()) {
+        recorded_.insert(recorded_.end(), ready.begin(), ready.end());
+      }
+      for (SimulationResponse &response : ready) {
+        pending_.push_back(std::move(response));
+      }
+      if (!running) {
+        state_ = State::FINISHED;
+        waveforms_ = std::move(waveforms);
+        final_response_ = std::move(held_final_response);
+        // A simulator that was killed (by a limit, say) might not be next
+        // time.
+        store = exited;
+      }
+    }
+  }
+  if (!running) {
+    // Nothing is left for Stop() to do.
+    simulator_.reset();
+    ticket.reset();
+    FinishCaching(store);
+  }
+  if (!ready.empty() || !running) {
+    NotifyReady();
+  }
+}
+
+void SimulationJob::ArmBatchTimer() {
+  // One timer at a time; a Pump before it fires only leaves the deadline
+  // later, and the timer's own Pump re-arms it.
+  auto deadline = batcher_.NextDeadline();
+  if (!deadline || batch_timer_armed_) {
+    return;
+  }
+  batch_timer_armed_ = true;
+  std::weak_ptr<SimulationJob> weak_job = weak_from_this();
+  WorkerPool::GetInstance().PostAfter(
+      std::max(std::chrono::duration_cast<std::chrono::milliseconds>(
+                   *deadline - OutputBatcher::Clock::now()),
+               std::chrono::milliseconds(0)),
+      [weak_job]() {
+        if (auto job = weak_job.lock()) {
+          {
+            std::lock_guard<std::mutex> work_lock(job->work_mutex_);
+            job->batch_timer_armed_ = false;
+          }
+          job->Pump();
+        }
+      });
+}
+
+void SimulationJob::ArmPreview() {
+  if (!previewer_ || preview_armed_) {
+    return;
+  }
+  preview_armed_ = true;
+  std::weak_ptr<SimulationJob> weak_job = weak_from_this();
+  WorkerPool::GetInstance().PostAfter(
+      std::max(std::chrono::duration_cast<std::chrono::milliseconds>(
+                   next_preview_at_ - OutputBatcher::Clock::now()),
+               std::chrono::milliseconds(0)),
+      [weak_job]() {
+        if (auto job = weak_job.lock()) {
+          {
+            std::lock_guard<std::mutex> work_lock(job->work_mutex_);
+            job->preview_armed_ = false;
+          }
+          job->Pump();
+        }
+      });
+}
+
+void SimulationJob::Stop() {
+  std::lock_guard<std::mutex> work_lock(work_mutex_);
+  BeginStop();
+}
+
+void SimulationJob::BeginStop() {
+  if (!simulator_ || stopping_) {
+    return;
+  }
+  stopping_ = true;
+  simulator_->BeginTermination();
+  stop_deadline_ = SimulatorManager::Clock::now() +
+      std::chrono::milliseconds(FLAGS_termination_grace_period_ms);
+
+  // The job is kept until the simulator is gone: by the exit callback (which
+  // can't be the last to let go of it, since FinishStop's destroying the
+  // simulator waits for the callback to return), or by the polls.
+  auto job = shared_from_this();
+  bool notified = simulator_->NotifyWhenExited([job]() {
+    WorkerPool::GetInstance().Post([job]() { job->FinishStop(); });
+  });
+  if (!notified) {
+    WorkerPool::GetInstance().PostAfter(
+        kFallbackPollInterval, [job]() { job->FinishStop(); });
+    return;
+  }
+  std::weak_ptr<SimulationJob> weak_job = job;
+  WorkerPool::GetInstance().PostAfter(
+      std::chrono::milliseconds(FLAGS_termination_grace_period_ms),
+      [weak_job]() {
+        if (auto job = weak_job.lock()) {
+          job->FinishStop();
+        }
+      });
+}
+
+void SimulationJob::FinishStop() {
+  std::lock_guard<std::mutex> work_lock(work_mutex_);
+  if (!simulator_) {
+    return;
+  }
+  if (!simulator_->HasExited()) {
+    auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+        stop_deadline_ - SimulatorManager::Clock::now());
+    if (remaining.count() > 0) {
+      auto job = shared_from_this();
+      WorkerPool::GetInstance().PostAfter(
+          std::min(remaining, kFallbackPollInterval),
+          [job]() { job->FinishStop(); });
+      return;
+    }
+    LOG(WARNING) << "Simulator did not exit within "
+                 << FLAGS_termination_grace_period_ms
+                 << " ms of SIGTERM; killing it";
+  }
+  simulator_->Kill();
+
+  SimulationResponse unsent_response;
+  unsent_response.set_exit_code(-1);
+  Account(&unsent_response);
+
+  std::shared_ptr<JobScheduler::Ticket> ticket;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ticket = std::move(ticket_);
+  }
+  simulator_.reset();
+  ticket.reset();
+}
+
+void SimulationJob::FinishCaching(bool store) {
+  std::string key;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    key.swap(cache_key_);
+  }
+  if (key.empty()) {
+    return;
+  }
+  if (store) {
+    ResultCache::GetInstance().Store(key, recorded_);
+    recorded_.clear();
+  } else {
+    ResultCache::GetInstance().Abandon(key);
+  }
+}
+
+void SimulationJob::Account(SimulationResponse *response) {
+  *response->mutable_resource_usage() = simulator_->GetResourceUsage();
+  PhaseTimings *timings = response->mutable_phase_timings();
+  *timings = simulator_->GetPhaseTimings();
+  timings->set_queue_seconds(queue_time_.count());
+  timings->set_total_seconds(timings->total_seconds() + queue_time_.count());
+  response->set_terminating_signal(simulator_->TerminatingSignal());
+  auto cgroup_usage = simulator_->GetCgroupUsage();
+  if (cgroup_usage) {
+    *response->mutable_cgroup_usage() = *cgroup_usage;
+  }
+
+  const ResourceUsage &usage = response->resource_usage();
+  LOG(INFO) << "Simulation in " << simulator_->directory()
+            << " finished: exit code " << response->exit_code()
+            << ", signal " << response->terminating_signal()
+            << ", " << usage.user_cpu_seconds() << " s user, "
+            << usage.system_cpu_seconds() << " s system, "
+            << usage.max_rss_bytes() / (1024 * 1024) << " MiB max RSS, "
+            << response->phase_timings().total_seconds() << " s total";
+
+  UsageStatistics::GetInstance().Record(
+      request_.simulator(),
+      simulator_->directory().string(),
+      *response);
+}
+
+}  // namespace spiceserver
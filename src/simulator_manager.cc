@@ -1,55 +1,143 @@
 #include "simulator_manager.h"
 
+#include <signal.h>
+#include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <filesystem>
-#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <utility>
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <absl/status/status.h>
 #include <absl/status/statusor.h>
+#include <absl/strings/str_cat.h>
 
+#include "blob_store.h"
+#include "cgroup_manager.h"
 #include "embedded_python_netlister.h"
+#include "input_writer.h"
+#include "native_netlister.h"
+#include "netlister_pool.h"
+#include "output_spool.h"
 #include "simulator_registry.h"
 #include "subprocess.h"
 #include "proto/spice_simulator.pb.h"
 
+DEFINE_uint64(output_spool_memory_bytes, 4 * 1024 * 1024,
+              "Simulator output waiting to be sent to a client is held in "
+              "memory up to this many bytes per job, and then written to a "
+              "file in the job directory.");
+DEFINE_uint64(termination_grace_period_ms, 5000,
+              "When a simulation is cancelled, how long the simulator has to "
+              "exit after SIGTERM before its process group is sent SIGKILL.");
+
 namespace spiceserver {
 
-SimulatorManager::SimulatorManager() {}
+namespace {
+
+constexpr char kSpoolFileName[] = ".spice_server_output.spool";
+
+constexpr char kRawfileName[] = ".spice_server_waveforms.raw";
+
+// The most output handed to the caller by one PollAndReadOutput.
+constexpr size_t kMaxBytesPerRead = 256 * 1024;
+
+}   // namespace
+
+namespace {
+
+// Python isn't started with the server, only on the first input that needs
+// it: in the netlister workers, if there are to be any, or else in this
+// process.
+void StartPythonNetlisters() {
+  static std::once_flag started;
+  std::call_once(started, []() {
+    NetlisterPool &pool = NetlisterPool::GetInstance();
+    absl::Status status = pool.Initialise();
+    if (status.ok() && pool.enabled()) {
+      return;
+    }
+    LOG_IF(WARNING, !status.ok())
+        << "Could not start netlister workers, netlisting in the server: "
+        << status;
+    status = EmbeddedPythonNetlister::GetInstance().status();
+    LOG_IF(WARNING, !status.ok())
+        << (NativeNetlister::Enabled() ?
+            "Only VLSIR inputs the native netlister supports will be "
+            "accepted: " :
+            "VLSIR inputs will not be accepted: ")
+        << status;
+  });
+}
+
+// Natively, if that can; otherwise by vlsirtools, in a worker process if
+// there are any or else in this one.
+absl::StatusOr<std::string> NetlistSim(
+    const Flavour &flavour, const vlsir::spice::SimInput &sim_input) {
+  if (NativeNetlister::Enabled()) {
+    auto netlist = NativeNetlister::NetlistSim(sim_input, flavour);
+    if (netlist.status().code() != absl::StatusCode::kUnimplemented) {
+      return netlist;
+    }
+    VLOG(1) << "Falling back to the Python netlister: " << netlist.status();
+  }
+  StartPythonNetlisters();
+  NetlisterPool &pool = NetlisterPool::GetInstance();
+  if (pool.enabled()) {
+    return pool.NetlistSim(sim_input, flavour);
+  }
+  return EmbeddedPythonNetlister::GetInstance().NetlistSim(sim_input, flavour);
+}
+
+double Seconds(SimulatorManager::Clock::duration duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+double Seconds(const struct timeval &value) {
+  return value.tv_sec + value.tv_usec / 1e6;
+}
+
+}   // namespace
 
-SimulatorManager::~SimulatorManager() {}
+SimulatorManager::SimulatorManager()
+    : limits_(CgroupManager::DefaultLimits()),
+      created_at_(Clock::now()),
+      exited_(false),
+      exit_code_(-1),
+      streaming_(false),
+      write_rawfile_(false) {}
+
+SimulatorManager::~SimulatorManager() {
+  // Nobody is waiting for the result any more.
+  if (IsRunning()) {
+    LOG(INFO) << "Simulator still running; terminating it";
+    Terminate();
+  }
+}
 
 absl::StatusOr<std::string> SimulatorManager::PrepareVerbatimInputsOnDisk(
-    const std::vector<FileInfo> &files) {
+    const InputWriter::Files &files) {
   auto temp = CreateTemporaryDirectory();
   if (!temp.ok()) {
     return temp.status();
   }
 
   LOG(INFO) << "Using temp dir: " << *temp;
-  for (const FileInfo &file_info_pb : files) {
-    std::filesystem::path path(*temp);
-    path /= std::filesystem::path(file_info_pb.path());
-    LOG(INFO) << "Writing: " << path;
-
-    std::filesystem::path directories = path;
-    directories.remove_filename();
-
-    std::filesystem::create_directories(directories);
-
-    std::ofstream of;
-    of.open(path, std::ios::out | std::ios::binary);
-    of.write(file_info_pb.data().c_str(), file_info_pb.data().size());
-    of.close();
+  absl::Status written = InputWriter::Write(*temp, files);
+  if (!written.ok()) {
+    return written;
   }
-
   return *temp;
 }
 
 absl::Status SimulatorManager::RunSimulator(
     const Flavour &flavour,
-    const std::vector<FileInfo> &files,
+    const InputWriter::Files &files,
     const std::vector<std::string> &additional_args) {
   auto simulator_info =
       SimulatorRegistry::GetInstance().GetSimulatorInfo(flavour);
@@ -61,18 +149,10 @@ absl::Status SimulatorManager::RunSimulator(
   if (!result_or.ok()) {
     return result_or.status();
   }
-  std::string directory = *result_or;
-
-  std::vector<std::string> args(additional_args.begin(), additional_args.end());
-  args.insert(args.begin(), files.begin()->path());
-
-  const std::string &command = simulator_info->path;
-  auto result = subprocess_.Spawn(command, args, directory);
-  if (!result.ok()) {
-    return result;
-  }
+  directory_ = *result_or;
 
-  return absl::OkStatus();
+  return Start(simulator_info->path,
+               Arguments(flavour, files.Get(0).path(), additional_args));
 }
 
 absl::Status SimulatorManager::RunSimulator(
@@ -89,36 +169,301 @@ absl::Status SimulatorManager::RunSimulator(
   if (!result_or.ok()) {
     return result_or.status();
   }
-  std::filesystem::path directory(*result_or);
+  directory_ = *result_or;
+
+  auto netlist = NetlistSim(flavour, sim_input);
+  if (!netlist.ok()) {
+    return netlist.status();
+  }
+  InputWriter::Files files;
+  FileInfo *main_file = files.Add();
+  main_file->set_path("main.sp");
+  main_file->set_data(std::move(*netlist));
+  absl::Status written = InputWriter::Write(directory_, files);
+  if (!written.ok()) {
+    return written;
+  }
+
+  return Start(simulator_info->path,
+               Arguments(flavour, main_file->path(), additional_args));
+}
+
+absl::Status SimulatorManager::RunSimulatorInDirectory(
+    const Flavour &flavour,
+    const std::filesystem::path &directory,
+    const std::string &main_file,
+    const std::vector<std::string> &additional_args) {
+  auto simulator_info =
+      SimulatorRegistry::GetInstance().GetSimulatorInfo(flavour);
+  if (!simulator_info) {
+    return absl::InvalidArgumentError("No simulator found.");
+  }
+  directory_ = directory;
 
-  auto netlists = EmbeddedPythonNetlister::GetInstance().WriteSim(
-      sim_input, flavour, directory);
-  if (netlists.empty()) {
-    return absl::InvalidArgumentError(
-        "Could not convert VLSIR SimInput to a SPICE netlist");
+  return Start(simulator_info->path,
+               Arguments(flavour, main_file, additional_args));
+}
+
+bool SimulatorManager::CanWriteRawfile(const Flavour &flavour) {
+  switch (flavour) {
+    case Flavour::XYCE:
+    case Flavour::XYCE_7_8:
+    case Flavour::XYCE_7_9:
+    case Flavour::XYCE_7_10:
+    case Flavour::NGSPICE:
+      return true;
+    default:
+      return false;
   }
+}
 
-  std::vector<std::string> args(additional_args.begin(), additional_args.end());
-  args.insert(args.begin(), netlists.begin()->string());
+std::filesystem::path SimulatorManager::RawfilePath() const {
+  return directory_ / kRawfileName;
+}
+
+std::vector<std::string> SimulatorManager::Arguments(
+    const Flavour &flavour,
+    const std::string &main_file,
+    const std::vector<std::string> &additional_args) const {
+  std::vector<std::string> args;
+  if (write_rawfile_ && CanWriteRawfile(flavour)) {
+    // ngspice only writes a rawfile in batch mode. Both write binary ones
+    // unless told otherwise.
+    if (flavour == Flavour::NGSPICE &&
+        std::find(additional_args.begin(), additional_args.end(), "-b") ==
+            additional_args.end()) {
+      args.push_back("-b");
+    }
+    args.push_back("-r");
+    args.push_back(kRawfileName);
+  }
+  args.push_back(main_file);
+  args.insert(args.end(), additional_args.begin(), additional_args.end());
+  return args;
+}
 
-  const std::string &command = simulator_info->path;
-  auto result = subprocess_.Spawn(command, args, directory);
+absl::StatusOr<std::vector<FileInfo>> SimulatorManager::Netlist(
+    const Flavour &flavour, const vlsir::spice::SimInput &sim_input) {
+  auto netlist = NetlistSim(flavour, sim_input);
+  if (!netlist.ok()) {
+    return netlist.status();
+  }
+  FileInfo file_info_pb;
+  file_info_pb.set_path("main.sp");
+  file_info_pb.set_data(std::move(*netlist));
+  return std::vector<FileInfo> {std::move(file_info_pb)};
+}
+
+absl::Status SimulatorManager::Start(const std::string &command,
+                                     const std::vector<std::string> &args) {
+  spawn_started_at_ = Clock::now();
+
+  CgroupManager &cgroup_manager = CgroupManager::GetInstance();
+  if (cgroup_manager.IsAvailable()) {
+    auto cgroup = cgroup_manager.CreateJobCgroup(limits_);
+    if (cgroup.ok()) {
+      cgroup_ = std::move(*cgroup);
+      subprocess_.PlaceInCgroup(cgroup_->procs_fd());
+    } else {
+      LOG(WARNING) << "Running simulator without a cgroup: "
+                   << cgroup.status();
+    }
+  }
+
+  auto result = subprocess_.Spawn(command, args, directory_.string());
   if (!result.ok()) {
     return result;
   }
+  spawned_at_ = Clock::now();
+  StartStreaming(directory_);
 
   return absl::OkStatus();
 }
 
-bool SimulatorManager::PollAndReadOutput(Subprocess::OutputCallback callback) {
-  return subprocess_.PollAndReadOutput(callback);
+void SimulatorManager::StartStreaming(const std::filesystem::path &directory) {
+  spool_ = std::make_unique<OutputSpool>(
+      FLAGS_output_spool_memory_bytes, directory / kSpoolFileName);
+
+  auto on_output = [this](const char *data,
+                          size_t length,
+                          Subprocess::StreamType stream_type) {
+    spool_->Append(stream_type, data, length);
+  };
+  auto on_exit = [this](int exit_code) {
+    std::function<void()> on_exited;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      exited_ = true;
+      exit_code_ = exit_code;
+      exited_at_ = Clock::now();
+      exited_condition_.notify_all();
+      on_exited.swap(on_exited_);
+    }
+    spool_->Finish();
+    if (on_exited) {
+      on_exited();
+    }
+  };
+  auto status = subprocess_.StartWatching(on_output, on_exit);
+  if (!status.ok()) {
+    LOG(WARNING) << "Falling back to polling subprocess output: " << status;
+    streaming_ = false;
+    return;
+  }
+  streaming_ = true;
+}
+
+bool SimulatorManager::PollAndReadOutput(Subprocess::OutputCallback callback,
+                                         std::chrono::milliseconds timeout) {
+  if (!streaming_) {
+    return subprocess_.PollAndReadOutput(callback, timeout);
+  }
+  return spool_->Read(callback, timeout, kMaxBytesPerRead);
+}
+
+bool SimulatorManager::NotifyWhenOutputReady(std::function<void()> callback) {
+  if (!streaming_) {
+    return false;
+  }
+  spool_->NotifyWhenReadable(std::move(callback));
+  return true;
+}
+
+bool SimulatorManager::NotifyWhenExited(std::function<void()> callback) {
+  if (!streaming_) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!exited_) {
+      on_exited_ = std::move(callback);
+      return true;
+    }
+  }
+  callback();
+  return true;
 }
 
 int SimulatorManager::WaitForCompletion() {
-  return subprocess_.WaitForCompletion();
+  if (streaming_) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    exited_condition_.wait(lock, [this]() { return exited_; });
+    return exit_code_;
+  }
+  int exit_code = subprocess_.WaitForCompletion();
+  if (exited_at_ == Clock::time_point()) {
+    exited_at_ = Clock::now();
+  }
+  return exit_code;
+}
+
+ResourceUsage SimulatorManager::GetResourceUsage() const {
+  const struct rusage &usage = subprocess_.resource_usage();
+  ResourceUsage usage_pb;
+  usage_pb.set_user_cpu_seconds(Seconds(usage.ru_utime));
+  usage_pb.set_system_cpu_seconds(Seconds(usage.ru_stime));
+  // Linux reports this in KiB.
+  usage_pb.set_max_rss_bytes(static_cast<uint64_t>(usage.ru_maxrss) * 1024);
+  usage_pb.set_minor_page_faults(usage.ru_minflt);
+  usage_pb.set_major_page_faults(usage.ru_majflt);
+  usage_pb.set_voluntary_context_switches(usage.ru_nvcsw);
+  usage_pb.set_involuntary_context_switches(usage.ru_nivcsw);
+  return usage_pb;
+}
+
+std::optional<CgroupUsage> SimulatorManager::GetCgroupUsage() const {
+  if (!cgroup_) {
+    return std::nullopt;
+  }
+  return cgroup_->ReadUsage();
+}
+
+int SimulatorManager::TerminatingSignal() const {
+  return subprocess_.terminating_signal();
+}
+
+PhaseTimings SimulatorManager::GetPhaseTimings() const {
+  Clock::time_point now = Clock::now();
+  Clock::time_point exited_at;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exited_at = exited_at_;
+  }
+
+  PhaseTimings timings;
+  timings.set_total_seconds(Seconds(now - created_at_));
+  if (spawn_started_at_ == Clock::time_point()) {
+    // Never got as far as starting the simulator.
+    timings.set_prepare_seconds(timings.total_seconds());
+    return timings;
+  }
+  timings.set_prepare_seconds(Seconds(spawn_started_at_ - created_at_));
+  if (spawned_at_ == Clock::time_point()) {
+    return timings;
+  }
+  timings.set_spawn_seconds(Seconds(spawned_at_ - spawn_started_at_));
+  if (exited_at == Clock::time_point()) {
+    timings.set_run_seconds(Seconds(now - spawned_at_));
+    return timings;
+  }
+  timings.set_run_seconds(Seconds(exited_at - spawned_at_));
+  timings.set_drain_seconds(Seconds(now - exited_at));
+  return timings;
+}
+
+bool SimulatorManager::WaitForExit(std::chrono::milliseconds timeout) {
+  if (streaming_) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return exited_condition_.wait_for(
+        lock, timeout, [this]() { return exited_; });
+  }
+  return subprocess_.WaitForExit(timeout);
+}
+
+void SimulatorManager::Terminate(std::chrono::milliseconds grace_period) {
+  if (!IsRunning()) {
+    return;
+  }
+  BeginTermination();
+  if (!WaitForExit(grace_period)) {
+    LOG(WARNING) << "Simulator did not exit within "
+                 << grace_period.count() << " ms of SIGTERM; killing it";
+  }
+  Kill();
+}
+
+void SimulatorManager::BeginTermination() {
+  subprocess_.SignalProcessGroup(SIGTERM);
+}
+
+void SimulatorManager::Kill() {
+  // The child may have exited and left some of its own children behind.
+  // cgroup.kill catches those, and any that left the process group; without
+  // a cgroup the group can only be signalled while the child is unreaped.
+  if (cgroup_) {
+    cgroup_->Kill();
+  } else {
+    subprocess_.SignalProcessGroup(SIGKILL);
+  }
+  WaitForCompletion();
+}
+
+void SimulatorManager::Terminate() {
+  Terminate(std::chrono::milliseconds(FLAGS_termination_grace_period_ms));
+}
+
+OutputSpool::Statistics SimulatorManager::SpoolStatistics() const {
+  if (!spool_) {
+    return OutputSpool::Statistics {0, 0, 0, 0, 0};
+  }
+  return spool_->statistics();
 }
 
 bool SimulatorManager::IsRunning() const {
+  if (streaming_) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !exited_;
+  }
   return subprocess_.IsRunning();
 }
 
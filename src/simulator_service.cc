@@ -1,94 +1,441 @@
 #include "simulator_service.h"
 
-#include <iostream>
+#include <filesystem>
+#include <memory>
+#include <mutex>
 #include <string>
-#include <vector>
+#include <utility>
 
-#include <absl/strings/str_cat.h>
+#include <glog/logging.h>
 
-#include "simulator_manager.h"
+#include <absl/status/status.h>
+
+#include "batch_job.h"
+#include "blob_store.h"
+#include "input_stager.h"
+#include "sha256.h"
+#include "simulation_job.h"
+#include "sweep_job.h"
+#include "usage_statistics.h"
+#include "waveform_query.h"
+#include "worker_pool.h"
 
 namespace spiceserver {
 
-grpc::Status SimulatorServiceImpl::ListSimulators(
-    grpc::ServerContext* context,
-    const ListSimulatorsRequest* request,
-    ListSimulatorsResponse* reseponse) {
-  // Query the singleton/static SimulatorRegistry.
+namespace {
+
+grpc::Status ToGrpcStatus(const absl::Status &status) {
+  // absl's canonical codes are the same as gRPC's.
+  return grpc::Status(static_cast<grpc::StatusCode>(status.code()),
+                      std::string(status.message()));
+}
 
-  return grpc::Status::OK;
+// Who the job belongs to, for fair sharing: the client's own idea if it
+// gave one, otherwise its address (without the port, which differs per
+// connection).
+std::string ClientName(const grpc::CallbackServerContext &context,
+                       const SimulationRequest &request) {
+  if (!request.client_id().empty()) {
+    return request.client_id();
+  }
+  std::string peer = context.peer();
+  size_t port = peer.rfind(':');
+  if (port != std::string::npos && port > 0) {
+    peer.resize(port);
+  }
+  return peer;
 }
 
-grpc::Status SimulatorServiceImpl::RunSimulation(
-    grpc::ServerContext* context, const SimulationRequest* request,
-    grpc::ServerWriter<SimulationResponse>* writer) {
-  // Validate input
-  if (request->simulator() == Flavour::UNSET) {
-    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
-                        "Simulator flavour is required");
+// Fails the RPC straight away.
+template <typename Response>
+class FailedWriteReactor : public grpc::ServerWriteReactor<Response> {
+ public:
+  explicit FailedWriteReactor(const grpc::Status &status) {
+    this->Finish(status);
+  }
+
+  void OnDone() override { delete this; }
+};
+
+// Streams a job's responses to the client, one write in flight at a time.
+// Job is a SimulationJob or anything used the same way. Base is the kind of
+// reactor: a ServerWriteReactor, unless the RPC also reads, in which case
+// the job is only given (StartJob) once reading is done. Deletes itself when
+// gRPC is done with it.
+template <typename Job, typename Response,
+          typename Base = grpc::ServerWriteReactor<Response>>
+class JobWriteReactor : public Base {
+ public:
+  explicit JobWriteReactor(std::shared_ptr<Job> job) : JobWriteReactor() {
+    StartJob(std::move(job));
+  }
+
+  void OnWriteDone(bool ok) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      writing_ = false;
+    }
+    if (!ok) {
+      // Don't keep a simulator running for a client that isn't listening.
+      CancelJob(absl::CancelledError(
+          "Client stream broken; simulation terminated"));
+    }
+    MaybeWrite();
+  }
+
+  void OnCancel() override {
+    // Also how we find out that the deadline has passed.
+    CancelJob(absl::CancelledError(
+        "Client cancelled; simulation terminated"));
+    MaybeWrite();
+  }
+
+  void OnDone() override {
+    std::shared_ptr<Job> job;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job = std::move(job_);
+    }
+    if (job) {
+      job->Detach();
+      // Destroying the job may mean waiting for the simulator, which must
+      // not happen on gRPC's threads.
+      WorkerPool::GetInstance().Post([job]() {});
+    }
+    delete this;
   }
 
-  SimulatorManager simulator_manager;
+ protected:
+  JobWriteReactor() : writing_(false), finished_(false) {}
 
-  std::vector<std::string> additional_args(
-      request->additional_args().begin(),
-      request->additional_args().end());
+  void StartJob(std::shared_ptr<Job> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job_ = job;
+    }
+    job->Start([this]() { MaybeWrite(); });
+  }
 
-  if (request->has_vlsir_sim_input()) {
-    auto status = simulator_manager.RunSimulator(
-        request->simulator(), request->vlsir_sim_input(), additional_args);
-    if (!status.ok()) {
-      std::string new_message = absl::StrCat(
-          "Failure in running simulator:", status.message());
-      return grpc::Status(grpc::StatusCode::INTERNAL, new_message);
+ private:
+  void CancelJob(const absl::Status &status) {
+    std::shared_ptr<Job> job;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      job = job_;
     }
-  } else if (request->has_verbatim_files()) {
-    std::vector<FileInfo> file_infos(
-        request->verbatim_files().files().begin(),
-        request->verbatim_files().files().end());
+    if (job) {
+      job->Cancel(status);
+    }
+  }
 
-    auto status = simulator_manager.RunSimulator(
-        request->simulator(), file_infos, additional_args);
-    if (!status.ok()) {
-      std::string new_message = absl::StrCat(
-          "Failure in running simulator:", status.message());
-      return grpc::Status(grpc::StatusCode::INTERNAL, new_message);
+  void MaybeWrite() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!job_ || writing_ || finished_) {
+      return;
     }
-  } else {
-    return grpc::Status(
-        grpc::StatusCode::INVALID_ARGUMENT, "No circuit inputs.");
+    absl::Status status;
+    switch (job_->Next(&response_, &status)) {
+      case SimulationJob::NextResult::MESSAGE:
+        writing_ = true;
+        this->StartWrite(&response_);
+        break;
+      case SimulationJob::NextResult::DONE:
+        finished_ = true;
+        this->Finish(ToGrpcStatus(status));
+        break;
+      case SimulationJob::NextResult::WAIT:
+        break;
+    }
+  }
+
+  std::mutex mutex_;
+  std::shared_ptr<Job> job_;
+  bool writing_;
+  bool finished_;
+  // Must stay put until the write is done.
+  Response response_;
+};
+
+// Reads an UploadAndRun's inputs into an InputStager (on the WorkerPool, one
+// message at a time), then runs them as a SimulationJob.
+class UploadAndRunReactor
+    : public JobWriteReactor<
+          SimulationJob, SimulationResponse,
+          grpc::ServerBidiReactor<UploadRequest, SimulationResponse>> {
+ public:
+  explicit UploadAndRunReactor(grpc::CallbackServerContext *context)
+      : context_(context), started_(false) {
+    StartRead(&request_);
+  }
+
+  void OnReadDone(bool ok) override {
+    WorkerPool::GetInstance().Post([this, ok]() {
+      absl::Status status = ok ? Write() : Run();
+      if (!status.ok()) {
+        stager_.reset();
+        Finish(ToGrpcStatus(status));
+      } else if (ok) {
+        StartRead(&request_);
+      }
+    });
   }
 
-  // Poll and stream output from the subprocess
-  auto output_callback = [writer](const char* data, size_t length,
-                                  Subprocess::StreamType stream_type) {
-    SimulationResponse response;
-    response.set_output(data, length);
+ private:
+  absl::Status Write() {
+    if (!started_) {
+      if (request_.part_case() != UploadRequest::kSimulation) {
+        return absl::InvalidArgumentError(
+            "UploadAndRun must start with the SimulationRequest");
+      }
+      if (request_.simulation().has_vlsir_sim_input()) {
+        return absl::InvalidArgumentError(
+            "UploadAndRun takes verbatim files only");
+      }
+      started_ = true;
+      simulation_ = std::move(*request_.mutable_simulation());
+      // Checked before any chunks are taken, so that a bad request doesn't
+      // cost the client its upload. The streamed files count as inputs,
+      // though none have arrived yet.
+      simulation_.mutable_verbatim_files();
+      absl::Status valid = SimulationJob::Validate(simulation_);
+      if (!valid.ok()) {
+        return valid;
+      }
+      auto stager = InputStager::Create();
+      if (!stager.ok()) {
+        return stager.status();
+      }
+      stager_ = std::move(*stager);
+      for (const FileInfo &file : simulation_.verbatim_files().files()) {
+        absl::Status added = stager_->AddFile(file);
+        if (!added.ok()) {
+          return added;
+        }
+      }
+      return absl::OkStatus();
+    }
+    if (request_.part_case() != UploadRequest::kChunk) {
+      return absl::InvalidArgumentError(
+          "Only file chunks may follow the SimulationRequest");
+    }
+    return stager_->Append(request_.chunk());
+  }
 
-    if (stream_type == Subprocess::StreamType::STDOUT) {
-      response.set_stream_type(SimulationResponse::STDOUT);
-    } else {
-      response.set_stream_type(SimulationResponse::STDERR);
+  // The client has sent everything (or gone away).
+  absl::Status Run() {
+    if (context_->IsCancelled()) {
+      return absl::CancelledError("Client cancelled the upload");
+    }
+    if (!started_) {
+      return absl::InvalidArgumentError("No SimulationRequest given");
     }
+    absl::Status finished = stager_->Finish();
+    if (!finished.ok()) {
+      return finished;
+    }
+    VerbatimFileInput *files = simulation_.mutable_verbatim_files();
+    files->clear_files();
+    for (const std::string &path : stager_->paths()) {
+      files->add_files()->set_path(path);
+    }
+    if (files->files().empty()) {
+      return absl::InvalidArgumentError("No files given");
+    }
+    LOG(INFO) << "Uploaded " << stager_->total_bytes() << " bytes of input to "
+              << stager_->directory();
+    std::filesystem::path directory = stager_->Release();
+    stager_.reset();
+    // Once the job has started it can finish, and delete this, at any time,
+    // so no member may be touched after.
+    StartJob(SimulationJob::CreateStaged(
+        simulation_, ClientName(*context_, simulation_), directory));
+    return absl::OkStatus();
+  }
 
-    response.set_done(false);
-    writer->Write(response);
-  };
+  grpc::CallbackServerContext *context_;
+  UploadRequest request_;
+  bool started_;
+  SimulationRequest simulation_;
+  std::unique_ptr<InputStager> stager_;
+};
 
-  while (simulator_manager.PollAndReadOutput(output_callback)) {
-    // Continue polling while process is running and pipes are open
+// Takes a PutBlob stream into the BlobStore. Writing to disk happens on the
+// WorkerPool; the next message is only read once the last is written.
+class BlobUploadReactor : public grpc::ServerReadReactor<PutBlobRequest> {
+ public:
+  BlobUploadReactor(grpc::CallbackServerContext *context,
+                    PutBlobResponse *response)
+      : context_(context), response_(response) {
+    StartRead(&request_);
   }
 
-  // Wait for subprocess to complete and get exit code
-  int exit_code = simulator_manager.WaitForCompletion();
+  void OnReadDone(bool ok) override {
+    WorkerPool::GetInstance().Post([this, ok]() {
+      if (ok) {
+        Write();
+      } else {
+        Close();
+      }
+    });
+  }
 
-  // Send final message with exit code
-  SimulationResponse final_response;
-  final_response.set_done(true);
-  final_response.set_exit_code(exit_code);
-  writer->Write(final_response);
+  void OnDone() override { delete this; }
 
-  return grpc::Status::OK;
+ private:
+  void Write() {
+    if (!upload_) {
+      auto upload = BlobStore::GetInstance().StartUpload(request_.digest());
+      if (!upload.ok()) {
+        Finish(ToGrpcStatus(upload.status()));
+        return;
+      }
+      upload_ = std::move(*upload);
+      response_->set_digest(request_.digest());
+    } else if (!request_.digest().empty() &&
+               request_.digest() != response_->digest()) {
+      upload_.reset();
+      Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Digest changed part way through the blob"));
+      return;
+    }
+    absl::Status appended = upload_->Append(request_.data());
+    if (!appended.ok()) {
+      upload_.reset();
+      Finish(ToGrpcStatus(appended));
+      return;
+    }
+    StartRead(&request_);
+  }
+
+  // The client has sent everything (or gone away).
+  void Close() {
+    if (context_->IsCancelled()) {
+      upload_.reset();
+      Finish(grpc::Status::CANCELLED);
+      return;
+    }
+    if (!upload_) {
+      Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "No blob given"));
+      return;
+    }
+    absl::Status finished = upload_->Finish();
+    response_->set_size_bytes(upload_->size());
+    upload_.reset();
+    if (finished.ok()) {
+      LOG(INFO) << "Stored blob " << response_->digest() << ", "
+                << response_->size_bytes() << " bytes";
+    }
+    Finish(ToGrpcStatus(finished));
+  }
+
+  grpc::CallbackServerContext *context_;
+  PutBlobResponse *response_;
+  PutBlobRequest request_;
+  std::unique_ptr<BlobStore::Upload> upload_;
+};
+
+}   // namespace
+
+grpc::ServerBidiReactor<UploadRequest, SimulationResponse>*
+SimulatorServiceImpl::UploadAndRun(grpc::CallbackServerContext* context) {
+  return new UploadAndRunReactor(context);
+}
+
+grpc::ServerUnaryReactor* SimulatorServiceImpl::HasBlobs(
+    grpc::CallbackServerContext* context,
+    const HasBlobsRequest* request,
+    HasBlobsResponse* response) {
+  grpc::ServerUnaryReactor *reactor = context->DefaultReactor();
+  BlobStore &store = BlobStore::GetInstance();
+  if (!store.enabled()) {
+    reactor->Finish(grpc::Status(grpc::StatusCode::UNIMPLEMENTED,
+                                 "This server has no blob store"));
+    return reactor;
+  }
+  for (const std::string &digest : request->digests()) {
+    if (!Sha256::IsHexDigest(digest)) {
+      reactor->Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                                   "Not a SHA-256 digest: " + digest));
+      return reactor;
+    }
+    if (!store.Has(digest)) {
+      response->add_missing_digests(digest);
+    }
+  }
+  reactor->Finish(grpc::Status::OK);
+  return reactor;
+}
+
+grpc::ServerReadReactor<PutBlobRequest>* SimulatorServiceImpl::PutBlob(
+    grpc::CallbackServerContext* context, PutBlobResponse* response) {
+  return new BlobUploadReactor(context, response);
+}
+
+grpc::ServerWriteReactor<WaveformChunk>* SimulatorServiceImpl::GetWaveform(
+    grpc::CallbackServerContext* context, const GetWaveformRequest* request) {
+  absl::Status valid = WaveformQuery::Validate(*request);
+  if (!valid.ok()) {
+    return new FailedWriteReactor<WaveformChunk>(ToGrpcStatus(valid));
+  }
+  return new JobWriteReactor<WaveformQuery, WaveformChunk>(
+      WaveformQuery::Create(*request));
+}
+
+grpc::ServerUnaryReactor* SimulatorServiceImpl::ListSimulators(
+    grpc::CallbackServerContext* context,
+    const ListSimulatorsRequest* request,
+    ListSimulatorsResponse* reseponse) {
+  // Query the singleton/static SimulatorRegistry.
+
+  grpc::ServerUnaryReactor *reactor = context->DefaultReactor();
+  reactor->Finish(grpc::Status::OK);
+  return reactor;
+}
+
+grpc::ServerUnaryReactor* SimulatorServiceImpl::GetUsageStatistics(
+    grpc::CallbackServerContext* context,
+    const GetUsageStatisticsRequest* request,
+    GetUsageStatisticsResponse* response) {
+  UsageStatistics::GetInstance().Report(response);
+  grpc::ServerUnaryReactor *reactor = context->DefaultReactor();
+  reactor->Finish(grpc::Status::OK);
+  return reactor;
+}
+
+grpc::ServerWriteReactor<SimulationResponse>*
+SimulatorServiceImpl::RunSimulation(
+    grpc::CallbackServerContext* context, const SimulationRequest* request) {
+  absl::Status valid = SimulationJob::Validate(*request);
+  if (!valid.ok()) {
+    return new FailedWriteReactor<SimulationResponse>(ToGrpcStatus(valid));
+  }
+  return new JobWriteReactor<SimulationJob, SimulationResponse>(
+      SimulationJob::Create(*request, ClientName(*context, *request)));
+}
+
+grpc::ServerWriteReactor<SweepResponse>* SimulatorServiceImpl::RunSweep(
+    grpc::CallbackServerContext* context, const SweepRequest* request) {
+  absl::Status valid = SweepJob::Validate(*request);
+  if (!valid.ok()) {
+    return new FailedWriteReactor<SweepResponse>(ToGrpcStatus(valid));
+  }
+  return new JobWriteReactor<SweepJob, SweepResponse>(
+      SweepJob::Create(*request,
+                       ClientName(*context, request->simulation())));
+}
+
+grpc::ServerWriteReactor<BatchResponse>*
+SimulatorServiceImpl::RunSimulationBatch(
+    grpc::CallbackServerContext* context, const BatchRequest* request) {
+  absl::Status valid = BatchJob::Validate(*request);
+  if (!valid.ok()) {
+    return new FailedWriteReactor<BatchResponse>(ToGrpcStatus(valid));
+  }
+  // The whole batch counts against whoever sent its first request.
+  return new JobWriteReactor<BatchJob, BatchResponse>(
+      BatchJob::Create(*request,
+                       ClientName(*context, request->requests(0))));
 }
 
 }  // namespace spiceserver
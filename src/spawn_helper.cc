@@ -0,0 +1,352 @@
+#include "spawn_helper.h"
+
+#include <fcntl.h>
+#include <linux/sched.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+
+#include "subprocess.h"
+#include "proto/spawn_helper.pb.h"
+
+namespace spiceserver {
+
+namespace {
+
+// Largest request or response we will exchange with the helper. Requests are
+// just a command line, so this is generous.
+constexpr size_t kMaxMessageBytes = 64 * 1024;
+
+// stdout, stderr, pidfd.
+constexpr size_t kMaxFdsPerMessage = 3;
+
+void CloseAll(const std::vector<int> &fds) {
+  for (int fd : fds) {
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+}
+
+}   // namespace
+
+SpawnHelper::SpawnHelper()
+    : helper_pid_(-1),
+      socket_fd_(-1) {}
+
+SpawnHelper::~SpawnHelper() {
+  if (socket_fd_ != -1) {
+    // The helper exits when it sees EOF.
+    close(socket_fd_);
+    socket_fd_ = -1;
+  }
+  if (helper_pid_ > 0) {
+    waitpid(helper_pid_, nullptr, 0);
+  }
+}
+
+absl::Status SpawnHelper::Start() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (socket_fd_ != -1) {
+    return absl::AlreadyExistsError("Spawn helper is already running.");
+  }
+
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1) {
+    return absl::InternalError(
+        absl::StrCat("socketpair failed: ", strerror(errno)));
+  }
+
+  pid_t server_pid = getpid();
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(sockets[0]);
+    close(sockets[1]);
+    return absl::InternalError(absl::StrCat("fork failed: ", strerror(errno)));
+  }
+
+  if (pid == 0) {
+    close(sockets[0]);
+    // Don't outlive the server.
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != server_pid) {
+      _exit(0);
+    }
+    // ^C is for the server; it will close the socket on its way out.
+    signal(SIGINT, SIG_IGN);
+    Serve(sockets[1]);
+  }
+
+  close(sockets[1]);
+  socket_fd_ = sockets[0];
+  helper_pid_ = pid;
+  LOG(INFO) << "Started spawn helper with pid " << helper_pid_;
+  return absl::OkStatus();
+}
+
+bool SpawnHelper::IsRunning() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return socket_fd_ != -1;
+}
+
+absl::Status SpawnHelper::Spawn(const SpawnRequest &request,
+                                int cgroup_procs_fd,
+                                SpawnedProcess *spawned) {
+  SpawnResponse response;
+  std::vector<int> fds;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (socket_fd_ == -1) {
+      return absl::UnavailableError("Spawn helper is not running.");
+    }
+    std::vector<int> fds_to_send;
+    if (cgroup_procs_fd != -1) {
+      fds_to_send.push_back(cgroup_procs_fd);
+    }
+    if (!SendMessage(socket_fd_, request, fds_to_send) ||
+        !ReceiveMessage(socket_fd_, &response, &fds)) {
+      // The helper is gone or confused; stop using it.
+      LOG(ERROR) << "Lost contact with spawn helper: " << strerror(errno);
+      close(socket_fd_);
+      socket_fd_ = -1;
+      CloseAll(fds);
+      return absl::UnavailableError("Spawn helper is not responding.");
+    }
+  }
+
+  if (response.error_number() != 0) {
+    CloseAll(fds);
+    if (response.pid() > 0) {
+      // The child was created (as our child) but failed to exec.
+      waitpid(response.pid(), nullptr, 0);
+    }
+    return absl::InternalError(response.error());
+  }
+  if (fds.size() != kMaxFdsPerMessage) {
+    CloseAll(fds);
+    return absl::InternalError(absl::StrCat(
+        "Spawn helper sent ", fds.size(), " descriptors, expected ",
+        kMaxFdsPerMessage));
+  }
+
+  spawned->pid = response.pid();
+  spawned->stdout_fd = fds[0];
+  spawned->stderr_fd = fds[1];
+  spawned->pidfd = fds[2];
+  return absl::OkStatus();
+}
+
+void SpawnHelper::Serve(int socket_fd) {
+  while (true) {
+    SpawnRequest request;
+    std::vector<int> received_fds;
+    if (!ReceiveMessage(socket_fd, &request, &received_fds)) {
+      // The server has gone away (or sent us garbage).
+      _exit(0);
+    }
+
+    std::vector<int> fds_to_send;
+    SpawnResponse response = HandleRequest(
+        request, received_fds, &fds_to_send);
+    CloseAll(received_fds);
+    bool sent = SendMessage(socket_fd, response, fds_to_send);
+    CloseAll(fds_to_send);
+    if (!sent) {
+      _exit(1);
+    }
+  }
+}
+
+SpawnResponse SpawnHelper::HandleRequest(const SpawnRequest &request,
+                                         const std::vector<int> &received_fds,
+                                         std::vector<int> *fds_to_send) {
+  SpawnResponse response;
+  auto fail = [&](const std::string &what, int error_number) {
+    response.set_error_number(error_number);
+    response.set_error(absl::StrCat(what, ": ", strerror(error_number)));
+    return response;
+  };
+
+  // Everything the child needs has to be allocated before it exists.
+  std::vector<char*> argv;
+  argv.push_back(const_cast<char*>(request.command().c_str()));
+  for (const std::string &arg : request.args()) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  std::vector<Subprocess::ResourceLimit> resource_limits;
+  for (const auto &limit_pb : request.resource_limits()) {
+    resource_limits.push_back(Subprocess::ResourceLimit{
+        limit_pb.resource(),
+        static_cast<rlim_t>(limit_pb.soft()),
+        static_cast<rlim_t>(limit_pb.hard())});
+  }
+
+  int stdout_pipe[2] = {-1, -1};
+  int stderr_pipe[2] = {-1, -1};
+  // The child writes its errno here if it can't exec. Since it's
+  // close-on-exec, EOF means the exec worked.
+  int error_pipe[2] = {-1, -1};
+  if (pipe2(stdout_pipe, O_CLOEXEC) == -1 ||
+      pipe2(stderr_pipe, O_CLOEXEC) == -1 ||
+      pipe2(error_pipe, O_CLOEXEC) == -1) {
+    int pipe_errno = errno;
+    CloseAll({stdout_pipe[0], stdout_pipe[1], stderr_pipe[0], stderr_pipe[1],
+              error_pipe[0], error_pipe[1]});
+    return fail("Could not create pipes to child process", pipe_errno);
+  }
+
+  Subprocess::ChildSetup setup {
+    .command = argv.front(),
+    .argv = argv.data(),
+    .directory = request.directory().c_str(),
+    .stdout_write_fd = stdout_pipe[1],
+    .stderr_write_fd = stderr_pipe[1],
+    .error_fd = error_pipe[1],
+    .resource_limits = &resource_limits,
+    .cgroup_procs_fd = received_fds.empty() ? -1 : received_fds.front()
+  };
+
+  // CLONE_PARENT makes the child a sibling of the helper, i.e. a child of the
+  // server, so that the server can reap it and collect its exit status.
+  // (exit_signal must be 0 with CLONE_PARENT; the child inherits ours,
+  // SIGCHLD.)
+  int pidfd = -1;
+  struct clone_args args;
+  memset(&args, 0, sizeof(args));
+  args.flags = CLONE_PARENT | CLONE_PIDFD;
+  args.pidfd = reinterpret_cast<uint64_t>(&pidfd);
+  args.exit_signal = 0;
+
+  pid_t pid = static_cast<pid_t>(syscall(SYS_clone3, &args, sizeof(args)));
+  if (pid == 0) {
+    int exec_errno;
+    Subprocess::ExecChild(setup, &exec_errno);
+  }
+  int clone_errno = errno;
+
+  close(stdout_pipe[1]);
+  close(stderr_pipe[1]);
+  close(error_pipe[1]);
+
+  if (pid == -1) {
+    CloseAll({stdout_pipe[0], stderr_pipe[0], error_pipe[0]});
+    return fail("clone3 failed", clone_errno);
+  }
+  response.set_pid(pid);
+
+  int exec_errno = 0;
+  ssize_t count;
+  do {
+    count = read(error_pipe[0], &exec_errno, sizeof(exec_errno));
+  } while (count == -1 && errno == EINTR);
+  close(error_pipe[0]);
+
+  if (count > 0) {
+    CloseAll({stdout_pipe[0], stderr_pipe[0], pidfd});
+    return fail(absl::StrCat("Failed to execute ", request.command()),
+                exec_errno);
+  }
+
+  *fds_to_send = {stdout_pipe[0], stderr_pipe[0], pidfd};
+  return response;
+}
+
+bool SpawnHelper::SendMessage(int socket_fd,
+                              const google::protobuf::Message &message,
+                              const std::vector<int> &fds) {
+  std::string serialised;
+  if (!message.SerializeToString(&serialised) ||
+      serialised.size() > kMaxMessageBytes ||
+      fds.size() > kMaxFdsPerMessage) {
+    return false;
+  }
+
+  // A zero-length SOCK_SEQPACKET message is indistinguishable from EOF, so
+  // always send at least a byte: the first byte is a marker and the
+  // serialised message follows.
+  serialised.insert(serialised.begin(), '\x01');
+
+  struct iovec iov;
+  iov.iov_base = serialised.data();
+  iov.iov_len = serialised.size();
+
+  struct msghdr header;
+  memset(&header, 0, sizeof(header));
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+
+  char control[CMSG_SPACE(sizeof(int) * kMaxFdsPerMessage)];
+  if (!fds.empty()) {
+    memset(control, 0, sizeof(control));
+    header.msg_control = control;
+    header.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(socket_fd, &header, MSG_NOSIGNAL);
+  } while (sent == -1 && errno == EINTR);
+  return sent == static_cast<ssize_t>(serialised.size());
+}
+
+bool SpawnHelper::ReceiveMessage(int socket_fd,
+                                 google::protobuf::Message *message,
+                                 std::vector<int> *fds) {
+  std::vector<char> buffer(kMaxMessageBytes + 1);
+  struct iovec iov;
+  iov.iov_base = buffer.data();
+  iov.iov_len = buffer.size();
+
+  char control[CMSG_SPACE(sizeof(int) * kMaxFdsPerMessage)];
+  struct msghdr header;
+  memset(&header, 0, sizeof(header));
+  header.msg_iov = &iov;
+  header.msg_iovlen = 1;
+  header.msg_control = control;
+  header.msg_controllen = sizeof(control);
+
+  ssize_t received;
+  do {
+    received = recvmsg(socket_fd, &header, MSG_CMSG_CLOEXEC);
+  } while (received == -1 && errno == EINTR);
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+       cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&header, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int *received_fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+    fds->insert(fds->end(), received_fds, received_fds + num_fds);
+  }
+
+  if (received <= 0 ||
+      (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+      buffer[0] != '\x01') {
+    return false;
+  }
+  return message->ParseFromArray(buffer.data() + 1, received - 1);
+}
+
+}  // namespace spiceserver
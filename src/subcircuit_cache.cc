@@ -0,0 +1,83 @@
+#include "subcircuit_cache.h"
+
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <gflags/gflags.h>
+
+DEFINE_uint64(subcircuit_cache_max_bytes, 256ULL << 20,
+              "How much netlisted module text to keep for reuse by later "
+              "requests; 0 turns this off.");
+
+namespace spiceserver {
+
+SubcircuitCache &SubcircuitCache::GetInstance() {
+  static SubcircuitCache instance(FLAGS_subcircuit_cache_max_bytes);
+  return instance;
+}
+
+SubcircuitCache::SubcircuitCache(uint64_t max_bytes)
+    : max_bytes_(max_bytes),
+      total_bytes_(0),
+      hits_(0),
+      misses_(0) {}
+
+std::shared_ptr<const std::string> SubcircuitCache::Lookup(
+    const std::string &key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    ++misses_;
+    return nullptr;
+  }
+  ++hits_;
+  lru_.splice(lru_.end(), lru_, it->second.lru_position);
+  return it->second.text;
+}
+
+void SubcircuitCache::Store(const std::string &key, std::string text) {
+  if (!enabled() || text.size() > max_bytes_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (entries_.find(key) != entries_.end()) {
+    // Someone else got there first; it's the same text.
+    return;
+  }
+  total_bytes_ += text.size();
+  lru_.push_back(key);
+  entries_[key] = Entry {
+      std::make_shared<const std::string>(std::move(text)),
+      std::prev(lru_.end())};
+  Evict();
+}
+
+uint64_t SubcircuitCache::total_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return total_bytes_;
+}
+
+uint64_t SubcircuitCache::hits() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+uint64_t SubcircuitCache::misses() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
+
+void SubcircuitCache::Evict() {
+  while (total_bytes_ > max_bytes_ && !lru_.empty()) {
+    auto it = entries_.find(lru_.front());
+    total_bytes_ -= it->second.text->size();
+    entries_.erase(it);
+    lru_.pop_front();
+  }
+}
+
+}  // namespace spiceserver
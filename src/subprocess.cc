@@ -2,36 +2,98 @@
 
 #include <fcntl.h>
 #include <poll.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <cstring>
-#include <filesystem>
 #include <csignal>
 
 #include <array>
+#include <chrono>
+#include <mutex>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
 #include <absl/strings/str_join.h>
 
+#include "output_reactor.h"
+#include "spawn_helper.h"
+#include "proto/spawn_helper.pb.h"
+
+DEFINE_string(spawn_method, "helper",
+              "How to start simulator processes: \"fork\", \"posix_spawn\", "
+              "\"clone_vfork\" or \"helper\". All but \"fork\" avoid "
+              "copying the server's page tables. \"helper\" asks a small "
+              "process forked at startup to do it, and falls back to "
+              "\"posix_spawn\" if that isn't available.");
+
+extern char **environ;
+
 void sigint_handler(int value) {
   std::cout << "Caught signal: " << strsignal(value) << std::endl;
 }
 
 namespace spiceserver {
 
+namespace {
+
+constexpr size_t kCloneStackBytes = 256 * 1024;
+
+}   // namespace
+
 Subprocess::Subprocess()
-    : pid_(-1),
+    : Subprocess(DefaultSpawnMethod()) {}
+
+Subprocess::Subprocess(SpawnMethod spawn_method)
+    : spawn_method_(spawn_method),
+      cgroup_procs_fd_(-1),
+      pid_(-1),
+      pidfd_(-1),
       stdout_open_(false),
       stderr_open_(false),
-      process_spawned_(false) {
+      process_spawned_(false),
+      reaped_(false),
+      exit_code_(-1),
+      terminating_signal_(0),
+      watch_id_(0) {
+  memset(&rusage_, 0, sizeof(rusage_));
   stdout_pipe_[0] = -1;
   stdout_pipe_[1] = -1;
   stderr_pipe_[0] = -1;
   stderr_pipe_[1] = -1;
 }
 
-Subprocess::~Subprocess() { CleanupPipes(); }
+Subprocess::SpawnMethod Subprocess::DefaultSpawnMethod() {
+  auto method = ParseSpawnMethod(FLAGS_spawn_method);
+  if (!method.ok()) {
+    LOG(WARNING) << method.status() << "; using fork";
+    return SpawnMethod::FORK;
+  }
+  return *method;
+}
+
+Subprocess::~Subprocess() {
+  StopWatching();
+  CleanupPipes();
+  if (pidfd_ != -1) {
+    close(pidfd_);
+    pidfd_ = -1;
+  }
+}
+
+void Subprocess::StopWatching() {
+  if (watch_id_ == 0) {
+    return;
+  }
+  OutputReactor::GetInstance().Remove(watch_id_);
+  watch_id_ = 0;
+}
 
 void Subprocess::CleanupPipes() {
   if (stdout_pipe_[0] != -1) {
@@ -56,59 +118,370 @@ void Subprocess::SetNonBlocking(int fd) {
   fcntl(fd, F_SETFL, O_NONBLOCK);
 }
 
-absl::Status Subprocess::Spawn(
-    const std::string &command,
-    const std::vector<std::string> &args,
-    const std::string &directory) {
-  if (process_spawned_) {
-    return absl::AlreadyExistsError("The process has already been spawned.");
+[[noreturn]] void Subprocess::ExecChild(const ChildSetup &setup,
+                                       int *exec_errno) {
+  auto fail = [&]() {
+    *exec_errno = errno;
+    if (setup.error_fd != -1) {
+      ssize_t unused = write(setup.error_fd, exec_errno, sizeof(*exec_errno));
+      (void)unused;
+    }
+    _exit(127);
+  };
+
+  // Lead a new process group, so that the whole tree can be killed at once.
+  if (setpgid(0, 0) == -1) {
+    fail();
   }
 
-  // Create pipes for stdout and stderr. Index 0 gets the read end of the pipe,
-  // and index 1 gets the write end.
-  if (pipe(stdout_pipe_) == -1 || pipe(stderr_pipe_) == -1) {
-    CleanupPipes();
-    return absl::InternalError("Could not create pipes to child process.");
+  // Join the job's cgroup before doing anything that might allocate.
+  if (setup.cgroup_procs_fd != -1 &&
+      write(setup.cgroup_procs_fd, "0", 1) != 1) {
+    fail();
+  }
+
+  if (setup.resource_limits) {
+    for (const ResourceLimit &limit : *setup.resource_limits) {
+      struct rlimit value;
+      value.rlim_cur = limit.soft;
+      value.rlim_max = limit.hard;
+      if (setrlimit(limit.resource, &value) == -1) {
+        fail();
+      }
+    }
+  }
+
+  if (chdir(setup.directory) == -1) {
+    fail();
+  }
+
+  // Redirect stdout and stderr to pipes
+  if (dup2(setup.stdout_write_fd, STDOUT_FILENO) == -1 ||
+      dup2(setup.stderr_write_fd, STDERR_FILENO) == -1) {
+    fail();
   }
 
+  // Execute the command.
+  execvp(setup.command, setup.argv);
+
+  // If execvp returns, it failed.
+  fail();
+  _exit(127);
+}
+
+namespace {
+
+struct CloneVforkArgs {
+  Subprocess::ChildSetup setup;
+  const sigset_t *parent_mask;
+  // Written by the child, which shares our memory, if it fails to exec.
+  int exec_errno;
+};
+
+int CloneVforkChild(void *arg) {
+  CloneVforkArgs *args = static_cast<CloneVforkArgs*>(arg);
+
+  // We share the parent's memory and signal handlers, so a handler running
+  // here would be running on the parent's data. Reset anything that isn't
+  // SIG_IGN to the default before unblocking signals.
+  for (int signal_number = 1; signal_number < NSIG; ++signal_number) {
+    struct sigaction action;
+    if (sigaction(signal_number, nullptr, &action) == 0 &&
+        action.sa_handler != SIG_IGN &&
+        action.sa_handler != SIG_DFL) {
+      action.sa_handler = SIG_DFL;
+      sigaction(signal_number, &action, nullptr);
+    }
+  }
+  sigprocmask(SIG_SETMASK, args->parent_mask, nullptr);
+
+  Subprocess::ExecChild(args->setup, &args->exec_errno);
+}
+
+}   // namespace
+
+absl::Status Subprocess::SpawnWithFork(const std::string &command,
+                                       const std::vector<char*> &argv,
+                                       const std::string &directory) {
   pid_ = fork();
 
   if (pid_ == -1) {
-    CleanupPipes();
     return absl::InternalError("Fork failed.");
   }
 
   if (pid_ == 0) {
-    std::filesystem::current_path(directory);
+    // Child process. Nobody is there to read this in our copy of memory, so
+    // the exit code is all the parent will see.
+    int unused_errno;
+    ExecChild(MakeChildSetup(argv, directory), &unused_errno);
+  }
+  // The child does this too; whoever gets there first closes the window in
+  // which we might signal a group that doesn't exist yet. (This fails
+  // harmlessly if the child has already exec'd.)
+  setpgid(pid_, pid_);
+  return absl::OkStatus();
+}
 
-    // Child process
-    close(stdout_pipe_[0]);
-    close(stderr_pipe_[0]);
+absl::Status Subprocess::SpawnWithPosixSpawn(const std::string &command,
+                                             const std::vector<char*> &argv,
+                                             const std::string &directory) {
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  posix_spawn_file_actions_addchdir_np(&file_actions, directory.c_str());
+  posix_spawn_file_actions_adddup2(
+      &file_actions, stdout_pipe_[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(
+      &file_actions, stderr_pipe_[1], STDERR_FILENO);
+
+  // Give the child a clean signal mask and default dispositions for anything
+  // we've installed handlers for.
+  posix_spawnattr_t attributes;
+  posix_spawnattr_init(&attributes);
+  sigset_t empty_mask;
+  sigemptyset(&empty_mask);
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  sigaddset(&default_signals, SIGINT);
+  sigaddset(&default_signals, SIGPIPE);
+  posix_spawnattr_setsigmask(&attributes, &empty_mask);
+  posix_spawnattr_setsigdefault(&attributes, &default_signals);
+  // Lead a new process group (pgid = the child's pid).
+  posix_spawnattr_setpgroup(&attributes, 0);
+  posix_spawnattr_setflags(
+      &attributes,
+      POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+
+  int result = posix_spawnp(&pid_,
+                            command.c_str(),
+                            &file_actions,
+                            &attributes,
+                            argv.data(),
+                            environ);
+
+  posix_spawnattr_destroy(&attributes);
+  posix_spawn_file_actions_destroy(&file_actions);
+
+  if (result != 0) {
+    pid_ = -1;
+    return absl::InternalError(
+        absl::StrCat("posix_spawn failed: ", strerror(result)));
+  }
 
-    // Redirect stdout and stderr to pipes
-    dup2(stdout_pipe_[1], STDOUT_FILENO);
-    dup2(stderr_pipe_[1], STDERR_FILENO);
+  return absl::OkStatus();
+}
 
-    close(stdout_pipe_[1]);
-    close(stderr_pipe_[1]);
+absl::Status Subprocess::SpawnWithHelper(
+    const std::string &command,
+    const std::vector<std::string> &args,
+    const std::string &directory) {
+  SpawnRequest request;
+  request.set_command(command);
+  for (const std::string &arg : args) {
+    request.add_args(arg);
+  }
+  request.set_directory(directory);
+  for (const ResourceLimit &limit : resource_limits_) {
+    spiceserver::ResourceLimit *limit_pb = request.add_resource_limits();
+    limit_pb->set_resource(limit.resource);
+    limit_pb->set_soft(limit.soft);
+    limit_pb->set_hard(limit.hard);
+  }
+
+  SpawnHelper::SpawnedProcess spawned;
+  auto status = SpawnHelper::GetInstance().Spawn(
+      request, cgroup_procs_fd_, &spawned);
+  if (!status.ok()) {
+    return status;
+  }
+  pid_ = spawned.pid;
+  pidfd_ = spawned.pidfd;
+  stdout_pipe_[0] = spawned.stdout_fd;
+  stderr_pipe_[0] = spawned.stderr_fd;
+  return absl::OkStatus();
+}
+
+Subprocess::ChildSetup Subprocess::MakeChildSetup(
+    const std::vector<char*> &argv, const std::string &directory) const {
+  return ChildSetup {
+    .command = argv.front(),
+    .argv = argv.data(),
+    .directory = directory.c_str(),
+    .stdout_write_fd = stdout_pipe_[1],
+    .stderr_write_fd = stderr_pipe_[1],
+    .error_fd = -1,
+    .resource_limits = &resource_limits_,
+    .cgroup_procs_fd = cgroup_procs_fd_
+  };
+}
 
-    // Build argument list
-    std::vector<char*> argv;
-    argv.push_back(const_cast<char*>(command.c_str()));
+absl::Status Subprocess::SpawnWithCloneVfork(const std::string &command,
+                                             const std::vector<char*> &argv,
+                                             const std::string &directory) {
+  // The child runs on its own small stack until it execs; CLONE_VFORK
+  // suspends us until then, so it can be freed straight after.
+  void *stack = mmap(nullptr,
+                     kCloneStackBytes,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+                     -1,
+                     0);
+  if (stack == MAP_FAILED) {
+    return absl::ResourceExhaustedError(
+        "Could not allocate a stack for the child.");
+  }
+
+  // Block everything so that none of our handlers run in the child before it
+  // has had a chance to reset them.
+  sigset_t all_signals;
+  sigset_t parent_mask;
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &parent_mask);
+
+  CloneVforkArgs args {
+    .setup = MakeChildSetup(argv, directory),
+    .parent_mask = &parent_mask,
+    .exec_errno = 0
+  };
+
+  pid_ = clone(&CloneVforkChild,
+               static_cast<char*>(stack) + kCloneStackBytes,
+               CLONE_VM | CLONE_VFORK | SIGCHLD,
+               &args);
+  int clone_errno = errno;
+
+  pthread_sigmask(SIG_SETMASK, &parent_mask, nullptr);
+  munmap(stack, kCloneStackBytes);
 
-    for (const auto& arg : args) {
-      argv.push_back(const_cast<char*>(arg.c_str()));
+  if (pid_ == -1) {
+    return absl::InternalError(
+        absl::StrCat("clone failed: ", strerror(clone_errno)));
+  }
+  if (args.exec_errno != 0) {
+    // The child has already exited; collect it so it doesn't linger.
+    waitpid(pid_, nullptr, 0);
+    pid_ = -1;
+    return absl::InternalError(
+        absl::StrCat("Failed to execute command: ",
+                     strerror(args.exec_errno)));
+  }
+  return absl::OkStatus();
+}
+
+absl::StatusOr<Subprocess::SpawnMethod> Subprocess::ParseSpawnMethod(
+    const std::string &name) {
+  if (name == "fork") {
+    return SpawnMethod::FORK;
+  } else if (name == "posix_spawn") {
+    return SpawnMethod::POSIX_SPAWN;
+  } else if (name == "clone_vfork") {
+    return SpawnMethod::VFORK;
+  } else if (name == "helper") {
+    return SpawnMethod::HELPER;
+  }
+  return absl::InvalidArgumentError(
+      absl::StrCat("Unknown spawn method: \"", name, "\""));
+}
+
+std::string Subprocess::SpawnMethodName(SpawnMethod method) {
+  switch (method) {
+    case SpawnMethod::FORK:
+      return "fork";
+    case SpawnMethod::POSIX_SPAWN:
+      return "posix_spawn";
+    case SpawnMethod::VFORK:
+      return "clone_vfork";
+    case SpawnMethod::HELPER:
+      return "helper";
+  }
+  return "unknown";
+}
+
+absl::Status Subprocess::Spawn(
+    const std::string &command,
+    const std::vector<std::string> &args,
+    const std::string &directory) {
+  if (process_spawned_) {
+    return absl::AlreadyExistsError("The process has already been spawned.");
+  }
+
+  if (spawn_method_ == SpawnMethod::HELPER) {
+    if (SpawnHelper::GetInstance().IsRunning()) {
+      auto spawned = SpawnWithHelper(command, args, directory);
+      if (spawned.ok()) {
+        return FinishSpawn(command, args);
+      }
+      LOG(WARNING) << "Spawn helper failed, spawning directly: " << spawned;
+    } else {
+      LOG_FIRST_N(WARNING, 1)
+          << "Spawn helper is not running, spawning directly";
     }
-    argv.push_back(nullptr);
+  }
+
+  // Create pipes for stdout and stderr. Index 0 gets the read end of the pipe,
+  // and index 1 gets the write end. Both ends are close-on-exec so that
+  // children spawned concurrently for other jobs don't inherit them (and keep
+  // them open); the child's dup2 onto stdout/stderr clears the flag on the
+  // copies it actually needs.
+  if (pipe2(stdout_pipe_, O_CLOEXEC) == -1 ||
+      pipe2(stderr_pipe_, O_CLOEXEC) == -1) {
+    CleanupPipes();
+    return absl::InternalError("Could not create pipes to child process.");
+  }
 
-    // Execute the command.
-    execvp(command.c_str(), argv.data());
+  // Build argument list. This must all be done before the child exists,
+  // since it can't safely allocate.
+  std::vector<char*> argv;
+  argv.push_back(const_cast<char*>(command.c_str()));
+  for (const auto& arg : args) {
+    argv.push_back(const_cast<char*>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  // Limits can't be applied to a posix_spawn child until it has exec'd,
+  // when the simulator is already running without them.
+  bool needs_setup = !resource_limits_.empty() || cgroup_procs_fd_ != -1;
+
+  absl::Status spawned;
+  switch (spawn_method_) {
+    case SpawnMethod::POSIX_SPAWN:
+      spawned = needs_setup ?
+          SpawnWithCloneVfork(command, argv, directory) :
+          SpawnWithPosixSpawn(command, argv, directory);
+      break;
+    case SpawnMethod::VFORK:
+      spawned = SpawnWithCloneVfork(command, argv, directory);
+      break;
+    case SpawnMethod::FORK:
+      spawned = SpawnWithFork(command, argv, directory);
+      break;
+    case SpawnMethod::HELPER:
+    default:
+      // Only get here if the helper is unavailable.
+      spawned = needs_setup ?
+          SpawnWithCloneVfork(command, argv, directory) :
+          SpawnWithPosixSpawn(command, argv, directory);
+      break;
+  }
+  if (!spawned.ok()) {
+    CleanupPipes();
+    return spawned;
+  }
 
-    // TODO(aryap): Need to extract return code.
+  return FinishSpawn(command, args);
+}
 
-    // If execvp returns, it failed.
-    LOG(ERROR) << "Failed to execute command: " << strerror(errno);
-    _exit(1);
+absl::Status Subprocess::FinishSpawn(const std::string &command,
+                                     const std::vector<std::string> &args) {
+  // The pidfd lets the OutputReactor find out that the child has exited
+  // without anyone blocking in waitpid. Since we don't reap the child until
+  // the pidfd says so, the pid can't be recycled underneath us in the
+  // meantime.
+  if (pidfd_ == -1) {
+    pidfd_ = static_cast<int>(syscall(SYS_pidfd_open, pid_, 0));
+  }
+  if (pidfd_ == -1) {
+    LOG(WARNING) << "pidfd_open failed, child exit will only be detected "
+                 << "with waitpid: " << strerror(errno);
   }
 
   // If I don't do this, ^C doesn't work:
@@ -120,11 +493,15 @@ absl::Status Subprocess::Spawn(
   full_command.insert(full_command.begin(), command);
   LOG(INFO) << "Child is running command: " << absl::StrJoin(full_command, " ");
 
-  // Parent process
-  close(stdout_pipe_[1]);
-  stdout_pipe_[1] = -1;
-  close(stderr_pipe_[1]);
-  stderr_pipe_[1] = -1;
+  // Parent process. (The spawn helper keeps the write ends to itself.)
+  if (stdout_pipe_[1] != -1) {
+    close(stdout_pipe_[1]);
+    stdout_pipe_[1] = -1;
+  }
+  if (stderr_pipe_[1] != -1) {
+    close(stderr_pipe_[1]);
+    stderr_pipe_[1] = -1;
+  }
 
   // Set pipes to non-blocking
   SetNonBlocking(stdout_pipe_[0]);
@@ -132,12 +509,51 @@ absl::Status Subprocess::Spawn(
 
   stdout_open_ = true;
   stderr_open_ = true;
-  process_spawned_ = true;
+  reaped_ = false;
+  exit_code_ = -1;
+  terminating_signal_ = 0;
+  process_spawned_.store(true, std::memory_order_release);
+
+  return absl::OkStatus();
+}
+
+absl::Status Subprocess::StartWatching(OutputCallback on_output,
+                                       ExitCallback on_exit) {
+  if (!process_spawned_) {
+    return absl::FailedPreconditionError("No process has been spawned.");
+  }
+  if (pidfd_ == -1) {
+    return absl::UnavailableError(
+        "Child has no pidfd; cannot be watched by the OutputReactor.");
+  }
+  if (watch_id_ != 0) {
+    return absl::AlreadyExistsError("Subprocess is already being watched.");
+  }
 
+  auto id = OutputReactor::GetInstance().Add(
+      stdout_pipe_[0],
+      stderr_pipe_[0],
+      pidfd_,
+      on_output,
+      [this, on_exit]() {
+        // The reactor is finished with our descriptors, and since the pidfd
+        // was readable this won't block. watch_id_ is left alone: this can
+        // run before Add() has returned it, and removing a finished watch is
+        // harmless.
+        stdout_open_ = false;
+        stderr_open_ = false;
+        Reap();
+        on_exit(exit_code_);
+      });
+  if (!id.ok()) {
+    return id.status();
+  }
+  watch_id_ = *id;
   return absl::OkStatus();
 }
 
-bool Subprocess::PollAndReadOutput(OutputCallback callback) {
+bool Subprocess::PollAndReadOutput(OutputCallback callback,
+                                   std::chrono::milliseconds timeout) {
   if (!process_spawned_ || (!stdout_open_ && !stderr_open_)) {
     return false;
   }
@@ -150,7 +566,7 @@ bool Subprocess::PollAndReadOutput(OutputCallback callback) {
 
   char buffer[4096];
 
-  int poll_result = poll(fds.data(), 2, 1000);
+  int poll_result = poll(fds.data(), 2, timeout.count());
 
   if (poll_result == -1) {
     return false;
@@ -183,8 +599,52 @@ bool Subprocess::PollAndReadOutput(OutputCallback callback) {
   return stdout_open_ || stderr_open_;
 }
 
+void Subprocess::Reap() {
+  if (reaped_.load(std::memory_order_acquire)) {
+    return;
+  }
+
+  // Wait for the exit without reaping first, so as not to block
+  // SignalProcessGroup for as long as the child runs.
+  siginfo_t info;
+  while (waitid(P_PID, pid_, &info, WEXITED | WNOWAIT) == -1 &&
+         errno == EINTR) {}
+
+  std::lock_guard<std::mutex> lock(reap_mutex_);
+  if (reaped_.load(std::memory_order_acquire)) {
+    return;
+  }
+  int status = 0;
+  pid_t result;
+  do {
+    result = wait4(pid_, &status, 0, &rusage_);
+  } while (result == -1 && errno == EINTR);
+
+  if (result == -1) {
+    LOG(ERROR) << "wait4 failed for pid " << pid_ << ": " << strerror(errno);
+    exit_code_ = -1;
+  } else if (WIFEXITED(status)) {
+    exit_code_ = WEXITSTATUS(status);
+  } else {
+    exit_code_ = -1;
+    if (WIFSIGNALED(status)) {
+      terminating_signal_ = WTERMSIG(status);
+      LOG(INFO) << "pid " << pid_ << " was killed by "
+                << strsignal(terminating_signal_)
+                << (WCOREDUMP(status) ? " (core dumped)" : "");
+    }
+  }
+  reaped_.store(true, std::memory_order_release);
+  process_spawned_.store(false, std::memory_order_release);
+}
+
 int Subprocess::WaitForCompletion() {
-  if (!process_spawned_) {
+  // Waits for the reactor's exit callback, if it's running, to return.
+  StopWatching();
+  if (reaped_.load(std::memory_order_acquire)) {
+    return exit_code_;
+  }
+  if (!process_spawned_.load(std::memory_order_acquire)) {
     return -1;
   }
 
@@ -198,18 +658,64 @@ int Subprocess::WaitForCompletion() {
     stderr_pipe_[0] = -1;
   }
 
-  int status;
-  waitpid(pid_, &status, 0);
+  Reap();
+  return exit_code_;
+}
 
-  process_spawned_ = false;
+bool Subprocess::IsRunning() const {
+  return process_spawned_.load(std::memory_order_acquire);
+}
 
-  if (WIFEXITED(status)) {
-    return WEXITSTATUS(status);
+bool Subprocess::SignalProcessGroup(int signal_number) {
+  // Once the leader has been reaped and the rest of its group has gone, the
+  // group id is free to be reused, so it's only signalled while the leader is
+  // an unreaped child of ours. Reap() can't run meanwhile.
+  std::lock_guard<std::mutex> lock(reap_mutex_);
+  if (pid_ <= 0 || reaped_.load(std::memory_order_acquire) ||
+      !process_spawned_.load(std::memory_order_acquire)) {
+    return false;
   }
-
-  return -1;
+  if (kill(-pid_, signal_number) == -1) {
+    if (errno != ESRCH) {
+      LOG(WARNING) << "Could not send " << strsignal(signal_number)
+                   << " to process group " << pid_ << ": " << strerror(errno);
+    }
+    return false;
+  }
+  return true;
 }
 
-bool Subprocess::IsRunning() const { return process_spawned_; }
+bool Subprocess::WaitForExit(std::chrono::milliseconds timeout) {
+  if (reaped_.load(std::memory_order_acquire) ||
+      !process_spawned_.load(std::memory_order_acquire)) {
+    return true;
+  }
+
+  if (pidfd_ != -1) {
+    // A pidfd becomes readable when the process exits.
+    struct pollfd fd;
+    fd.fd = pidfd_;
+    fd.events = POLLIN;
+    int result;
+    do {
+      result = poll(&fd, 1, static_cast<int>(timeout.count()));
+    } while (result == -1 && errno == EINTR);
+    return result > 0;
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (true) {
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    if (waitid(P_PID, pid_, &info, WEXITED | WNOHANG | WNOWAIT) == 0 &&
+        info.si_pid == pid_) {
+      return true;
+    }
+    if (std::chrono::steady_clock::now() >= deadline) {
+      return false;
+    }
+    usleep(10 * 1000);
+  }
+}
 
 }  // namespace spiceserver
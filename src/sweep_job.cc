@@ -0,0 +1,277 @@
+#include "sweep_job.h"
+
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include <absl/status/status.h>
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_cat.h>
+
+#include "job_scheduler.h"
+#include "parameter_sweep.h"
+#include "simulation_job.h"
+#include "simulator_manager.h"
+#include "worker_pool.h"
+
+namespace spiceserver {
+
+absl::Status SweepJob::Validate(const SweepRequest &request) {
+  absl::Status simulation = SimulationJob::Validate(request.simulation());
+  if (!simulation.ok()) {
+    return simulation;
+  }
+  if (request.sweep_case() == SweepRequest::SWEEP_NOT_SET) {
+    return absl::InvalidArgumentError("No sweep given");
+  }
+  return absl::OkStatus();
+}
+
+std::shared_ptr<SweepJob> SweepJob::Create(const SweepRequest &request,
+                                           const std::string &client) {
+  return std::shared_ptr<SweepJob>(new SweepJob(request, client));
+}
+
+SweepJob::SweepJob(const SweepRequest &request, const std::string &client)
+    : request_(request),
+      client_(client),
+      max_parallel_(1),
+      prepared_(false),
+      finished_(false),
+      next_point_(0),
+      starting_(0) {}
+
+void SweepJob::Start(std::function<void()> on_ready) {
+  {
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    on_ready_ = std::move(on_ready);
+  }
+  auto job = shared_from_this();
+  WorkerPool::GetPreparationInstance().Post([job]() { job->Prepare(); });
+}
+
+void SweepJob::Prepare() {
+  auto points = ParameterSweep::Expand(request_);
+  if (!points.ok()) {
+    Fail(points.status());
+    return;
+  }
+
+  const SimulationRequest &simulation = request_.simulation();
+  std::vector<FileInfo> files;
+  if (simulation.has_vlsir_sim_input()) {
+    auto netlisted = SimulatorManager::Netlist(
+        simulation.simulator(), simulation.vlsir_sim_input());
+    if (!netlisted.ok()) {
+      Fail(netlisted.status());
+      return;
+    }
+    files = std::move(*netlisted);
+  } else {
+    files.assign(simulation.verbatim_files().files().begin(),
+                 simulation.verbatim_files().files().end());
+  }
+
+  // Every point sets the same parameters, so checking one is enough.
+  std::set<std::string> replaced;
+  for (const FileInfo &file : files) {
+    ParameterSweep::RewriteParameters(file.data(), points->front(), &replaced);
+  }
+  for (const auto &entry : points->front()) {
+    if (replaced.count(absl::AsciiStrToLower(entry.first)) == 0) {
+      Fail(absl::InvalidArgumentError(absl::StrCat(
+          "Sweep parameter \"", entry.first,
+          "\" is not set by a .param in the netlist")));
+      return;
+    }
+  }
+
+  LOG(INFO) << "Sweep of " << points->size() << " points";
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    points_ = std::move(*points);
+    files_ = std::move(files);
+    max_parallel_ = request_.max_parallel_points() > 0 ?
+        request_.max_parallel_points() :
+        JobScheduler::GetInstance().host_slots();
+    prepared_ = true;
+  }
+  StartPoints();
+}
+
+void SweepJob::StartPoints() {
+  uint32_t first;
+  uint32_t count;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_) {
+      return;
+    }
+    first = next_point_;
+    uint32_t in_flight = running_.size() + starting_;
+    count = std::min<uint32_t>(
+        max_parallel_ > in_flight ? max_parallel_ - in_flight : 0,
+        points_.size() - next_point_);
+    next_point_ += count;
+    starting_ += count;
+  }
+  if (count == 0) {
+    return;
+  }
+
+  // Rewriting the netlists is done outside the lock.
+  std::vector<Point> started;
+  for (uint32_t index = first; index < first + count; ++index) {
+    started.push_back(Point {
+        index, SimulationJob::Create(RequestForPoint(index), client_), false});
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    starting_ -= count;
+    if (finished_) {
+      return;
+    }
+    running_.insert(running_.end(), started.begin(), started.end());
+  }
+
+  std::weak_ptr<SweepJob> weak_sweep = weak_from_this();
+  for (const Point &point : started) {
+    point.job->Start([weak_sweep]() {
+      if (auto sweep = weak_sweep.lock()) {
+        sweep->NotifyReady();
+      }
+    });
+  }
+}
+
+SimulationRequest SweepJob::RequestForPoint(uint32_t index) const {
+  SimulationRequest request = request_.simulation();
+  // This also clears any VLSIR input, which has already been netlisted.
+  VerbatimFileInput *inputs = request.mutable_verbatim_files();
+  inputs->clear_files();
+  std::set<std::string> replaced;
+  for (const FileInfo &file : files_) {
+    FileInfo *point_file = inputs->add_files();
+    *point_file = file;
+    // Blobs are left as they are.
+    if (file.blob_digest().empty()) {
+      point_file->set_data(ParameterSweep::RewriteParameters(
+          file.data(), points_[index], &replaced));
+    }
+  }
+  return request;
+}
+
+SweepJob::NextResult SweepJob::Next(SweepResponse *response,
+                                    absl::Status *status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (finished_) {
+    *status = final_status_;
+    return NextResult::DONE;
+  }
+
+  // Look at each running point once, starting after the last one that sent
+  // something, so that chatty points don't starve the others.
+  bool freed = false;
+  NextResult result = NextResult::WAIT;
+  for (size_t remaining = running_.size();
+       remaining > 0 && result == NextResult::WAIT;
+       --remaining) {
+    Point point = std::move(running_.front());
+    running_.pop_front();
+
+    SimulationResponse point_response;
+    absl::Status point_status;
+    switch (point.job->Next(&point_response, &point_status)) {
+      case NextResult::MESSAGE:
+        response->Clear();
+        response->set_point(point.index);
+        response->set_total_points(points_.size());
+        if (!point.sent_parameters) {
+          for (const auto &entry : points_[point.index]) {
+            (*response->mutable_parameters())[entry.first] = entry.second;
+          }
+          point.sent_parameters = true;
+        }
+        *response->mutable_response() = std::move(point_response);
+        running_.push_back(std::move(point));
+        result = NextResult::MESSAGE;
+        break;
+      case NextResult::DONE:
+        freed = true;
+        if (!point_status.ok()) {
+          response->Clear();
+          response->set_point(point.index);
+          response->set_total_points(points_.size());
+          response->set_error_code(static_cast<int>(point_status.code()));
+          response->set_error_message(std::string(point_status.message()));
+          result = NextResult::MESSAGE;
+        }
+        break;
+      case NextResult::WAIT:
+        running_.push_back(std::move(point));
+        break;
+    }
+  }
+
+  if (freed && next_point_ < points_.size()) {
+    auto job = shared_from_this();
+    WorkerPool::GetInstance().Post([job]() { job->StartPoints(); });
+  }
+  if (result == NextResult::MESSAGE) {
+    return result;
+  }
+  if (prepared_ && running_.empty() && starting_ == 0 &&
+      next_point_ >= points_.size()) {
+    *status = absl::OkStatus();
+    return NextResult::DONE;
+  }
+  return NextResult::WAIT;
+}
+
+void SweepJob::Fail(const absl::Status &status) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_) {
+      return;
+    }
+    finished_ = true;
+    final_status_ = status;
+  }
+  NotifyReady();
+}
+
+void SweepJob::Cancel(const absl::Status &status) {
+  std::list<Point> running;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_) {
+      return;
+    }
+    finished_ = true;
+    final_status_ = status;
+    running.swap(running_);
+  }
+  for (const Point &point : running) {
+    point.job->Cancel(status);
+  }
+}
+
+void SweepJob::Detach() {
+  std::lock_guard<std::mutex> lock(callback_mutex_);
+  on_ready_ = nullptr;
+}
+
+void SweepJob::NotifyReady() {
+  std::lock_guard<std::mutex> lock(callback_mutex_);
+  if (on_ready_) {
+    on_ready_();
+  }
+}
+
+}  // namespace spiceserver
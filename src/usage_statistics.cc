@@ -0,0 +1,47 @@
+#include "usage_statistics.h"
+
+#include <mutex>
+#include <string>
+
+#include "proto/spice_simulator.pb.h"
+
+namespace spiceserver {
+
+void UsageStatistics::Record(Flavour flavour,
+                             const std::string &directory,
+                             const SimulationResponse &final_response) {
+  const ResourceUsage &usage = final_response.resource_usage();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  FlavourUsage &totals = by_flavour_[flavour];
+  totals.set_flavour(flavour);
+  totals.set_runs(totals.runs() + 1);
+  if (final_response.exit_code() != 0 ||
+      final_response.terminating_signal() != 0) {
+    totals.set_failed_runs(totals.failed_runs() + 1);
+  }
+  if (final_response.terminating_signal() != 0) {
+    totals.set_signalled_runs(totals.signalled_runs() + 1);
+  }
+  totals.set_user_cpu_seconds(
+      totals.user_cpu_seconds() + usage.user_cpu_seconds());
+  totals.set_system_cpu_seconds(
+      totals.system_cpu_seconds() + usage.system_cpu_seconds());
+  totals.set_run_seconds(
+      totals.run_seconds() + final_response.phase_timings().run_seconds());
+  totals.set_total_max_rss_bytes(
+      totals.total_max_rss_bytes() + usage.max_rss_bytes());
+  if (usage.max_rss_bytes() > totals.peak_max_rss_bytes()) {
+    totals.set_peak_max_rss_bytes(usage.max_rss_bytes());
+    totals.set_peak_max_rss_directory(directory);
+  }
+}
+
+void UsageStatistics::Report(GetUsageStatisticsResponse *response) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &entry : by_flavour_) {
+    *response->add_flavours() = entry.second;
+  }
+}
+
+}  // namespace spiceserver
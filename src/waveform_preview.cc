@@ -0,0 +1,284 @@
+#include "waveform_preview.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+
+DEFINE_uint32(waveform_preview_interval_ms, 500,
+              "How often to send live waveform previews, for clients that "
+              "don't say.");
+
+namespace spiceserver {
+
+namespace {
+
+// Refinement n has 2^n times as many buckets as the live pass (though never
+// more than there are points).
+constexpr uint32_t kMaxRefinements = 16;
+
+// Points read from the rawfile at a time.
+constexpr uint64_t kPointsPerRead = 4096;
+
+// Points decimated between flushes, which bounds the size of a preview.
+constexpr uint64_t kPointsPerPreview = 1 << 16;
+
+}   // namespace
+
+MinMaxDecimator::MinMaxDecimator(std::vector<size_t> columns,
+                                 double resolution)
+    : columns_(std::move(columns)),
+      resolution_(resolution),
+      open_changed_(false),
+      open_min_(columns_.size()),
+      open_max_(columns_.size()),
+      open_last_(columns_.size()) {}
+
+void MinMaxDecimator::Add(const RawfileReader &reader,
+                          size_t plot,
+                          uint64_t first_point,
+                          uint64_t num_points) {
+  std::vector<double> x(std::min(kPointsPerRead, num_points));
+  std::vector<std::vector<double>> values(columns_.size(),
+                                          std::vector<double>(x.size()));
+  for (uint64_t first = first_point; first < first_point + num_points;
+       first += kPointsPerRead) {
+    uint64_t count = std::min(kPointsPerRead,
+                              first_point + num_points - first);
+    reader.ReadSignal(plot, 0, first, count, x.data());
+    for (size_t i = 0; i < columns_.size(); ++i) {
+      reader.ReadSignal(plot, columns_[i], first, count, values[i].data());
+    }
+    for (uint64_t point = 0; point < count; ++point) {
+      double bucket = std::floor(x[point] / resolution_);
+      // Also rules out NaN.
+      if (!(std::abs(bucket) < 1e18)) {
+        continue;
+      }
+      int64_t index = static_cast<int64_t>(bucket);
+      if (open_ && *open_ == index) {
+        for (size_t i = 0; i < columns_.size(); ++i) {
+          double value = values[i][point];
+          open_min_[i] = std::min(open_min_[i], value);
+          open_max_[i] = std::max(open_max_[i], value);
+          open_last_[i] = value;
+        }
+      } else {
+        Close();
+        open_ = index;
+        for (size_t i = 0; i < columns_.size(); ++i) {
+          double value = values[i][point];
+          open_min_[i] = value;
+          open_max_[i] = value;
+          open_last_[i] = value;
+        }
+      }
+      open_changed_ = true;
+    }
+  }
+}
+
+void MinMaxDecimator::Close() {
+  if (!open_) {
+    return;
+  }
+  if (open_changed_) {
+    closed_.push_back(*open_);
+    closed_min_.insert(closed_min_.end(), open_min_.begin(), open_min_.end());
+    closed_max_.insert(closed_max_.end(), open_max_.begin(), open_max_.end());
+    closed_last_.insert(closed_last_.end(), open_last_.begin(),
+                        open_last_.end());
+  }
+  open_.reset();
+  open_changed_ = false;
+}
+
+bool MinMaxDecimator::Flush(WaveformPreview *preview) {
+  if (closed_.empty() && !open_changed_) {
+    return false;
+  }
+  size_t num_buckets = closed_.size() + (open_changed_ ? 1 : 0);
+  preview->mutable_buckets()->Reserve(num_buckets);
+  preview->mutable_buckets()->Add(closed_.begin(), closed_.end());
+  if (open_changed_) {
+    preview->add_buckets(*open_);
+  }
+  // Per bucket here; per signal in the preview.
+  size_t values = num_buckets * columns_.size();
+  preview->mutable_min()->Reserve(values);
+  preview->mutable_max()->Reserve(values);
+  preview->mutable_last()->Reserve(values);
+  for (size_t i = 0; i < columns_.size(); ++i) {
+    for (size_t bucket = 0; bucket < closed_.size(); ++bucket) {
+      size_t at = bucket * columns_.size() + i;
+      preview->add_min(closed_min_[at]);
+      preview->add_max(closed_max_[at]);
+      preview->add_last(closed_last_[at]);
+    }
+    if (open_changed_) {
+      preview->add_min(open_min_[i]);
+      preview->add_max(open_max_[i]);
+      preview->add_last(open_last_[i]);
+    }
+  }
+  closed_.clear();
+  closed_min_.clear();
+  closed_max_.clear();
+  closed_last_.clear();
+  open_changed_ = false;
+  return true;
+}
+
+absl::Status WaveformPreviewer::Validate(const PreviewOptions &options) {
+  if (!(options.resolution() > 0) || !std::isfinite(options.resolution())) {
+    return absl::InvalidArgumentError(
+        "Preview resolution must be a positive number");
+  }
+  if (options.refinements() > kMaxRefinements) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "At most ", kMaxRefinements, " preview refinements are allowed"));
+  }
+  return absl::OkStatus();
+}
+
+WaveformPreviewer::WaveformPreviewer(const std::filesystem::path &rawfile,
+                                     const PreviewOptions &options)
+    : rawfile_(rawfile),
+      options_(options) {}
+
+std::chrono::milliseconds WaveformPreviewer::interval() const {
+  return std::chrono::milliseconds(options_.interval_ms() > 0 ?
+      options_.interval_ms() : FLAGS_waveform_preview_interval_ms);
+}
+
+std::vector<size_t> WaveformPreviewer::Columns(
+    const RawfileReader::Plot &plot) const {
+  std::vector<size_t> columns;
+  if (plot.complex) {
+    return columns;
+  }
+  if (options_.signals().empty()) {
+    for (size_t i = 1; i < plot.signals.size(); ++i) {
+      columns.push_back(i);
+    }
+    return columns;
+  }
+  std::map<std::string, size_t> by_name;
+  for (size_t i = 1; i < plot.signals.size(); ++i) {
+    by_name.emplace(plot.signals[i].name(), i);
+  }
+  // Signals that aren't in this plot may be in another.
+  for (const std::string &name : options_.signals()) {
+    auto it = by_name.find(name);
+    if (it != by_name.end()) {
+      columns.push_back(it->second);
+    }
+  }
+  return columns;
+}
+
+void WaveformPreviewer::Poll(std::vector<WaveformPreview> *previews) {
+  auto reader = RawfileReader::Open(rawfile_);
+  if (reader.ok()) {
+    Update(**reader, false, previews);
+  }
+}
+
+void WaveformPreviewer::Finish(const RawfileReader &reader,
+                               std::vector<WaveformPreview> *previews) {
+  Update(reader, true, previews);
+  for (uint32_t pass = 1; pass <= options_.refinements(); ++pass) {
+    double resolution =
+        std::ldexp(options_.resolution(), -static_cast<int>(pass));
+    for (size_t plot = 0; plot < reader.plots().size(); ++plot) {
+      std::vector<size_t> columns = Columns(reader.plots()[plot]);
+      if (columns.empty()) {
+        continue;
+      }
+      MinMaxDecimator decimator(std::move(columns), resolution);
+      bool started = false;
+      Decimate(reader, plot, pass, 0, reader.plots()[plot].num_points, true,
+               &decimator, &started, previews);
+    }
+  }
+}
+
+void WaveformPreviewer::Update(const RawfileReader &reader,
+                               bool final,
+                               std::vector<WaveformPreview> *previews) {
+  const std::vector<RawfileReader::Plot> &plots = reader.plots();
+  for (size_t plot = 0; plot < plots.size(); ++plot) {
+    if (plot == plots_.size()) {
+      std::vector<size_t> columns = Columns(plots[plot]);
+      plots_.push_back(PlotState {
+          columns.empty() ? nullptr : std::make_unique<MinMaxDecimator>(
+              std::move(columns), options_.resolution()),
+          0,
+          false});
+    }
+    PlotState &state = plots_[plot];
+    if (!state.decimator) {
+      continue;
+    }
+    uint64_t end_point = std::max(state.points_seen, plots[plot].num_points);
+    Decimate(reader, plot, 0, state.points_seen, end_point, final,
+             state.decimator.get(), &state.started, previews);
+    state.points_seen = end_point;
+  }
+}
+
+void WaveformPreviewer::Decimate(const RawfileReader &reader,
+                                 size_t plot,
+                                 uint32_t pass,
+                                 uint64_t first_point,
+                                 uint64_t end_point,
+                                 bool final,
+                                 MinMaxDecimator *decimator,
+                                 bool *started,
+                                 std::vector<WaveformPreview> *previews) const {
+  const RawfileReader::Plot &source = reader.plots()[plot];
+  auto add = [&](WaveformPreview preview) {
+    preview.set_plot(plot);
+    preview.set_pass(pass);
+    preview.set_resolution(decimator->resolution());
+    if (!*started) {
+      preview.set_plot_name(source.name);
+      for (size_t column : Columns(source)) {
+        preview.add_signals(source.signals[column].name());
+      }
+      *started = true;
+    }
+    previews->push_back(std::move(preview));
+  };
+  bool added = false;
+  uint64_t first = first_point;
+  do {
+    uint64_t count = std::min(kPointsPerPreview, end_point - first);
+    decimator->Add(reader, plot, first, count);
+    first += count;
+    WaveformPreview preview;
+    if (decimator->Flush(&preview)) {
+      add(std::move(preview));
+      added = true;
+    }
+  } while (first < end_point);
+  if (final) {
+    if (!added) {
+      add(WaveformPreview());
+    }
+    previews->back().set_final(true);
+  }
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,265 @@
+#include "waveform_query.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <gflags/gflags.h>
+
+#include <absl/status/status.h>
+#include <absl/strings/str_cat.h>
+
+#include "result_store.h"
+#include "worker_pool.h"
+
+DECLARE_uint64(waveform_chunk_bytes);
+
+namespace spiceserver {
+
+namespace {
+
+// The first of the num_points values (every parts'th double from index)
+// that isn't less than value, or num_points if there's none; or, if after,
+// the first that is greater.
+uint64_t Search(const double *index, size_t parts, uint64_t num_points,
+                double value, bool after) {
+  uint64_t low = 0;
+  uint64_t high = num_points;
+  while (low < high) {
+    uint64_t middle = low + (high - low) / 2;
+    double found = index[middle * parts];
+    if (after ? found <= value : found < value) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+}   // namespace
+
+absl::Status WaveformQuery::Validate(const GetWaveformRequest &request) {
+  if (request.result_id().empty()) {
+    return absl::InvalidArgumentError("result_id is required");
+  }
+  if (request.has_start() && request.has_stop() &&
+      request.start() > request.stop()) {
+    return absl::InvalidArgumentError("start is after stop");
+  }
+  return absl::OkStatus();
+}
+
+std::shared_ptr<WaveformQuery> WaveformQuery::Create(
+    const GetWaveformRequest &request) {
+  return std::shared_ptr<WaveformQuery>(new WaveformQuery(request));
+}
+
+WaveformQuery::WaveformQuery(const GetWaveformRequest &request)
+    : request_(request),
+      first_point_(0),
+      stride_(1),
+      num_points_(0),
+      sent_points_(0),
+      filled_last_(false) {}
+
+void WaveformQuery::Start(std::function<void()> on_ready) {
+  {
+    std::lock_guard<std::mutex> lock(callback_mutex_);
+    on_ready_ = std::move(on_ready);
+  }
+  auto query = shared_from_this();
+  WorkerPool::GetInstance().Post([query]() { query->Open(); });
+}
+
+void WaveformQuery::Open() {
+  auto result = ResultStore::GetInstance().Get(request_.result_id());
+  if (!result.ok()) {
+    Fail(result.status());
+    return;
+  }
+  result_ = std::move(*result);
+  absl::Status planned = Plan();
+  if (!planned.ok()) {
+    Fail(planned);
+    return;
+  }
+  Fill();
+}
+
+absl::Status WaveformQuery::Plan() {
+  const StoredResultIndex &index = result_->index();
+  if (request_.plot() >= static_cast<uint32_t>(index.plots_size())) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Result has ", index.plots_size(), " plots, not ",
+        request_.plot() + 1));
+  }
+  const StoredPlot &plot = index.plots(request_.plot());
+
+  // The first signal always comes first; asking for it again is harmless.
+  columns_ = {0};
+  if (request_.signals().empty()) {
+    for (int i = 1; i < plot.signals_size(); ++i) {
+      columns_.push_back(i);
+    }
+  } else {
+    std::map<std::string, size_t> by_name;
+    for (int i = 0; i < plot.signals_size(); ++i) {
+      by_name.emplace(plot.signals(i).name(), i);
+    }
+    for (const std::string &name : request_.signals()) {
+      auto it = by_name.find(name);
+      if (it == by_name.end()) {
+        return absl::NotFoundError(absl::StrCat(
+            "Plot ", plot.name(), " has no signal ", name));
+      }
+      if (it->second != 0) {
+        columns_.push_back(it->second);
+      }
+    }
+  }
+
+  // The real part of a complex index (frequency) is the one that's sorted.
+  const double *index_values = result_->Signal(request_.plot(), 0);
+  size_t parts = plot.complex() ? 2 : 1;
+  uint64_t end_point = plot.num_points();
+  if (request_.has_start()) {
+    first_point_ = Search(index_values, parts, plot.num_points(),
+                          request_.start(), false);
+  }
+  if (request_.has_stop()) {
+    end_point = Search(index_values, parts, plot.num_points(),
+                       request_.stop(), true);
+  }
+  uint64_t span = end_point > first_point_ ? end_point - first_point_ : 0;
+  if (request_.max_points() > 0 && span > request_.max_points()) {
+    stride_ = (span + request_.max_points() - 1) / request_.max_points();
+  }
+  num_points_ = (span + stride_ - 1) / stride_;
+  return absl::OkStatus();
+}
+
+bool WaveformQuery::FillChunk(WaveformChunk *chunk) {
+  const StoredPlot &plot = result_->index().plots(request_.plot());
+  size_t parts = plot.complex() ? 2 : 1;
+
+  chunk->set_plot(request_.plot());
+  if (sent_points_ == 0) {
+    chunk->set_plot_name(plot.name());
+    for (size_t column : columns_) {
+      *chunk->add_signals() = plot.signals(column);
+    }
+  }
+  chunk->set_complex(plot.complex());
+  if (stride_ > 1) {
+    chunk->set_point_stride(stride_);
+  }
+
+  uint64_t point_bytes = columns_.size() * parts *
+      (request_.single_precision() ? sizeof(float) : sizeof(double));
+  uint64_t count = std::min(
+      std::max<uint64_t>(1, FLAGS_waveform_chunk_bytes / point_bytes),
+      num_points_ - sent_points_);
+  uint64_t first = first_point_ + sent_points_ * stride_;
+  chunk->set_first_point(first);
+  chunk->set_num_points(count);
+
+  size_t values = columns_.size() * count * parts;
+  double *doubles = nullptr;
+  float *floats = nullptr;
+  if (request_.single_precision()) {
+    chunk->mutable_float_values()->Resize(values, 0);
+    floats = chunk->mutable_float_values()->mutable_data();
+  } else {
+    chunk->mutable_values()->Resize(values, 0);
+    doubles = chunk->mutable_values()->mutable_data();
+  }
+  size_t out = 0;
+  for (size_t column : columns_) {
+    const double *in =
+        result_->Signal(request_.plot(), column) + first * parts;
+    for (uint64_t point = 0; point < count; ++point) {
+      for (size_t part = 0; part < parts; ++part) {
+        if (floats) {
+          floats[out++] = in[part];
+        } else {
+          doubles[out++] = in[part];
+        }
+      }
+      in += stride_ * parts;
+    }
+  }
+
+  sent_points_ += count;
+  bool last = sent_points_ >= num_points_;
+  chunk->set_last(last);
+  return last;
+}
+
+void WaveformQuery::Fill() {
+  WaveformChunk chunk;
+  bool last = FillChunk(&chunk);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!status_.ok()) {
+      return;
+    }
+    ready_ = std::move(chunk);
+    filled_last_ = last;
+  }
+  NotifyReady();
+}
+
+WaveformQuery::NextResult WaveformQuery::Next(WaveformChunk *chunk,
+                                              absl::Status *status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!status_.ok()) {
+    *status = status_;
+    return NextResult::DONE;
+  }
+  if (ready_) {
+    *chunk = std::move(*ready_);
+    ready_.reset();
+    if (!filled_last_) {
+      auto query = shared_from_this();
+      WorkerPool::GetInstance().Post([query]() { query->Fill(); });
+    }
+    return NextResult::MESSAGE;
+  }
+  if (filled_last_) {
+    *status = absl::OkStatus();
+    return NextResult::DONE;
+  }
+  return NextResult::WAIT;
+}
+
+void WaveformQuery::Fail(const absl::Status &status) {
+  Cancel(status);
+  NotifyReady();
+}
+
+void WaveformQuery::Cancel(const absl::Status &status) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (status_.ok()) {
+    status_ = status;
+  }
+}
+
+void WaveformQuery::Detach() {
+  std::lock_guard<std::mutex> lock(callback_mutex_);
+  on_ready_ = nullptr;
+}
+
+void WaveformQuery::NotifyReady() {
+  std::lock_guard<std::mutex> lock(callback_mutex_);
+  if (on_ready_) {
+    on_ready_();
+  }
+}
+
+}  // namespace spiceserver
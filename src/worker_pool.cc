@@ -0,0 +1,91 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <utility>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int32(job_worker_threads, 4,
+             "Threads for simulation jobs' short work (reading output, "
+             "terminating) and timers.");
+DEFINE_int32(job_prepare_threads, 4,
+             "Threads that prepare simulation jobs (writing inputs, "
+             "netlisting, spawning), which can block for a long time.");
+
+namespace spiceserver {
+
+WorkerPool &WorkerPool::GetInstance() {
+  static WorkerPool instance(FLAGS_job_worker_threads);
+  return instance;
+}
+
+WorkerPool &WorkerPool::GetPreparationInstance() {
+  static WorkerPool instance(FLAGS_job_prepare_threads);
+  return instance;
+}
+
+WorkerPool::WorkerPool(int num_threads)
+    : stopping_(false),
+      next_sequence_(0) {
+  num_threads = std::max(num_threads, 1);
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.emplace_back([this]() { Run(); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  changed_.notify_all();
+  for (std::thread &thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkerPool::Post(Task task) {
+  PostAfter(std::chrono::milliseconds(0), std::move(task));
+}
+
+void WorkerPool::PostAfter(std::chrono::milliseconds delay, Task task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push(DelayedTask {
+        Clock::now() + delay, next_sequence_++, std::move(task)});
+  }
+  // Any thread might now have an earlier deadline to wait for.
+  changed_.notify_all();
+}
+
+void WorkerPool::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    if (stopping_) {
+      return;
+    }
+    if (tasks_.empty()) {
+      changed_.wait(lock);
+      continue;
+    }
+    Clock::time_point due = tasks_.top().due;
+    if (Clock::now() < due) {
+      changed_.wait_until(lock, due);
+      continue;
+    }
+
+    // priority_queue::top is const, but we're about to pop it anyway.
+    Task task = std::move(const_cast<DelayedTask&>(tasks_.top()).task);
+    tasks_.pop();
+    lock.unlock();
+    task();
+    // Drop anything the task captured before taking the lock again.
+    task = nullptr;
+    lock.lock();
+  }
+}
+
+}  // namespace spiceserver
@@ -0,0 +1,122 @@
+#include "batch_job.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "simulator_registry.h"
+
+namespace spiceserver {
+namespace {
+
+using std::chrono::milliseconds;
+
+struct BatchResult {
+  std::optional<absl::Status> status;
+  std::map<uint32_t, std::string> output;
+  std::map<uint32_t, int> exit_codes;
+  // The job of each response, in the order they came.
+  std::vector<uint32_t> order;
+};
+
+BatchResult RunBatch(const BatchRequest &request, milliseconds timeout) {
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool ready = false;
+  auto batch = BatchJob::Create(request, "test");
+  batch->Start([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready = true;
+    changed.notify_all();
+  });
+
+  BatchResult result;
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!result.status) {
+    BatchResponse response;
+    absl::Status status;
+    switch (batch->Next(&response, &status)) {
+      case BatchJob::NextResult::MESSAGE:
+        result.order.push_back(response.job());
+        result.output[response.job()] += response.response().output();
+        if (response.response().done()) {
+          result.exit_codes[response.job()] = response.response().exit_code();
+        }
+        continue;
+      case BatchJob::NextResult::DONE:
+        result.status = status;
+        continue;
+      case BatchJob::NextResult::WAIT:
+        break;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!changed.wait_until(lock, deadline, [&]() { return ready; })) {
+      break;
+    }
+    ready = false;
+  }
+  batch->Detach();
+  return result;
+}
+
+class BatchJobTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    SimulatorRegistry::GetInstance().RegisterSimulator(
+        Flavour::XYCE, SimulatorRegistry::SimulatorInfo {.path = "/bin/sh"});
+  }
+
+  // A batch of shell scripts, each printing its index and exiting with it.
+  static BatchRequest Batch(int jobs, uint32_t max_parallel) {
+    BatchRequest request;
+    for (int i = 0; i < jobs; ++i) {
+      SimulationRequest *simulation = request.add_requests();
+      simulation->set_simulator(Flavour::XYCE);
+      FileInfo *file = simulation->mutable_verbatim_files()->add_files();
+      file->set_path("run.sh");
+      file->set_data("echo job " + std::to_string(i) + "\nexit " +
+                     std::to_string(i) + "\n");
+    }
+    request.set_max_parallel_jobs(max_parallel);
+    return request;
+  }
+};
+
+TEST_F(BatchJobTest, RunsEveryJob) {
+  BatchResult result = RunBatch(Batch(6, 2), milliseconds(20000));
+  ASSERT_TRUE(result.status.has_value());
+  EXPECT_TRUE(result.status->ok()) << *result.status;
+  ASSERT_EQ(result.output.size(), 6);
+  for (uint32_t job = 0; job < 6; ++job) {
+    EXPECT_EQ(result.output[job], "job " + std::to_string(job) + "\n");
+    EXPECT_EQ(result.exit_codes[job], job);
+  }
+}
+
+TEST_F(BatchJobTest, KeepsToMaxParallelJobs) {
+  BatchResult result = RunBatch(Batch(4, 1), milliseconds(20000));
+  ASSERT_TRUE(result.status.has_value());
+  EXPECT_TRUE(result.status->ok()) << *result.status;
+
+  // One at a time, so each job's responses come before the next's.
+  std::vector<uint32_t> jobs;
+  for (uint32_t job : result.order) {
+    if (jobs.empty() || jobs.back() != job) {
+      jobs.push_back(job);
+    }
+  }
+  EXPECT_EQ(jobs, (std::vector<uint32_t> {0, 1, 2, 3}));
+}
+
+TEST(BatchJobValidateTest, RejectsEmptyBatch) {
+  EXPECT_EQ(BatchJob::Validate(BatchRequest()).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace spiceserver
@@ -0,0 +1,163 @@
+#include "blob_store.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "sha256.h"
+
+namespace spiceserver {
+namespace {
+
+class BlobStoreTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = std::filesystem::temp_directory_path() /
+                ("blob_store_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(test_dir_);
+    std::filesystem::create_directories(test_dir_ / "work");
+  }
+
+  void TearDown() override {
+    std::filesystem::remove_all(test_dir_);
+  }
+
+  static absl::Status Put(BlobStore *store, const std::string &data) {
+    auto upload = store->StartUpload(Sha256::HexDigestOf(data));
+    if (!upload.ok()) {
+      return upload.status();
+    }
+    // In two parts, as a client would send it.
+    absl::Status status = (*upload)->Append(data.substr(0, data.size() / 2));
+    if (!status.ok()) {
+      return status;
+    }
+    status = (*upload)->Append(data.substr(data.size() / 2));
+    if (!status.ok()) {
+      return status;
+    }
+    return (*upload)->Finish();
+  }
+
+  static std::string Read(const std::filesystem::path &path) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  }
+
+  std::filesystem::path test_dir_;
+};
+
+TEST_F(BlobStoreTest, HashesLikeSha256) {
+  EXPECT_EQ(Sha256::HexDigestOf("abc"),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  EXPECT_TRUE(Sha256::IsHexDigest(Sha256::HexDigestOf("")));
+  EXPECT_FALSE(Sha256::IsHexDigest("abc"));
+  EXPECT_FALSE(Sha256::IsHexDigest(std::string(64, 'G')));
+}
+
+TEST_F(BlobStoreTest, StoresAndLinksBlobs) {
+  BlobStore store;
+  ASSERT_TRUE(store.Open(test_dir_ / "blobs", 1 << 20).ok());
+  std::string data = ".model nfet nmos level=1\n";
+  std::string digest = Sha256::HexDigestOf(data);
+  EXPECT_FALSE(store.Has(digest));
+  ASSERT_TRUE(Put(&store, data).ok());
+  EXPECT_TRUE(store.Has(digest));
+  EXPECT_EQ(store.total_bytes(), data.size());
+
+  std::filesystem::path path = test_dir_ / "work" / "models.lib";
+  ASSERT_TRUE(store.Materialise(digest, path).ok());
+  EXPECT_EQ(Read(path), data);
+  // Same filesystem, so a hard link to a read-only file.
+  struct stat info;
+  ASSERT_EQ(stat(path.c_str(), &info), 0);
+  EXPECT_EQ(info.st_nlink, 2);
+  EXPECT_EQ(info.st_mode & 0222, 0);
+
+  // Still there after a restart.
+  BlobStore reopened;
+  ASSERT_TRUE(reopened.Open(test_dir_ / "blobs", 1 << 20).ok());
+  EXPECT_TRUE(reopened.Has(digest));
+}
+
+TEST_F(BlobStoreTest, RejectsWrongContents) {
+  BlobStore store;
+  ASSERT_TRUE(store.Open(test_dir_ / "blobs", 1 << 20).ok());
+  auto upload = store.StartUpload(Sha256::HexDigestOf("right"));
+  ASSERT_TRUE(upload.ok());
+  ASSERT_TRUE((*upload)->Append("wrong").ok());
+  EXPECT_EQ((*upload)->Finish().code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_FALSE(store.Has(Sha256::HexDigestOf("right")));
+  EXPECT_FALSE(store.StartUpload("not a digest").ok());
+
+  // The partial upload is cleaned up.
+  upload->reset();
+  EXPECT_TRUE(std::filesystem::is_empty(test_dir_ / "blobs"));
+}
+
+TEST_F(BlobStoreTest, EvictsLeastRecentlyUsed) {
+  BlobStore store;
+  ASSERT_TRUE(store.Open(test_dir_ / "blobs", 25).ok());
+  std::string a(10, 'a');
+  std::string b(10, 'b');
+  std::string c(10, 'c');
+  ASSERT_TRUE(Put(&store, a).ok());
+  ASSERT_TRUE(Put(&store, b).ok());
+  EXPECT_TRUE(store.Has(Sha256::HexDigestOf(a)));
+  ASSERT_TRUE(Put(&store, c).ok());
+
+  EXPECT_TRUE(store.Has(Sha256::HexDigestOf(a)));
+  EXPECT_FALSE(store.Has(Sha256::HexDigestOf(b)));
+  EXPECT_TRUE(store.Has(Sha256::HexDigestOf(c)));
+  EXPECT_EQ(store.Materialise(Sha256::HexDigestOf(b), test_dir_ / "work" / "b")
+                .code(),
+            absl::StatusCode::kFailedPrecondition);
+
+  // Bigger than the whole store.
+  EXPECT_EQ(Put(&store, std::string(30, 'd')).code(),
+            absl::StatusCode::kResourceExhausted);
+}
+
+TEST_F(BlobStoreTest, KeepsSymlinkedBlobs) {
+  // A work directory on another filesystem, where the blob can only be
+  // symbolically linked.
+  std::filesystem::path work =
+      std::filesystem::path("/dev/shm") /
+      ("blob_store_test_" + std::to_string(getpid()));
+  struct stat store_stat;
+  struct stat work_stat;
+  if (stat(test_dir_.c_str(), &store_stat) != 0 ||
+      stat("/dev/shm", &work_stat) != 0 ||
+      store_stat.st_dev == work_stat.st_dev) {
+    GTEST_SKIP() << "No second filesystem to link across";
+  }
+  std::filesystem::create_directories(work);
+
+  BlobStore store;
+  ASSERT_TRUE(store.Open(test_dir_ / "blobs", 25).ok());
+  std::string a(10, 'a');
+  ASSERT_TRUE(Put(&store, a).ok());
+  ASSERT_TRUE(store.Materialise(Sha256::HexDigestOf(a), work / "a").ok());
+  ASSERT_TRUE(std::filesystem::is_symlink(work / "a"));
+
+  // Least recently used, but linked to.
+  ASSERT_TRUE(Put(&store, std::string(10, 'b')).ok());
+  ASSERT_TRUE(Put(&store, std::string(10, 'c')).ok());
+  EXPECT_TRUE(store.Has(Sha256::HexDigestOf(a)));
+  EXPECT_EQ(Read(work / "a"), a);
+
+  // Once the job's directory has gone, so can the blob (which Has made more
+  // recently used than c).
+  std::filesystem::remove_all(work);
+  ASSERT_TRUE(Put(&store, std::string(10, 'd')).ok());
+  ASSERT_TRUE(Put(&store, std::string(10, 'e')).ok());
+  EXPECT_FALSE(store.Has(Sha256::HexDigestOf(a)));
+}
+
+}  // namespace
+}  // namespace spiceserver
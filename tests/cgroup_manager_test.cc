@@ -0,0 +1,50 @@
+#include "cgroup_manager.h"
+
+#include <gtest/gtest.h>
+
+#include "proto/spice_simulator.pb.h"
+
+namespace spiceserver {
+namespace {
+
+TEST(CgroupManagerTest, ParsesKeyedValues) {
+  auto values = CgroupManager::ParseKeyedValues(
+      "usage_usec 1500000\n"
+      "user_usec 1000000\n"
+      "nr_throttled 3\n"
+      "garbage\n"
+      "not_a_number abc\n");
+  EXPECT_EQ(values.size(), 3);
+  EXPECT_EQ(values["usage_usec"], 1500000);
+  EXPECT_EQ(values["user_usec"], 1000000);
+  EXPECT_EQ(values["nr_throttled"], 3);
+}
+
+TEST(CgroupManagerTest, FormatsCpuMax) {
+  EXPECT_EQ(CgroupManager::FormatCpuMax(0), "max 100000");
+  EXPECT_EQ(CgroupManager::FormatCpuMax(1.5), "150000 100000");
+  EXPECT_EQ(CgroupManager::FormatCpuMax(4), "400000 100000");
+  // Below the kernel's minimum quota.
+  EXPECT_EQ(CgroupManager::FormatCpuMax(0.001), "1000 100000");
+}
+
+TEST(CgroupManagerTest, RequestOverridesDefaults) {
+  JobLimits limits_pb;
+  limits_pb.set_memory_bytes(1 << 30);
+  CgroupManager::Limits defaults = CgroupManager::DefaultLimits();
+  CgroupManager::Limits limits = CgroupManager::LimitsFromRequest(limits_pb);
+  EXPECT_EQ(limits.memory_bytes, 1 << 30);
+  EXPECT_EQ(limits.cpus, defaults.cpus);
+  EXPECT_EQ(limits.max_pids, defaults.max_pids);
+}
+
+TEST(CgroupManagerTest, UnavailableUntilInitialised) {
+  // --job_cgroups is off by default, so this does nothing.
+  EXPECT_TRUE(CgroupManager::GetInstance().Initialise().ok());
+  EXPECT_FALSE(CgroupManager::GetInstance().IsAvailable());
+  EXPECT_FALSE(CgroupManager::GetInstance().CreateJobCgroup(
+      CgroupManager::DefaultLimits()).ok());
+}
+
+}  // namespace
+}  // namespace spiceserver
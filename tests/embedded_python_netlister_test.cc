@@ -2,6 +2,9 @@
 
 #include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 
 #include "proto/spice_simulator.pb.h"
@@ -32,7 +35,7 @@ class EmbeddedPythonNetlisterTest : public ::testing::Test {
   std::filesystem::path test_dir_;
 };
 
-TEST_F(EmbeddedPythonNetlisterTest, WritesProtobufToFile) {
+TEST_F(EmbeddedPythonNetlisterTest, NetlistsWithoutWritingProtobuf) {
   // Create a simple SimInput protobuf
   vlsir::spice::SimInput sim_input;
   sim_input.set_top("test_top");
@@ -41,48 +44,37 @@ TEST_F(EmbeddedPythonNetlisterTest, WritesProtobufToFile) {
   auto* pkg = sim_input.mutable_pkg();
   pkg->set_domain("test_domain");
 
-  // Call WriteSim
   Flavour flavour = Flavour::XYCE;
+  auto netlist = netlister_->NetlistSim(sim_input, flavour);
   auto result = netlister_->WriteSim(sim_input, flavour, test_dir_);
+  ASSERT_EQ(result.ok(), netlist.ok()) << result.status();
 
-  // Verify the output file was created
-  std::filesystem::path expected_file = test_dir_ / "sim_input.pb";
-  ASSERT_TRUE(std::filesystem::exists(expected_file))
-      << "Expected file " << expected_file << " does not exist";
-
-  // Verify we can read the file back
-  std::fstream input_file(expected_file.string(),
-                          std::ios::in | std::ios::binary);
-  ASSERT_TRUE(input_file.is_open())
-      << "Could not open file " << expected_file;
-
-  // Parse the protobuf from the file
-  vlsir::spice::SimInput read_sim_input;
-  ASSERT_TRUE(read_sim_input.ParseFromIstream(&input_file))
-      << "Failed to parse protobuf from file";
-
-  // Verify the contents match what we wrote
-  EXPECT_EQ(read_sim_input.top(), "test_top");
-  EXPECT_EQ(read_sim_input.pkg().domain(), "test_domain");
+  // The input is passed to Python in memory, so only the netlist (if any)
+  // is written.
+  for (const auto &entry : std::filesystem::directory_iterator(test_dir_)) {
+    EXPECT_EQ(entry.path(), test_dir_ / "main.sp");
+  }
+  if (!netlist.ok()) {
+    EXPECT_EQ(netlist.status(), netlister_->status());
+    return;
+  }
+  ASSERT_FALSE(result->empty());
+  EXPECT_EQ(result->front(), test_dir_ / "main.sp");
+  std::ifstream main_file(result->front(), std::ios::in | std::ios::binary);
+  std::string written((std::istreambuf_iterator<char>(main_file)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ(written, *netlist);
 }
 
-TEST_F(EmbeddedPythonNetlisterTest, HandlesEmptySimInput) {
-  // Create an empty SimInput protobuf
+TEST_F(EmbeddedPythonNetlisterTest, RejectsUnknownFlavour) {
   vlsir::spice::SimInput sim_input;
+  sim_input.set_top("unset_flavour");
 
-  // Call WriteSim with empty input
-  Flavour flavour = Flavour::NGSPICE;
-  auto result = netlister_->WriteSim(sim_input, flavour, test_dir_);
-
-  // Verify the output file was still created
-  std::filesystem::path expected_file = test_dir_ / "sim_input.pb";
-  ASSERT_TRUE(std::filesystem::exists(expected_file));
-
-  // Verify we can read it back
-  std::fstream input_file(expected_file.string(),
-                          std::ios::in | std::ios::binary);
-  vlsir::spice::SimInput read_sim_input;
-  ASSERT_TRUE(read_sim_input.ParseFromIstream(&input_file));
+  auto netlist = netlister_->NetlistSim(sim_input, Flavour::UNSET);
+  EXPECT_FALSE(netlist.ok());
+  auto result = netlister_->WriteSim(sim_input, Flavour::UNSET, test_dir_);
+  EXPECT_FALSE(result.ok());
+  EXPECT_TRUE(std::filesystem::is_empty(test_dir_));
 }
 
 TEST_F(EmbeddedPythonNetlisterTest, WorksWithDifferentFlavours) {
@@ -103,15 +95,30 @@ TEST_F(EmbeddedPythonNetlisterTest, WorksWithDifferentFlavours) {
     std::filesystem::create_directories(flavour_dir);
 
     auto result = netlister_->WriteSim(sim_input, flavour, flavour_dir);
+    if (!netlister_->status().ok()) {
+      // Without vlsir and vlsirtools, every flavour says so.
+      EXPECT_EQ(result.status(), netlister_->status());
+      continue;
+    }
+
+    if (result.status().code() == absl::StatusCode::kUnimplemented) {
+      // This vlsirtools has no netlister for the flavour; nothing written.
+      EXPECT_TRUE(std::filesystem::is_empty(flavour_dir));
+      continue;
+    }
 
     // Verify file was created for each flavour
-    std::filesystem::path expected_file = flavour_dir / "sim_input.pb";
-    EXPECT_TRUE(std::filesystem::exists(expected_file))
+    ASSERT_TRUE(result.ok())
+        << "Flavour " << static_cast<int>(flavour) << ": " << result.status();
+    EXPECT_TRUE(std::filesystem::exists(flavour_dir / "main.sp"))
         << "File not created for flavour " << static_cast<int>(flavour);
   }
 }
 
 TEST_F(EmbeddedPythonNetlisterTest, OverwritesExistingFile) {
+  if (!netlister_->status().ok()) {
+    GTEST_SKIP() << netlister_->status();
+  }
   vlsir::spice::SimInput first_input;
   first_input.set_top("first");
 
@@ -119,24 +126,28 @@ TEST_F(EmbeddedPythonNetlisterTest, OverwritesExistingFile) {
   second_input.set_top("second");
 
   Flavour flavour = Flavour::XYCE;
-  std::filesystem::path expected_file = test_dir_ / "sim_input.pb";
+  std::filesystem::path expected_file = test_dir_ / "main.sp";
 
   // Write first time
-  netlister_->WriteSim(first_input, flavour, test_dir_);
+  ASSERT_TRUE(netlister_->WriteSim(first_input, flavour, test_dir_).ok());
   ASSERT_TRUE(std::filesystem::exists(expected_file));
 
   // Write second time (should overwrite)
-  netlister_->WriteSim(second_input, flavour, test_dir_);
-
-  // Verify the file contains the second input
-  std::fstream input_file(expected_file.string(),
-                          std::ios::in | std::ios::binary);
-  vlsir::spice::SimInput read_input;
-  ASSERT_TRUE(read_input.ParseFromIstream(&input_file));
-  EXPECT_EQ(read_input.top(), "second");
+  ASSERT_TRUE(netlister_->WriteSim(second_input, flavour, test_dir_).ok());
+
+  // Verify the file contains the second netlist
+  auto second_netlist = netlister_->NetlistSim(second_input, flavour);
+  ASSERT_TRUE(second_netlist.ok());
+  std::ifstream main_file(expected_file, std::ios::in | std::ios::binary);
+  std::string written((std::istreambuf_iterator<char>(main_file)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_EQ(written, *second_netlist);
 }
 
 TEST_F(EmbeddedPythonNetlisterTest, CreatesDirectoryIfNeeded) {
+  if (!netlister_->status().ok()) {
+    GTEST_SKIP() << netlister_->status();
+  }
   // Use a nested directory that doesn't exist yet
   auto nested_dir = test_dir_ / "nested" / "path" / "test";
   std::filesystem::create_directories(nested_dir);
@@ -146,9 +157,10 @@ TEST_F(EmbeddedPythonNetlisterTest, CreatesDirectoryIfNeeded) {
 
   Flavour flavour = Flavour::XYCE;
   auto result = netlister_->WriteSim(sim_input, flavour, nested_dir);
+  ASSERT_TRUE(result.ok()) << result.status();
 
   // Verify the file was created in the nested directory
-  std::filesystem::path expected_file = nested_dir / "sim_input.pb";
+  std::filesystem::path expected_file = nested_dir / "main.sp";
   EXPECT_TRUE(std::filesystem::exists(expected_file));
 }
 
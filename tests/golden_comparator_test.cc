@@ -0,0 +1,151 @@
+#include "golden_comparator.h"
+
+#include <unistd.h>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "rawfile_reader.h"
+#include "rawfile_test_util.h"
+#include "result_store.h"
+
+namespace spiceserver {
+namespace {
+
+// A transient plot with time going from 0 to 10 in steps of step, v(in) at
+// time and v(out) at time + offset, but for a glitch of 1 at time 4.5.
+std::string Rawfile(double step, double offset) {
+  int num_points = static_cast<int>(10 / step) + 1;
+  std::string raw = RawfileHeader(
+      "Transient Analysis", false,
+      {{"time", "time"}, {"v(in)", "voltage"}, {"v(out)", "voltage"}},
+      num_points);
+  for (int point = 0; point < num_points; ++point) {
+    double time = point * step;
+    AppendValues({time, time, time + offset + (time == 4.5 ? 1 : 0)}, &raw);
+  }
+  return raw;
+}
+
+class GoldenComparatorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    directory_ = std::filesystem::temp_directory_path() /
+                 ("golden_comparator_test_" + std::to_string(getpid()));
+    ASSERT_TRUE(store_.Open(directory_, 1 << 20).ok());
+  }
+
+  void TearDown() override {
+    std::filesystem::remove_all(directory_);
+  }
+
+  static std::unique_ptr<RawfileReader> Read(const std::string &contents) {
+    TemporaryRawfile rawfile;
+    rawfile.Write(contents);
+    return rawfile.Open();
+  }
+
+  static GoldenOptions Options(double absolute) {
+    GoldenOptions options;
+    options.set_test_id("inverter/tran");
+    options.mutable_default_tolerance()->set_absolute(absolute);
+    return options;
+  }
+
+  std::filesystem::path directory_;
+  ResultStore store_;
+};
+
+TEST_F(GoldenComparatorTest, AlignsRunsOnTime) {
+  EXPECT_EQ(store_.GetGolden("inverter/tran").status().code(),
+            absl::StatusCode::kNotFound);
+  // Golden points every 1, so without the glitch.
+  ASSERT_TRUE(store_.SetGolden("inverter/tran", *Read(Rawfile(1, 0))).ok());
+  auto golden = store_.GetGolden("inverter/tran");
+  ASSERT_TRUE(golden.ok()) << golden.status();
+
+  // Points every 0.5, slightly off.
+  std::unique_ptr<RawfileReader> run = Read(Rawfile(0.5, 0.01));
+  GoldenOptions options = Options(0.02);
+  SignalTolerance *tolerance = options.add_signals();
+  tolerance->set_signal("v(in)");
+  GoldenComparison comparison =
+      GoldenComparator(**golden, *run).Compare(options);
+  EXPECT_TRUE(comparison.passed()) << comparison.DebugString();
+  EXPECT_EQ(comparison.test_id(), "inverter/tran");
+  ASSERT_EQ(comparison.signals_size(), 1);
+  EXPECT_EQ(comparison.signals(0).plot(), "Transient Analysis");
+  // The golden's points are among the run's.
+  EXPECT_EQ(comparison.signals(0).points(), 21);
+  EXPECT_EQ(comparison.signals(0).max_error(), 0);
+
+  // v(out) is off by 0.01, and by 1 more at 4.5, between the golden's
+  // points.
+  tolerance->set_signal("v(out)");
+  tolerance->set_absolute(0.02);
+  comparison = GoldenComparator(**golden, *run).Compare(options);
+  EXPECT_FALSE(comparison.passed());
+  ASSERT_EQ(comparison.signals_size(), 1);
+  const SignalComparison &out = comparison.signals(0);
+  EXPECT_EQ(out.violations(), 1);
+  EXPECT_NEAR(out.max_error(), 1.01, 1e-9);
+  EXPECT_DOUBLE_EQ(out.max_error_at(), 4.5);
+  EXPECT_NEAR(out.max_relative_error(), 1.01 / 4.5, 1e-9);
+
+  // Within 2% of the golden, but that's not enough near 0.
+  tolerance->set_absolute(0);
+  tolerance->set_relative(0.02);
+  run = Read(Rawfile(1, 0.01));
+  comparison = GoldenComparator(**golden, *run).Compare(options);
+  ASSERT_EQ(comparison.signals_size(), 1);
+  EXPECT_EQ(comparison.signals(0).violations(), 1);
+}
+
+TEST_F(GoldenComparatorTest, ComparesEverySignalByDefault) {
+  ASSERT_TRUE(store_.SetGolden("inverter/tran", *Read(Rawfile(1, 0))).ok());
+  // Replaced.
+  ASSERT_TRUE(store_.SetGolden("inverter/tran", *Read(Rawfile(1, 5))).ok());
+  auto golden = store_.GetGolden("inverter/tran");
+  ASSERT_TRUE(golden.ok()) << golden.status();
+  // Goldens don't count towards the store's results.
+  EXPECT_EQ(store_.total_bytes(), 0);
+
+  std::unique_ptr<RawfileReader> run = Read(Rawfile(1, 5));
+  GoldenComparison comparison =
+      GoldenComparator(**golden, *run).Compare(Options(0));
+  EXPECT_TRUE(comparison.passed()) << comparison.DebugString();
+  ASSERT_EQ(comparison.signals_size(), 2);
+  EXPECT_EQ(comparison.signals(0).signal(), "v(in)");
+  EXPECT_EQ(comparison.signals(1).signal(), "v(out)");
+}
+
+TEST_F(GoldenComparatorTest, FailsWhatCantBeCompared) {
+  ASSERT_TRUE(store_.SetGolden("inverter/tran", *Read(Rawfile(1, 0))).ok());
+  auto golden = store_.GetGolden("inverter/tran");
+  ASSERT_TRUE(golden.ok()) << golden.status();
+
+  std::string renamed = Rawfile(1, 0);
+  renamed.replace(renamed.find("v(out)"), 6, "v(xyz)");
+  std::unique_ptr<RawfileReader> run = Read(renamed);
+  GoldenOptions options = Options(1);
+  options.add_signals()->set_signal("v(out)");
+  options.add_signals()->set_signal("v(none)");
+  GoldenComparison comparison =
+      GoldenComparator(**golden, *run).Compare(options);
+  EXPECT_FALSE(comparison.passed());
+  ASSERT_EQ(comparison.signals_size(), 2);
+  EXPECT_EQ(comparison.signals(0).error(), "Not in the run");
+  EXPECT_EQ(comparison.signals(1).signal(), "v(none)");
+  EXPECT_EQ(comparison.signals(1).error(), "Not in the golden");
+
+  EXPECT_TRUE(GoldenComparator::Validate(options).ok());
+  options.mutable_signals(0)->set_relative(-1);
+  EXPECT_EQ(GoldenComparator::Validate(options).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(GoldenComparator::Validate(GoldenOptions()).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace spiceserver
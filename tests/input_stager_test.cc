@@ -0,0 +1,89 @@
+#include "input_stager.h"
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+DECLARE_uint64(max_upload_bytes);
+
+namespace spiceserver {
+namespace {
+
+std::string Read(const std::filesystem::path &path) {
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  return std::string(std::istreambuf_iterator<char>(in),
+                     std::istreambuf_iterator<char>());
+}
+
+FileInfo File(const std::string &path, const std::string &data) {
+  FileInfo file;
+  file.set_path(path);
+  file.set_data(data);
+  return file;
+}
+
+FileChunk Chunk(const std::string &path, const std::string &data) {
+  FileChunk chunk;
+  chunk.set_path(path);
+  chunk.set_data(data);
+  return chunk;
+}
+
+TEST(InputStagerTest, StreamsFilesInChunks) {
+  auto stager = InputStager::Create();
+  ASSERT_TRUE(stager.ok());
+  ASSERT_TRUE((*stager)->AddFile(File("main.sp", ".include lib/big.lib\n"))
+                  .ok());
+  ASSERT_TRUE((*stager)->Append(Chunk("lib/big.lib", "* first\n")).ok());
+  ASSERT_TRUE((*stager)->Append(Chunk("lib/big.lib", "* second\n")).ok());
+  ASSERT_TRUE((*stager)->Append(Chunk("stimulus.pwl", "0 0\n")).ok());
+  ASSERT_TRUE((*stager)->Finish().ok());
+
+  std::filesystem::path directory = (*stager)->directory();
+  EXPECT_EQ((*stager)->paths(),
+            (std::vector<std::string> {
+                "main.sp", "lib/big.lib", "stimulus.pwl"}));
+  EXPECT_EQ(Read(directory / "lib" / "big.lib"), "* first\n* second\n");
+  EXPECT_EQ(Read(directory / "stimulus.pwl"), "0 0\n");
+  EXPECT_EQ((*stager)->total_bytes(), 42);
+
+  // A file that has been closed can't be reopened.
+  EXPECT_EQ((*stager)->Append(Chunk("lib/big.lib", "* third\n")).code(),
+            absl::StatusCode::kInvalidArgument);
+
+  stager->reset();
+  EXPECT_FALSE(std::filesystem::exists(directory));
+}
+
+TEST(InputStagerTest, KeepsFilesInsideTheDirectory) {
+  auto stager = InputStager::Create();
+  ASSERT_TRUE(stager.ok());
+  EXPECT_FALSE((*stager)->AddFile(File("/etc/passwd", "")).ok());
+  EXPECT_FALSE((*stager)->AddFile(File("../escape.sp", "")).ok());
+  EXPECT_FALSE((*stager)->Append(Chunk("lib/../../escape.sp", "")).ok());
+  EXPECT_FALSE((*stager)->AddFile(File("", "")).ok());
+  EXPECT_TRUE((*stager)->paths().empty());
+}
+
+TEST(InputStagerTest, LimitsUploadSize) {
+  uint64_t old_max = FLAGS_max_upload_bytes;
+  FLAGS_max_upload_bytes = 10;
+  auto stager = InputStager::Create();
+  ASSERT_TRUE(stager.ok());
+  EXPECT_TRUE((*stager)->Append(Chunk("a.sp", "12345")).ok());
+  EXPECT_EQ((*stager)->Append(Chunk("a.sp", "678901")).code(),
+            absl::StatusCode::kResourceExhausted);
+  FLAGS_max_upload_bytes = old_max;
+
+  std::filesystem::path directory = (*stager)->Release();
+  stager->reset();
+  EXPECT_TRUE(std::filesystem::exists(directory));
+  std::filesystem::remove_all(directory);
+}
+
+}  // namespace
+}  // namespace spiceserver
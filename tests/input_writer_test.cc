@@ -0,0 +1,103 @@
+#include "input_writer.h"
+
+#include <unistd.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+DECLARE_uint64(parallel_input_write_bytes);
+
+namespace spiceserver {
+namespace {
+
+class InputWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = std::filesystem::temp_directory_path() /
+                ("input_writer_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(test_dir_);
+    std::filesystem::create_directories(test_dir_);
+  }
+
+  void TearDown() override {
+    std::filesystem::remove_all(test_dir_);
+  }
+
+  static std::string Read(const std::filesystem::path &path) {
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in),
+                       std::istreambuf_iterator<char>());
+  }
+
+  std::filesystem::path test_dir_;
+};
+
+TEST_F(InputWriterTest, WritesFilesInNestedDirectories) {
+  VerbatimFileInput input;
+  FileInfo *main = input.add_files();
+  main->set_path("main.sp");
+  main->set_data(".include models/nfet.lib\n");
+  FileInfo *model = input.add_files();
+  model->set_path("models/nfet.lib");
+  model->set_data(".model nfet nmos\n");
+  FileInfo *deep = input.add_files();
+  deep->set_path("models/corners/ss.lib");
+  FileInfo *empty = input.add_files();
+  empty->set_path("models/corners/empty.lib");
+
+  ASSERT_TRUE(InputWriter::Write(test_dir_, input.files()).ok());
+  EXPECT_EQ(Read(test_dir_ / "main.sp"), ".include models/nfet.lib\n");
+  EXPECT_EQ(Read(test_dir_ / "models" / "nfet.lib"), ".model nfet nmos\n");
+  EXPECT_TRUE(std::filesystem::exists(test_dir_ / "models" / "corners" /
+                                      "ss.lib"));
+  EXPECT_EQ(std::filesystem::file_size(
+                test_dir_ / "models" / "corners" / "empty.lib"), 0);
+}
+
+TEST_F(InputWriterTest, WritesLargeFilesInParallel) {
+  uint64_t old_threshold = FLAGS_parallel_input_write_bytes;
+  FLAGS_parallel_input_write_bytes = 0;
+  VerbatimFileInput input;
+  FileInfo *big = input.add_files();
+  big->set_path("big.raw");
+  // Several pieces, the last one short.
+  std::string data;
+  for (int i = 0; data.size() < (20 << 20) + 17; ++i) {
+    data += std::to_string(i);
+  }
+  big->set_data(data);
+
+  absl::Status status = InputWriter::Write(test_dir_, input.files());
+  FLAGS_parallel_input_write_bytes = old_threshold;
+  ASSERT_TRUE(status.ok());
+  EXPECT_TRUE(Read(test_dir_ / "big.raw") == data);
+}
+
+TEST_F(InputWriterTest, FailsWithoutDirectory) {
+  VerbatimFileInput input;
+  input.add_files()->set_path("main.sp");
+  EXPECT_FALSE(InputWriter::Write(test_dir_ / "missing", input.files()).ok());
+}
+
+TEST_F(InputWriterTest, RejectsPathsOutsideDirectory) {
+  std::filesystem::path job = test_dir_ / "job";
+  std::filesystem::create_directories(job);
+  for (const std::string &path :
+           {std::string("../escaped"), std::string("models/../../escaped"),
+            (test_dir_ / "escaped").string(), std::string()}) {
+    VerbatimFileInput input;
+    input.add_files()->set_path("main.sp");
+    input.add_files()->set_path(path);
+    EXPECT_EQ(InputWriter::Write(job, input.files()).code(),
+              absl::StatusCode::kInvalidArgument) << path;
+  }
+  EXPECT_FALSE(std::filesystem::exists(test_dir_ / "escaped"));
+  // Nothing is written.
+  EXPECT_TRUE(std::filesystem::is_empty(job));
+}
+
+}  // namespace
+}  // namespace spiceserver
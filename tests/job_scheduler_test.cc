@@ -0,0 +1,146 @@
+#include "job_scheduler.h"
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "proto/spice_simulator.pb.h"
+
+namespace spiceserver {
+namespace {
+
+using std::chrono::milliseconds;
+
+JobScheduler::JobRequest Job(const std::string &client,
+                             int priority = 0,
+                             int slots = 1,
+                             Flavour flavour = Flavour::XYCE) {
+  return JobScheduler::JobRequest {
+    .flavour = flavour,
+    .client = client,
+    .priority = priority,
+    .slots = slots
+  };
+}
+
+TEST(JobSchedulerTest, AdmitsUpToHostSlots) {
+  JobScheduler scheduler(2, {});
+  auto a = scheduler.Enqueue(Job("x"));
+  auto b = scheduler.Enqueue(Job("x"));
+  auto c = scheduler.Enqueue(Job("x"));
+  EXPECT_TRUE(a->admitted());
+  EXPECT_TRUE(b->admitted());
+  EXPECT_FALSE(c->admitted());
+  EXPECT_EQ(c->Status().position(), 0);
+  EXPECT_EQ(c->Status().running_jobs(), 2);
+
+  a.reset();
+  EXPECT_TRUE(c->WaitForAdmission(milliseconds(0)));
+}
+
+TEST(JobSchedulerTest, CallsBackOnAdmission) {
+  JobScheduler scheduler(1, {});
+  auto running = scheduler.Enqueue(Job("x"));
+  bool running_admitted = false;
+  running->OnAdmitted([&]() { running_admitted = true; });
+  EXPECT_TRUE(running_admitted);
+
+  auto waiting = scheduler.Enqueue(Job("x"));
+  bool waiting_admitted = false;
+  waiting->OnAdmitted([&]() { waiting_admitted = true; });
+  EXPECT_FALSE(waiting_admitted);
+
+  running.reset();
+  EXPECT_TRUE(waiting_admitted);
+}
+
+TEST(JobSchedulerTest, HigherPriorityGoesFirst) {
+  JobScheduler scheduler(1, {});
+  auto running = scheduler.Enqueue(Job("x"));
+  auto low = scheduler.Enqueue(Job("x", 0));
+  auto high = scheduler.Enqueue(Job("x", 10));
+  EXPECT_EQ(high->Status().position(), 0);
+  EXPECT_EQ(low->Status().position(), 1);
+
+  running.reset();
+  EXPECT_TRUE(high->admitted());
+  EXPECT_FALSE(low->admitted());
+}
+
+TEST(JobSchedulerTest, SharesFairlyBetweenClients) {
+  JobScheduler scheduler(2, {});
+  auto greedy_1 = scheduler.Enqueue(Job("greedy"));
+  auto greedy_2 = scheduler.Enqueue(Job("greedy"));
+  auto greedy_3 = scheduler.Enqueue(Job("greedy"));
+  auto modest = scheduler.Enqueue(Job("modest"));
+
+  // The modest client has nothing running, so it jumps the greedy one.
+  EXPECT_EQ(modest->Status().position(), 0);
+  greedy_1.reset();
+  EXPECT_TRUE(modest->admitted());
+  EXPECT_FALSE(greedy_3->admitted());
+}
+
+TEST(JobSchedulerTest, FlavourLimitDoesNotBlockOtherFlavours) {
+  JobScheduler scheduler(4, {{Flavour::XYCE, 1}});
+  auto xyce_1 = scheduler.Enqueue(Job("x", 0, 1, Flavour::XYCE));
+  auto xyce_2 = scheduler.Enqueue(Job("x", 0, 1, Flavour::XYCE));
+  auto ngspice = scheduler.Enqueue(Job("x", 0, 1, Flavour::NGSPICE));
+  EXPECT_TRUE(xyce_1->admitted());
+  EXPECT_FALSE(xyce_2->admitted());
+  EXPECT_TRUE(ngspice->admitted());
+}
+
+TEST(JobSchedulerTest, ClampsJobsToTheirFlavourLimit) {
+  JobScheduler scheduler(8, {{Flavour::XYCE, 2}});
+  // Would never fit under the limit of 2.
+  auto big = scheduler.Enqueue(Job("x", 0, 4, Flavour::XYCE));
+  EXPECT_TRUE(big->admitted());
+  EXPECT_EQ(big->Status().free_slots(), 6);
+  auto next = scheduler.Enqueue(Job("x", 0, 1, Flavour::XYCE));
+  EXPECT_FALSE(next->admitted());
+}
+
+TEST(JobSchedulerTest, BigJobsAreNotStarvedBySmallOnes) {
+  JobScheduler scheduler(2, {});
+  auto small_1 = scheduler.Enqueue(Job("x"));
+  auto big = scheduler.Enqueue(Job("x", 0, 2));
+  auto small_2 = scheduler.Enqueue(Job("x"));
+  // One slot is free, but it's being held for the big job.
+  EXPECT_FALSE(big->admitted());
+  EXPECT_FALSE(small_2->admitted());
+
+  small_1.reset();
+  EXPECT_TRUE(big->admitted());
+  EXPECT_FALSE(small_2->admitted());
+}
+
+TEST(JobSchedulerTest, EstimatesStartFromPastRunTimes) {
+  JobScheduler scheduler(1, {});
+  {
+    auto first = scheduler.Enqueue(Job("x"));
+    EXPECT_TRUE(first->admitted());
+    first->Finished();
+  }
+
+  auto running = scheduler.Enqueue(Job("x"));
+  auto waiting = scheduler.Enqueue(Job("x"));
+  QueueStatus status = waiting->Status();
+  EXPECT_TRUE(status.has_estimate());
+  EXPECT_GE(status.estimated_start_seconds(), 0);
+}
+
+TEST(JobSchedulerTest, ParsesFlavourSlots) {
+  auto slots = JobScheduler::ParseFlavourSlots("XYCE=8, NGSPICE=4");
+  ASSERT_TRUE(slots.ok());
+  EXPECT_EQ((*slots)[Flavour::XYCE], 8);
+  EXPECT_EQ((*slots)[Flavour::NGSPICE], 4);
+
+  EXPECT_FALSE(JobScheduler::ParseFlavourSlots("XYCE").ok());
+  EXPECT_FALSE(JobScheduler::ParseFlavourSlots("BOGUS=1").ok());
+  EXPECT_FALSE(JobScheduler::ParseFlavourSlots("XYCE=0").ok());
+}
+
+}  // namespace
+}  // namespace spiceserver
@@ -0,0 +1,111 @@
+#include "lru_directory.h"
+
+#include <unistd.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <gtest/gtest.h>
+
+namespace spiceserver {
+namespace {
+
+class LruDirectoryTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = std::filesystem::temp_directory_path() /
+                ("lru_directory_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(test_dir_);
+    std::filesystem::create_directories(test_dir_);
+  }
+
+  void TearDown() override {
+    std::filesystem::remove_all(test_dir_);
+  }
+
+  // Writes size bytes to name, modified age seconds ago.
+  void Write(const std::string &name, size_t size, int age) {
+    std::filesystem::path path = test_dir_ / name;
+    std::ofstream(path, std::ios::binary) << std::string(size, 'x');
+    std::filesystem::last_write_time(
+        path, std::filesystem::file_time_type::clock::now() -
+                  std::chrono::seconds(age));
+  }
+
+  static bool IsEntry(const std::filesystem::directory_entry &entry) {
+    return entry.path().extension() != ".partial";
+  }
+
+  std::filesystem::path test_dir_;
+};
+
+TEST_F(LruDirectoryTest, PicksUpOldestFirst) {
+  Write("old", 10, 30);
+  Write("new", 10, 10);
+  Write("middle", 10, 20);
+  Write("half.partial", 10, 0);
+  std::filesystem::create_directories(test_dir_ / "kept");
+
+  LruDirectory directory;
+  ASSERT_TRUE(directory.Open(test_dir_, 25, IsEntry, {"kept"}).ok());
+  // The oldest was evicted to fit, and the partial one removed.
+  EXPECT_EQ(directory.size(), 2);
+  EXPECT_EQ(directory.total_bytes(), 20);
+  EXPECT_FALSE(directory.Contains("old"));
+  EXPECT_FALSE(std::filesystem::exists(test_dir_ / "old"));
+  EXPECT_FALSE(std::filesystem::exists(test_dir_ / "half.partial"));
+  EXPECT_TRUE(std::filesystem::exists(test_dir_ / "kept"));
+  EXPECT_TRUE(directory.Contains("middle"));
+  EXPECT_TRUE(directory.Contains("new"));
+}
+
+TEST_F(LruDirectoryTest, EvictsLeastRecentlyUsed) {
+  LruDirectory directory;
+  ASSERT_TRUE(directory.Open(test_dir_, 25, IsEntry).ok());
+  Write("a", 10, 0);
+  directory.Add("a", 10);
+  Write("b", 10, 0);
+  directory.Add("b", 10);
+  EXPECT_TRUE(directory.Touch("a"));
+  EXPECT_FALSE(directory.Touch("c"));
+
+  Write("c", 10, 0);
+  directory.Add("c", 10);
+  EXPECT_FALSE(directory.Contains("b"));
+  EXPECT_FALSE(std::filesystem::exists(test_dir_ / "b"));
+  EXPECT_EQ(directory.total_bytes(), 20);
+
+  // Re-adding replaces the size rather than counting it twice.
+  directory.Add("c", 5);
+  EXPECT_EQ(directory.total_bytes(), 15);
+
+  // Forgotten, but left on disk.
+  directory.Remove("a");
+  EXPECT_FALSE(directory.Contains("a"));
+  EXPECT_TRUE(std::filesystem::exists(test_dir_ / "a"));
+  EXPECT_EQ(directory.total_bytes(), 5);
+}
+
+TEST_F(LruDirectoryTest, KeepsPinnedEntries) {
+  LruDirectory directory;
+  ASSERT_TRUE(directory.Open(test_dir_, 25, IsEntry).ok());
+  Write("a", 10, 0);
+  directory.Add("a", 10);
+  directory.Pin("a");
+  Write("b", 10, 0);
+  directory.Add("b", 10);
+  Write("c", 10, 0);
+  directory.Add("c", 10);
+  EXPECT_TRUE(directory.Contains("a"));
+  EXPECT_FALSE(directory.Contains("b"));
+
+  directory.Unpin("a");
+  Write("d", 10, 0);
+  directory.Add("d", 10);
+  EXPECT_FALSE(directory.Contains("a"));
+  EXPECT_TRUE(directory.Contains("c"));
+  EXPECT_TRUE(directory.Contains("d"));
+}
+
+}  // namespace
+}  // namespace spiceserver
@@ -0,0 +1,140 @@
+#include "measurement_evaluator.h"
+
+#include <memory>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "rawfile_reader.h"
+#include "rawfile_test_util.h"
+
+namespace spiceserver {
+namespace {
+
+// A transient plot over 11 points, with time going from 0 to 10, v(in)
+// rising as time does, v(out) falling from 10 to 0 and i(vdd) at 2
+// throughout; then a complex AC plot.
+std::string Rawfile() {
+  std::string raw = RawfileHeader(
+      "Transient Analysis", false,
+      {{"time", "time"}, {"v(in)", "voltage"}, {"v(out)", "voltage"},
+       {"i(vdd)", "current"}}, 11);
+  for (double point = 0; point <= 10; ++point) {
+    AppendValues({point, point, 10 - point, 2}, &raw);
+  }
+  raw += RawfileHeader(
+      "AC Analysis", true,
+      {{"frequency", "frequency"}, {"v(ac)", "voltage"}}, 1);
+  AppendValues({1, 1, 1, 1}, &raw);
+  return raw;
+}
+
+class MeasurementEvaluatorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    rawfile_.Write(Rawfile());
+    reader_ = rawfile_.Open();
+    ASSERT_NE(reader_, nullptr);
+  }
+
+  static Measurement Of(Measurement::Kind kind, const std::string &signal) {
+    Measurement measurement;
+    measurement.set_name("m");
+    measurement.set_kind(kind);
+    measurement.set_signal(signal);
+    return measurement;
+  }
+
+  static void SetCrossing(const std::string &signal,
+                          double threshold,
+                          Crossing::Edge edge,
+                          Crossing *crossing) {
+    crossing->set_signal(signal);
+    crossing->set_threshold(threshold);
+    crossing->set_edge(edge);
+  }
+
+  TemporaryRawfile rawfile_;
+  std::unique_ptr<RawfileReader> reader_;
+};
+
+TEST_F(MeasurementEvaluatorTest, FindsCrossingsAndDelays) {
+  MeasurementEvaluator evaluator(*reader_);
+
+  Measurement cross = Of(Measurement::CROSS, "");
+  SetCrossing("v(in)", 2.5, Crossing::RISE, cross.mutable_trigger());
+  MeasurementResult result = evaluator.Evaluate(cross);
+  EXPECT_EQ(result.name(), "m");
+  EXPECT_TRUE(result.error().empty()) << result.error();
+  EXPECT_DOUBLE_EQ(result.value(), 2.5);
+
+  // v(in) only rises.
+  cross.mutable_trigger()->set_edge(Crossing::FALL);
+  EXPECT_FALSE(evaluator.Evaluate(cross).error().empty());
+  cross.mutable_trigger()->set_edge(Crossing::EITHER);
+  cross.mutable_trigger()->set_occurrence(2);
+  EXPECT_FALSE(evaluator.Evaluate(cross).error().empty());
+
+  Measurement delay = Of(Measurement::DELAY, "");
+  SetCrossing("v(in)", 2.5, Crossing::RISE, delay.mutable_trigger());
+  SetCrossing("v(out)", 4, Crossing::FALL, delay.mutable_target());
+  result = evaluator.Evaluate(delay);
+  EXPECT_TRUE(result.error().empty()) << result.error();
+  EXPECT_DOUBLE_EQ(result.value(), 3.5);
+}
+
+TEST_F(MeasurementEvaluatorTest, IntegratesAndAveragesOverWindows) {
+  MeasurementEvaluator evaluator(*reader_);
+
+  Measurement integral = Of(Measurement::INTEGRAL, "v(in)");
+  EXPECT_DOUBLE_EQ(evaluator.Evaluate(integral).value(), 50);
+  // Between points, at both ends.
+  integral.set_from(0.5);
+  integral.set_to(2.5);
+  EXPECT_DOUBLE_EQ(evaluator.Evaluate(integral).value(), 3);
+
+  Measurement average = Of(Measurement::AVERAGE, "i(vdd)");
+  average.set_from(1.5);
+  average.set_to(3.5);
+  EXPECT_DOUBLE_EQ(evaluator.Evaluate(average).value(), 2);
+  average.set_signal("v(in)");
+  average.set_to(1.5);
+  EXPECT_DOUBLE_EQ(evaluator.Evaluate(average).value(), 1.5);
+
+  Measurement minimum = Of(Measurement::MIN, "v(out)");
+  minimum.set_from(2.5);
+  minimum.set_to(7.5);
+  EXPECT_DOUBLE_EQ(evaluator.Evaluate(minimum).value(), 2.5);
+  Measurement maximum = minimum;
+  maximum.set_kind(Measurement::MAX);
+  EXPECT_DOUBLE_EQ(evaluator.Evaluate(maximum).value(), 7.5);
+
+  // Past the end of the simulation.
+  maximum.set_from(20);
+  maximum.set_to(30);
+  EXPECT_FALSE(evaluator.Evaluate(maximum).error().empty());
+}
+
+TEST_F(MeasurementEvaluatorTest, ReportsWhatCantBeMeasured) {
+  MeasurementEvaluator evaluator(*reader_);
+  EXPECT_FALSE(evaluator.Evaluate(Of(Measurement::MAX, "v(none)"))
+                   .error().empty());
+  EXPECT_FALSE(evaluator.Evaluate(Of(Measurement::MAX, "v(ac)"))
+                   .error().empty());
+  Measurement elsewhere = Of(Measurement::MAX, "v(in)");
+  elsewhere.set_plot("AC Analysis");
+  EXPECT_FALSE(evaluator.Evaluate(elsewhere).error().empty());
+
+  google::protobuf::RepeatedPtrField<Measurement> measurements;
+  *measurements.Add() = Of(Measurement::MAX, "v(in)");
+  EXPECT_TRUE(MeasurementEvaluator::Validate(measurements).ok());
+  measurements.Add()->set_name("no kind");
+  EXPECT_EQ(MeasurementEvaluator::Validate(measurements).code(),
+            absl::StatusCode::kInvalidArgument);
+  *measurements.Mutable(1) = Of(Measurement::DELAY, "");
+  measurements.Mutable(1)->mutable_trigger()->set_signal("v(in)");
+  EXPECT_EQ(MeasurementEvaluator::Validate(measurements).code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+}  // namespace
+}  // namespace spiceserver
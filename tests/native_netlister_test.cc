@@ -0,0 +1,306 @@
+#include "native_netlister.h"
+
+#include <unistd.h>
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_join.h>
+#include <absl/strings/str_replace.h>
+#include <absl/strings/str_split.h>
+
+#include "embedded_python_netlister.h"
+#include "subcircuit_cache.h"
+#include "proto/spice_simulator.pb.h"
+#include "vlsir/circuit.pb.h"
+#include "vlsir/spice.pb.h"
+
+namespace spiceserver {
+namespace {
+
+void Connect(vlsir::circuit::Instance *instance, const std::string &port,
+             const std::string &signal) {
+  auto *connection = instance->add_connections();
+  connection->set_portname(port);
+  connection->mutable_target()->set_sig(signal);
+}
+
+vlsir::circuit::Instance *AddPrimitive(vlsir::circuit::Module *module,
+                                       const std::string &primitive,
+                                       const std::string &name) {
+  auto *instance = module->add_instances();
+  instance->set_name(name);
+  instance->mutable_module()->mutable_external()->set_domain(
+      "vlsir.primitives");
+  instance->mutable_module()->mutable_external()->set_name(primitive);
+  return instance;
+}
+
+void AddParam(vlsir::circuit::Instance *instance, const std::string &name,
+              double value) {
+  auto *param = instance->add_parameters();
+  param->set_name(name);
+  param->mutable_value()->set_double_value(value);
+}
+
+// A resistive divider driven by a 1 V source.
+vlsir::spice::SimInput Divider() {
+  vlsir::spice::SimInput sim_input;
+  sim_input.set_top("tb");
+  vlsir::circuit::Package *package = sim_input.mutable_pkg();
+  package->set_domain("test");
+  vlsir::circuit::Module *tb = package->add_modules();
+  tb->set_name("tb");
+  for (const char *signal : {"VSS", "vin", "out"}) {
+    auto *added = tb->add_signals();
+    added->set_name(signal);
+    added->set_width(1);
+  }
+  tb->add_ports()->set_signal("VSS");
+
+  auto *source = AddPrimitive(tb, "vdc", "v1");
+  Connect(source, "p", "vin");
+  Connect(source, "n", "VSS");
+  AddParam(source, "dc", 1.0);
+
+  auto *upper = AddPrimitive(tb, "resistor", "r1");
+  Connect(upper, "p", "vin");
+  Connect(upper, "n", "out");
+  auto *prefixed = upper->add_parameters();
+  prefixed->set_name("r");
+  prefixed->mutable_value()->mutable_prefixed()->set_prefix(
+      vlsir::utils::KILO);
+  prefixed->mutable_value()->mutable_prefixed()->set_int64_value(1);
+
+  auto *lower = AddPrimitive(tb, "resistor", "r2");
+  Connect(lower, "p", "out");
+  Connect(lower, "n", "VSS");
+  AddParam(lower, "r", 2e3);
+
+  sim_input.add_an()->mutable_op()->set_analysis_name("op");
+  return sim_input;
+}
+
+// Lines joined, comments and blank lines dropped, case, whitespace, quoting
+// and the form of numbers made uniform: what's left should be the same for
+// equivalent netlists.
+std::string Normalise(const std::string &netlist) {
+  std::vector<std::string> lines;
+  for (absl::string_view line : absl::StrSplit(netlist, '\n')) {
+    std::string text = absl::AsciiStrToLower(line);
+    text = absl::StrReplaceAll(text, {{"\"", ""}, {"'", ""}, {"{", ""},
+                                      {"}", ""}, {"params:", ""}});
+    std::vector<std::string> words;
+    for (absl::string_view word :
+         absl::StrSplit(text, absl::ByAnyChar(" \t="), absl::SkipEmpty())) {
+      char *end;
+      std::string copy(word);
+      double value = strtod(copy.c_str(), &end);
+      if (!copy.empty() && *end == '\0') {
+        std::ostringstream number;
+        number << value;
+        words.push_back(number.str());
+      } else {
+        words.emplace_back(word);
+      }
+    }
+    if (words.empty() || words.front()[0] == '*') {
+      continue;
+    }
+    if (words.front() == "+" && !lines.empty()) {
+      words.erase(words.begin());
+      absl::StrAppend(&lines.back(), " ", absl::StrJoin(words, " "));
+      continue;
+    }
+    lines.push_back(absl::StrJoin(words, " "));
+  }
+  return absl::StrJoin(lines, "\n");
+}
+
+TEST(NativeNetlisterTest, NetlistsDivider) {
+  auto netlist = NativeNetlister::NetlistSim(Divider(), Flavour::XYCE);
+  ASSERT_TRUE(netlist.ok()) << netlist.status();
+  EXPECT_EQ(*netlist,
+            "* tb\n"
+            "\n"
+            ".SUBCKT tb VSS\n"
+            "vv1 vin VSS dc 1\n"
+            "rr1 vin out 1000\n"
+            "rr2 out VSS 2000\n"
+            ".ENDS\n"
+            "\n"
+            "xtop 0 tb\n"
+            "\n"
+            ".op\n"
+            ".end\n");
+}
+
+TEST(NativeNetlisterTest, ExpandsBusesAndWritesAnalyses) {
+  vlsir::spice::SimInput sim_input = Divider();
+  sim_input.mutable_an()->Clear();
+  vlsir::spice::TranInput *tran = sim_input.add_an()->mutable_tran();
+  tran->set_tstop(1e-9);
+  tran->set_tstep(1e-12);
+  (*tran->mutable_ic())["out"] = 0.5;
+  sim_input.mutable_opts()->set_temp(27);
+
+  vlsir::circuit::Package *package = sim_input.mutable_pkg();
+  vlsir::circuit::ExternalModule *nmos = package->add_ext_modules();
+  nmos->mutable_name()->set_domain("pdk");
+  nmos->mutable_name()->set_name("nch");
+  nmos->set_spicetype(vlsir::circuit::MOS);
+  for (const char *port : {"d", "g", "s", "b"}) {
+    nmos->add_ports()->set_signal(port);
+  }
+
+  // A two-bit bank of transistors, used with a slice of a wider bus.
+  vlsir::circuit::Module *bank = package->add_modules();
+  bank->set_name("bank");
+  auto *bits = bank->add_signals();
+  bits->set_name("g");
+  bits->set_width(2);
+  bank->add_ports()->set_signal("g");
+  bank->add_signals()->set_name("VSS");
+  bank->add_ports()->set_signal("VSS");
+  for (int i = 0; i < 2; ++i) {
+    auto *device = bank->add_instances();
+    device->set_name(std::to_string(i));
+    device->mutable_module()->mutable_external()->CopyFrom(nmos->name());
+    Connect(device, "d", "VSS");
+    auto *gate = device->add_connections();
+    gate->set_portname("g");
+    gate->mutable_target()->mutable_slice()->set_signal("g");
+    gate->mutable_target()->mutable_slice()->set_top(i);
+    gate->mutable_target()->mutable_slice()->set_bot(i);
+    Connect(device, "s", "VSS");
+    Connect(device, "b", "VSS");
+  }
+  // Modules are defined before they're used.
+  package->mutable_modules()->SwapElements(0, 1);
+
+  vlsir::circuit::Module *tb = package->mutable_modules(1);
+  auto *bus = tb->add_signals();
+  bus->set_name("sel");
+  bus->set_width(4);
+  auto *instance = tb->add_instances();
+  instance->set_name("bank");
+  instance->mutable_module()->set_local("bank");
+  auto *gates = instance->add_connections();
+  gates->set_portname("g");
+  gates->mutable_target()->mutable_slice()->set_signal("sel");
+  gates->mutable_target()->mutable_slice()->set_top(2);
+  gates->mutable_target()->mutable_slice()->set_bot(1);
+  Connect(instance, "VSS", "VSS");
+
+  auto netlist = NativeNetlister::NetlistSim(sim_input, Flavour::NGSPICE);
+  ASSERT_TRUE(netlist.ok()) << netlist.status();
+  EXPECT_NE(netlist->find(".SUBCKT bank g_0 g_1 VSS\n"
+                          "m0 VSS g_0 VSS VSS nch\n"
+                          "m1 VSS g_1 VSS VSS nch\n"
+                          ".ENDS\n"), std::string::npos) << *netlist;
+  EXPECT_NE(netlist->find("xbank sel_1 sel_2 VSS bank\n"), std::string::npos)
+      << *netlist;
+  EXPECT_NE(netlist->find(".temp 27\n"
+                          ".ic v(out)=0.5\n"
+                          ".tran 1e-12 1e-09\n"
+                          ".end\n"), std::string::npos) << *netlist;
+
+  // The wrong number of nodes for a port is the input's fault.
+  gates->mutable_target()->mutable_slice()->set_top(3);
+  EXPECT_EQ(NativeNetlister::NetlistSim(sim_input, Flavour::NGSPICE)
+                .status().code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+TEST(NativeNetlisterTest, ReusesUnchangedModules) {
+  SubcircuitCache &cache = SubcircuitCache::GetInstance();
+  ASSERT_TRUE(cache.enabled());
+
+  vlsir::spice::SimInput sim_input = Divider();
+  vlsir::circuit::Module *cell = sim_input.mutable_pkg()->add_modules();
+  cell->set_name("cell_with_a_unique_name");
+  sim_input.mutable_pkg()->mutable_modules()->SwapElements(0, 1);
+  auto first = NativeNetlister::NetlistSim(sim_input, Flavour::XYCE);
+  ASSERT_TRUE(first.ok()) << first.status();
+
+  uint64_t hits = cache.hits();
+  uint64_t misses = cache.misses();
+  auto second = NativeNetlister::NetlistSim(sim_input, Flavour::XYCE);
+  ASSERT_TRUE(second.ok()) << second.status();
+  EXPECT_EQ(*second, *first);
+  EXPECT_EQ(cache.hits() - hits, 2);
+  EXPECT_EQ(cache.misses() - misses, 0);
+
+  // Only the testbench changed.
+  sim_input.mutable_pkg()->mutable_modules(1)->mutable_instances(2)
+      ->mutable_parameters(0)->mutable_value()->set_double_value(3e3);
+  auto third = NativeNetlister::NetlistSim(sim_input, Flavour::XYCE);
+  ASSERT_TRUE(third.ok()) << third.status();
+  EXPECT_NE(third->find("rr2 out VSS 3000\n"), std::string::npos);
+  EXPECT_EQ(cache.hits() - hits, 3);
+  EXPECT_EQ(cache.misses() - misses, 1);
+}
+
+TEST(NativeNetlisterTest, LeavesUnsupportedInputsToPython) {
+  EXPECT_EQ(NativeNetlister::NetlistSim(Divider(), Flavour::SPECTRE)
+                .status().code(),
+            absl::StatusCode::kUnimplemented);
+
+  vlsir::spice::SimInput sim_input = Divider();
+  AddPrimitive(sim_input.mutable_pkg()->mutable_modules(0), "vpulse", "2");
+  EXPECT_EQ(NativeNetlister::NetlistSim(sim_input, Flavour::XYCE)
+                .status().code(),
+            absl::StatusCode::kUnimplemented);
+}
+
+TEST(NativeNetlisterTest, StreamsToFile) {
+  std::filesystem::path directory =
+      std::filesystem::temp_directory_path() /
+      ("native_netlister_test_" + std::to_string(getpid()));
+  std::filesystem::create_directories(directory);
+
+  auto netlist = NativeNetlister::NetlistSim(Divider(), Flavour::XYCE);
+  auto written = NativeNetlister::WriteSim(Divider(), Flavour::XYCE,
+                                           directory);
+  ASSERT_TRUE(written.ok()) << written.status();
+  ASSERT_EQ(written->size(), 1);
+  EXPECT_EQ(written->front(), directory / "main.sp");
+  std::ifstream file(written->front(), std::ios::in | std::ios::binary);
+  std::string contents((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+  EXPECT_EQ(contents, *netlist);
+
+  // Nothing is left behind on failure.
+  std::filesystem::remove(written->front());
+  EXPECT_FALSE(NativeNetlister::WriteSim(Divider(), Flavour::SPECTRE,
+                                         directory).ok());
+  EXPECT_TRUE(std::filesystem::is_empty(directory));
+  std::filesystem::remove_all(directory);
+}
+
+// The differential test: where vlsirtools is installed, both netlisters
+// should say the same thing.
+TEST(NativeNetlisterTest, MatchesPythonNetlister) {
+  EmbeddedPythonNetlister &python = EmbeddedPythonNetlister::GetInstance();
+  if (!python.status().ok()) {
+    GTEST_SKIP() << "No Python netlister: " << python.status();
+  }
+  for (Flavour flavour : {Flavour::XYCE, Flavour::NGSPICE}) {
+    auto native = NativeNetlister::NetlistSim(Divider(), flavour);
+    auto reference = python.NetlistSim(Divider(), flavour);
+    ASSERT_TRUE(native.ok()) << native.status();
+    ASSERT_TRUE(reference.ok()) << reference.status();
+    EXPECT_EQ(Normalise(*native), Normalise(*reference))
+        << "Native:\n" << *native << "\nPython:\n" << *reference;
+  }
+}
+
+}  // namespace
+}  // namespace spiceserver
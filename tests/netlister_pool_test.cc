@@ -0,0 +1,141 @@
+#include "netlister_pool.h"
+
+#include <unistd.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "vlsir/spice.pb.h"
+
+namespace spiceserver {
+namespace {
+
+// Speaks the worker protocol without needing vlsirtools: the "netlist" is a
+// comment giving the request's size. Requests mentioning "crash" or "hang"
+// do that.
+constexpr char kFakeWorker[] = R"python(
+import os, struct, sys, time
+
+def varint(n):
+  out = b''
+  while True:
+    byte = n & 0x7f
+    n >>= 7
+    if n:
+      out += bytes([byte | 0x80])
+    else:
+      return out + bytes([byte])
+
+def field(number, data):
+  return varint(number << 3 | 2) + varint(len(data)) + data
+
+def send(message):
+  os.write(3, struct.pack('<I', len(message)) + message)
+
+def read(size):
+  data = b''
+  while len(data) < size:
+    more = os.read(3, size - len(data))
+    if not more:
+      sys.exit(0)
+    data += more
+  return data
+
+if sys.argv[1] == 'broken':
+  send(varint(2 << 3) + varint(14) + field(3, b'no vlsirtools here'))
+  sys.exit(1)
+send(b'')
+while True:
+  request = read(struct.unpack('<I', read(4))[0])
+  if b'crash' in request:
+    os._exit(3)
+  if b'hang' in request:
+    time.sleep(60)
+  send(field(1, b'* %d bytes\n' % len(request)))
+)python";
+
+class NetlisterPoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    script_ = std::filesystem::temp_directory_path() /
+              ("netlister_pool_test_" + std::to_string(getpid()) + ".py");
+    std::ofstream(script_) << kFakeWorker;
+  }
+
+  void TearDown() override {
+    std::filesystem::remove(script_);
+  }
+
+  absl::Status Start(NetlisterPool *pool, int num_workers,
+                     const std::string &mode,
+                     std::chrono::milliseconds timeout =
+                         std::chrono::seconds(10)) {
+    return pool->Start(num_workers, "/usr/bin/env",
+                       {"python3", script_.string(), mode}, timeout);
+  }
+
+  static vlsir::spice::SimInput Input(const std::string &top) {
+    vlsir::spice::SimInput sim_input;
+    sim_input.set_top(top);
+    return sim_input;
+  }
+
+  std::filesystem::path script_;
+};
+
+TEST_F(NetlisterPoolTest, NetlistsInParallel) {
+  NetlisterPool pool;
+  EXPECT_FALSE(pool.enabled());
+  ASSERT_TRUE(Start(&pool, 3, "ok").ok());
+  EXPECT_TRUE(pool.enabled());
+
+  std::vector<std::thread> threads;
+  std::vector<absl::StatusOr<std::string>> netlists(12);
+  for (size_t i = 0; i < netlists.size(); ++i) {
+    threads.emplace_back([&pool, &netlists, i]() {
+      netlists[i] = pool.NetlistSim(Input("top"), Flavour::XYCE);
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  for (const auto &netlist : netlists) {
+    ASSERT_TRUE(netlist.ok()) << netlist.status();
+    EXPECT_EQ(*netlist, "* 9 bytes\n");
+  }
+  EXPECT_EQ(pool.restarts(), 0);
+}
+
+TEST_F(NetlisterPoolTest, ReplacesCrashedWorker) {
+  NetlisterPool pool;
+  ASSERT_TRUE(Start(&pool, 1, "ok").ok());
+  EXPECT_EQ(pool.NetlistSim(Input("crash"), Flavour::XYCE).status().code(),
+            absl::StatusCode::kUnavailable);
+  EXPECT_EQ(pool.restarts(), 1);
+  EXPECT_TRUE(pool.NetlistSim(Input("fine"), Flavour::XYCE).ok());
+}
+
+TEST_F(NetlisterPoolTest, ReplacesHungWorker) {
+  NetlisterPool pool;
+  ASSERT_TRUE(Start(&pool, 1, "ok", std::chrono::milliseconds(2000)).ok());
+  EXPECT_EQ(pool.NetlistSim(Input("hang"), Flavour::XYCE).status().code(),
+            absl::StatusCode::kDeadlineExceeded);
+  EXPECT_EQ(pool.restarts(), 1);
+  EXPECT_TRUE(pool.NetlistSim(Input("fine"), Flavour::XYCE).ok());
+}
+
+TEST_F(NetlisterPoolTest, ReportsWorkersThatCannotLoad) {
+  NetlisterPool pool;
+  absl::Status status = Start(&pool, 2, "broken");
+  EXPECT_EQ(status.code(), absl::StatusCode::kUnavailable);
+  EXPECT_NE(status.message().find("no vlsirtools here"), std::string::npos);
+  EXPECT_FALSE(pool.enabled());
+  EXPECT_FALSE(pool.NetlistSim(Input("top"), Flavour::XYCE).ok());
+}
+
+}  // namespace
+}  // namespace spiceserver
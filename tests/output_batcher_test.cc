@@ -0,0 +1,176 @@
+#include "output_batcher.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "proto/spice_simulator.pb.h"
+
+namespace spiceserver {
+namespace {
+
+using Clock = OutputBatcher::Clock;
+using std::chrono::milliseconds;
+
+OutputBatcher::Options TestOptions() {
+  return OutputBatcher::Options {
+    .max_bytes = 16,
+    .max_latency = milliseconds(50),
+    .line_framed = true,
+    .as_lines = false,
+    .disabled = false
+  };
+}
+
+void Add(OutputBatcher *batcher,
+         const std::string &text,
+         Clock::time_point now,
+         std::vector<SimulationResponse> *ready) {
+  batcher->Add(text.data(), text.size(), Subprocess::StreamType::STDOUT, now,
+               ready);
+}
+
+TEST(OutputBatcherTest, CoalescesSmallChunks) {
+  OutputBatcher batcher(TestOptions());
+  std::vector<SimulationResponse> ready;
+  Clock::time_point now = Clock::now();
+
+  Add(&batcher, "a\n", now, &ready);
+  Add(&batcher, "b\n", now, &ready);
+  Add(&batcher, "c\n", now, &ready);
+  EXPECT_TRUE(ready.empty());
+
+  batcher.FlushAll(&ready);
+  ASSERT_EQ(ready.size(), 1);
+  EXPECT_EQ(ready[0].output(), "a\nb\nc\n");
+  EXPECT_EQ(ready[0].stream_type(), SimulationResponse::STDOUT);
+}
+
+TEST(OutputBatcherTest, CutsAtLineBoundaryWhenFull) {
+  OutputBatcher batcher(TestOptions());
+  std::vector<SimulationResponse> ready;
+  Clock::time_point now = Clock::now();
+
+  // 20 bytes, with the last newline inside the first 16.
+  Add(&batcher, "0123456789\nabcdefghi", now, &ready);
+  ASSERT_EQ(ready.size(), 1);
+  EXPECT_EQ(ready[0].output(), "0123456789\n");
+
+  batcher.FlushAll(&ready);
+  ASSERT_EQ(ready.size(), 2);
+  EXPECT_EQ(ready[1].output(), "abcdefghi");
+}
+
+TEST(OutputBatcherTest, SplitsLinesLongerThanMaxBytes) {
+  OutputBatcher batcher(TestOptions());
+  std::vector<SimulationResponse> ready;
+
+  Add(&batcher, std::string(40, 'x'), Clock::now(), &ready);
+  ASSERT_EQ(ready.size(), 2);
+  EXPECT_EQ(ready[0].output().size(), 16);
+  EXPECT_EQ(ready[1].output().size(), 16);
+}
+
+TEST(OutputBatcherTest, CutsLargeChunksIntoBatchesInOrder) {
+  OutputBatcher batcher(TestOptions());
+  std::vector<SimulationResponse> ready;
+
+  std::string text;
+  for (int line = 0; line < 100; ++line) {
+    text += "line " + std::to_string(line % 10) + "\n";
+  }
+  Add(&batcher, text + "tail", Clock::now(), &ready);
+  // Two 7-byte lines to a batch.
+  ASSERT_EQ(ready.size(), 50);
+  batcher.FlushAll(&ready);
+  std::string sent;
+  for (const SimulationResponse &response : ready) {
+    sent += response.output();
+  }
+  EXPECT_EQ(sent, text + "tail");
+}
+
+TEST(OutputBatcherTest, FlushesCompleteLinesAfterMaxLatency) {
+  OutputBatcher batcher(TestOptions());
+  std::vector<SimulationResponse> ready;
+  Clock::time_point start = Clock::now();
+
+  Add(&batcher, "done\npartial", start, &ready);
+  ASSERT_TRUE(batcher.NextDeadline().has_value());
+  EXPECT_EQ(*batcher.NextDeadline(), start + milliseconds(50));
+
+  batcher.FlushExpired(start + milliseconds(10), &ready);
+  EXPECT_TRUE(ready.empty());
+
+  batcher.FlushExpired(start + milliseconds(50), &ready);
+  ASSERT_EQ(ready.size(), 1);
+  EXPECT_EQ(ready[0].output(), "done\n");
+
+  // The partial line goes out on its own one period later.
+  batcher.FlushExpired(start + milliseconds(100), &ready);
+  ASSERT_EQ(ready.size(), 2);
+  EXPECT_EQ(ready[1].output(), "partial");
+  EXPECT_FALSE(batcher.NextDeadline().has_value());
+}
+
+TEST(OutputBatcherTest, KeepsStreamsSeparate) {
+  OutputBatcher batcher(TestOptions());
+  std::vector<SimulationResponse> ready;
+  Clock::time_point now = Clock::now();
+
+  Add(&batcher, "out\n", now, &ready);
+  batcher.Add("err\n", 4, Subprocess::StreamType::STDERR, now, &ready);
+  batcher.FlushAll(&ready);
+
+  ASSERT_EQ(ready.size(), 2);
+  EXPECT_EQ(ready[0].output(), "out\n");
+  EXPECT_EQ(ready[0].stream_type(), SimulationResponse::STDOUT);
+  EXPECT_EQ(ready[1].output(), "err\n");
+  EXPECT_EQ(ready[1].stream_type(), SimulationResponse::STDERR);
+}
+
+TEST(OutputBatcherTest, ReturnsLinesWhenAsked) {
+  OutputBatcher::Options options = TestOptions();
+  options.as_lines = true;
+  OutputBatcher batcher(options);
+  std::vector<SimulationResponse> ready;
+
+  Add(&batcher, "a 1\nb 2\n", Clock::now(), &ready);
+  batcher.FlushAll(&ready);
+
+  ASSERT_EQ(ready.size(), 1);
+  EXPECT_TRUE(ready[0].output().empty());
+  ASSERT_EQ(ready[0].lines_size(), 2);
+  EXPECT_EQ(ready[0].lines(0), "a 1");
+  EXPECT_EQ(ready[0].lines(1), "b 2");
+}
+
+TEST(OutputBatcherTest, PassesChunksStraightThroughWhenDisabled) {
+  OutputBatcher::Options options = TestOptions();
+  options.disabled = true;
+  OutputBatcher batcher(options);
+  std::vector<SimulationResponse> ready;
+
+  Add(&batcher, "a", Clock::now(), &ready);
+  Add(&batcher, "b", Clock::now(), &ready);
+  ASSERT_EQ(ready.size(), 2);
+  EXPECT_EQ(ready[0].output(), "a");
+  EXPECT_EQ(ready[1].output(), "b");
+}
+
+TEST(OutputBatcherTest, ClientOptionsOverrideDefaults) {
+  OutputBatching batching_pb;
+  batching_pb.set_max_bytes(123);
+  batching_pb.set_line_framed(false);
+
+  OutputBatcher::Options options =
+      OutputBatcher::OptionsFromRequest(batching_pb);
+  EXPECT_EQ(options.max_bytes, 123);
+  EXPECT_FALSE(options.line_framed);
+  EXPECT_EQ(options.max_latency,
+            OutputBatcher::DefaultOptions().max_latency);
+}
+
+}  // namespace
+}  // namespace spiceserver
@@ -0,0 +1,147 @@
+#include "output_spool.h"
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <gtest/gtest.h>
+
+namespace spiceserver {
+namespace {
+
+using std::chrono::milliseconds;
+
+class OutputSpoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = std::filesystem::temp_directory_path() /
+                ("output_spool_test_" + std::to_string(getpid()));
+    std::filesystem::create_directories(test_dir_);
+  }
+
+  void TearDown() override {
+    std::filesystem::remove_all(test_dir_);
+  }
+
+  // Reads everything out of the spool, tagging stderr with a leading '!'.
+  std::string Drain(OutputSpool *spool) {
+    std::string all;
+    auto callback = [&](const char *data,
+                        size_t length,
+                        Subprocess::StreamType stream_type) {
+      if (stream_type == Subprocess::StreamType::STDERR) {
+        all += "!";
+      }
+      all.append(data, length);
+    };
+    while (spool->Read(callback, milliseconds(100), 1024)) {}
+    return all;
+  }
+
+  std::filesystem::path test_dir_;
+};
+
+TEST_F(OutputSpoolTest, KeepsSmallOutputInMemory) {
+  OutputSpool spool(1024, test_dir_ / "spool");
+  spool.Append(Subprocess::StreamType::STDOUT, "hello ", 6);
+  spool.Append(Subprocess::StreamType::STDERR, "oops ", 5);
+  spool.Append(Subprocess::StreamType::STDOUT, "world", 5);
+  spool.Finish();
+
+  EXPECT_EQ(Drain(&spool), "hello !oops world");
+
+  OutputSpool::Statistics statistics = spool.statistics();
+  EXPECT_EQ(statistics.total_bytes, 16);
+  EXPECT_EQ(statistics.spilled_bytes, 0);
+  EXPECT_FALSE(std::filesystem::exists(test_dir_ / "spool"));
+}
+
+TEST_F(OutputSpoolTest, OverflowsToFileInOrder) {
+  // Room for about two 10-byte records.
+  OutputSpool spool(32, test_dir_ / "spool");
+  std::string expected;
+  for (int i = 0; i < 100; ++i) {
+    std::string line = "line " + std::to_string(1000 + i) + "\n";
+    spool.Append(Subprocess::StreamType::STDOUT, line.data(), line.size());
+    expected += line;
+  }
+  spool.Finish();
+  EXPECT_TRUE(std::filesystem::exists(test_dir_ / "spool"));
+
+  EXPECT_EQ(Drain(&spool), expected);
+
+  OutputSpool::Statistics statistics = spool.statistics();
+  EXPECT_EQ(statistics.total_bytes, expected.size());
+  EXPECT_GT(statistics.spilled_bytes, 0);
+  EXPECT_LE(statistics.memory_high_water_bytes, 32);
+  EXPECT_GE(statistics.backlog_high_water_bytes, expected.size());
+  EXPECT_EQ(statistics.dropped_bytes, 0);
+}
+
+TEST_F(OutputSpoolTest, ReturnsToMemoryOnceFileIsDrained) {
+  OutputSpool spool(32, test_dir_ / "spool");
+  std::string big(100, 'x');
+  spool.Append(Subprocess::StreamType::STDOUT, big.data(), big.size());
+
+  std::string read;
+  auto callback = [&](const char *data, size_t length,
+                      Subprocess::StreamType) { read.append(data, length); };
+  EXPECT_TRUE(spool.Read(callback, milliseconds(0), 1024));
+  EXPECT_EQ(read, big);
+
+  spool.Append(Subprocess::StreamType::STDOUT, "small", 5);
+  spool.Finish();
+  EXPECT_FALSE(spool.Read(callback, milliseconds(0), 1024));
+  EXPECT_EQ(read, big + "small");
+  EXPECT_EQ(spool.statistics().spilled_bytes, big.size());
+}
+
+TEST_F(OutputSpoolTest, NotifiesOnceReadable) {
+  OutputSpool spool(1024, test_dir_ / "spool");
+  int notified = 0;
+  spool.NotifyWhenReadable([&]() { ++notified; });
+  EXPECT_EQ(notified, 0);
+
+  spool.Append(Subprocess::StreamType::STDOUT, "hi", 2);
+  EXPECT_EQ(notified, 1);
+  // One-shot.
+  spool.Append(Subprocess::StreamType::STDOUT, "hi", 2);
+  EXPECT_EQ(notified, 1);
+
+  // Already readable, so straight away.
+  spool.NotifyWhenReadable([&]() { ++notified; });
+  EXPECT_EQ(notified, 2);
+
+  spool.Finish();
+  EXPECT_EQ(Drain(&spool), "hihi");
+}
+
+TEST_F(OutputSpoolTest, WriterNeverWaitsForReader) {
+  OutputSpool spool(64, test_dir_ / "spool");
+  std::string expected;
+  std::thread writer([&]() {
+    for (int i = 0; i < 10000; ++i) {
+      std::string line = std::to_string(i) + "\n";
+      spool.Append(Subprocess::StreamType::STDOUT, line.data(), line.size());
+    }
+    spool.Finish();
+  });
+  for (int i = 0; i < 10000; ++i) {
+    expected += std::to_string(i) + "\n";
+  }
+
+  std::string read;
+  auto callback = [&](const char *data, size_t length,
+                      Subprocess::StreamType) {
+    read.append(data, length);
+    // A slow client.
+    std::this_thread::sleep_for(std::chrono::microseconds(10));
+  };
+  while (spool.Read(callback, milliseconds(100), 256)) {}
+  writer.join();
+
+  EXPECT_EQ(read, expected);
+}
+
+}  // namespace
+}  // namespace spiceserver
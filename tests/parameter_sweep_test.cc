@@ -0,0 +1,123 @@
+#include "parameter_sweep.h"
+
+#include <set>
+#include <string>
+#include <gtest/gtest.h>
+
+namespace spiceserver {
+namespace {
+
+void AddParameter(const std::string &name,
+                  std::initializer_list<double> values,
+                  google::protobuf::RepeatedPtrField<SweepParameter> *out) {
+  SweepParameter *parameter = out->Add();
+  parameter->set_name(name);
+  for (double value : values) {
+    parameter->add_values(value);
+  }
+}
+
+TEST(ParameterSweepTest, GridVariesLastParameterFastest) {
+  SweepRequest request;
+  AddParameter("a", {1, 2}, request.mutable_grid()->mutable_parameters());
+  AddParameter("b", {10, 20, 30},
+               request.mutable_grid()->mutable_parameters());
+
+  auto points = ParameterSweep::Expand(request);
+  ASSERT_TRUE(points.ok()) << points.status();
+  ASSERT_EQ(points->size(), 6);
+  EXPECT_EQ((*points)[0], (SweepPoint {{"a", 1}, {"b", 10}}));
+  EXPECT_EQ((*points)[1], (SweepPoint {{"a", 1}, {"b", 20}}));
+  EXPECT_EQ((*points)[3], (SweepPoint {{"a", 2}, {"b", 10}}));
+  EXPECT_EQ((*points)[5], (SweepPoint {{"a", 2}, {"b", 30}}));
+}
+
+TEST(ParameterSweepTest, ListZipsParameters) {
+  SweepRequest request;
+  AddParameter("a", {1, 2}, request.mutable_list()->mutable_parameters());
+  AddParameter("b", {10, 20}, request.mutable_list()->mutable_parameters());
+  auto points = ParameterSweep::Expand(request);
+  ASSERT_TRUE(points.ok()) << points.status();
+  ASSERT_EQ(points->size(), 2);
+  EXPECT_EQ((*points)[1], (SweepPoint {{"a", 2}, {"b", 20}}));
+
+  AddParameter("c", {1}, request.mutable_list()->mutable_parameters());
+  EXPECT_FALSE(ParameterSweep::Expand(request).ok());
+}
+
+TEST(ParameterSweepTest, RejectsBadSweeps) {
+  SweepRequest request;
+  EXPECT_FALSE(ParameterSweep::Expand(request).ok());
+
+  AddParameter("a", {1}, request.mutable_grid()->mutable_parameters());
+  AddParameter("A", {2}, request.mutable_grid()->mutable_parameters());
+  EXPECT_FALSE(ParameterSweep::Expand(request).ok());
+
+  request.clear_grid();
+  for (int i = 0; i < 6; ++i) {
+    AddParameter(std::to_string(i), {1, 2, 3, 4, 5, 6, 7, 8, 9, 10},
+                 request.mutable_grid()->mutable_parameters());
+  }
+  EXPECT_FALSE(ParameterSweep::Expand(request).ok());
+}
+
+TEST(ParameterSweepTest, MonteCarloIsReproducible) {
+  SweepRequest request;
+  MonteCarlo *monte_carlo = request.mutable_monte_carlo();
+  monte_carlo->set_samples(100);
+  monte_carlo->set_seed(42);
+  monte_carlo->set_seed_parameter("seed");
+  MonteCarloParameter *vth = monte_carlo->add_parameters();
+  vth->set_name("vth");
+  vth->set_mean(0.4);
+  vth->set_sigma(0.01);
+  MonteCarloParameter *w = monte_carlo->add_parameters();
+  w->set_name("w");
+  w->set_distribution(MonteCarloParameter::UNIFORM);
+  w->set_min(1);
+  w->set_max(2);
+
+  auto first = ParameterSweep::Expand(request);
+  auto second = ParameterSweep::Expand(request);
+  ASSERT_TRUE(first.ok()) << first.status();
+  ASSERT_EQ(first->size(), 100);
+  EXPECT_EQ(*first, *second);
+
+  EXPECT_EQ((*first)[7][0], (std::pair<std::string, double>("seed", 49)));
+  for (const SweepPoint &point : *first) {
+    EXPECT_NEAR(point[1].second, 0.4, 0.1);
+    EXPECT_GE(point[2].second, 1);
+    EXPECT_LT(point[2].second, 2);
+  }
+
+  monte_carlo->set_seed(43);
+  auto other = ParameterSweep::Expand(request);
+  ASSERT_TRUE(other.ok());
+  EXPECT_NE((*other)[0][1], (*first)[0][1]);
+}
+
+TEST(ParameterSweepTest, RewritesParamStatements) {
+  std::string netlist =
+      "* title\n"
+      ".PARAM vdd=1.8 Len = {2*lmin} other=3\n"
+      "+ w='x + 1' z=5\n"
+      "r1 a b {len}\n"
+      ".param vdd_half={vdd/2}\n"
+      ".end\n";
+  std::set<std::string> replaced;
+  std::string rewritten = ParameterSweep::RewriteParameters(
+      netlist, {{"vdd", 0.9}, {"len", 1e-6}, {"w", 2}, {"missing", 1}},
+      &replaced);
+  EXPECT_EQ(rewritten,
+            "* title\n"
+            ".PARAM vdd=0.90000000000000002 Len = 9.9999999999999995e-07 "
+            "other=3\n"
+            "+ w=2 z=5\n"
+            "r1 a b {len}\n"
+            ".param vdd_half={vdd/2}\n"
+            ".end\n");
+  EXPECT_EQ(replaced, (std::set<std::string> {"vdd", "len", "w"}));
+}
+
+}  // namespace
+}  // namespace spiceserver
@@ -0,0 +1,165 @@
+#include "rawfile_reader.h"
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "rawfile_test_util.h"
+
+namespace spiceserver {
+namespace {
+
+// A transient plot of time, v(in) and v(out) over 5 points, where v(in) is
+// 10 * point and v(out) is 100 * point; then an AC plot of one complex
+// signal over 3 points.
+std::string Rawfile() {
+  std::string raw = RawfileHeader(
+      "Transient Analysis", false,
+      {{"time", "time"}, {"v(in)", "voltage"}, {"v(out)", "voltage"}}, 5);
+  // Simulators add lines that aren't needed.
+  raw.insert(raw.find("Plotname:"), "Date: today\n");
+  for (double point = 0; point < 5; ++point) {
+    AppendValues({point * 1e-9, point * 10, point * 100}, &raw);
+  }
+  raw += RawfileHeader(
+      "AC Analysis", true,
+      {{"frequency", "frequency grid=3"}, {"v(out)", "voltage"}}, 3);
+  for (double point = 0; point < 3; ++point) {
+    AppendValues({point, 0, point, -point}, &raw);
+  }
+  return raw;
+}
+
+class RawfileReaderTest : public ::testing::Test {
+ protected:
+  TemporaryRawfile rawfile_;
+};
+
+TEST_F(RawfileReaderTest, ReadsPlots) {
+  rawfile_.Write(Rawfile());
+  auto reader = RawfileReader::Open(rawfile_.path());
+  ASSERT_TRUE(reader.ok()) << reader.status();
+  const auto &plots = (*reader)->plots();
+  ASSERT_EQ(plots.size(), 2);
+  EXPECT_EQ(plots[0].name, "Transient Analysis");
+  EXPECT_FALSE(plots[0].complex);
+  EXPECT_EQ(plots[0].num_points, 5);
+  ASSERT_EQ(plots[0].signals.size(), 3);
+  EXPECT_EQ(plots[0].signals[2].name(), "v(out)");
+  EXPECT_EQ(plots[0].signals[2].type(), "voltage");
+  EXPECT_TRUE(plots[1].complex);
+  EXPECT_EQ(plots[1].num_points, 3);
+}
+
+TEST_F(RawfileReaderTest, StreamsColumnarChunks) {
+  rawfile_.Write(Rawfile());
+  auto reader = RawfileReader::Open(rawfile_.path());
+  ASSERT_TRUE(reader.ok()) << reader.status();
+  WaveformOptions options;
+  options.set_max_points_per_chunk(2);
+  WaveformStream stream(std::move(*reader), options);
+
+  std::vector<WaveformChunk> chunks;
+  WaveformChunk chunk;
+  while (stream.Next(&chunk)) {
+    chunks.push_back(chunk);
+  }
+  // 2 + 2 + 1 points, then 2 + 1.
+  ASSERT_EQ(chunks.size(), 5);
+  EXPECT_EQ(chunks[0].plot_name(), "Transient Analysis");
+  EXPECT_EQ(chunks[0].signals_size(), 3);
+  EXPECT_EQ(chunks[1].signals_size(), 0);
+  EXPECT_EQ(chunks[1].first_point(), 2);
+  EXPECT_EQ(chunks[1].num_points(), 2);
+  EXPECT_FALSE(chunks[1].last());
+  // Points 2 and 3 of each signal in turn.
+  std::vector<double> expected = {2 * 1e-9, 3 * 1e-9, 20, 30, 200, 300};
+  EXPECT_EQ(std::vector<double>(chunks[1].values().begin(),
+                                chunks[1].values().end()), expected);
+  EXPECT_TRUE(chunks[2].last());
+  EXPECT_EQ(chunks[2].num_points(), 1);
+
+  EXPECT_EQ(chunks[3].plot(), 1);
+  EXPECT_TRUE(chunks[3].complex());
+  EXPECT_EQ(chunks[3].plot_name(), "AC Analysis");
+  // Frequency 0, 1 and v(out) 0, 1 - i, as (real, imaginary) pairs.
+  expected = {0, 0, 1, 0, 0, 0, 1, -1};
+  EXPECT_EQ(std::vector<double>(chunks[3].values().begin(),
+                                chunks[3].values().end()), expected);
+  EXPECT_TRUE(chunks[4].last());
+}
+
+TEST_F(RawfileReaderTest, SendsSinglePrecision) {
+  rawfile_.Write(Rawfile());
+  auto reader = RawfileReader::Open(rawfile_.path());
+  ASSERT_TRUE(reader.ok()) << reader.status();
+  WaveformOptions options;
+  options.set_single_precision(true);
+  WaveformStream stream(std::move(*reader), options);
+
+  WaveformChunk chunk;
+  ASSERT_TRUE(stream.Next(&chunk));
+  EXPECT_EQ(chunk.num_points(), 5);
+  EXPECT_TRUE(chunk.last());
+  EXPECT_EQ(chunk.values_size(), 0);
+  ASSERT_EQ(chunk.float_values_size(), 15);
+  EXPECT_EQ(chunk.float_values(14), 400.0f);
+}
+
+TEST_F(RawfileReaderTest, KeepsWholePointsOfTruncatedFile) {
+  std::string raw = Rawfile();
+  // Part way through the fourth point of the first plot.
+  size_t header = raw.find("Binary:\n") + 8;
+  rawfile_.Write(raw.substr(0, header + 3 * 3 * sizeof(double) + 4));
+  auto reader = RawfileReader::Open(rawfile_.path());
+  ASSERT_TRUE(reader.ok()) << reader.status();
+  ASSERT_EQ((*reader)->plots().size(), 1);
+  EXPECT_EQ((*reader)->plots()[0].num_points, 3);
+}
+
+TEST_F(RawfileReaderTest, ReadsPlotBeingWritten) {
+  // Blank, or ngspice's placeholder, until the simulator is done.
+  for (const std::string &placeholder : {"", "0       "}) {
+    std::string raw = RawfileHeader(
+        "Transient Analysis", false,
+        {{"time", "time"}, {"v(out)", "voltage"}}, -1);
+    raw.replace(raw.find("No. Points: ") + 12, 0, placeholder);
+    for (double point = 0; point < 3; ++point) {
+      AppendValues({point, point * 10}, &raw);
+    }
+    // Half of the next point.
+    AppendValues({3}, &raw);
+    rawfile_.Write(raw);
+    auto reader = RawfileReader::Open(rawfile_.path());
+    ASSERT_TRUE(reader.ok()) << reader.status();
+    ASSERT_EQ((*reader)->plots().size(), 1);
+    EXPECT_EQ((*reader)->plots()[0].num_points, 3);
+  }
+
+  // Whereas a finished plot can have no points.
+  std::string raw = RawfileHeader(
+      "Operating Point", false, {{"v(out)", "voltage"}}, 0);
+  raw += Rawfile();
+  rawfile_.Write(raw);
+  auto reader = RawfileReader::Open(rawfile_.path());
+  ASSERT_TRUE(reader.ok()) << reader.status();
+  ASSERT_EQ((*reader)->plots().size(), 3);
+  EXPECT_EQ((*reader)->plots()[0].num_points, 0);
+  EXPECT_EQ((*reader)->plots()[1].num_points, 5);
+}
+
+TEST_F(RawfileReaderTest, RejectsBadFiles) {
+  EXPECT_EQ(RawfileReader::Open(rawfile_.path()).status().code(),
+            absl::StatusCode::kNotFound);
+  rawfile_.Write("Title: test\nNo. Variables: 1\n");
+  EXPECT_EQ(RawfileReader::Open(rawfile_.path()).status().code(),
+            absl::StatusCode::kDataLoss);
+  rawfile_.Write(
+      "Title: test\nNo. Variables: 1\nVariables:\n\t0\ttime\ttime\n"
+      "Values:\n0\t0\n");
+  EXPECT_EQ(RawfileReader::Open(rawfile_.path()).status().code(),
+            absl::StatusCode::kUnimplemented);
+}
+
+}  // namespace
+}  // namespace spiceserver
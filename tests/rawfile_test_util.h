@@ -0,0 +1,100 @@
+#ifndef RAWFILE_TEST_UTIL_H_
+#define RAWFILE_TEST_UTIL_H_
+
+#include <unistd.h>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include <absl/strings/str_cat.h>
+
+#include "rawfile_reader.h"
+
+// Binary rawfiles, as simulators write them, for the tests of what reads
+// them.
+
+namespace spiceserver {
+
+// A variable's name and type, like "v(out)" and "voltage".
+using RawfileVariable = std::pair<std::string, std::string>;
+
+// The header of one binary plot, its values to follow. A negative num_points
+// is left blank, as it is while the simulator is still writing.
+inline std::string RawfileHeader(const std::string &plot_name,
+                                 bool complex,
+                                 const std::vector<RawfileVariable> &variables,
+                                 int num_points) {
+  std::string header = absl::StrCat(
+      "Title: test\n"
+      "Plotname: ", plot_name, "\n"
+      "Flags: ", complex ? "complex" : "real", "\n"
+      "No. Variables: ", variables.size(), "\n"
+      "No. Points: ", num_points < 0 ? "" : absl::StrCat(num_points), "\n"
+      "Variables:\n");
+  for (size_t i = 0; i < variables.size(); ++i) {
+    absl::StrAppend(&header, "\t", i, "\t", variables[i].first, "\t",
+                    variables[i].second, "\n");
+  }
+  header += "Binary:\n";
+  return header;
+}
+
+// Appends values as they're stored: native doubles, a point's variables in
+// turn (and a complex value's real and imaginary parts).
+inline void AppendValues(std::initializer_list<double> values,
+                         std::string *raw) {
+  for (double value : values) {
+    raw->append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+}
+
+// A file in the temporary directory, named for the test, removed when this
+// goes. Readers opened already keep their mappings.
+class TemporaryRawfile {
+ public:
+  TemporaryRawfile() {
+    static int next = 0;
+    const ::testing::TestInfo *test =
+        ::testing::UnitTest::GetInstance()->current_test_info();
+    path_ = std::filesystem::temp_directory_path() / absl::StrCat(
+        test->test_suite_name(), "_", test->name(), "_", getpid(), "_",
+        next++, ".raw");
+  }
+
+  ~TemporaryRawfile() {
+    std::error_code error;
+    std::filesystem::remove(path_, error);
+  }
+
+  TemporaryRawfile(const TemporaryRawfile&) = delete;
+  TemporaryRawfile& operator=(const TemporaryRawfile&) = delete;
+
+  const std::filesystem::path &path() const { return path_; }
+
+  void Write(const std::string &contents) {
+    std::ofstream(path_, std::ios::binary) << contents;
+  }
+
+  void Append(const std::string &contents) {
+    std::ofstream(path_, std::ios::binary | std::ios::app) << contents;
+  }
+
+  // Fails the test if the file can't be read.
+  std::unique_ptr<RawfileReader> Open() const {
+    auto reader = RawfileReader::Open(path_);
+    EXPECT_TRUE(reader.ok()) << reader.status();
+    return reader.ok() ? std::move(*reader) : nullptr;
+  }
+
+ private:
+  std::filesystem::path path_;
+};
+
+}  // namespace spiceserver
+
+#endif  // RAWFILE_TEST_UTIL_H_
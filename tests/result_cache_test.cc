@@ -0,0 +1,169 @@
+#include "result_cache.h"
+
+#include <unistd.h>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "simulator_registry.h"
+
+namespace spiceserver {
+namespace {
+
+class ResultCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = std::filesystem::temp_directory_path() /
+                ("result_cache_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(test_dir_);
+  }
+
+  void TearDown() override {
+    std::filesystem::remove_all(test_dir_);
+  }
+
+  static std::vector<SimulationResponse> Responses(const std::string &output,
+                                                   int exit_code) {
+    std::vector<SimulationResponse> responses(2);
+    responses[0].set_output(output);
+    responses[1].set_done(true);
+    responses[1].set_exit_code(exit_code);
+    return responses;
+  }
+
+  static std::string Key(char c) {
+    return std::string(64, c);
+  }
+
+  std::filesystem::path test_dir_;
+};
+
+TEST_F(ResultCacheTest, StoresAndReplaysAcrossOpens) {
+  {
+    ResultCache cache;
+    ASSERT_TRUE(cache.Open(test_dir_, 1 << 20).ok());
+    std::vector<SimulationResponse> responses;
+    ASSERT_EQ(cache.Lookup(Key('a'), &responses, nullptr),
+              ResultCache::LookupResult::MISS);
+    cache.Store(Key('a'), Responses("hello\n", 3));
+  }
+
+  ResultCache cache;
+  ASSERT_TRUE(cache.Open(test_dir_, 1 << 20).ok());
+  EXPECT_GT(cache.total_bytes(), 0);
+  std::vector<SimulationResponse> responses;
+  ASSERT_EQ(cache.Lookup(Key('a'), &responses, nullptr),
+            ResultCache::LookupResult::HIT);
+  ASSERT_EQ(responses.size(), 2);
+  EXPECT_EQ(responses[0].output(), "hello\n");
+  EXPECT_EQ(responses[1].exit_code(), 3);
+}
+
+TEST_F(ResultCacheTest, CoalescesIdenticalRequests) {
+  ResultCache cache;
+  ASSERT_TRUE(cache.Open(test_dir_, 1 << 20).ok());
+  std::vector<SimulationResponse> responses;
+  ASSERT_EQ(cache.Lookup(Key('a'), &responses, nullptr),
+            ResultCache::LookupResult::MISS);
+
+  int woken = 0;
+  EXPECT_EQ(cache.Lookup(Key('a'), &responses, [&]() { ++woken; }),
+            ResultCache::LookupResult::IN_FLIGHT);
+  EXPECT_EQ(cache.Lookup(Key('a'), &responses, [&]() { ++woken; }),
+            ResultCache::LookupResult::IN_FLIGHT);
+  cache.Store(Key('a'), Responses("x", 0));
+  EXPECT_EQ(woken, 2);
+  EXPECT_EQ(cache.Lookup(Key('a'), &responses, nullptr),
+            ResultCache::LookupResult::HIT);
+
+  // If the first gives up, the next to look runs it instead.
+  ASSERT_EQ(cache.Lookup(Key('b'), &responses, nullptr),
+            ResultCache::LookupResult::MISS);
+  EXPECT_EQ(cache.Lookup(Key('b'), &responses, [&]() { ++woken; }),
+            ResultCache::LookupResult::IN_FLIGHT);
+  cache.Abandon(Key('b'));
+  EXPECT_EQ(woken, 3);
+  EXPECT_EQ(cache.Lookup(Key('b'), &responses, nullptr),
+            ResultCache::LookupResult::MISS);
+}
+
+TEST_F(ResultCacheTest, EvictsLeastRecentlyUsed) {
+  ResultCache cache;
+  std::string output(1000, 'x');
+  // Room for two entries, not three.
+  ASSERT_TRUE(cache.Open(test_dir_, 2500).ok());
+  std::vector<SimulationResponse> responses;
+  for (char c : {'a', 'b'}) {
+    ASSERT_EQ(cache.Lookup(Key(c), &responses, nullptr),
+              ResultCache::LookupResult::MISS);
+    cache.Store(Key(c), Responses(output, 0));
+  }
+  ASSERT_EQ(cache.Lookup(Key('a'), &responses, nullptr),
+            ResultCache::LookupResult::HIT);
+  ASSERT_EQ(cache.Lookup(Key('c'), &responses, nullptr),
+            ResultCache::LookupResult::MISS);
+  cache.Store(Key('c'), Responses(output, 0));
+
+  EXPECT_LE(cache.total_bytes(), 2500);
+  EXPECT_TRUE(std::filesystem::exists(test_dir_ / Key('a')));
+  EXPECT_FALSE(std::filesystem::exists(test_dir_ / Key('b')));
+  EXPECT_EQ(cache.Lookup(Key('b'), &responses, nullptr),
+            ResultCache::LookupResult::MISS);
+  EXPECT_EQ(cache.Lookup(Key('a'), &responses, nullptr),
+            ResultCache::LookupResult::HIT);
+}
+
+TEST_F(ResultCacheTest, KeyCoversEverythingThatShapesResponses) {
+  SimulatorRegistry::GetInstance().RegisterSimulator(
+      Flavour::XYCE, SimulatorRegistry::SimulatorInfo {.path = "/bin/sh"});
+  SimulationRequest request;
+  request.set_simulator(Flavour::XYCE);
+  auto add_file = [](SimulationRequest *request, const std::string &path,
+                     const std::string &data) {
+    FileInfo *file = request->mutable_verbatim_files()->add_files();
+    file->set_path(path);
+    file->set_data(data);
+  };
+  add_file(&request, "top.sp", "x");
+  add_file(&request, "a.inc", "a");
+  add_file(&request, "b.inc", "b");
+  auto key = ResultCache::KeyFor(request);
+  ASSERT_TRUE(key.ok()) << key.status();
+  EXPECT_EQ(key->size(), 64);
+
+  // Only the first file's place matters.
+  SimulationRequest reordered;
+  reordered.set_simulator(Flavour::XYCE);
+  add_file(&reordered, "top.sp", "x");
+  add_file(&reordered, "b.inc", "b");
+  add_file(&reordered, "a.inc", "a");
+  EXPECT_EQ(*ResultCache::KeyFor(reordered), *key);
+
+  SimulationRequest other_top = reordered;
+  other_top.mutable_verbatim_files()->mutable_files()->SwapElements(0, 1);
+  EXPECT_NE(*ResultCache::KeyFor(other_top), *key);
+
+  SimulationRequest other_data = request;
+  other_data.mutable_verbatim_files()->mutable_files(2)->set_data("c");
+  EXPECT_NE(*ResultCache::KeyFor(other_data), *key);
+
+  SimulationRequest other_args = request;
+  other_args.add_additional_args("-a");
+  EXPECT_NE(*ResultCache::KeyFor(other_args), *key);
+
+  SimulationRequest other_limits = request;
+  other_limits.mutable_limits()->set_memory_bytes(1 << 20);
+  EXPECT_NE(*ResultCache::KeyFor(other_limits), *key);
+
+  SimulationRequest other_batching = request;
+  other_batching.mutable_output_batching()->set_as_lines(true);
+  EXPECT_NE(*ResultCache::KeyFor(other_batching), *key);
+
+  SimulationRequest unknown = request;
+  unknown.set_simulator(Flavour::UNSET);
+  EXPECT_FALSE(ResultCache::KeyFor(unknown).ok());
+}
+
+}  // namespace
+}  // namespace spiceserver
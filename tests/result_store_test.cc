@@ -0,0 +1,227 @@
+#include "result_store.h"
+
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "rawfile_reader.h"
+#include "rawfile_test_util.h"
+#include "waveform_query.h"
+
+namespace spiceserver {
+namespace {
+
+// A transient plot of time, v(a), v(b) and v(c) over num_points points,
+// where time is point * 1e-9 and v(x) is point plus 1000, 2000 or 3000.
+std::string Rawfile(int num_points) {
+  std::string raw = RawfileHeader(
+      "Transient Analysis", false,
+      {{"time", "time"}, {"v(a)", "voltage"}, {"v(b)", "voltage"},
+       {"v(c)", "voltage"}}, num_points);
+  for (double point = 0; point < num_points; ++point) {
+    AppendValues({point * 1e-9, point + 1000, point + 2000, point + 3000},
+                 &raw);
+  }
+  return raw;
+}
+
+// Runs a query to the end.
+struct QueryResult {
+  std::optional<absl::Status> status;
+  std::vector<WaveformChunk> chunks;
+};
+
+QueryResult RunQuery(const GetWaveformRequest &request) {
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool ready = false;
+  auto query = WaveformQuery::Create(request);
+  query->Start([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready = true;
+    changed.notify_all();
+  });
+
+  QueryResult result;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  while (!result.status) {
+    WaveformChunk chunk;
+    absl::Status status;
+    switch (query->Next(&chunk, &status)) {
+      case WaveformQuery::NextResult::MESSAGE:
+        result.chunks.push_back(std::move(chunk));
+        continue;
+      case WaveformQuery::NextResult::DONE:
+        result.status = status;
+        continue;
+      case WaveformQuery::NextResult::WAIT:
+        break;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!changed.wait_until(lock, deadline, [&]() { return ready; })) {
+      break;
+    }
+    ready = false;
+  }
+  query->Detach();
+  return result;
+}
+
+class ResultStoreTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = std::filesystem::temp_directory_path() /
+                ("result_store_test_" + std::to_string(getpid()));
+    std::filesystem::remove_all(test_dir_);
+    std::filesystem::create_directories(test_dir_);
+  }
+
+  void TearDown() override {
+    ASSERT_TRUE(ResultStore::GetInstance().Open("", 0).ok());
+    std::filesystem::remove_all(test_dir_);
+  }
+
+  std::string Store(ResultStore *store, int num_points) {
+    TemporaryRawfile rawfile;
+    rawfile.Write(Rawfile(num_points));
+    std::unique_ptr<RawfileReader> reader = rawfile.Open();
+    if (reader == nullptr) {
+      return "";
+    }
+    auto id = store->Add(*reader);
+    EXPECT_TRUE(id.ok()) << id.status();
+    return id.ok() ? *id : "";
+  }
+
+  std::filesystem::path test_dir_;
+};
+
+TEST_F(ResultStoreTest, StoresSignalsAsColumns) {
+  ResultStore store;
+  EXPECT_FALSE(store.enabled());
+  ASSERT_TRUE(store.Open(test_dir_ / "store", 1 << 20).ok());
+  std::string id = Store(&store, 10);
+
+  auto result = store.Get(id);
+  ASSERT_TRUE(result.ok()) << result.status();
+  const StoredResultIndex &index = (*result)->index();
+  ASSERT_EQ(index.plots_size(), 1);
+  EXPECT_EQ(index.plots(0).name(), "Transient Analysis");
+  EXPECT_EQ(index.plots(0).num_points(), 10);
+  ASSERT_EQ(index.plots(0).signals_size(), 4);
+  EXPECT_EQ(index.plots(0).signals(2).name(), "v(b)");
+  const double *b = (*result)->Signal(0, 2);
+  EXPECT_EQ(b[0], 2000);
+  EXPECT_EQ(b[9], 2009);
+
+  // Found again when reopened.
+  ResultStore reopened;
+  ASSERT_TRUE(reopened.Open(test_dir_ / "store", 1 << 20).ok());
+  EXPECT_TRUE(reopened.Get(id).ok());
+  EXPECT_EQ(reopened.total_bytes(), store.total_bytes());
+
+  EXPECT_EQ(store.Get("not an id").status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(store.Get(std::string(32, '0')).status().code(),
+            absl::StatusCode::kNotFound);
+
+  // Cut short (say by a full disk), which mustn't be mapped.
+  std::filesystem::resize_file(test_dir_ / "store" / id / "plot_0.bin", 8);
+  EXPECT_EQ(store.Get(id).status().code(), absl::StatusCode::kDataLoss);
+}
+
+TEST_F(ResultStoreTest, RemovesLeastRecentlyUsed) {
+  // Each result is 100 points * 4 signals * 8 bytes, plus its index.
+  ResultStore store;
+  ASSERT_TRUE(store.Open(test_dir_ / "store", 7000).ok());
+  std::string first = Store(&store, 100);
+  std::string second = Store(&store, 100);
+  ASSERT_TRUE(store.Get(first).ok());
+  std::string third = Store(&store, 100);
+
+  EXPECT_TRUE(store.Get(first).ok());
+  EXPECT_EQ(store.Get(second).status().code(), absl::StatusCode::kNotFound);
+  EXPECT_TRUE(store.Get(third).ok());
+  EXPECT_FALSE(std::filesystem::exists(test_dir_ / "store" / second));
+  EXPECT_LE(store.total_bytes(), 7000);
+}
+
+TEST_F(ResultStoreTest, ReplacesGoldensWhole) {
+  ResultStore store;
+  ASSERT_TRUE(store.Open(test_dir_ / "store", 1 << 20).ok());
+  TemporaryRawfile short_rawfile;
+  short_rawfile.Write(Rawfile(10));
+  TemporaryRawfile long_rawfile;
+  long_rawfile.Write(Rawfile(20));
+  std::unique_ptr<RawfileReader> goldens[] = {short_rawfile.Open(),
+                                              long_rawfile.Open()};
+  ASSERT_TRUE(goldens[0] && goldens[1]);
+  ASSERT_TRUE(store.SetGolden("test", *goldens[0]).ok());
+
+  std::atomic<bool> done = false;
+  std::thread replacer([&]() {
+    for (int i = 1; i <= 2000; ++i) {
+      EXPECT_TRUE(store.SetGolden("test", *goldens[i % 2]).ok());
+    }
+    done = true;
+  });
+  // Always one or the other, never neither nor a mixture.
+  while (!done) {
+    auto golden = store.GetGolden("test");
+    ASSERT_TRUE(golden.ok()) << golden.status();
+    uint64_t num_points = (*golden)->index().plots(0).num_points();
+    ASSERT_TRUE(num_points == 10 || num_points == 20);
+    EXPECT_EQ((*golden)->Signal(0, 1)[num_points - 1],
+              1000 + num_points - 1);
+  }
+  replacer.join();
+}
+
+TEST_F(ResultStoreTest, QueriesSignalsOverSpan) {
+  ResultStore &store = ResultStore::GetInstance();
+  ASSERT_TRUE(store.Open(test_dir_ / "store", 1 << 20).ok());
+
+  GetWaveformRequest request;
+  request.set_result_id(Store(&store, 1000));
+  request.add_signals("v(c)");
+  request.add_signals("v(a)");
+  // Points 100 to 399.
+  request.set_start(99.5e-9);
+  request.set_stop(399.5e-9);
+  request.set_max_points(100);
+
+  QueryResult result = RunQuery(request);
+  ASSERT_TRUE(result.status && result.status->ok());
+  ASSERT_EQ(result.chunks.size(), 1);
+  const WaveformChunk &chunk = result.chunks[0];
+  ASSERT_EQ(chunk.signals_size(), 3);
+  EXPECT_EQ(chunk.signals(0).name(), "time");
+  EXPECT_EQ(chunk.signals(1).name(), "v(c)");
+  EXPECT_EQ(chunk.signals(2).name(), "v(a)");
+  EXPECT_EQ(chunk.first_point(), 100);
+  EXPECT_EQ(chunk.point_stride(), 3);
+  ASSERT_EQ(chunk.num_points(), 100);
+  ASSERT_EQ(chunk.values_size(), 300);
+  EXPECT_DOUBLE_EQ(chunk.values(1), 103e-9);
+  EXPECT_EQ(chunk.values(100), 3100);
+  EXPECT_EQ(chunk.values(299), 1397);
+  EXPECT_TRUE(chunk.last());
+
+  request.clear_signals();
+  request.add_signals("v(d)");
+  result = RunQuery(request);
+  ASSERT_TRUE(result.status);
+  EXPECT_EQ(result.status->code(), absl::StatusCode::kNotFound);
+}
+
+}  // namespace
+}  // namespace spiceserver
@@ -0,0 +1,403 @@
+#include "simulation_job.h"
+
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "blob_store.h"
+#include "result_cache.h"
+#include "result_store.h"
+#include "sha256.h"
+#include "simulator_registry.h"
+#include "worker_pool.h"
+
+DECLARE_int32(job_worker_threads);
+DECLARE_uint64(termination_grace_period_ms);
+
+namespace spiceserver {
+namespace {
+
+using std::chrono::milliseconds;
+
+// Drives a job the way the gRPC reactor does, collecting what it sends.
+class JobDriver {
+ public:
+  explicit JobDriver(std::shared_ptr<SimulationJob> job)
+      : job_(job), ready_(false) {
+    job_->Start([this]() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready_ = true;
+      changed_.notify_all();
+    });
+  }
+
+  ~JobDriver() { job_->Detach(); }
+
+  // Returns the final status, or nullopt if the job didn't finish in time.
+  std::optional<absl::Status> Run(milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      SimulationResponse response;
+      absl::Status status;
+      switch (job_->Next(&response, &status)) {
+        case SimulationJob::NextResult::MESSAGE:
+          responses.push_back(response);
+          continue;
+        case SimulationJob::NextResult::DONE:
+          return status;
+        case SimulationJob::NextResult::WAIT:
+          break;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!changed_.wait_until(lock, deadline, [this]() { return ready_; })) {
+        return std::nullopt;
+      }
+      ready_ = false;
+    }
+  }
+
+  std::string Output() const {
+    std::string output;
+    for (const SimulationResponse &response : responses) {
+      output += response.output();
+    }
+    return output;
+  }
+
+  std::vector<SimulationResponse> responses;
+
+ private:
+  std::shared_ptr<SimulationJob> job_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  bool ready_;
+};
+
+class SimulationJobTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // The "simulator" is the shell, run on a script.
+    SimulatorRegistry::GetInstance().RegisterSimulator(
+        Flavour::XYCE, SimulatorRegistry::SimulatorInfo {.path = "/bin/sh"});
+  }
+
+  static SimulationRequest Script(const std::string &script) {
+    SimulationRequest request;
+    request.set_simulator(Flavour::XYCE);
+    FileInfo *file = request.mutable_verbatim_files()->add_files();
+    file->set_path("run.sh");
+    file->set_data(script);
+    return request;
+  }
+};
+
+TEST_F(SimulationJobTest, RejectsRequestsWithoutInputs) {
+  SimulationRequest request;
+  request.set_simulator(Flavour::XYCE);
+  EXPECT_EQ(SimulationJob::Validate(request).code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_TRUE(SimulationJob::Validate(Script("true")).ok());
+}
+
+TEST_F(SimulationJobTest, StreamsOutputThenFinalResponse) {
+  JobDriver driver(SimulationJob::Create(
+      Script("echo hello; sleep 0.1; echo world; exit 3"), "test"));
+  auto status = driver.Run(milliseconds(10000));
+  ASSERT_TRUE(status.has_value());
+  EXPECT_TRUE(status->ok()) << *status;
+
+  EXPECT_EQ(driver.Output(), "hello\nworld\n");
+  ASSERT_FALSE(driver.responses.empty());
+  const SimulationResponse &last = driver.responses.back();
+  EXPECT_TRUE(last.done());
+  EXPECT_EQ(last.exit_code(), 3);
+  EXPECT_TRUE(last.has_phase_timings());
+}
+
+TEST_F(SimulationJobTest, CancelStopsRunningSimulator) {
+  auto job = SimulationJob::Create(Script("echo started; sleep 30"), "test");
+  JobDriver driver(job);
+
+  // Wait until the simulator is up.
+  while (driver.Output().empty()) {
+    auto status = driver.Run(milliseconds(100));
+    ASSERT_FALSE(status.has_value()) << "Finished early: " << *status;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  job->Cancel(absl::CancelledError("test"));
+  auto status = driver.Run(milliseconds(1000));
+  ASSERT_TRUE(status.has_value());
+  EXPECT_EQ(status->code(), absl::StatusCode::kCancelled);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, milliseconds(1000));
+
+  // Terminating carries on in the background (holding the job, as does the
+  // driver); let it finish.
+  while (job.use_count() > 2) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+}
+
+TEST_F(SimulationJobTest, StoppingDoesNotHoldUpWorkerPool) {
+  FLAGS_termination_grace_period_ms = 2000;
+  auto job = SimulationJob::Create(
+      Script("trap '' TERM; echo started; while true; do sleep 0.1; done"),
+      "test");
+  auto driver = std::make_unique<JobDriver>(job);
+  while (driver->Output().empty()) {
+    auto status = driver->Run(milliseconds(100));
+    ASSERT_FALSE(status.has_value()) << "Finished early: " << *status;
+  }
+  job->Cancel(absl::CancelledError("test"));
+
+  // Every thread of the pool is free to take a task while the simulator is
+  // given its grace period.
+  std::mutex mutex;
+  std::condition_variable started_condition;
+  int started = 0;
+  for (int i = 0; i < FLAGS_job_worker_threads; ++i) {
+    WorkerPool::GetInstance().Post([&]() {
+      std::unique_lock<std::mutex> lock(mutex);
+      ++started;
+      started_condition.notify_all();
+      started_condition.wait_for(lock, milliseconds(1000), [&]() {
+        return started == FLAGS_job_worker_threads;
+      });
+    });
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    EXPECT_TRUE(started_condition.wait_for(lock, milliseconds(1000), [&]() {
+      return started == FLAGS_job_worker_threads;
+    }));
+  }
+
+  // Killed once the grace period is up.
+  driver.reset();
+  while (job.use_count() > 1) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  FLAGS_termination_grace_period_ms = 5000;
+}
+
+TEST_F(SimulationJobTest, ReplaysCachedResult) {
+  std::filesystem::path cache_dir =
+      std::filesystem::temp_directory_path() /
+      ("simulation_job_test_cache_" + std::to_string(getpid()));
+  std::filesystem::path runs = cache_dir.string() + ".runs";
+  ASSERT_TRUE(ResultCache::GetInstance().Open(cache_dir, 1 << 20).ok());
+  SimulationRequest request = Script(
+      "echo run >> " + runs.string() + "; sleep 0.2; echo out; exit 2");
+
+  // Run three at once: only one should actually run. Each is driven on its
+  // own thread, as by its own reactor: whichever runs only makes progress
+  // while it's being read.
+  std::vector<std::unique_ptr<JobDriver>> drivers;
+  for (int i = 0; i < 3; ++i) {
+    drivers.push_back(std::make_unique<JobDriver>(
+        SimulationJob::Create(request, "test")));
+  }
+  std::vector<std::optional<absl::Status>> statuses(drivers.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < drivers.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      statuses[i] = drivers[i]->Run(milliseconds(10000));
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  for (size_t i = 0; i < drivers.size(); ++i) {
+    ASSERT_TRUE(statuses[i].has_value());
+    EXPECT_TRUE(statuses[i]->ok()) << *statuses[i];
+    EXPECT_EQ(drivers[i]->Output(), "out\n");
+    EXPECT_EQ(drivers[i]->responses.back().exit_code(), 2);
+  }
+  JobDriver later(SimulationJob::Create(request, "test"));
+  ASSERT_TRUE(later.Run(milliseconds(10000)).has_value());
+  EXPECT_TRUE(later.responses.back().cached());
+  EXPECT_EQ(later.Output(), "out\n");
+
+  std::ifstream in(runs);
+  std::string contents((std::istreambuf_iterator<char>(in)),
+                       std::istreambuf_iterator<char>());
+  EXPECT_EQ(contents, "run\n");
+
+  ASSERT_TRUE(ResultCache::GetInstance().Open("", 0).ok());
+  std::filesystem::remove_all(cache_dir);
+  std::filesystem::remove(runs);
+}
+
+TEST_F(SimulationJobTest, SendsWaveformsBeforeFinalResponse) {
+  // Writes a rawfile of 4 points of time and v(out) where asked to by -r,
+  // if the input says so.
+  std::filesystem::path simulator =
+      std::filesystem::temp_directory_path() /
+      ("simulation_job_test_xyce_" + std::to_string(getpid()));
+  std::ofstream(simulator) << R"python(#!/usr/bin/env python3
+import struct, sys
+rawfile, netlist = sys.argv[2], sys.argv[3]
+print(open(netlist).read().strip())
+if 'results' in open(netlist).read():
+  with open(rawfile, 'wb') as out:
+    out.write(b'Title: t\nPlotname: Transient\nFlags: real\n'
+              b'No. Variables: 2\nNo. Points: 4\nVariables:\n'
+              b'\t0\ttime\ttime\n\t1\tv(out)\tvoltage\nBinary:\n')
+    for point in range(4):
+      out.write(struct.pack('<dd', point, point / 2))
+)python";
+  std::filesystem::permissions(simulator,
+                               std::filesystem::perms::owner_all);
+  SimulatorRegistry::GetInstance().RegisterSimulator(
+      Flavour::XYCE, SimulatorRegistry::SimulatorInfo {
+          .path = simulator.string()});
+
+  SimulationRequest request = Script("results");
+  request.mutable_waveforms()->set_enabled(true);
+  request.mutable_waveforms()->set_max_points_per_chunk(3);
+  JobDriver driver(SimulationJob::Create(request, "test"));
+  auto status = driver.Run(milliseconds(10000));
+  ASSERT_TRUE(status.has_value());
+  EXPECT_TRUE(status->ok()) << *status;
+
+  EXPECT_EQ(driver.Output(), "results\n");
+  std::vector<const WaveformChunk*> chunks;
+  for (const SimulationResponse &response : driver.responses) {
+    if (response.has_waveform()) {
+      chunks.push_back(&response.waveform());
+    }
+  }
+  ASSERT_EQ(chunks.size(), 2);
+  EXPECT_EQ(chunks[0]->signals(1).name(), "v(out)");
+  // The last point: time, then v(out).
+  ASSERT_EQ(chunks[1]->values_size(), 2);
+  EXPECT_EQ(chunks[1]->values(0), 3);
+  EXPECT_EQ(chunks[1]->values(1), 1.5);
+  EXPECT_TRUE(driver.responses.back().done());
+  EXPECT_TRUE(driver.responses.back().waveform_error().empty());
+
+  // Cancelled part way through the waveforms, the rest of them and the final
+  // response are dropped.
+  auto cancelled = SimulationJob::Create(request, "test");
+  cancelled->Start([]() {});
+  SimulationResponse response;
+  absl::Status cancelled_status;
+  auto deadline = std::chrono::steady_clock::now() + milliseconds(10000);
+  while (!response.has_waveform() &&
+         std::chrono::steady_clock::now() < deadline) {
+    if (cancelled->Next(&response, &cancelled_status) ==
+        SimulationJob::NextResult::WAIT) {
+      std::this_thread::sleep_for(milliseconds(10));
+    }
+  }
+  ASSERT_TRUE(response.has_waveform());
+  cancelled->Cancel(absl::CancelledError("test"));
+  EXPECT_EQ(cancelled->Next(&response, &cancelled_status),
+            SimulationJob::NextResult::DONE);
+  EXPECT_EQ(cancelled_status.code(), absl::StatusCode::kCancelled);
+  cancelled->Detach();
+
+  // Just a preview (two buckets of two points) and a measurement.
+  request = Script("results");
+  request.mutable_waveforms()->mutable_preview()->set_resolution(2);
+  Measurement *measurement = request.add_measurements();
+  measurement->set_name("peak");
+  measurement->set_kind(Measurement::MAX);
+  measurement->set_signal("v(out)");
+  JobDriver previewed(SimulationJob::Create(request, "test"));
+  ASSERT_TRUE(previewed.Run(milliseconds(10000)).has_value());
+  ASSERT_GE(previewed.responses.size(), 2);
+  const SimulationResponse &preview =
+      previewed.responses[previewed.responses.size() - 2];
+  ASSERT_TRUE(preview.has_preview());
+  EXPECT_TRUE(preview.preview().final());
+  ASSERT_EQ(preview.preview().max_size(), 2);
+  EXPECT_EQ(preview.preview().max(1), 1.5);
+  for (const SimulationResponse &response : previewed.responses) {
+    EXPECT_FALSE(response.has_waveform());
+  }
+  ASSERT_EQ(previewed.responses.back().measurements_size(), 1);
+  EXPECT_EQ(previewed.responses.back().measurements(0).value(), 1.5);
+
+  // Made the golden, then compared with it, without the output.
+  request = Script("results");
+  request.mutable_golden()->set_test_id("test");
+  request.mutable_golden()->set_mode(GoldenOptions::UPDATE);
+  EXPECT_EQ(SimulationJob::Validate(request).code(),
+            absl::StatusCode::kFailedPrecondition);
+  std::filesystem::path store_dir =
+      std::filesystem::temp_directory_path() /
+      ("simulation_job_test_store_" + std::to_string(getpid()));
+  ASSERT_TRUE(ResultStore::GetInstance().Open(store_dir, 1 << 20).ok());
+  JobDriver updating(SimulationJob::Create(request, "test"));
+  ASSERT_TRUE(updating.Run(milliseconds(10000)).has_value());
+  EXPECT_TRUE(updating.responses.back().golden().updated());
+  request.mutable_golden()->set_mode(GoldenOptions::COMPARE);
+  request.mutable_golden()->set_discard_output(true);
+  JobDriver comparing(SimulationJob::Create(request, "test"));
+  ASSERT_TRUE(comparing.Run(milliseconds(10000)).has_value());
+  EXPECT_EQ(comparing.Output(), "");
+  const GoldenComparison &golden = comparing.responses.back().golden();
+  EXPECT_TRUE(golden.passed()) << golden.DebugString();
+  ASSERT_EQ(golden.signals_size(), 1);
+  EXPECT_EQ(golden.signals(0).points(), 4);
+  ASSERT_TRUE(ResultStore::GetInstance().Open("", 0).ok());
+  std::filesystem::remove_all(store_dir);
+
+  // Without a rawfile, the final response says why there's nothing.
+  request = Script("nothing");
+  request.mutable_waveforms()->set_enabled(true);
+  JobDriver failing(SimulationJob::Create(request, "test"));
+  ASSERT_TRUE(failing.Run(milliseconds(10000)).has_value());
+  EXPECT_TRUE(failing.responses.back().done());
+  EXPECT_NE(failing.responses.back().waveform_error(), "");
+
+  request.set_simulator(Flavour::SPECTRE);
+  EXPECT_EQ(SimulationJob::Validate(request).code(),
+            absl::StatusCode::kInvalidArgument);
+  std::filesystem::remove(simulator);
+}
+
+TEST_F(SimulationJobTest, LinksBlobInputs) {
+  std::filesystem::path blob_dir =
+      std::filesystem::temp_directory_path() /
+      ("simulation_job_test_blobs_" + std::to_string(getpid()));
+  BlobStore &store = BlobStore::GetInstance();
+  ASSERT_TRUE(store.Open(blob_dir, 1 << 20).ok());
+
+  SimulationRequest request = Script("cat lib/models.inc");
+  FileInfo *library = request.mutable_verbatim_files()->add_files();
+  library->set_path("lib/models.inc");
+  library->set_blob_digest(Sha256::HexDigestOf("shared\n"));
+  EXPECT_EQ(SimulationJob::Validate(request).code(),
+            absl::StatusCode::kFailedPrecondition);
+
+  auto upload = store.StartUpload(library->blob_digest());
+  ASSERT_TRUE(upload.ok());
+  ASSERT_TRUE((*upload)->Append("shared\n").ok());
+  ASSERT_TRUE((*upload)->Finish().ok());
+  ASSERT_TRUE(SimulationJob::Validate(request).ok());
+
+  JobDriver driver(SimulationJob::Create(request, "test"));
+  auto status = driver.Run(milliseconds(10000));
+  ASSERT_TRUE(status.has_value());
+  EXPECT_TRUE(status->ok()) << *status;
+  EXPECT_EQ(driver.Output(), "shared\n");
+
+  ASSERT_TRUE(store.Open("", 0).ok());
+  std::filesystem::remove_all(blob_dir);
+}
+
+}  // namespace
+}  // namespace spiceserver
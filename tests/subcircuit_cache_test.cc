@@ -0,0 +1,38 @@
+#include "subcircuit_cache.h"
+
+#include <string>
+#include <gtest/gtest.h>
+
+namespace spiceserver {
+namespace {
+
+TEST(SubcircuitCacheTest, EvictsLeastRecentlyUsed) {
+  SubcircuitCache cache(10);
+  cache.Store("a", "aaaa");
+  cache.Store("b", "bbbb");
+  // Using "a" makes "b" the one to go.
+  ASSERT_NE(cache.Lookup("a"), nullptr);
+  cache.Store("c", "cccc");
+
+  EXPECT_EQ(cache.total_bytes(), 8);
+  EXPECT_EQ(cache.Lookup("b"), nullptr);
+  ASSERT_NE(cache.Lookup("a"), nullptr);
+  EXPECT_EQ(*cache.Lookup("c"), "cccc");
+  EXPECT_EQ(cache.hits(), 3);
+  EXPECT_EQ(cache.misses(), 1);
+
+  // Too big to keep at all.
+  cache.Store("d", std::string(11, 'd'));
+  EXPECT_EQ(cache.Lookup("d"), nullptr);
+  EXPECT_NE(cache.Lookup("a"), nullptr);
+}
+
+TEST(SubcircuitCacheTest, DisabledWithNoBytes) {
+  SubcircuitCache cache(0);
+  EXPECT_FALSE(cache.enabled());
+  cache.Store("a", "");
+  EXPECT_EQ(cache.Lookup("a"), nullptr);
+}
+
+}  // namespace
+}  // namespace spiceserver
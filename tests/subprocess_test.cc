@@ -0,0 +1,174 @@
+#include "subprocess.h"
+
+#include <signal.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "spawn_helper.h"
+
+namespace spiceserver {
+namespace {
+
+class SubprocessTest
+    : public ::testing::TestWithParam<Subprocess::SpawnMethod> {
+ protected:
+  void SetUp() override {
+    SpawnHelper &helper = SpawnHelper::GetInstance();
+    if (GetParam() == Subprocess::SpawnMethod::HELPER && !helper.IsRunning()) {
+      ASSERT_TRUE(helper.Start().ok());
+    }
+  }
+
+  // Runs the subprocess to completion with the synchronous poll loop and
+  // returns its exit code.
+  int RunToCompletion(Subprocess *subprocess) {
+    auto callback = [this](const char *data,
+                           size_t length,
+                           Subprocess::StreamType stream_type) {
+      if (stream_type == Subprocess::StreamType::STDOUT) {
+        stdout_.append(data, length);
+      } else {
+        stderr_.append(data, length);
+      }
+    };
+    while (subprocess->PollAndReadOutput(callback)) {}
+    return subprocess->WaitForCompletion();
+  }
+
+  std::string stdout_;
+  std::string stderr_;
+};
+
+TEST_P(SubprocessTest, CapturesOutputAndExitCode) {
+  Subprocess subprocess(GetParam());
+  ASSERT_TRUE(subprocess.Spawn(
+      "/bin/sh", {"-c", "echo out; echo err >&2; exit 3"}, "/").ok());
+  EXPECT_EQ(RunToCompletion(&subprocess), 3);
+  EXPECT_EQ(stdout_, "out\n");
+  EXPECT_EQ(stderr_, "err\n");
+}
+
+TEST_P(SubprocessTest, RunsInGivenDirectory) {
+  Subprocess subprocess(GetParam());
+  ASSERT_TRUE(subprocess.Spawn("/bin/sh", {"-c", "pwd"}, "/tmp").ok());
+  EXPECT_EQ(RunToCompletion(&subprocess), 0);
+  EXPECT_EQ(stdout_, "/tmp\n");
+}
+
+TEST_P(SubprocessTest, AppliesResourceLimitsBeforeExec) {
+  Subprocess subprocess(GetParam());
+  subprocess.AddResourceLimit(RLIMIT_NOFILE, 17, 17);
+  ASSERT_TRUE(subprocess.Spawn("/bin/sh", {"-c", "ulimit -n"}, "/").ok());
+  EXPECT_EQ(RunToCompletion(&subprocess), 0);
+  EXPECT_EQ(stdout_, "17\n");
+}
+
+TEST_P(SubprocessTest, FailsToRunMissingCommand) {
+  Subprocess subprocess(GetParam());
+  auto status = subprocess.Spawn("/nonexistent/simulator", {}, "/");
+  if (GetParam() == Subprocess::SpawnMethod::FORK) {
+    // A forked child can only report the failure through its exit code.
+    ASSERT_TRUE(status.ok());
+    EXPECT_EQ(RunToCompletion(&subprocess), 127);
+  } else {
+    EXPECT_FALSE(status.ok());
+  }
+}
+
+TEST_P(SubprocessTest, ReportsTerminatingSignalAndUsage) {
+  Subprocess subprocess(GetParam());
+  // Burn a little CPU, then die.
+  ASSERT_TRUE(subprocess.Spawn(
+      "/bin/sh",
+      {"-c", "i=0; while [ $i -lt 20000 ]; do i=$((i+1)); done; kill -9 $$"},
+      "/").ok());
+  EXPECT_EQ(RunToCompletion(&subprocess), -1);
+  EXPECT_EQ(subprocess.terminating_signal(), SIGKILL);
+
+  const struct rusage &usage = subprocess.resource_usage();
+  EXPECT_GT(usage.ru_maxrss, 0);
+  EXPECT_GT(usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec +
+            usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec, 0);
+}
+
+// True if pid is gone (or a zombie, which is as good as gone).
+bool ProcessIsDead(pid_t pid) {
+  std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+  if (!stat) {
+    return true;
+  }
+  std::string unused_pid, unused_name, state;
+  stat >> unused_pid >> unused_name >> state;
+  return state == "Z" || state == "X";
+}
+
+TEST_P(SubprocessTest, SignalsWholeProcessGroup) {
+  Subprocess subprocess(GetParam());
+  // The shell ignores SIGTERM, so only SIGKILL will do, and it leaves a
+  // grandchild behind to make sure that gets it too.
+  ASSERT_TRUE(subprocess.Spawn(
+      "/bin/sh",
+      {"-c", "trap '' TERM; sleep 60 & echo $!; wait"}, "/").ok());
+
+  auto callback = [this](const char *data,
+                         size_t length,
+                         Subprocess::StreamType stream_type) {
+    stdout_.append(data, length);
+  };
+  while (stdout_.find('\n') == std::string::npos &&
+         subprocess.PollAndReadOutput(callback)) {}
+  pid_t grandchild = std::stoi(stdout_);
+
+  EXPECT_TRUE(subprocess.SignalProcessGroup(SIGTERM));
+  EXPECT_FALSE(subprocess.WaitForExit(std::chrono::milliseconds(100)));
+
+  EXPECT_TRUE(subprocess.SignalProcessGroup(SIGKILL));
+  EXPECT_TRUE(subprocess.WaitForExit(std::chrono::milliseconds(5000)));
+  EXPECT_EQ(subprocess.WaitForCompletion(), -1);
+  // Its group id is no longer ours to signal.
+  EXPECT_FALSE(subprocess.SignalProcessGroup(SIGKILL));
+
+  for (int i = 0; i < 100 && !ProcessIsDead(grandchild); ++i) {
+    usleep(10 * 1000);
+  }
+  EXPECT_TRUE(ProcessIsDead(grandchild));
+}
+
+TEST_P(SubprocessTest, WaitsForExitCallbackToReturn) {
+  Subprocess subprocess(GetParam());
+  ASSERT_TRUE(subprocess.Spawn("/bin/sh", {"-c", "exit 3"}, "/").ok());
+  std::atomic<bool> started = false;
+  std::atomic<bool> finished = false;
+  absl::Status status = subprocess.StartWatching(
+      [](const char*, size_t, Subprocess::StreamType) {},
+      [&](int exit_code) {
+        started = true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        finished = true;
+      });
+  if (status.code() == absl::StatusCode::kUnavailable) {
+    GTEST_SKIP() << status;
+  }
+  ASSERT_TRUE(status.ok()) << status;
+  while (!started) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(subprocess.WaitForCompletion(), 3);
+  EXPECT_TRUE(finished);
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    AllSpawnMethods,
+    SubprocessTest,
+    ::testing::Values(Subprocess::SpawnMethod::FORK,
+                      Subprocess::SpawnMethod::POSIX_SPAWN,
+                      Subprocess::SpawnMethod::VFORK,
+                      Subprocess::SpawnMethod::HELPER));
+
+}  // namespace
+}  // namespace spiceserver
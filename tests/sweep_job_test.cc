@@ -0,0 +1,128 @@
+#include "sweep_job.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "simulator_registry.h"
+
+namespace spiceserver {
+namespace {
+
+using std::chrono::milliseconds;
+
+// Runs a sweep to the end, collecting the output of each point.
+struct SweepResult {
+  std::optional<absl::Status> status;
+  std::map<uint32_t, std::string> output;
+  std::map<uint32_t, std::map<std::string, double>> parameters;
+  std::map<uint32_t, int> exit_codes;
+  int errors = 0;
+};
+
+SweepResult RunSweep(const SweepRequest &request, milliseconds timeout) {
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool ready = false;
+  auto sweep = SweepJob::Create(request, "test");
+  sweep->Start([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready = true;
+    changed.notify_all();
+  });
+
+  SweepResult result;
+  auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (!result.status) {
+    SweepResponse response;
+    absl::Status status;
+    switch (sweep->Next(&response, &status)) {
+      case SweepJob::NextResult::MESSAGE: {
+        uint32_t point = response.point();
+        result.output[point] += response.response().output();
+        for (const auto &entry : response.parameters()) {
+          result.parameters[point][entry.first] = entry.second;
+        }
+        if (response.response().done()) {
+          result.exit_codes[point] = response.response().exit_code();
+        }
+        result.errors += response.error_code() != 0;
+        continue;
+      }
+      case SweepJob::NextResult::DONE:
+        result.status = status;
+        continue;
+      case SweepJob::NextResult::WAIT:
+        break;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!changed.wait_until(lock, deadline, [&]() { return ready; })) {
+      break;
+    }
+    ready = false;
+  }
+  sweep->Detach();
+  return result;
+}
+
+class SweepJobTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    SimulatorRegistry::GetInstance().RegisterSimulator(
+        Flavour::XYCE, SimulatorRegistry::SimulatorInfo {.path = "/bin/sh"});
+  }
+
+  // The "simulator" is the shell; the script prints its own .param line,
+  // as rewritten for the point.
+  static SweepRequest Sweep() {
+    SweepRequest request;
+    SimulationRequest *simulation = request.mutable_simulation();
+    simulation->set_simulator(Flavour::XYCE);
+    FileInfo *file = simulation->mutable_verbatim_files()->add_files();
+    file->set_path("run.sh");
+    file->set_data("cat <<EOF\n.param x=0\nEOF\n");
+    request.set_max_parallel_points(2);
+    return request;
+  }
+};
+
+TEST_F(SweepJobTest, RunsEveryPoint) {
+  SweepRequest request = Sweep();
+  SweepParameter *x = request.mutable_grid()->add_parameters();
+  x->set_name("x");
+  for (double value : {1, 2, 3, 4, 5}) {
+    x->add_values(value);
+  }
+
+  SweepResult result = RunSweep(request, milliseconds(20000));
+  ASSERT_TRUE(result.status.has_value());
+  EXPECT_TRUE(result.status->ok()) << *result.status;
+  EXPECT_EQ(result.errors, 0);
+  ASSERT_EQ(result.output.size(), 5);
+  for (uint32_t point = 0; point < 5; ++point) {
+    EXPECT_EQ(result.output[point],
+              ".param x=" + std::to_string(point + 1) + "\n");
+    EXPECT_EQ(result.parameters[point]["x"], point + 1);
+    EXPECT_EQ(result.exit_codes[point], 0);
+  }
+}
+
+TEST_F(SweepJobTest, FailsIfParameterIsNotInNetlist) {
+  SweepRequest request = Sweep();
+  SweepParameter *y = request.mutable_list()->add_parameters();
+  y->set_name("y");
+  y->add_values(1);
+
+  SweepResult result = RunSweep(request, milliseconds(5000));
+  ASSERT_TRUE(result.status.has_value());
+  EXPECT_EQ(result.status->code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_TRUE(result.output.empty());
+}
+
+}  // namespace
+}  // namespace spiceserver
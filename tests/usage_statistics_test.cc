@@ -0,0 +1,53 @@
+#include "usage_statistics.h"
+
+#include <gtest/gtest.h>
+
+#include "proto/spice_simulator.pb.h"
+
+namespace spiceserver {
+namespace {
+
+SimulationResponse FinalResponse(int exit_code,
+                                 int terminating_signal,
+                                 double user_cpu_seconds,
+                                 uint64_t max_rss_bytes) {
+  SimulationResponse response;
+  response.set_done(true);
+  response.set_exit_code(exit_code);
+  response.set_terminating_signal(terminating_signal);
+  response.mutable_resource_usage()->set_user_cpu_seconds(user_cpu_seconds);
+  response.mutable_resource_usage()->set_max_rss_bytes(max_rss_bytes);
+  response.mutable_phase_timings()->set_run_seconds(2 * user_cpu_seconds);
+  return response;
+}
+
+TEST(UsageStatisticsTest, AggregatesPerFlavour) {
+  UsageStatistics statistics;
+  statistics.Record(Flavour::XYCE, "/tmp/a", FinalResponse(0, 0, 1.0, 100));
+  statistics.Record(Flavour::XYCE, "/tmp/b", FinalResponse(1, 0, 2.0, 300));
+  statistics.Record(Flavour::XYCE, "/tmp/c", FinalResponse(-1, 9, 4.0, 200));
+  statistics.Record(Flavour::NGSPICE, "/tmp/d", FinalResponse(0, 0, 0.5, 50));
+
+  GetUsageStatisticsResponse response;
+  statistics.Report(&response);
+  ASSERT_EQ(response.flavours_size(), 2);
+
+  const FlavourUsage &xyce = response.flavours(0);
+  EXPECT_EQ(xyce.flavour(), Flavour::XYCE);
+  EXPECT_EQ(xyce.runs(), 3);
+  EXPECT_EQ(xyce.failed_runs(), 2);
+  EXPECT_EQ(xyce.signalled_runs(), 1);
+  EXPECT_DOUBLE_EQ(xyce.user_cpu_seconds(), 7.0);
+  EXPECT_DOUBLE_EQ(xyce.run_seconds(), 14.0);
+  EXPECT_EQ(xyce.total_max_rss_bytes(), 600);
+  EXPECT_EQ(xyce.peak_max_rss_bytes(), 300);
+  EXPECT_EQ(xyce.peak_max_rss_directory(), "/tmp/b");
+
+  const FlavourUsage &ngspice = response.flavours(1);
+  EXPECT_EQ(ngspice.flavour(), Flavour::NGSPICE);
+  EXPECT_EQ(ngspice.runs(), 1);
+  EXPECT_EQ(ngspice.failed_runs(), 0);
+}
+
+}  // namespace
+}  // namespace spiceserver
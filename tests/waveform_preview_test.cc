@@ -0,0 +1,129 @@
+#include "waveform_preview.h"
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "rawfile_reader.h"
+#include "rawfile_test_util.h"
+
+namespace spiceserver {
+namespace {
+
+// A transient plot of time, v(in) and v(out), where time is point and v(in)
+// is 10 * point and v(out) alternates between point and -point; its number
+// of points is left blank, as while it's being written.
+std::string Header() {
+  return RawfileHeader(
+      "Transient Analysis", false,
+      {{"time", "time"}, {"v(in)", "voltage"}, {"v(out)", "voltage"}}, -1);
+}
+
+std::string Points(int first, int end) {
+  std::string raw;
+  for (int point = first; point < end; ++point) {
+    double value = point;
+    AppendValues({value, value * 10, point % 2 == 0 ? value : -value}, &raw);
+  }
+  return raw;
+}
+
+class WaveformPreviewTest : public ::testing::Test {
+ protected:
+  TemporaryRawfile rawfile_;
+};
+
+TEST_F(WaveformPreviewTest, KeepsMinMaxAndLastPerBucket) {
+  rawfile_.Append(Header() + Points(0, 10));
+  auto reader = RawfileReader::Open(rawfile_.path());
+  ASSERT_TRUE(reader.ok()) << reader.status();
+  ASSERT_EQ((*reader)->plots()[0].num_points, 10);
+
+  // Buckets of 4: points 0-3, 4-7 and 8-9.
+  MinMaxDecimator decimator({2}, 4);
+  decimator.Add(**reader, 0, 0, 6);
+  WaveformPreview preview;
+  ASSERT_TRUE(decimator.Flush(&preview));
+  ASSERT_EQ(preview.buckets_size(), 2);
+  EXPECT_EQ(preview.buckets(0), 0);
+  EXPECT_EQ(preview.buckets(1), 1);
+  EXPECT_EQ(preview.min(0), -3);
+  EXPECT_EQ(preview.max(0), 2);
+  EXPECT_EQ(preview.last(0), -3);
+  // Still filling.
+  EXPECT_EQ(preview.min(1), -5);
+  EXPECT_EQ(preview.max(1), 4);
+
+  preview.Clear();
+  EXPECT_FALSE(decimator.Flush(&preview));
+
+  // The second bucket again, now full, and the third.
+  decimator.Add(**reader, 0, 6, 4);
+  ASSERT_TRUE(decimator.Flush(&preview));
+  ASSERT_EQ(preview.buckets_size(), 2);
+  EXPECT_EQ(preview.buckets(0), 1);
+  EXPECT_EQ(preview.min(0), -7);
+  EXPECT_EQ(preview.max(0), 6);
+  EXPECT_EQ(preview.last(0), -7);
+  EXPECT_EQ(preview.buckets(1), 2);
+  EXPECT_EQ(preview.last(1), -9);
+}
+
+TEST_F(WaveformPreviewTest, FollowsGrowingRawfileThenRefines) {
+  PreviewOptions options;
+  options.add_signals("v(in)");
+  options.set_resolution(50);
+  options.set_refinements(2);
+  WaveformPreviewer previewer(rawfile_.path(), options);
+
+  // Nothing written yet.
+  std::vector<WaveformPreview> previews;
+  previewer.Poll(&previews);
+  EXPECT_TRUE(previews.empty());
+
+  rawfile_.Append(Header() + Points(0, 120));
+  previewer.Poll(&previews);
+  ASSERT_EQ(previews.size(), 1);
+  EXPECT_EQ(previews[0].plot_name(), "Transient Analysis");
+  ASSERT_EQ(previews[0].signals_size(), 1);
+  EXPECT_EQ(previews[0].signals(0), "v(in)");
+  ASSERT_EQ(previews[0].buckets_size(), 3);
+  EXPECT_EQ(previews[0].max(2), 1190);
+  EXPECT_FALSE(previews[0].final());
+
+  rawfile_.Append(Points(120, 200));
+  auto reader = RawfileReader::Open(rawfile_.path());
+  ASSERT_TRUE(reader.ok()) << reader.status();
+  previews.clear();
+  previewer.Finish(**reader, &previews);
+
+  // The rest of the live pass, then one preview per refinement.
+  ASSERT_EQ(previews.size(), 3);
+  EXPECT_EQ(previews[0].pass(), 0);
+  EXPECT_TRUE(previews[0].plot_name().empty());
+  ASSERT_EQ(previews[0].buckets_size(), 2);
+  EXPECT_EQ(previews[0].buckets(0), 2);
+  EXPECT_EQ(previews[0].min(0), 1000);
+  EXPECT_EQ(previews[0].last(1), 1990);
+  EXPECT_TRUE(previews[0].final());
+
+  EXPECT_EQ(previews[1].pass(), 1);
+  EXPECT_EQ(previews[1].resolution(), 25);
+  EXPECT_EQ(previews[1].buckets_size(), 8);
+  EXPECT_EQ(previews[1].plot_name(), "Transient Analysis");
+  EXPECT_TRUE(previews[1].final());
+  EXPECT_EQ(previews[2].pass(), 2);
+  EXPECT_EQ(previews[2].buckets_size(), 16);
+}
+
+TEST_F(WaveformPreviewTest, RejectsBadOptions) {
+  PreviewOptions options;
+  EXPECT_FALSE(WaveformPreviewer::Validate(options).ok());
+  options.set_resolution(1e-9);
+  EXPECT_TRUE(WaveformPreviewer::Validate(options).ok());
+  options.set_refinements(100);
+  EXPECT_FALSE(WaveformPreviewer::Validate(options).ok());
+}
+
+}  // namespace
+}  // namespace spiceserver